@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Client.hpp"
+#include "DirectPlayMessage.hpp"
+#include "IniFile.hpp"
+#include "Logger.hpp"
+#include "ReliableProtocol.hpp"
+#include "Session.hpp"
+#include "Unicode.hpp"
+
+// micro-benchmarks for the per-packet code, results are written as JSON
+// each benchmark is calibrated to run for roughly minTime, then repeated and the median taken
+
+struct BenchResult
+{
+    std::string name;
+    uint64_t iterations;
+    std::vector<double> nsPerOp; // one per repeat
+};
+
+// stop the compiler from throwing away the result
+template<class T>
+static void keep(T &&value)
+{
+#if defined(__GNUC__)
+    asm volatile("" : : "g"(&value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+}
+
+class BenchRunner final
+{
+public:
+    BenchRunner(std::chrono::milliseconds minTime, int repeats, std::string filter) : minTime(minTime), repeats(repeats), filter(std::move(filter)) {}
+
+    // fn runs the operation n times
+    void run(const std::string &name, const std::function<void(uint64_t)> &fn)
+    {
+        if(!filter.empty() && name.find(filter) == std::string::npos)
+            return;
+
+        // find an iteration count that takes long enough to measure
+        uint64_t iterations = 1;
+        while(true)
+        {
+            auto time = timeRun(fn, iterations);
+            if(time >= minTime || iterations >= (1ull << 40))
+                break;
+
+            // aim a bit over, but don't jump too far from a noisy short run
+            auto scale = time.count() > 0 ? minTime / time * 1.2 : 100.0;
+            iterations = std::max(iterations + 1, static_cast<uint64_t>(iterations * std::min(scale, 100.0)));
+        }
+
+        BenchResult result{name, iterations, {}};
+
+        for(int i = 0; i < repeats; i++)
+        {
+            auto time = timeRun(fn, iterations);
+            result.nsPerOp.push_back(std::chrono::duration<double, std::nano>(time).count() / iterations);
+        }
+
+        auto sorted = result.nsPerOp;
+        std::sort(sorted.begin(), sorted.end());
+        fprintf(stderr, "%-40s %12.1f ns/op (min %.1f, max %.1f, %llu iterations)\n", name.c_str(), sorted[sorted.size() / 2], sorted.front(), sorted.back(),
+                static_cast<unsigned long long>(iterations));
+
+        results.push_back(std::move(result));
+    }
+
+    std::string toJSON() const
+    {
+        std::ostringstream out;
+
+        char date[32];
+        auto now = time(nullptr);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+        out << "{\n  \"context\": {\n";
+        out << "    \"date\": \"" << date << "\",\n";
+#if defined(__VERSION__)
+        out << "    \"compiler\": \"" << __VERSION__ << "\",\n";
+#endif
+#if defined(NDEBUG)
+        out << "    \"assertions\": false,\n";
+#else
+        out << "    \"assertions\": true,\n";
+#endif
+        out << "    \"min_time_ms\": " << std::chrono::duration_cast<std::chrono::milliseconds>(minTime).count() << ",\n";
+        out << "    \"repeats\": " << repeats << "\n";
+        out << "  },\n  \"benchmarks\": [";
+
+        for(size_t i = 0; i < results.size(); i++)
+        {
+            auto &result = results[i];
+            auto sorted = result.nsPerOp;
+            std::sort(sorted.begin(), sorted.end());
+
+            double mean = 0.0;
+            for(auto &t : sorted)
+                mean += t;
+            mean /= sorted.size();
+
+            out << (i ? ",\n" : "\n");
+            out << "    {\"name\": \"" << result.name << "\", \"iterations\": " << result.iterations
+                << ", \"median_ns\": " << sorted[sorted.size() / 2] << ", \"mean_ns\": " << mean
+                << ", \"min_ns\": " << sorted.front() << ", \"max_ns\": " << sorted.back() << "}";
+        }
+
+        out << "\n  ]\n}\n";
+        return out.str();
+    }
+
+private:
+    static std::chrono::nanoseconds timeRun(const std::function<void(uint64_t)> &fn, uint64_t iterations)
+    {
+        auto start = std::chrono::steady_clock::now();
+        fn(iterations);
+        return std::chrono::steady_clock::now() - start;
+    }
+
+    std::chrono::nanoseconds minTime;
+    int repeats;
+    std::string filter;
+
+    std::vector<BenchResult> results;
+};
+
+static std::vector<uint8_t> makeDPlayPacket(DPSPCommand command, size_t payloadSize)
+{
+    std::vector<uint8_t> packet(sizeof(DPSPMessageHeader) + payloadSize);
+
+    auto header = reinterpret_cast<DPSPMessageHeader *>(packet.data());
+    header->sizeToken = packet.size() | 0xFAB << 20;
+    header->sockaddr = {};
+    header->sockaddr.family = 2;
+    memcpy(header->signature, "play", 4);
+    header->command = command;
+    header->version = 14;
+
+    return packet;
+}
+
+// a session with numPlayers / 2 remote machines, each with a system player and a game player
+static void fillSession(Session &session, size_t numPlayers)
+{
+    session.createLocalSystemPlayer(2300);
+
+    DPSockaddrIn spData[2] = {};
+    spData[0].family = spData[1].family = 2;
+
+    for(size_t i = 0; i < numPlayers / 2; i++)
+    {
+        auto &systemPlayer = session.createNewSystemPlayer();
+        systemPlayer.setServiceProviderData(reinterpret_cast<uint8_t *>(spData), sizeof(spData));
+
+        session.createNewPlayer(systemPlayer.getId());
+    }
+}
+
+static uint8_t appGUID[16]{};
+
+// the shipped config.ini, with most of the options set
+static const char *sampleConfig = R"([Server]
+Port=31415 ; Port in lego.ini
+ListenAddr=::
+SessionName=LEGO International Train Server ; Name in lego.ini
+MaxPlayers=10
+AppGUID=4625cdf9-7f57-d211-9426-00a0244bda7a
+RouteThroughHost=1 ; relay player messages for clients behind NAT
+ClientTimeout=30 ; seconds without hearing from a joined client before removing its players, 0 to disable
+HandshakeTimeout=10 ; the same for clients that haven't finished joining
+SharedUDPSockets=0 ; RP traffic for all clients through this many sockets (SO_REUSEPORT if more than one) instead of one each, 0 for one each
+FlushInterval=0 ; ms to hold outgoing RP frames and acks so they're sent together, 0 sends right away
+;RestartSocket=server.sock ; lets a new server take over with --hot-restart, without disconnecting anyone
+[Log]
+Level=Info ; Debug, Info, Warning, Error or None
+RP=Debug ; per-category override (General, Net, DPlay, RP, Loco)
+DebugClients=::ffff:192.168.0.2, ::ffff:192.168.0.3 ; dump unknown messages from these clients
+
+[Postcards]
+Path=postcards ; postcards.dat and postcards.idx, disabled if not set
+MaxSizeMB=1024
+
+[Users]
+Path=users.dat ; remembers returning players, disabled if not set
+
+[Latency]
+KeepAlive=1 ; DirectPlay keep alive, clients drop players that stop answering pings
+PingInterval=2000 ; ms, 0 to disable pings
+MaxJoinRTT=0 ; ms, reject clients with a higher TCP RTT when joining, 0 to allow anyone
+DegradedRTT=300 ; ms, log and count clients over these (see /clients on the metrics port)
+DegradedJitter=100
+DegradedLostPings=2
+
+[ClientUDPSocket] ; also BroadcastSocket, ListenSocket and ClientTCPSocket, unset options are left alone
+ReceiveBuffer=262144 ; bytes
+SendBuffer=262144
+DSCP=46 ; expedited forwarding
+AutoTuneMax=4194304 ; bytes, double the receive buffer up to this when the kernel drops packets (UDP only)
+Timestamps=1 ; kernel receive times for the queue/ack delay metrics
+
+[ClientTCPSocket]
+NoDelay=1
+
+[Limits] ; memory, see memory_bytes on the metrics port
+ClientMemoryKB=4096 ; buffers plus the client's players and groups, over this it's removed, 0 to disable
+SessionMemoryKB=0 ; everything, the largest clients are removed until it's under, 0 to disable
+MaxMessageKB=1024 ; reassembled RP messages over this are dropped
+
+[Pipeline]
+IOThreads=1 ; client UDP receive, RP reassembly and acks on their own threads, 0 does everything on the main thread
+;IOThreadCPUs=2,3 ; pin the I/O threads, in order
+;LogicThreadCPU=1 ; pin the main thread
+
+[Metrics]
+Port=9100 ; serve prometheus metrics over HTTP, disabled if not set
+ListenAddr=::1
+
+[Trace]
+;Enabled=1 ; record spans, exported from the metrics server at /trace.json (chrome://tracing) and /trace.folded (flamegraph.pl)
+;BufferEvents=200000 ; per thread, the oldest are dropped
+)";
+
+int main(int argc, char *argv[])
+{
+    int minTimeMs = 200;
+    int repeats = 5;
+    std::string filter;
+    const char *outputPath = nullptr;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--min-time") == 0 && i + 1 < argc)
+            minTimeMs = std::max(1, atoi(argv[++i]));
+        else if(strcmp(argv[i], "--repeats") == 0 && i + 1 < argc)
+            repeats = std::max(1, atoi(argv[++i]));
+        else if(strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            outputPath = argv[++i];
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--min-time ms] [--repeats n] [--filter substring] [--output results.json]\n";
+            return 1;
+        }
+    }
+
+    // nothing should be logged, but make sure formatting isn't measured
+    Logger::get().setLevel(LogLevel::None);
+
+    BenchRunner runner(std::chrono::milliseconds(minTimeMs), repeats, filter);
+
+    // reliable protocol headers
+    // ids are 1-3 byte varints, so cover each size
+    const uint16_t rpIds[]{5, 300, 20000};
+    const char *rpIdNames[]{"1b", "2b", "3b"};
+
+    for(int i = 0; i < 3; i++)
+    {
+        auto id = rpIds[i];
+
+        runner.run(std::string("rp_header_fill/") + rpIdNames[i], [id](uint64_t n)
+        {
+            uint8_t buf[16];
+            for(uint64_t j = 0; j < n; j++)
+            {
+                auto size = getRPHeaderSize(id, id);
+                auto end = fillRPHeader(buf, id, id, DPRPFrame_Reliable | DPRPFrame_Start | DPRPFrame_End, j & 0xFF, 1, 0);
+                keep(size);
+                keep(end);
+            }
+        });
+
+        runner.run(std::string("rp_header_parse/") + rpIdNames[i], [id](uint64_t n)
+        {
+            uint8_t frame[64] = {};
+            auto headerEnd = fillRPHeader(frame, id, id, DPRPFrame_Reliable | DPRPFrame_Start | DPRPFrame_End, 1, 1, 0);
+            size_t len = headerEnd - frame + 16;
+
+            for(uint64_t j = 0; j < n; j++)
+            {
+                RPFrameHeader header;
+                keep(frame);
+                bool ok = parseRPHeader(frame, len, header);
+                keep(ok);
+                keep(header);
+            }
+        });
+    }
+
+    // dplay header parsing, an old version is rejected after all the header checks without dispatching
+    {
+        Session session("bench", appGUID, 0);
+        Client client(session, "::1", 2300);
+        client.setReplayMode(true);
+
+        auto packet = makeDPlayPacket(DPSPCommand::EnumSessions, 64);
+        reinterpret_cast<DPSPMessageHeader *>(packet.data())->version = 13;
+
+        runner.run("dplay_header_parse", [&client, &packet](uint64_t n)
+        {
+            for(uint64_t j = 0; j < n; j++)
+            {
+                size_t len = packet.size();
+                keep(packet);
+                bool handled = client.handleDPlayPacket(packet.data(), len);
+                keep(handled);
+                keep(len);
+            }
+        });
+    }
+
+    // UTF conversions, roughly the length of a session/player name
+    {
+        std::string u8Name = "Brick Train International \xc3\xa9\xc3\xa8 Session";
+        auto u16Name = convertUTF8ToUCS2(u8Name);
+
+        runner.run("utf8_to_ucs2", [&u8Name](uint64_t n)
+        {
+            for(uint64_t j = 0; j < n; j++)
+            {
+                keep(u8Name);
+                auto ret = convertUTF8ToUCS2(u8Name);
+                keep(ret);
+            }
+        });
+
+        runner.run("ucs2_to_utf8", [&u16Name](uint64_t n)
+        {
+            for(uint64_t j = 0; j < n; j++)
+            {
+                keep(u16Name);
+                auto ret = convertUCS2ToUTF8(u16Name);
+                keep(ret);
+            }
+        });
+    }
+
+    // SuperEnumPlayersReply, built in response to an AddForwardRequest
+    // replay mode skips the socket so this is only the parsing + building
+    for(size_t numPlayers : {10, 100, 1000})
+    {
+        Session session("bench", appGUID, 0);
+        fillSession(session, numPlayers);
+
+        Client client(session, "::1", 2300);
+        client.setReplayMode(true);
+
+        // request for an existing system player, no names or data
+        auto requestSize = sizeof(DPSPMessageAddForwardRequest) + sizeof(DPPackedPlayer) + 2 + 4;
+        auto packet = makeDPlayPacket(DPSPCommand::AddForwardRequest, requestSize);
+        auto request = reinterpret_cast<DPSPMessageAddForwardRequest *>(packet.data() + sizeof(DPSPMessageHeader));
+        auto packedPlayer = reinterpret_cast<DPPackedPlayer *>(request + 1);
+
+        uint32_t playerId = 0;
+        for(auto &player : session.getPlayers())
+        {
+            if(!(player.second.getFlags() & DPPlayer_SendingMachine))
+            {
+                playerId = player.first;
+                break;
+            }
+        }
+
+        request->idTo = 0;
+        request->playerId = session.adjustId(playerId);
+        request->groupId = 0;
+        request->createOffset = sizeof(DPSPMessageAddForwardRequest) + 8;
+        request->passwordOffset = 0;
+
+        memset(packedPlayer, 0, sizeof(DPPackedPlayer));
+        packedPlayer->size = sizeof(DPPackedPlayer);
+        packedPlayer->flags = DPPlayer_System;
+        packedPlayer->playerId = session.adjustId(playerId);
+        packedPlayer->fixedSize = sizeof(DPPackedPlayer);
+
+        runner.run("super_enum_players_reply/" + std::to_string(numPlayers), [&session, &client, &packet](uint64_t n)
+        {
+            for(uint64_t j = 0; j < n; j++)
+            {
+                size_t len = packet.size();
+                bool handled = client.handleDPlayPacket(packet.data(), len);
+                keep(handled);
+
+                // the request queues a roster change, the main loop would send and clear it
+                session.clearRosterChanges();
+            }
+        });
+    }
+
+    // a machine joining and leaving (system player + game player)
+    {
+        Session session("bench", appGUID, 0);
+        fillSession(session, 16);
+
+        runner.run("session_create_delete", [&session](uint64_t n)
+        {
+            for(uint64_t j = 0; j < n; j++)
+            {
+                auto systemId = session.createNewSystemPlayer().getId();
+                session.createNewPlayer(systemId);
+                session.deletePlayer(systemId);
+            }
+        });
+    }
+
+    runner.run("ini_load", [](uint64_t n)
+    {
+        for(uint64_t j = 0; j < n; j++)
+        {
+            std::istringstream stream(sampleConfig);
+            IniFile ini(stream);
+            keep(ini);
+        }
+    });
+
+    auto json = runner.toJSON();
+
+    if(outputPath)
+    {
+        std::ofstream out(outputPath);
+        out << json;
+
+        if(!out)
+        {
+            std::cerr << "failed to write " << outputPath << "\n";
+            return 1;
+        }
+    }
+    else
+        std::cout << json;
+
+    return 0;
+}
@@ -0,0 +1,114 @@
+#include <cstring>
+
+#include "Capture.hpp"
+
+CaptureWriter &CaptureWriter::get()
+{
+    static CaptureWriter writer;
+    return writer;
+}
+
+CaptureWriter::~CaptureWriter()
+{
+    close();
+}
+
+bool CaptureWriter::open(const char *path)
+{
+    close();
+
+    file = fopen(path, "wb");
+
+    if(!file)
+        return false;
+
+    CaptureFileHeader header;
+    memcpy(header.magic, "BTCP", 4);
+    header.version = 1;
+
+    fwrite(&header, sizeof(header), 1, file);
+
+    startTime = std::chrono::steady_clock::now();
+
+    return true;
+}
+
+void CaptureWriter::close()
+{
+    std::lock_guard lock(mutex);
+
+    if(file)
+        fclose(file);
+
+    file = nullptr;
+}
+
+void CaptureWriter::write(CaptureType type, std::string_view key, const void *data, size_t len)
+{
+    CaptureRecordHeader header;
+    header.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    header.type = type;
+    header.keyLength = key.length() > 255 ? 255 : key.length();
+    header.reserved = 0;
+    header.dataLength = len;
+
+    std::lock_guard lock(mutex);
+
+    if(!file)
+        return;
+
+    // stdio buffers this for us
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(key.data(), 1, header.keyLength, file);
+    fwrite(data, 1, len, file);
+}
+
+CaptureReader::~CaptureReader()
+{
+    if(file)
+        fclose(file);
+}
+
+bool CaptureReader::open(const char *path)
+{
+    file = fopen(path, "rb");
+
+    if(!file)
+        return false;
+
+    CaptureFileHeader header;
+
+    if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, "BTCP", 4) != 0 || header.version != 1)
+    {
+        fclose(file);
+        file = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+bool CaptureReader::read(Record &record)
+{
+    if(!file)
+        return false;
+
+    CaptureRecordHeader header;
+
+    if(fread(&header, sizeof(header), 1, file) != 1)
+        return false;
+
+    record.timestamp = header.timestamp;
+    record.type = header.type;
+
+    record.key.resize(header.keyLength);
+    record.data.resize(header.dataLength);
+
+    if(fread(record.key.data(), 1, header.keyLength, file) != header.keyLength)
+        return false;
+
+    if(fread(record.data.data(), 1, header.dataLength, file) != header.dataLength)
+        return false;
+
+    return true;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// traffic capture file format
+// file header, then a record header + key + data for each packet
+
+enum class CaptureType : uint8_t
+{
+    TCPIn,
+    TCPOut,
+    BroadcastIn,
+    RPIn,
+    RPOut,
+    Disconnect, // no data
+};
+
+struct CaptureFileHeader
+{
+    char magic[4]; // "BTCP"
+    uint32_t version;
+};
+static_assert(sizeof(CaptureFileHeader) == 8);
+
+struct CaptureRecordHeader
+{
+    uint64_t timestamp; // ns since the start of the capture
+    CaptureType type;
+    uint8_t keyLength;
+    uint16_t reserved;
+    uint32_t dataLength;
+
+    // key, data
+};
+static_assert(sizeof(CaptureRecordHeader) == 16);
+
+class CaptureWriter final
+{
+public:
+    static CaptureWriter &get();
+
+    ~CaptureWriter();
+
+    bool open(const char *path);
+    void close();
+
+    bool isOpen() const
+    {
+        return file != nullptr;
+    }
+
+    void record(CaptureType type, std::string_view key, const void *data, size_t len)
+    {
+        if(file)
+            write(type, key, data, len);
+    }
+
+private:
+    CaptureWriter() = default;
+
+    void write(CaptureType type, std::string_view key, const void *data, size_t len);
+
+    std::mutex mutex;
+    FILE *file = nullptr;
+    std::chrono::steady_clock::time_point startTime;
+};
+
+class CaptureReader final
+{
+public:
+    struct Record
+    {
+        uint64_t timestamp;
+        CaptureType type;
+        std::string key;
+        std::vector<uint8_t> data;
+    };
+
+    CaptureReader() = default;
+    ~CaptureReader();
+
+    bool open(const char *path);
+
+    bool read(Record &record);
+
+private:
+    FILE *file = nullptr;
+};
@@ -0,0 +1,2161 @@
+#include <algorithm>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "Capture.hpp"
+#include "Client.hpp"
+#include "LocoMessage.hpp"
+#include "PostcardStore.hpp"
+#include "Probes.hpp"
+#include "Logger.hpp"
+#include "ReliableProtocol.hpp"
+#include "ServerMetrics.hpp"
+#include "Trace.hpp"
+#include "Unicode.hpp"
+#include "UserRegistry.hpp"
+
+// super packed players have 1, 2 or 4 byte counts
+static size_t getPackedCountSize(uint32_t count)
+{
+    return count < 0x100 ? 1 : (count < 0x10000 ? 2 : 4);
+}
+
+static uint8_t *writePackedCount(uint8_t *ptr, uint32_t count, uint32_t &infoMask, int shift)
+{
+    auto size = getPackedCountSize(count);
+
+    infoMask |= (size == 4 ? 3 : size) << shift;
+    memcpy(ptr, &count, size); // little endian
+
+    return ptr + size;
+}
+
+// UCS-2 with the terminator, empty for no name
+static std::u16string getPackedName(const std::string &name)
+{
+    // names from the game can still have their terminator
+    auto ret = convertUTF8ToUCS2(name.c_str());
+
+    if(!ret.empty())
+        ret.push_back(0);
+
+    return ret;
+}
+
+static void appendBytes(std::vector<uint8_t> &buf, const void *data, size_t len)
+{
+    auto bytes = static_cast<const uint8_t *>(data);
+    buf.insert(buf.end(), bytes, bytes + len);
+}
+
+// the packed player/group at createOffset, null if it or anything it has the size of is outside the message
+static const DPPackedPlayer *getPackedPlayer(const uint8_t *data, size_t len, size_t commandSize, uint32_t createOffset)
+{
+    if(len < commandSize || len < sizeof(DPPackedPlayer) || createOffset < 8 || createOffset - 8 > len - sizeof(DPPackedPlayer))
+        return nullptr;
+
+    auto offset = createOffset - 8;
+    auto player = reinterpret_cast<const DPPackedPlayer *>(data + offset);
+
+    uint64_t partsSize = uint64_t(player->shortNameLength) + player->longNameLength + player->serviceProviderDataSize + player->playerDataSize;
+
+    if(player->size < sizeof(DPPackedPlayer) || player->size > len - offset || sizeof(DPPackedPlayer) + partsSize > player->size)
+        return nullptr;
+
+    return player;
+}
+
+// returns the total length, only copies if capturing
+static size_t recordGathered(CaptureType type, const std::string &address, const iovec *iov, int iovCount)
+{
+    size_t len = 0;
+    for(int i = 0; i < iovCount; i++)
+        len += iov[i].iov_len;
+
+    auto &capture = CaptureWriter::get();
+    if(capture.isOpen())
+    {
+        std::vector<uint8_t> packet;
+        packet.reserve(len);
+
+        for(int i = 0; i < iovCount; i++)
+        {
+            auto base = static_cast<const uint8_t *>(iov[i].iov_base);
+            packet.insert(packet.end(), base, base + iov[i].iov_len);
+        }
+
+        capture.record(type, address, packet.data(), packet.size());
+    }
+
+    return len;
+}
+
+LatencyLimits Client::latencyLimits;
+ClientTimeouts Client::timeouts;
+MemoryLimits Client::memoryLimits;
+std::chrono::milliseconds Client::flushInterval{0};
+Pipeline *Client::pipeline = nullptr;
+Socket *Client::sharedUDPSocket = nullptr;
+SocketOptions Client::tcpSocketOptions, Client::udpSocketOptions;
+
+// flushed early past these
+static constexpr size_t maxQueuedFrames = 64;
+static constexpr size_t maxQueuedBytes = 64 * 1024;
+
+// a client that isn't reading its outgoing connection gets it closed
+static constexpr size_t maxTCPOutput = 256 * 1024;
+
+Client::~Client()
+{
+    flushOutput();
+
+    if(pipelineId)
+        pipeline->removeClient(pipelineId);
+
+    if(systemPlayerId != ~0u)
+        session.deletePlayer(systemPlayerId);
+
+    if(degraded)
+        serverMetrics.degradedClients->add(-1);
+}
+
+void Client::serialize(StateWriter &writer) const
+{
+    writer.write<int32_t>(outgoingPort);
+
+    writer.writeFd(tcpIncoming.getFd());
+    writer.writeFd(tcpOutgoing.getFd());
+    writer.writeFd(udpSocket.getFd());
+    writer.write(usesSharedUDP());
+
+    writer.write(systemPlayerId);
+    writer.write<int64_t>(createdTime.time_since_epoch().count());
+
+    rpReceiver.serialize(writer);
+    writer.write(nextSendMessageId);
+
+    // serials start again with the new process
+    writer.write(rosterSerial != ~0u);
+    writer.write(joinState);
+
+    writer.write(tcpConnecting);
+    writer.writeBytes(tcpOutput.data(), tcpOutput.size());
+
+    writer.write(userValue);
+    writer.writeString(userName);
+    writer.write(userCounted);
+}
+
+bool Client::deserialize(StateReader &reader)
+{
+    outgoingPort = reader.read<int32_t>();
+
+    int fd = reader.readFd();
+    if(fd != -1)
+        tcpIncoming = Socket(SocketType::TCP, fd);
+
+    fd = reader.readFd();
+    if(fd != -1)
+        tcpOutgoing = Socket(SocketType::TCP, fd);
+
+    fd = reader.readFd();
+    if(fd != -1)
+        udpSocket = Socket(SocketType::UDP, fd);
+
+    // the shared socket is handed over with the rest
+    if(reader.read<bool>())
+        udpAddress = std::make_unique<SocketAddress>(address.c_str(), outgoingPort);
+
+    // mostly already set, but the drop counting state isn't in the fd
+    tcpIncoming.setOptions(tcpSocketOptions);
+    tcpOutgoing.setOptions(tcpSocketOptions);
+    udpSocket.setOptions(udpSocketOptions);
+
+    systemPlayerId = reader.read<uint32_t>();
+    createdTime = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(reader.read<int64_t>()));
+
+    rpReceiver.deserialize(reader);
+    nextSendMessageId = reader.read<uint8_t>();
+
+    rosterSerial = reader.read<bool>() ? 0 : ~0u;
+    joinState = reader.read<JoinState>();
+
+    tcpConnecting = reader.read<bool>();
+    tcpOutput = reader.readBytes();
+
+    userValue = reader.read<uint32_t>();
+    userName = reader.readString();
+    userCounted = reader.read<bool>();
+
+    if(reader.hasFailed())
+        return false;
+
+    // routes aren't saved, every player of this client's system player was created by it
+    if(systemPlayerId != ~0u)
+    {
+        for(auto &player : session.getPlayers())
+        {
+            if(player.second.getSystemPlayerId() == systemPlayerId)
+                session.setPlayerClient(player.first, this);
+        }
+    }
+
+    return true;
+}
+
+bool Client::handleDPlayPacket(const uint8_t *data, size_t &len, std::chrono::system_clock::time_point arrival)
+{
+    TRACE_SPAN("handleDPlayPacket");
+
+    lastReceiveTime = Clock::now();
+
+    if(len < sizeof(DPSPMessageHeader))
+    {
+        // not enough data for a header
+        len = 0;
+        return false;
+    }
+
+    // something something byte-order something
+    auto header = reinterpret_cast<const DPSPMessageHeader *>(data);
+
+    auto packetSize = header->sizeToken & 0xFFFFF;
+    //auto token = header->sizeToken >> 20;
+
+    if(len < packetSize)
+    {
+        // not enough data
+        len = packetSize;
+        return false;
+    }
+
+    len = packetSize;
+
+    if(memcmp(header->signature, "play", 4) != 0)
+        return false;
+
+    // only handle dx9
+    if(header->version != 14)
+        return false;
+
+    packetArrival = arrival;
+
+    if(arrival != std::chrono::system_clock::time_point{})
+    {
+        auto delay = getTimeSinceArrival();
+        serverMetrics.getCommandQueueDelay(header->command).observe(delay);
+        queueDelay.add(delay);
+    }
+
+    return handleDPlayCommand(header->command, data + sizeof(DPSPMessageHeader), len - sizeof(DPSPMessageHeader));
+}
+
+void Client::handleUDPRead()
+{
+    // this is for data received after joining a session
+    uint8_t buf[2048];
+    int len = udpSocket.recv(buf, sizeof(buf));
+    
+    // zero for disconnected is a tcp thing...?
+    if(len <= 0)
+        return;
+
+    CaptureWriter::get().record(CaptureType::RPIn, address, buf, len);
+
+    handleRPFrame(buf, len, udpSocket.getReceiveTime());
+}
+
+void Client::handleRPFrame(const uint8_t *buf, size_t len, std::chrono::system_clock::time_point arrival)
+{
+    TRACE_SPAN("handleRPFrame");
+
+    serverMetrics.rpPacketsReceived->inc();
+    serverMetrics.rpBytesReceived->inc(len);
+
+    packetArrival = arrival;
+
+    if(arrival != std::chrono::system_clock::time_point{})
+    {
+        auto delay = getTimeSinceArrival();
+        serverMetrics.rpQueueDelay->observe(delay);
+        queueDelay.add(delay);
+    }
+
+    lastReceiveTime = Clock::now();
+
+    HistogramTimer timer(*serverMetrics.rpFrameTime);
+
+    // assume we're using the "reliable protocol"
+    RPReceivedFrame frame;
+
+    {
+        TRACE_SPAN("rpReassembly");
+
+        if(!rpReceiver.handleFrame(buf, len, frame))
+            return;
+    }
+
+    auto &header = frame.header;
+    PROBE6(rp_frame, address.c_str(), header.fromId, header.toId, header.flags, header.messageId, header.sequence);
+
+    if(frame.message)
+    {
+        PROBE3(rp_message, address.c_str(), header.messageId, frame.messageLen);
+        handleCompletedRPMessage(frame.message, frame.messageLen);
+    }
+
+    if(frame.needsAck)
+        sendRPAck(frame.header);
+}
+
+bool Client::handleDPlayCommand(DPSPCommand command, const uint8_t *data, size_t len, bool viaRP)
+{
+    TRACE_SPAN("handleDPlayCommand", uint32_t(command));
+
+    serverMetrics.getCommandCounter(command).inc();
+    HistogramTimer timer(serverMetrics.getCommandTime(command));
+
+    PROBE4(dplay_command, address.c_str(), uint32_t(command), len, viaRP);
+
+    // data/len don't include header here
+    switch(command)
+    {
+        case DPSPCommand::EnumSessions:
+        {
+            auto cmd = reinterpret_cast<const DPSPMessageEnumSessions *>(data);
+            // TODO: password?
+            LOG_INFO(DPlay, "enum sessions %u %u", cmd->passwordOffset, cmd->flags);
+
+            // don't reply if app mismatch
+            if(memcmp(cmd->applicationGUID, session.getAppGUID(), 16) != 0)
+            {
+                LOG_WARNING(DPlay, "app guid mismatch");
+                return true;
+            }
+
+            // reply
+            if(checkOutgoingSocket())
+            {
+                auto sessionName = convertUTF8ToUCS2(session.getName());
+                size_t replySize = sizeof(DPSPMessageHeader) + sizeof(DPSPMessageEnumSessionsReply) + (sessionName.length() + 1) * 2;
+
+                auto replyBuffer = new uint8_t[replySize];
+                auto header = reinterpret_cast<DPSPMessageHeader *>(replyBuffer);
+                auto replyMessage = reinterpret_cast<DPSPMessageEnumSessionsReply *>(replyBuffer + sizeof(DPSPMessageHeader));
+
+                fillOutgoingHeader(header, replySize, DPSPCommand::EnumSessionsReply);
+                fillSessionDesc(&replyMessage->sessionDescription);
+
+                replyMessage->nameOffset = sizeof(DPSPMessageEnumSessionsReply) + 8;
+
+                // copy the name
+                memcpy(replyBuffer + sizeof(DPSPMessageHeader) + sizeof(DPSPMessageEnumSessionsReply), sessionName.data(), sessionName.length() * 2);
+                replyBuffer[replySize - 2] = 0;
+                replyBuffer[replySize - 1] = 0;
+
+                if(!sendTCP(replyBuffer, replySize))
+                {
+                    LOG_ERROR(DPlay, "Failed to send enum sessions reply!");
+                }
+
+                delete[] replyBuffer;
+            }
+            return true;
+        }
+
+        case DPSPCommand::RequestPlayerId:
+        {
+            auto cmd = reinterpret_cast<const DPSPMessageRequestPlayerId *>(data);
+
+            bool isSystem = cmd->flags & RequestPlayerId_System;
+
+            if(isSystem && systemPlayerId != ~0u)
+            {
+                LOG_WARNING(DPlay, "client requesting system player id when they already have one");
+                return true;
+            }
+
+            LOG_INFO(DPlay, "req player id %i", isSystem);
+
+            // turn away anyone too far away to play, before they get a player
+            if(isSystem && latencyLimits.maxJoinRTTMs)
+            {
+                auto rtt = getTCPRTTMs();
+
+                if(rtt > latencyLimits.maxJoinRTTMs)
+                {
+                    LOG_WARNING(DPlay, "rejecting %s, RTT %ums", address.c_str(), rtt);
+                    serverMetrics.joinsRejectedLatency->inc();
+                    sendRequestIdReply(0, DPResult_CantCreatePlayer);
+                    return true;
+                }
+            }
+
+            // MaxPlayers can be lowered by a reload, so it's checked here and not only sent in EnumSessions
+            if(session.getCurrentPlayers() >= session.getMaxPlayers())
+            {
+                LOG_WARNING(DPlay, "rejecting %s, session is full (%u players)", address.c_str(), session.getMaxPlayers());
+                serverMetrics.joinsRejectedFull->inc();
+                sendRequestIdReply(0, DPResult_CantCreatePlayer);
+                return true;
+            }
+
+            auto &newPlayer = isSystem ? session.createNewSystemPlayer() : session.createNewPlayer(systemPlayerId);
+            
+            if(isSystem)
+            {
+                systemPlayerId = newPlayer.getId();
+                joinState = JoinState::SystemPlayer;
+            }
+
+            session.setPlayerClient(newPlayer.getId(), this);
+
+            sendRequestIdReply(newPlayer.getId());
+            return true;
+        }
+
+        case DPSPCommand::RequestGroupId:
+        {
+            if(systemPlayerId == ~0u)
+            {
+                LOG_WARNING(DPlay, "client requesting group id without a system player");
+                return true;
+            }
+
+            auto &newGroup = session.createNewGroup(systemPlayerId);
+
+            LOG_INFO(DPlay, "req group id %u", newGroup.getId());
+
+            sendRequestIdReply(newGroup.getId());
+            return true;
+        }
+
+        case DPSPCommand::CreatePlayer:
+        {
+            auto cmd = reinterpret_cast<const DPSPMessageCreatePlayer *>(data);
+            auto playerInfo = getPackedPlayer(data, len, sizeof(DPSPMessageCreatePlayer), cmd->createOffset);
+
+            if(!playerInfo)
+            {
+                LOG_WARNING(DPlay, "bad create player from %s", address.c_str());
+                serverMetrics.malformedCommands->inc();
+                PROBE2(drop, "malformed_command", address.c_str());
+                return true;
+            }
+
+            auto ptr = reinterpret_cast<const uint8_t *>(playerInfo + 1);
+
+            auto player = getOwnPlayer(playerInfo->playerId);
+
+            if(!player)
+                return true;
+
+            // short name
+            std::u16string_view shortName(reinterpret_cast<const char16_t *>(ptr), playerInfo->shortNameLength / 2);
+            ptr += playerInfo->shortNameLength;
+            player->setShortName(convertUCS2ToUTF8(shortName));
+
+            // the length includes the terminator
+            userName = convertUCS2ToUTF8(shortName);
+            userName.resize(strlen(userName.c_str()));
+
+            // long name
+            std::u16string_view longName(reinterpret_cast<const char16_t *>(ptr), playerInfo->longNameLength / 2);
+            ptr += playerInfo->longNameLength;
+            player->setLongName(convertUCS2ToUTF8(longName));
+
+            // service provider data
+            if(playerInfo->serviceProviderDataSize)
+            {
+                player->setServiceProviderData(ptr, playerInfo->serviceProviderDataSize);
+                ptr += playerInfo->serviceProviderDataSize;
+            }
+
+            if(playerInfo->playerDataSize)
+            {
+                player->setData(ptr, playerInfo->playerDataSize);
+                ptr += playerInfo->playerDataSize;
+            }
+
+            // no reply, everyone else is told about it
+            addRosterChange(DPSPCommand::CreatePlayer, player->getId());
+
+            // is this the right place to open the socket?
+            // it's the last thing sent before switching to UDP...
+            // (and we're connecting the socket, it's only used to send to this client)
+            if(sharedUDPSocket && !replayMode)
+            {
+                udpAddress = std::make_unique<SocketAddress>(address.c_str(), outgoingPort);
+                joinState = JoinState::Joined;
+            }
+            else if(!replayMode && !udpSocket.connect(address.c_str(), outgoingPort, outgoingPort))
+                LOG_ERROR(Net, "failed to connect UDP socket");
+            else
+            {
+                udpSocket.setOptions(udpSocketOptions);
+                attachPipeline();
+                joinState = JoinState::Joined;
+            }
+
+            serverMetrics.handshakeTime->observe(Clock::now() - createdTime);
+
+            sendInitialLocoMessage();
+
+            return true;
+        }
+
+        case DPSPCommand::CreateGroup:
+        {
+            // same as CreatePlayer
+            auto cmd = reinterpret_cast<const DPSPMessageCreatePlayer *>(data);
+            auto groupInfo = getPackedPlayer(data, len, sizeof(DPSPMessageCreatePlayer), cmd->createOffset);
+
+            if(!groupInfo)
+            {
+                LOG_WARNING(DPlay, "bad create group from %s", address.c_str());
+                serverMetrics.malformedCommands->inc();
+                PROBE2(drop, "malformed_command", address.c_str());
+                return true;
+            }
+
+            auto ptr = reinterpret_cast<const uint8_t *>(groupInfo + 1);
+
+            auto group = getOwnGroup(groupInfo->playerId);
+
+            if(!group)
+                return true;
+
+            std::u16string_view shortName(reinterpret_cast<const char16_t *>(ptr), groupInfo->shortNameLength / 2);
+            ptr += groupInfo->shortNameLength;
+            group->setShortName(convertUCS2ToUTF8(shortName));
+
+            std::u16string_view longName(reinterpret_cast<const char16_t *>(ptr), groupInfo->longNameLength / 2);
+            ptr += groupInfo->longNameLength;
+            group->setLongName(convertUCS2ToUTF8(longName));
+
+            if(groupInfo->parentId)
+                group->setParentId(session.adjustId(groupInfo->parentId));
+
+            // no reply, everyone else is told about it
+            addRosterChange(DPSPCommand::CreateGroup, group->getId());
+            return true;
+        }
+
+        case DPSPCommand::DeletePlayer:
+        {
+            if(len < sizeof(DPSPMessageAddPlayerToGroup))
+                return true;
+
+            auto cmd = reinterpret_cast<const DPSPMessageAddPlayerToGroup *>(data);
+            auto player = getOwnPlayer(cmd->playerId);
+
+            if(!player)
+                return true;
+
+            auto id = player->getId();
+
+            LOG_INFO(DPlay, "delete player %u", id);
+
+            if(id == systemPlayerId)
+                leave(false);
+            else
+            {
+                addRosterChange(DPSPCommand::DeletePlayer, id);
+                session.deletePlayer(id);
+            }
+
+            return true;
+        }
+
+        case DPSPCommand::PlayerDataChanged:
+        {
+            auto cmd = reinterpret_cast<const DPSPMessagePlayerDataChanged *>(data);
+
+            // both from the wire, checked separately so the sum can't wrap
+            if(len < sizeof(DPSPMessagePlayerDataChanged) || cmd->dataOffset < 8 || size_t(cmd->dataOffset - 8) > len
+               || cmd->dataSize > len - size_t(cmd->dataOffset - 8))
+            {
+                LOG_WARNING(DPlay, "bad player data changed from %s", address.c_str());
+                serverMetrics.malformedCommands->inc();
+                PROBE2(drop, "malformed_command", address.c_str());
+                return true;
+            }
+
+            auto player = getOwnPlayer(cmd->playerId);
+
+            if(!player)
+                return true;
+
+            player->setData(data + cmd->dataOffset - 8, cmd->dataSize);
+            addRosterChange(command, player->getId());
+            return true;
+        }
+
+        case DPSPCommand::PlayerNameChanged:
+        {
+            auto cmd = reinterpret_cast<const DPSPMessagePlayerNameChanged *>(data);
+
+            if(len < sizeof(DPSPMessagePlayerNameChanged))
+                return true;
+
+            auto player = getOwnPlayer(cmd->playerId);
+
+            if(!player)
+                return true;
+
+            // offsets are 0 for no name
+            auto readName = [data, len](uint32_t offset)
+            {
+                if(offset < 8 + sizeof(DPSPMessagePlayerNameChanged) || offset - 8 >= len)
+                    return std::string();
+
+                auto start = reinterpret_cast<const char16_t *>(data + offset - 8);
+                std::u16string_view name(start, (len - (offset - 8)) / 2);
+
+                return convertUCS2ToUTF8(name.substr(0, name.find(u'\0')));
+            };
+
+            player->setShortName(readName(cmd->shortNameOffset));
+            player->setLongName(readName(cmd->longNameOffset));
+
+            addRosterChange(command, player->getId());
+            return true;
+        }
+
+        case DPSPCommand::DeleteGroup:
+        case DPSPCommand::AddPlayerToGroup:
+        case DPSPCommand::DeletePlayerFromGroup:
+        case DPSPCommand::AddShortcutToGroup:
+        case DPSPCommand::DeleteShortcutFromGroup:
+            handleGroupCommand(command, data, len);
+            return true;
+
+        case DPSPCommand::AddForwardRequest:
+        {
+            auto cmd = reinterpret_cast<const DPSPMessageAddForwardRequest *>(data);
+            auto playerInfo = getPackedPlayer(data, len, sizeof(DPSPMessageAddForwardRequest), cmd->createOffset);
+
+            if(!playerInfo)
+            {
+                LOG_WARNING(DPlay, "bad add forward request from %s", address.c_str());
+                serverMetrics.malformedCommands->inc();
+                PROBE2(drop, "malformed_command", address.c_str());
+                return true;
+            }
+
+            // followed by the password and a tick count, sessions don't have passwords and the tick count isn't needed
+
+            auto ptr = reinterpret_cast<const uint8_t *>(playerInfo + 1);
+
+            // this is the client's own system player
+            auto player = getOwnPlayer(playerInfo->playerId);
+
+            if(!player)
+                return true;
+
+            if(player->getId() != systemPlayerId)
+            {
+                LOG_WARNING(DPlay, "%s add fwd for %u, which isn't its system player", address.c_str(), player->getId());
+                return true;
+            }
+
+            std::u16string_view shortName(reinterpret_cast<const char16_t *>(ptr), playerInfo->shortNameLength / 2);
+            ptr += playerInfo->shortNameLength;
+            player->setShortName(convertUCS2ToUTF8(shortName));
+
+            // long name
+            std::u16string_view longName(reinterpret_cast<const char16_t *>(ptr), playerInfo->longNameLength / 2);
+            ptr += playerInfo->longNameLength;
+            player->setLongName(convertUCS2ToUTF8(longName));
+
+            // service provider data
+            if(playerInfo->serviceProviderDataSize)
+            {
+                player->setServiceProviderData(ptr, playerInfo->serviceProviderDataSize);
+                ptr += playerInfo->serviceProviderDataSize;
+            }
+
+            if(playerInfo->playerDataSize)
+            {
+                player->setData(ptr, playerInfo->playerDataSize);
+                ptr += playerInfo->playerDataSize;
+            }
+
+            // forwarded to everyone else
+            addRosterChange(DPSPCommand::CreatePlayer, player->getId());
+
+            if(checkOutgoingSocket())
+            {
+                // if session flags & DPSession_ServerPlayerOnly return EnumPlayersReply instead
+
+                // this is a big one
+                size_t replySize = sizeof(DPSPMessageHeader) + sizeof(DPSPMessageSuperEnumPlayersReply);
+
+                // session description + name
+                auto sessionName = convertUTF8ToUCS2(session.getName());
+                replySize += sizeof(DPSessionDesc2) + (sessionName.length() + 1) * 2;
+
+                auto &players = session.getPlayers();
+                replySize += sizeof(DPSuperPackedPlayer) * players.size();
+
+                for(auto &player : players)
+                {
+                    // TODO: + names and data
+                    auto spDataLen = player.second.getServiceProviderDataLen();
+                    if(spDataLen)
+                        replySize += spDataLen + 1; // we only support sockets so this will always be 32
+                }
+
+                auto &groups = session.getGroups();
+                replySize += sizeof(DPSuperPackedPlayer) * groups.size();
+
+                uint32_t shortcutCount = 0;
+
+                // UCS-2 names with terminators, in the same order
+                std::vector<std::pair<std::u16string, std::u16string>> groupNames;
+                groupNames.reserve(groups.size());
+
+                for(auto &group : groups)
+                {
+                    auto &names = groupNames.emplace_back(getPackedName(group.second.getShortName()), getPackedName(group.second.getLongName()));
+                    replySize += (names.first.length() + names.second.length()) * 2;
+
+                    auto &members = group.second.getMembers();
+                    if(!members.empty())
+                        replySize += getPackedCountSize(members.size()) + members.size() * 4;
+
+                    if(group.second.getParentId())
+                        replySize += 4;
+
+                    auto &shortcuts = group.second.getShortcuts();
+                    if(!shortcuts.empty())
+                    {
+                        replySize += getPackedCountSize(shortcuts.size()) + shortcuts.size() * 4;
+                        shortcutCount++;
+                    }
+                }
+
+                auto replyBuffer = new uint8_t[replySize];
+                auto header = reinterpret_cast<DPSPMessageHeader *>(replyBuffer);
+                auto ptr = replyBuffer + sizeof(DPSPMessageHeader);
+                auto replyMessage = reinterpret_cast<DPSPMessageSuperEnumPlayersReply *>(ptr);
+
+                fillOutgoingHeader(header, replySize, DPSPCommand::SuperEnumPlayersReply);
+
+                replyMessage->playerCount = players.size();
+                replyMessage->groupCount = groups.size();
+                replyMessage->shortcutCount = shortcutCount; // groups with shortcuts
+                replyMessage->passwordOffset = 0;
+
+                // session
+                ptr += sizeof(DPSPMessageSuperEnumPlayersReply);
+                replyMessage->descriptionOffset = ptr - replyBuffer - 20;
+                auto sessionDesc = reinterpret_cast<DPSessionDesc2 *>(ptr);
+                fillSessionDesc(sessionDesc);
+
+                // session name
+                ptr += sizeof(DPSessionDesc2);
+                replyMessage->nameOffset = ptr - replyBuffer - 20;
+                memcpy(ptr, sessionName.data(), sessionName.length() * 2);
+
+                // null terminate
+                ptr += sessionName.length() * 2;
+                *ptr++ = 0;
+                *ptr++ = 0;
+
+                // players
+                replyMessage->packedOffset = ptr - replyBuffer - 20;
+                for(auto &player : players)
+                {
+                    auto superPlayer = reinterpret_cast<DPSuperPackedPlayer *>(ptr);
+
+                    superPlayer->size = 16;
+                    superPlayer->flags = player.second.getFlags();
+                    superPlayer->id = session.adjustId(player.first);
+                    superPlayer->playerInfoMask = 0;
+
+                    if(superPlayer->flags & DPPlayer_System)
+                        superPlayer->versionOrSystemPlayerId = 14; // version
+                    else
+                        superPlayer->versionOrSystemPlayerId = player.second.getSystemPlayerId();
+
+                    ptr += sizeof(DPSuperPackedPlayer);
+                    // TODO: names + data
+
+                    // service provider data
+                    auto spDataLen = player.second.getServiceProviderDataLen();
+                    if(spDataLen)
+                    {
+                        superPlayer->playerInfoMask |= 1 << DPSuperPlayer_ServiceProviderDataShift;
+                        *ptr++ = spDataLen;
+
+                        memcpy(ptr, player.second.getServiceProviderData(), spDataLen);
+
+                        ptr += spDataLen;
+                    }
+                }
+
+                // groups, after the players
+                auto groupName = groupNames.begin();
+
+                for(auto &group : groups)
+                {
+                    auto superPlayer = reinterpret_cast<DPSuperPackedPlayer *>(ptr);
+
+                    superPlayer->size = 16;
+                    superPlayer->flags = group.second.getFlags();
+                    superPlayer->id = session.adjustId(group.first);
+                    superPlayer->playerInfoMask = 0;
+                    superPlayer->versionOrSystemPlayerId = group.second.getOwnerId();
+
+                    ptr += sizeof(DPSuperPackedPlayer);
+
+                    auto &names = *groupName++;
+
+                    if(!names.first.empty())
+                    {
+                        superPlayer->playerInfoMask |= DPSuperPlayer_ShortName;
+                        memcpy(ptr, names.first.data(), names.first.length() * 2);
+                        ptr += names.first.length() * 2;
+                    }
+
+                    if(!names.second.empty())
+                    {
+                        superPlayer->playerInfoMask |= DPSuperPlayer_LongName;
+                        memcpy(ptr, names.second.data(), names.second.length() * 2);
+                        ptr += names.second.length() * 2;
+                    }
+
+                    auto &members = group.second.getMembers();
+                    if(!members.empty())
+                    {
+                        ptr = writePackedCount(ptr, members.size(), superPlayer->playerInfoMask, DPSuperPlayer_PlayerCountShift);
+
+                        for(auto &member : members)
+                        {
+                            uint32_t id = session.adjustId(member);
+                            memcpy(ptr, &id, 4);
+                            ptr += 4;
+                        }
+                    }
+
+                    if(group.second.getParentId())
+                    {
+                        superPlayer->playerInfoMask |= DPSuperPlayer_ParentID;
+
+                        uint32_t id = session.adjustId(group.second.getParentId());
+                        memcpy(ptr, &id, 4);
+                        ptr += 4;
+                    }
+
+                    auto &shortcuts = group.second.getShortcuts();
+                    if(!shortcuts.empty())
+                    {
+                        ptr = writePackedCount(ptr, shortcuts.size(), superPlayer->playerInfoMask, DPSuperPlayer_ShortcutCountShift);
+
+                        for(auto &shortcut : shortcuts)
+                        {
+                            uint32_t id = session.adjustId(shortcut);
+                            memcpy(ptr, &id, 4);
+                            ptr += 4;
+                        }
+                    }
+                }
+
+                if(!sendTCP(replyBuffer, replySize))
+                {
+                    LOG_ERROR(DPlay, "Failed to send add forward reply!");
+                }
+                else
+                {
+                    rosterSerial = session.getRosterSerial();
+                    joinState = JoinState::PlayerList;
+                }
+
+                delete[] replyBuffer;
+            }
+
+            return true;
+        }
+
+        case DPSPCommand::PlayerMessage:
+        {
+            // only expected if the clients can't send to each other
+            if(!(session.getFlags() & DPSession_RouteThroughHost) || len < sizeof(DPSPMessagePlayerMessage))
+            {
+                LOG_WARNING(DPlay, "unexpected player message (size %zu)", len);
+                serverMetrics.playerMessagesDropped->inc();
+                PROBE2(drop, "player_message_unroutable", address.c_str());
+                return true;
+            }
+
+            relayPlayerMessage(data, len, viaRP);
+            return true;
+        }
+
+        case DPSPCommand::Ping:
+        {
+            if(len < sizeof(DPSPMessagePing))
+                return true;
+
+            auto cmd = reinterpret_cast<const DPSPMessagePing *>(data);
+            auto localId = session.getLocalSystemPlayer()->getId();
+
+            // reply the same way it came
+            DPSPMessagePing reply{session.adjustId(localId), cmd->tickCount};
+
+            if(sendDPlayMessage(DPSPCommand::PingReply, localId, reinterpret_cast<uint8_t *>(&reply), sizeof(reply), viaRP))
+                serverMetrics.pingsAnswered->inc();
+
+            return true;
+        }
+
+        case DPSPCommand::PingReply:
+        {
+            if(len >= sizeof(DPSPMessagePing))
+                handlePingReply(reinterpret_cast<const DPSPMessagePing *>(data)->tickCount);
+
+            return true;
+        }
+
+        case DPSPCommand::Packet:
+        {
+            if(len < sizeof(DPSPMessagePacket))
+            {
+                LOG_WARNING(DPlay, "short packet (%zu)", len);
+                serverMetrics.malformedCommands->inc();
+                PROBE2(drop, "malformed_command", address.c_str());
+                return true;
+            }
+
+            auto cmd = reinterpret_cast<const DPSPMessagePacket *>(data);
+            auto packetData = data + sizeof(DPSPMessagePacket);
+
+            if(cmd->totalPackets == 1)
+            {
+                // don't have the optional fields
+                auto headerSize = sizeof(DPSPMessageHeader) - offsetof(DPSPMessageHeader, signature);
+
+                // the nested message has to have its header and fit in what was received
+                if(cmd->dataSize < headerSize || cmd->dataSize > len - sizeof(DPSPMessagePacket))
+                {
+                    LOG_WARNING(DPlay, "bad nested packet size %u/%zu", cmd->dataSize, len);
+                    serverMetrics.malformedCommands->inc();
+                    PROBE2(drop, "malformed_command", address.c_str());
+                    return true;
+                }
+
+                DPSPMessageHeader packetHeader;
+                memcpy(&packetHeader.signature, packetData, headerSize);
+
+                if(packetHeader.version != 14 || memcmp(packetHeader.signature, "play", 4) != 0)
+                {
+                    LOG_WARNING(DPlay, "bad nested packet");
+                }
+                else
+                    return handleDPlayCommand(packetHeader.command, packetData + headerSize, cmd->dataSize - headerSize, viaRP);
+            }
+            else
+            {
+                //FIXME: actually re-assemble the packet
+                LOG_WARNING(DPlay, "packet %u/%u", cmd->packetIndex, cmd->totalPackets);
+            }
+            return true;
+        }
+
+        default:
+            LOG_WARNING(DPlay, "unhandled dplay cmd %i(size %zu)", int(command), len);
+            serverMetrics.unhandledCommands->inc();
+            PROBE2(drop, "unhandled_command", address.c_str());
+    }
+
+    return false;
+}
+
+void Client::handleGroupCommand(DPSPCommand command, const uint8_t *data, size_t len)
+{
+    if(len < sizeof(DPSPMessageAddPlayerToGroup))
+    {
+        LOG_WARNING(DPlay, "short group command %i", int(command));
+        return;
+    }
+
+    auto cmd = reinterpret_cast<const DPSPMessageAddPlayerToGroup *>(data);
+    auto playerId = session.adjustId(cmd->playerId);
+
+    // only the client that created a group can change it
+    auto group = getOwnGroup(cmd->groupId);
+
+    if(!group)
+        return;
+
+    auto groupId = group->getId();
+
+    if(command == DPSPCommand::DeleteGroup)
+    {
+        LOG_INFO(DPlay, "delete group %u", groupId);
+        addRosterChange(command, groupId);
+        session.deleteGroup(groupId);
+        return;
+    }
+
+    bool changed = false;
+
+    switch(command)
+    {
+        case DPSPCommand::AddPlayerToGroup:
+            if(session.getPlayer(playerId))
+                changed = group->addMember(playerId);
+            else
+                LOG_WARNING(DPlay, "player %u not found for add to group", playerId);
+            break;
+
+        case DPSPCommand::DeletePlayerFromGroup:
+            changed = group->removeMember(playerId);
+            break;
+
+        case DPSPCommand::AddShortcutToGroup:
+            // playerId is the other group here
+            if(session.getGroup(playerId))
+                changed = group->addShortcut(playerId);
+            else
+                LOG_WARNING(DPlay, "group %u not found for shortcut", playerId);
+            break;
+
+        case DPSPCommand::DeleteShortcutFromGroup:
+            changed = group->removeShortcut(playerId);
+            break;
+
+        default:
+            break;
+    }
+
+    if(changed)
+        addRosterChange(command, groupId, playerId);
+}
+
+void Client::handlePipelineInput(const PipelineInput &input)
+{
+    lastReceiveTime = Clock::now();
+    packetArrival = input.arrival;
+
+    if(input.ackDelay.count())
+        ackDelay.add(input.ackDelay);
+
+    if(input.message.empty())
+        return;
+
+    // including the time in the pipeline
+    if(packetArrival != std::chrono::system_clock::time_point{})
+        queueDelay.add(getTimeSinceArrival());
+
+    handleCompletedRPMessage(input.message.data(), input.message.size());
+}
+
+void Client::attachPipeline()
+{
+    if(!pipeline || !pipeline->isRunning() || replayMode || pipelineId || udpSocket.getFd() == -1)
+        return;
+
+    pipelineId = pipeline->addClient(this, udpSocket, address, std::move(rpReceiver));
+}
+
+void Client::detachPipeline(RPReceiver &&receiver)
+{
+    rpReceiver = std::move(receiver);
+    pipelineId = 0;
+}
+
+void Client::sendRPAck(const RPFrameHeader &header)
+{
+    uint8_t ack[RPReceiver::maxAckSize];
+    auto ackLen = rpReceiver.fillAck(ack, header, session.getTickCount());
+
+    // a retransmitted frame can get acked again before the first one is flushed
+    if(!sendUDP(ack, ackLen, RPReceiver::getAckKey(header)))
+    {
+        LOG_ERROR(RP, "Failed to send ack!");
+        return;
+    }
+
+    serverMetrics.rpAcksSent->inc();
+    PROBE3(rp_ack, address.c_str(), header.messageId, header.sequence);
+
+    if(packetArrival != std::chrono::system_clock::time_point{})
+    {
+        auto delay = getTimeSinceArrival();
+        serverMetrics.rpAckDelay->observe(delay);
+        ackDelay.add(delay);
+    }
+}
+
+void Client::handleCompletedRPMessage(const uint8_t *data, size_t len)
+{
+    TRACE_SPAN("handleCompletedRPMessage");
+
+    serverMetrics.rpMessages->inc();
+
+    // dplay header without the optional fields
+    auto headerSize = sizeof(DPSPMessageHeader) - offsetof(DPSPMessageHeader, signature);
+
+    if(len >= 4 && memcmp(data, "play", 4) == 0)
+    {
+        // the data is a dplay message
+        if(len < headerSize)
+        {
+            LOG_WARNING(DPlay, "short dplay message (%zu)", len);
+            serverMetrics.malformedCommands->inc();
+            PROBE2(drop, "malformed_command", address.c_str());
+            return;
+        }
+
+        DPSPMessageHeader packetHeader;
+        memcpy(&packetHeader.signature, data, headerSize);
+
+        if(packetArrival != std::chrono::system_clock::time_point{})
+            serverMetrics.getCommandQueueDelay(packetHeader.command).observe(getTimeSinceArrival());
+
+        handleDPlayCommand(packetHeader.command, data + headerSize, len - headerSize, true);
+        return;
+    }
+
+    if(len >= 12)
+    {
+        // check for loco-specific message
+        auto locoHeader = reinterpret_cast<const LocoMessageHeader *>(data);
+        if(locoHeader->magic == 300)
+        {
+            LOG_DEBUG(Loco, "loco msg %i from %u to %u len %zu", locoHeader->command, session.adjustId(locoHeader->srcPlayerId),
+                     session.adjustId(locoHeader->dstPlayerId), len - 12);
+
+            PROBE5(loco_message, address.c_str(), locoHeader->command, session.adjustId(locoHeader->srcPlayerId),
+                   session.adjustId(locoHeader->dstPlayerId), len - 12);
+
+            if(locoHeader->command == 1004) // postcards?
+            {
+                // this message has the value from the initial 1002 message
+                // followed by the number of postcards (twice?)
+                // then some postcard data, which seems to be in a slightly different format than the .crd files
+                // (and also might have some junk at the start...)
+
+                // echo
+                LocoMessageHeader echoHeader = *locoHeader;
+                echoHeader.dstPlayerId = session.adjustId(systemPlayerId);
+                echoHeader.srcPlayerId = 0;//session.adjustId(srcId);
+
+                // the postcards are stored after the user value, so identical ones from different players are only kept once
+                const size_t postcardOffset = sizeof(LocoMessageHeader) + 4;
+                const uint8_t *postcards = nullptr;
+
+                uint64_t postcardHash = 0;
+
+                auto &store = PostcardStore::get();
+                if(store.isOpen() && len > postcardOffset)
+                {
+                    uint32_t postcardLength = len - postcardOffset;
+
+                    // a returning user usually sends the same postcards as last time, check those without hashing
+                    uint32_t value;
+                    memcpy(&value, data + sizeof(LocoMessageHeader), 4);
+
+                    auto user = UserRegistry::get().find(value);
+
+                    if(user && user->postcardLength == postcardLength)
+                    {
+                        postcards = store.find(user->postcardHash, data + postcardOffset, postcardLength);
+                        postcardHash = user->postcardHash;
+                    }
+
+                    if(postcards)
+                        serverMetrics.postcardsDeduplicated->inc();
+                    else
+                    {
+                        bool isNew;
+                        postcardHash = PostcardStore::hash(data + postcardOffset, postcardLength);
+                        postcards = store.store(data + postcardOffset, postcardLength, postcardHash, &isNew);
+
+                        if(postcards)
+                            (isNew ? serverMetrics.postcardsStored : serverMetrics.postcardsDeduplicated)->inc();
+                    }
+                }
+
+                // send from the stored copy if we have one
+                iovec parts[3];
+                parts[0].iov_base = &echoHeader;
+                parts[0].iov_len = sizeof(echoHeader);
+                parts[1].iov_base = const_cast<uint8_t *>(data + sizeof(LocoMessageHeader));
+                parts[1].iov_len = (postcards ? postcardOffset : len) - sizeof(LocoMessageHeader);
+                parts[2].iov_base = const_cast<uint8_t *>(postcards);
+                parts[2].iov_len = postcards ? len - postcardOffset : 0;
+
+                if(!sendRPMessage(session.getLocalSystemPlayer()->getId(), parts, postcards ? 3 : 2))
+                {
+                    LOG_ERROR(Loco, "failed to send 1004 echo");
+                }
+
+                if(len >= postcardOffset)
+                    updateUser(data, len, postcards, postcardHash);
+            }
+            else if(locoHeader->command != 1002)
+            {
+                // 1002/1004 are between the client and us, anything else is game traffic for other players
+                relayLocoMessage(data, len);
+            }
+
+            return;
+        }
+    }
+
+    LOG_INFO(RP, "rp msg len %zu", len);
+
+    // only dump the whole thing if we're debugging this client
+    if(debug)
+        Logger::get().logHex(LogCategory::RP, LogLevel::Info, data, len);
+}
+
+bool Client::sendRPMessage(uint32_t fromId, const uint8_t *data, size_t len)
+{
+    iovec part;
+    part.iov_base = const_cast<uint8_t *>(data);
+    part.iov_len = len;
+
+    return sendRPMessage(fromId, &part, 1);
+}
+
+bool Client::sendRPMessage(uint32_t fromId, const iovec *parts, int partCount)
+{
+    static constexpr int maxParts = 4;
+
+    // can't send anything until CreatePlayer
+    if(systemPlayerId == ~0u || (!hasUDP() && !replayMode) || partCount > maxParts)
+        return false;
+
+    size_t len = 0;
+    for(int i = 0; i < partCount; i++)
+        len += parts[i].iov_len;
+
+    auto from = fromId & 0xFFFF;
+    auto to = systemPlayerId & 0xFFFF;
+    auto messageId = nextSendMessageId++;
+    uint8_t sequence = 1;
+
+    // the data isn't copied, each frame is the header + slices of the parts
+    uint8_t header[16];
+    size_t offset = 0;
+    int part = 0;
+    size_t partOffset = 0;
+
+    do
+    {
+        auto frameLen = std::min(len - offset, maxRPFramePayload);
+
+        uint8_t flags = DPRPFrame_Command;
+        if(offset == 0)
+            flags |= DPRPFrame_Start;
+        if(offset + frameLen == len)
+            flags |= DPRPFrame_End;
+
+        auto headerEnd = fillRPHeader(header, from, to, flags, messageId, sequence++, 0);
+
+        iovec iov[maxParts + 1];
+        iov[0].iov_base = header;
+        iov[0].iov_len = headerEnd - header;
+        int iovCount = 1;
+
+        for(auto remaining = frameLen; remaining;)
+        {
+            auto sliceLen = std::min(remaining, parts[part].iov_len - partOffset);
+
+            iov[iovCount].iov_base = static_cast<uint8_t *>(parts[part].iov_base) + partOffset;
+            iov[iovCount].iov_len = sliceLen;
+            iovCount++;
+
+            remaining -= sliceLen;
+            partOffset += sliceLen;
+
+            if(partOffset == parts[part].iov_len)
+            {
+                part++;
+                partOffset = 0;
+            }
+        }
+
+        if(!sendUDP(iov, iovCount))
+            return false;
+
+        offset += frameLen;
+    }
+    while(offset < len);
+
+    return true;
+}
+
+bool Client::getRelayTargets(uint32_t rawId, bool &isGroup)
+{
+    relayTargets.clear();
+    isGroup = true;
+
+    if(rawId == 0)
+    {
+        // everyone, send() skips anyone that hasn't finished joining
+        for(auto client : session.getRouteClients())
+        {
+            if(client != this)
+                relayTargets.push_back(client);
+        }
+        return true;
+    }
+
+    auto id = session.adjustId(rawId);
+
+    if(auto client = session.getPlayerClient(id))
+    {
+        isGroup = false;
+
+        if(client != this)
+            relayTargets.push_back(client);
+
+        return client != this;
+    }
+
+    if(auto group = session.getGroup(id))
+    {
+        session.getGroupClients(*group, relayTargets);
+
+        // our own members get it locally
+        relayTargets.erase(std::remove(relayTargets.begin(), relayTargets.end(), this), relayTargets.end());
+        return true;
+    }
+
+    return false;
+}
+
+void Client::relayLocoMessage(const uint8_t *data, size_t len)
+{
+    if(len < sizeof(LocoMessageHeader))
+        return;
+
+    // the message is sent on unmodified, only the frame header is different for each destination
+    auto locoHeader = reinterpret_cast<const LocoMessageHeader *>(data);
+
+    // don't let a client send as someone else's player
+    if(!getOwnPlayer(locoHeader->srcPlayerId))
+    {
+        serverMetrics.locoNotOwned->inc();
+        PROBE2(drop, "loco_message_not_owned", address.c_str());
+        return;
+    }
+
+    bool isGroup;
+    if(!getRelayTargets(locoHeader->dstPlayerId, isGroup))
+    {
+        LOG_DEBUG(Loco, "no route for loco msg %i to %u", locoHeader->command, session.adjustId(locoHeader->dstPlayerId));
+        serverMetrics.locoUnroutable->inc();
+        return;
+    }
+
+    if(isGroup)
+    {
+        for(auto client : relayTargets)
+            client->sendRPMessage(systemPlayerId, data, len);
+
+        serverMetrics.locoBroadcasts->inc();
+        return;
+    }
+
+    if(!relayTargets[0]->sendRPMessage(systemPlayerId, data, len))
+    {
+        LOG_WARNING(Loco, "failed to relay loco msg %i to %u", locoHeader->command, session.adjustId(locoHeader->dstPlayerId));
+        return;
+    }
+
+    serverMetrics.locoRelayed->inc();
+}
+
+void Client::relayPlayerMessage(const uint8_t *data, size_t len, bool viaRP)
+{
+    auto message = reinterpret_cast<const DPSPMessagePlayerMessage *>(data);
+    auto fromId = session.adjustId(message->idFrom);
+
+    // don't let a client send as someone else's player
+    if(session.getPlayerClient(fromId) != this)
+    {
+        LOG_WARNING(DPlay, "player message from %u, which isn't owned by this client", fromId);
+        serverMetrics.playerMessagesDropped->inc();
+        PROBE2(drop, "player_message_unroutable", address.c_str());
+        return;
+    }
+
+    bool isGroup;
+    if(!getRelayTargets(message->idTo, isGroup))
+    {
+        LOG_DEBUG(DPlay, "no route for player message to %u", session.adjustId(message->idTo));
+        serverMetrics.playerMessagesDropped->inc();
+        PROBE2(drop, "player_message_unroutable", address.c_str());
+        return;
+    }
+
+    // forwarded on the same transport it arrived on, the message itself isn't modified
+    for(auto client : relayTargets)
+    {
+        if(client->forwardPlayerMessage(systemPlayerId, data, len, viaRP))
+            serverMetrics.playerMessagesRelayed->inc();
+        else if(!isGroup)
+            LOG_WARNING(DPlay, "failed to forward player message to %u", session.adjustId(message->idTo));
+    }
+}
+
+bool Client::forwardPlayerMessage(uint32_t fromSystemId, const uint8_t *data, size_t len, bool viaRP)
+{
+    return sendDPlayMessage(DPSPCommand::PlayerMessage, fromSystemId, data, len, viaRP);
+}
+
+// CreateGroup is the same as CreatePlayer, members and shortcuts are sent separately
+static void encodeCreateGroup(Session &session, const Group &group, std::vector<uint8_t> &body)
+{
+    auto shortName = getPackedName(group.getShortName());
+    auto longName = getPackedName(group.getLongName());
+    uint32_t shortNameLen = shortName.length() * 2, longNameLen = longName.length() * 2;
+
+    auto id = session.adjustId(group.getId());
+    DPSPMessageCreatePlayer message{0, id, 0, 28, 0};
+
+    DPPackedPlayer packed{};
+    packed.size = sizeof(DPPackedPlayer) + shortNameLen + longNameLen;
+    packed.flags = group.getFlags();
+    packed.playerId = id;
+    packed.shortNameLength = shortNameLen;
+    packed.longNameLength = longNameLen;
+    packed.systemPlayerId = session.adjustId(group.getOwnerId());
+    packed.fixedSize = sizeof(DPPackedPlayer);
+    packed.playerVersion = 14;
+    packed.parentId = group.getParentId() ? session.adjustId(group.getParentId()) : 0;
+
+    const uint8_t reserved[6] = {};
+
+    appendBytes(body, &message, sizeof(message));
+    appendBytes(body, &packed, sizeof(packed));
+    appendBytes(body, shortName.data(), shortNameLen);
+    appendBytes(body, longName.data(), longNameLen);
+    appendBytes(body, reserved, sizeof(reserved));
+}
+
+void Client::encodeRosterChanges(Session &session, std::vector<RosterMessage> &messages)
+{
+    messages.clear();
+
+    for(auto &change : session.getRosterChanges())
+    {
+        auto id = session.adjustId(change.playerId);
+
+        if(change.command == DPSPCommand::DeletePlayer)
+        {
+            DPSPMessageAddPlayerToGroup message{0, id, 0, 0, 0};
+            appendBytes(messages.emplace_back(RosterMessage{change, {}}).body, &message, sizeof(message));
+            continue;
+        }
+
+        if(change.command == DPSPCommand::CreateGroup)
+        {
+            auto group = session.getGroup(change.playerId);
+
+            if(group)
+                encodeCreateGroup(session, *group, messages.emplace_back(RosterMessage{change, {}}).body);
+
+            continue;
+        }
+
+        // the rest of the group commands, membership isn't looked up as it's been sent in order
+        if(change.command != DPSPCommand::CreatePlayer && change.command != DPSPCommand::PlayerDataChanged && change.command != DPSPCommand::PlayerNameChanged)
+        {
+            DPSPMessageAddPlayerToGroup message{0, change.memberId ? session.adjustId(change.memberId) : 0, id, 0, 0};
+            appendBytes(messages.emplace_back(RosterMessage{change, {}}).body, &message, sizeof(message));
+            continue;
+        }
+
+        // the rest are sent with what the player looks like now, it might be gone already
+        auto player = session.getPlayer(change.playerId);
+
+        if(!player)
+            continue;
+
+        auto &body = messages.emplace_back(RosterMessage{change, {}}).body;
+
+        auto shortName = getPackedName(player->getShortName());
+        auto longName = getPackedName(player->getLongName());
+        uint32_t shortNameLen = shortName.length() * 2, longNameLen = longName.length() * 2;
+
+        if(change.command == DPSPCommand::CreatePlayer)
+        {
+            DPSPMessageCreatePlayer message{0, id, 0, 28, 0};
+
+            DPPackedPlayer packed{};
+            packed.size = sizeof(DPPackedPlayer) + shortNameLen + longNameLen + player->getServiceProviderDataLen() + player->getDataLen();
+            packed.flags = player->getFlags();
+            packed.playerId = id;
+            packed.shortNameLength = shortNameLen;
+            packed.longNameLength = longNameLen;
+            packed.serviceProviderDataSize = player->getServiceProviderDataLen();
+            packed.playerDataSize = player->getDataLen();
+            packed.systemPlayerId = session.adjustId(player->getSystemPlayerId());
+            packed.fixedSize = sizeof(DPPackedPlayer);
+            packed.playerVersion = 14; // same as the super packed players
+
+            const uint8_t reserved[6] = {};
+
+            appendBytes(body, &message, sizeof(message));
+            appendBytes(body, &packed, sizeof(packed));
+            appendBytes(body, shortName.data(), shortNameLen);
+            appendBytes(body, longName.data(), longNameLen);
+            appendBytes(body, player->getServiceProviderData(), player->getServiceProviderDataLen());
+            appendBytes(body, player->getData(), player->getDataLen());
+            appendBytes(body, reserved, sizeof(reserved));
+        }
+        else if(change.command == DPSPCommand::PlayerDataChanged)
+        {
+            DPSPMessagePlayerDataChanged message{0, id, player->getDataLen(), 8 + sizeof(DPSPMessagePlayerDataChanged)};
+
+            appendBytes(body, &message, sizeof(message));
+            appendBytes(body, player->getData(), player->getDataLen());
+        }
+        else
+        {
+            uint32_t offset = 8 + sizeof(DPSPMessagePlayerNameChanged);
+            DPSPMessagePlayerNameChanged message{0, id, shortNameLen ? offset : 0, longNameLen ? offset + shortNameLen : 0};
+
+            appendBytes(body, &message, sizeof(message));
+            appendBytes(body, shortName.data(), shortNameLen);
+            appendBytes(body, longName.data(), longNameLen);
+        }
+    }
+}
+
+void Client::sendRosterChanges(const std::vector<RosterMessage> &messages)
+{
+    TRACE_SPAN("sendRosterChanges");
+
+    // nothing until we've sent the player list, it has everything before it
+    if(rosterSerial == ~0u || systemPlayerId == ~0u)
+        return;
+
+    std::vector<uint8_t> buf;
+    int count = 0;
+
+    for(auto &message : messages)
+    {
+        if(message.change.serial <= rosterSerial || message.change.systemPlayerId == systemPlayerId)
+            continue;
+
+        auto offset = buf.size();
+        buf.resize(offset + sizeof(DPSPMessageHeader));
+        buf.insert(buf.end(), message.body.begin(), message.body.end());
+
+        fillOutgoingHeader(reinterpret_cast<DPSPMessageHeader *>(buf.data() + offset), sizeof(DPSPMessageHeader) + message.body.size(),
+                           message.change.command);
+        count++;
+    }
+
+    if(!count)
+        return;
+
+    if(!checkOutgoingSocket() || !sendTCP(buf.data(), buf.size()))
+    {
+        LOG_WARNING(DPlay, "failed to send %i roster changes to %s", count, address.c_str());
+        return;
+    }
+
+    serverMetrics.rosterBatchesSent->inc();
+    serverMetrics.rosterMessagesSent->inc(count);
+}
+
+void Client::update(std::chrono::steady_clock::time_point now)
+{
+    // can only ping once we can send RP messages
+    if(!latencyLimits.pingIntervalMs || systemPlayerId == ~0u || !hasUDP() || now < nextPingTime)
+        return;
+
+    nextPingTime = now + std::chrono::milliseconds(latencyLimits.pingIntervalMs);
+
+    // the last one never came back
+    if(pingPending)
+    {
+        latency.addLoss();
+        serverMetrics.pingsLost->inc();
+        updateDegraded();
+    }
+
+    auto localId = session.getLocalSystemPlayer()->getId();
+    DPSPMessagePing ping{session.adjustId(localId), session.getTickCount()};
+
+    if(sendDPlayMessage(DPSPCommand::Ping, localId, reinterpret_cast<uint8_t *>(&ping), sizeof(ping), true))
+    {
+        pingPending = true;
+        pendingPingTick = ping.tickCount;
+        serverMetrics.pingsSent->inc();
+    }
+}
+
+size_t Client::getMemoryUsage() const
+{
+    size_t ret = sizeof(*this) + address.capacity() + userName.capacity();
+
+    ret += tcpOutput.capacity() + queuedData.capacity() + queuedFrames.capacity() * sizeof(QueuedFrame);
+    ret += relayTargets.capacity() * sizeof(Client *);
+
+    if(!isPipelined())
+        ret += rpReceiver.getMemoryUsage();
+
+    return ret;
+}
+
+size_t Client::getPlayerMemoryUsage() const
+{
+    return systemPlayerId != ~0u ? session.getMemoryUsage(systemPlayerId) : 0;
+}
+
+bool Client::hasTimedOut(std::chrono::steady_clock::time_point now) const
+{
+    auto limit = joinState == JoinState::Joined ? timeouts.idleSeconds : timeouts.handshakeSeconds;
+
+    return limit && now - lastReceiveTime > std::chrono::seconds(limit);
+}
+
+void Client::leave(bool dead)
+{
+    if(systemPlayerId == ~0u)
+        return;
+
+    auto localId = session.getLocalSystemPlayer()->getId();
+
+    // don't try to connect to something that's gone
+    if(dead && (tcpOutgoing.getFd() != -1 || replayMode))
+        sendDPlayMessage(DPSPCommand::YouAreDead, localId, nullptr, 0, false);
+
+    // deleting the system player deletes its groups
+    for(auto &group : session.getGroups())
+    {
+        if(group.second.getOwnerId() == systemPlayerId)
+            addRosterChange(DPSPCommand::DeleteGroup, group.first);
+    }
+
+    // the system player goes last, deleting it deletes the rest
+    for(auto &player : session.getPlayers())
+    {
+        if(player.first != systemPlayerId && player.second.getSystemPlayerId() == systemPlayerId)
+            addRosterChange(DPSPCommand::DeletePlayer, player.first);
+    }
+
+    addRosterChange(DPSPCommand::DeletePlayer, systemPlayerId);
+
+    session.deletePlayer(systemPlayerId);
+    systemPlayerId = ~0u;
+    joinState = JoinState::New;
+}
+
+uint32_t Client::getTCPRTTMs() const
+{
+    tcp_info info;
+    socklen_t infoLen = sizeof(info);
+
+    if(tcpIncoming.getFd() == -1 || getsockopt(tcpIncoming.getFd(), IPPROTO_TCP, TCP_INFO, &info, &infoLen) == -1)
+        return 0;
+
+    return info.tcpi_rtt / 1000;
+}
+
+void Client::sendInitialLocoMessage()
+{
+    // this gets the game to send things
+    // another interesting command is 1000, which I think sends back the game version
+    // regular multiplayer session use at least 1008-1014, 1017-1018
+    LocoCmd1002 message{};
+
+    // seems a bit redundant
+    message.header.dstPlayerId = session.adjustId(systemPlayerId);
+    message.header.srcPlayerId = 0;
+
+    message.header.command = 1002;
+    message.header.magic = 300;
+
+    message.userValue = userValue;
+    message.unk = 0;
+
+    if(!sendRPMessage(session.getLocalSystemPlayer()->getId(), reinterpret_cast<uint8_t *>(&message), sizeof(message)))
+    {
+        LOG_ERROR(Loco, "Failed to send cmd1002!");
+    }
+}
+
+void Client::updateUser(const uint8_t *data, size_t len, const uint8_t *postcards, uint64_t postcardHash)
+{
+    auto &registry = UserRegistry::get();
+
+    if(!registry.isOpen())
+        return;
+
+    // the value we sent in 1002 (or one from an earlier session)
+    uint32_t value;
+    memcpy(&value, data + sizeof(LocoMessageHeader), 4);
+
+    auto user = registry.find(value);
+
+    // don't keep creating users if the game ignores the value we sent
+    if(!user)
+        user = registry.find(userValue);
+
+    if(!user)
+    {
+        // new to us, hand out a value and send it so that the game stores it
+        user = registry.create(userName);
+
+        if(!user)
+        {
+            LOG_WARNING(Loco, "failed to create user for %s", userName.c_str());
+            return;
+        }
+
+        serverMetrics.usersCreated->inc();
+
+        LOG_INFO(Loco, "new user %08X (%s)", user->userValue, userName.c_str());
+
+        userValue = user->userValue;
+        sendInitialLocoMessage();
+    }
+    else
+    {
+        serverMetrics.usersReturning->inc();
+
+        user->lastSeen = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+        if(userName != user->name)
+            registry.setName(*user, userName);
+
+        userValue = user->userValue;
+    }
+
+    // the game might send 1004 again after getting a new value
+    if(!userCounted)
+    {
+        user->sessionCount++;
+        memcpy(user->lastSession, session.getGUID(), 16);
+        userCounted = true;
+    }
+
+    if(postcards)
+    {
+        user->postcardHash = postcardHash;
+        user->postcardLength = len - sizeof(LocoMessageHeader) - 4;
+    }
+}
+
+bool Client::sendTCP(const uint8_t *data, size_t len)
+{
+    iovec iov;
+    iov.iov_base = const_cast<uint8_t *>(data);
+    iov.iov_len = len;
+
+    return sendTCP(&iov, 1);
+}
+
+bool Client::sendTCP(const iovec *iov, int iovCount)
+{
+    TRACE_SPAN("sendTCP");
+
+    auto len = recordGathered(CaptureType::TCPOut, address, iov, iovCount);
+
+    serverMetrics.tcpPacketsSent->inc();
+    serverMetrics.tcpBytesSent->inc(len);
+
+    if(replayMode)
+        return true;
+
+    if(tcpOutgoing.getFd() == -1)
+        return false;
+
+    // can't overtake anything that's already waiting
+    size_t sent = 0;
+
+    if(!tcpConnecting && tcpOutput.empty() && !tcpOutgoing.send(iov, iovCount, sent))
+    {
+        if(!tcpOutgoing.wouldBlock())
+        {
+            LOG_WARNING(Net, "failed to send to %s, closing the outgoing connection: %s", address.c_str(), strerror(errno));
+            closeOutgoingSocket();
+            return false;
+        }
+
+        sent = 0;
+    }
+
+    if(sent == len)
+        return true;
+
+    // the rest goes when the socket is writable
+    serverMetrics.tcpSendsDeferred->inc();
+
+    for(int i = 0; i < iovCount; i++)
+    {
+        auto base = static_cast<const uint8_t *>(iov[i].iov_base);
+        auto skip = std::min(sent, iov[i].iov_len);
+
+        tcpOutput.insert(tcpOutput.end(), base + skip, base + iov[i].iov_len);
+        sent -= skip;
+    }
+
+    if(tcpOutput.size() > maxTCPOutput)
+    {
+        LOG_WARNING(Net, "%s isn't reading, closing the outgoing connection", address.c_str());
+        closeOutgoingSocket();
+        return false;
+    }
+
+    return true;
+}
+
+void Client::handleTCPWrite()
+{
+    if(tcpConnecting)
+    {
+        if(int error = tcpOutgoing.getPendingError())
+        {
+            LOG_ERROR(Net, "failed to open outgoing connection to %s: %s", address.c_str(), strerror(error));
+            closeOutgoingSocket();
+            return;
+        }
+
+        tcpConnecting = false;
+    }
+
+    if(tcpOutput.empty())
+        return;
+
+    size_t sent = tcpOutput.size();
+
+    if(!tcpOutgoing.send(tcpOutput.data(), sent))
+    {
+        if(!tcpOutgoing.wouldBlock())
+        {
+            LOG_WARNING(Net, "failed to send to %s, closing the outgoing connection: %s", address.c_str(), strerror(errno));
+            closeOutgoingSocket();
+        }
+
+        return;
+    }
+
+    tcpOutput.erase(tcpOutput.begin(), tcpOutput.begin() + sent);
+}
+
+bool Client::sendUDP(const uint8_t *data, size_t len, uint32_t ackKey)
+{
+    iovec iov;
+    iov.iov_base = const_cast<uint8_t *>(data);
+    iov.iov_len = len;
+
+    return sendUDP(&iov, 1, ackKey);
+}
+
+bool Client::sendUDP(const iovec *iov, int iovCount, uint32_t ackKey)
+{
+    TRACE_SPAN("sendUDP");
+
+    // the I/O thread batches everything it gets each time round
+    if(pipelineId)
+    {
+        auto len = recordGathered(CaptureType::RPOut, address, iov, iovCount);
+
+        serverMetrics.rpPacketsSent->inc();
+        serverMetrics.rpBytesSent->inc(len);
+
+        pipeline->send(pipelineId, iov, iovCount);
+        return true;
+    }
+
+    if(flushInterval.count() && !replayMode)
+    {
+        size_t len = 0;
+        for(int i = 0; i < iovCount; i++)
+            len += iov[i].iov_len;
+
+        uint8_t *ptr = nullptr;
+
+        if(ackKey)
+        {
+            for(auto &frame : queuedFrames)
+            {
+                if(frame.ackKey == ackKey && frame.len == len)
+                {
+                    ptr = queuedData.data() + frame.offset;
+                    serverMetrics.rpAcksCoalesced->inc();
+                    break;
+                }
+            }
+        }
+
+        if(!ptr)
+        {
+            if(queuedFrames.size() == maxQueuedFrames || queuedData.size() + len > maxQueuedBytes)
+                flushOutput();
+
+            auto offset = queuedData.size();
+            queuedFrames.push_back({uint32_t(offset), uint32_t(len), ackKey});
+            queuedData.resize(offset + len);
+            ptr = queuedData.data() + offset;
+        }
+
+        for(int i = 0; i < iovCount; i++)
+        {
+            memcpy(ptr, iov[i].iov_base, iov[i].iov_len);
+            ptr += iov[i].iov_len;
+        }
+
+        return true;
+    }
+
+    auto len = recordGathered(CaptureType::RPOut, address, iov, iovCount);
+
+    serverMetrics.rpPacketsSent->inc();
+    serverMetrics.rpBytesSent->inc(len);
+
+    if(replayMode)
+        return true;
+
+    if(udpAddress)
+        return getSharedUDPSocket().send(iov, iovCount, len, udpAddress.get());
+
+    return udpSocket.send(iov, iovCount, len);
+}
+
+void Client::flushOutput()
+{
+    if(queuedFrames.empty())
+        return;
+
+    TRACE_SPAN("flushOutput");
+
+    iovec packets[maxQueuedFrames];
+    int count = 0;
+
+    for(auto &frame : queuedFrames)
+    {
+        packets[count].iov_base = queuedData.data() + frame.offset;
+        packets[count].iov_len = frame.len;
+
+        recordGathered(CaptureType::RPOut, address, &packets[count], 1);
+        serverMetrics.rpBytesSent->inc(frame.len);
+        count++;
+    }
+
+    serverMetrics.rpPacketsSent->inc(count);
+    serverMetrics.rpFlushes->inc();
+
+    int sent = udpAddress ? getSharedUDPSocket().sendBatch(packets, count, udpAddress.get()) : udpSocket.sendBatch(packets, count);
+
+    if(sent < count)
+        LOG_WARNING(RP, "only sent %i of %i queued frames to %s", sent, count, address.c_str());
+
+    queuedFrames.clear();
+    queuedData.clear();
+}
+
+void Client::sendRequestIdReply(uint32_t id, uint32_t result)
+{
+    if(!checkOutgoingSocket())
+        return;
+
+    size_t replySize = sizeof(DPSPMessageHeader) + sizeof(DPSPMessageRequestPlayerReply);
+
+    auto replyBuffer = new uint8_t[replySize];
+    auto header = reinterpret_cast<DPSPMessageHeader *>(replyBuffer);
+    auto replyMessage = reinterpret_cast<DPSPMessageRequestPlayerReply *>(replyBuffer + sizeof(DPSPMessageHeader));
+
+    fillOutgoingHeader(header, replySize, DPSPCommand::RequestPlayerReply);
+
+    // zero out security info
+    memset(replyMessage, 0, sizeof(DPSPMessageRequestPlayerReply));
+
+    replyMessage->id = session.adjustId(id);
+    replyMessage->result = result;
+
+    if(!sendTCP(replyBuffer, replySize))
+    {
+        LOG_ERROR(DPlay, "Failed to send request id reply!");
+    }
+    delete[] replyBuffer;
+}
+
+bool Client::sendDPlayMessage(DPSPCommand command, uint32_t fromId, const uint8_t *data, size_t len, bool viaRP)
+{
+    DPSPMessageHeader header;
+
+    iovec parts[2];
+    parts[1].iov_base = const_cast<uint8_t *>(data);
+    parts[1].iov_len = len;
+
+    if(viaRP)
+    {
+        // no size/sockaddr in RP messages
+        memcpy(header.signature, "play", 4);
+        header.command = command;
+        header.version = 14;
+
+        auto headerSize = sizeof(DPSPMessageHeader) - offsetof(DPSPMessageHeader, signature);
+        parts[0].iov_base = header.signature;
+        parts[0].iov_len = headerSize;
+
+        return sendRPMessage(fromId, parts, 2);
+    }
+
+    if(systemPlayerId == ~0u || !checkOutgoingSocket())
+        return false;
+
+    fillOutgoingHeader(&header, sizeof(header) + len, command);
+
+    parts[0].iov_base = &header;
+    parts[0].iov_len = sizeof(header);
+
+    return sendTCP(parts, 2);
+}
+
+void Client::handlePingReply(uint32_t tickCount)
+{
+    // a late reply has already been counted as lost
+    if(!pingPending || tickCount != pendingPingTick)
+        return;
+
+    pingPending = false;
+
+    auto rtt = session.getTickCount() - tickCount;
+
+    latency.addSample(rtt);
+    serverMetrics.pingRTT->observe(std::chrono::milliseconds(rtt));
+
+    updateDegraded();
+}
+
+Player *Client::getOwnPlayer(uint32_t rawId)
+{
+    auto id = session.adjustId(rawId);
+    auto player = session.getPlayer(id);
+
+    // clients can only change the players they created
+    if(!player || systemPlayerId == ~0u || player->getSystemPlayerId() != systemPlayerId)
+    {
+        LOG_WARNING(DPlay, "%s changing player %u that isn't theirs", address.c_str(), id);
+        return nullptr;
+    }
+
+    return player;
+}
+
+Group *Client::getOwnGroup(uint32_t rawId)
+{
+    auto id = session.adjustId(rawId);
+    auto group = session.getGroup(id);
+
+    // same for groups
+    if(!group || systemPlayerId == ~0u || group->getOwnerId() != systemPlayerId)
+    {
+        LOG_WARNING(DPlay, "%s changing group %u that isn't theirs", address.c_str(), id);
+        return nullptr;
+    }
+
+    return group;
+}
+
+void Client::addRosterChange(DPSPCommand command, uint32_t playerId, uint32_t memberId)
+{
+    serverMetrics.rosterChanges->inc();
+    session.addRosterChange(command, playerId, systemPlayerId, memberId);
+}
+
+std::chrono::nanoseconds Client::getTimeSinceArrival() const
+{
+    // both are CLOCK_REALTIME, which can step backwards
+    return std::max(std::chrono::nanoseconds(std::chrono::system_clock::now() - packetArrival), std::chrono::nanoseconds(0));
+}
+
+void Client::updateDegraded()
+{
+    bool nowDegraded = latency.isDegraded(latencyLimits);
+
+    if(nowDegraded == degraded)
+        return;
+
+    degraded = nowDegraded;
+    serverMetrics.degradedClients->add(degraded ? 1 : -1);
+
+    if(degraded)
+    {
+        LOG_WARNING(Net, "%s degraded: RTT %.0fms, jitter %.0fms, %u pings lost", address.c_str(), latency.getSmoothedRTT(), latency.getJitter(),
+                    latency.getLostCount());
+    }
+    else
+        LOG_INFO(Net, "%s recovered: RTT %.0fms, jitter %.0fms", address.c_str(), latency.getSmoothedRTT(), latency.getJitter());
+}
+
+bool Client::checkOutgoingSocket()
+{
+    // TODO: add an isConnected? (or some more accurate name for an fd existing)
+    if(tcpOutgoing.getFd() != -1 || replayMode)
+        return true;
+
+    LOG_INFO(Net, "Open outgoing to %s", address.c_str());
+
+    // sends are queued until it's connected
+    if(!tcpOutgoing.connect(address.c_str(), outgoingPort, 0, nullptr, false))
+    {
+        LOG_ERROR(Net, "failed to open outgoing connection to %s", address.c_str());
+        return false;
+    }
+
+    tcpOutgoing.setOptions(tcpSocketOptions);
+    tcpConnecting = true;
+
+    return true;
+}
+
+void Client::closeOutgoingSocket()
+{
+    // the next send opens a new one
+    tcpOutgoing.close();
+    tcpConnecting = false;
+    tcpOutput.clear();
+}
+
+void Client::fillOutgoingHeader(DPSPMessageHeader *header, size_t size, DPSPCommand command)
+{
+    header->sizeToken = size | 0xFAB << 20;
+
+    header->sockaddr.family = 2;
+    header->sockaddr.port = htons(outgoingPort);
+    header->sockaddr.addr = 0;
+    memset(header->sockaddr.padding, 0, 8);
+
+    memcpy(header->signature, "play", 4);
+    header->command = command;
+    header->version = 14;
+}
+
+void Client::fillSessionDesc(DPSessionDesc2 *desc)
+{
+    desc->size = sizeof(DPSessionDesc2);
+    desc->flags = session.getFlags();
+    memcpy(desc->instanceGUID, session.getGUID(), 16);
+    memcpy(desc->applicationGUID, session.getAppGUID(), 16);
+    desc->maxPlayers = session.getMaxPlayers();
+    desc->currentPlayerCount = session.getCurrentPlayers();
+
+    desc->sessionName = 0;
+    desc->password = 0;
+
+    desc->reserved1 = session.getIdXor();
+    desc->reserved2 = 0;
+
+    desc->applicationDefined1 = 0;
+    desc->applicationDefined2 = 0;
+    desc->applicationDefined3 = 0;
+    desc->applicationDefined4 = 0;
+}
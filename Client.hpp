@@ -0,0 +1,381 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "Clock.hpp"
+#include "DirectPlayMessage.hpp"
+#include "LatencyStats.hpp"
+#include "Pipeline.hpp"
+#include "ReliableProtocol.hpp"
+#include "Session.hpp"
+#include "Socket.hpp"
+
+// seconds without receiving anything, 0 disables each of them
+struct ClientTimeouts
+{
+    uint32_t idleSeconds = 30; // joined, pings keep this going if the game is quiet
+    uint32_t handshakeSeconds = 10; // everyone else
+};
+
+// bytes, 0 disables each of them
+struct MemoryLimits
+{
+    size_t clientBytes = 4 * 1024 * 1024; // buffers and the client's players/groups, over this it's removed
+    size_t sessionBytes = 0; // all clients and the session, the largest clients are removed until it's under
+    size_t messageBytes = 1024 * 1024; // a reassembled RP message, bigger ones are dropped
+};
+
+// how far through the DirectPlay handshake a client is
+enum class JoinState : uint8_t
+{
+    New, // maybe enumerating sessions
+    SystemPlayer, // asked for a system player id
+    PlayerList, // sent the player list (AddForwardRequest)
+    Joined, // created their player, switched to UDP
+};
+
+// a roster change encoded once (without the header), shared by everyone it's sent to
+struct RosterMessage
+{
+    RosterChange change;
+    std::vector<uint8_t> body;
+};
+
+class Client final
+{
+public:
+    Client(Session &session, std::string address, int outgoingPort) : session(session), address(std::move(address)), outgoingPort(outgoingPort), tcpIncoming(SocketType::TCP), tcpOutgoing(SocketType::TCP), udpSocket(SocketType::UDP)
+    {
+        createdTime = lastReceiveTime = Clock::now();
+    }
+
+    // the session's routes and the pipeline point at clients, so they stay where they're created
+    Client(const Client &) = delete;
+    Client &operator=(const Client &) = delete;
+
+    ~Client();
+
+    // arrival is the kernel receive time, if the socket has timestamps
+    bool handleDPlayPacket(const uint8_t *data, size_t &len, std::chrono::system_clock::time_point arrival = {});
+    void handleUDPRead();
+    void handleRPFrame(const uint8_t *data, size_t len, std::chrono::system_clock::time_point arrival = {});
+
+    // a message (or just activity) from the pipeline's I/O threads, which already acked it
+    void handlePipelineInput(const PipelineInput &input);
+
+    // frames and sends a message, splitting it if needed
+    bool sendRPMessage(uint32_t fromId, const uint8_t *data, size_t len);
+    bool sendRPMessage(uint32_t fromId, const iovec *parts, int partCount);
+
+    // data is a PlayerMessage without the header
+    bool forwardPlayerMessage(uint32_t fromSystemId, const uint8_t *data, size_t len, bool viaRP);
+
+    // builds the messages for the session's pending roster changes
+    static void encodeRosterChanges(Session &session, std::vector<RosterMessage> &messages);
+
+    // everything newer than the player list this client got, in one write
+    void sendRosterChanges(const std::vector<RosterMessage> &messages);
+
+    // periodic work (pings), called from the main loop
+    void update(std::chrono::steady_clock::time_point now);
+
+    const LatencyStats &getLatencyStats() const
+    {
+        return latency;
+    }
+
+    bool isDegraded() const
+    {
+        return degraded;
+    }
+
+    // kernel timestamp to handling/acking, empty without timestamps
+    const DelayStats &getQueueDelayStats() const
+    {
+        return queueDelay;
+    }
+
+    const DelayStats &getAckDelayStats() const
+    {
+        return ackDelay;
+    }
+
+    JoinState getJoinState() const
+    {
+        return joinState;
+    }
+
+    // buffers and the RP reassembly buffer (unless an I/O thread has it)
+    size_t getMemoryUsage() const;
+
+    // the players and groups it created, held by the session
+    size_t getPlayerMemoryUsage() const;
+
+    // nothing heard for too long
+    bool hasTimedOut(std::chrono::steady_clock::time_point now) const;
+
+    // removes this client's players from the session, everyone else is told with the next roster changes
+    // a client that's presumed dead is also told so, in case it wasn't
+    void leave(bool dead);
+
+    // kernel estimate for the incoming connection, 0 if unknown
+    uint32_t getTCPRTTMs() const;
+
+    static void setLatencyLimits(const LatencyLimits &limits)
+    {
+        latencyLimits = limits;
+    }
+
+    static void setTimeouts(const ClientTimeouts &timeouts)
+    {
+        Client::timeouts = timeouts;
+    }
+
+    static void setMemoryLimits(const MemoryLimits &limits)
+    {
+        memoryLimits = limits;
+        RPReceiver::setMaxMessageSize(limits.messageBytes ? limits.messageBytes : ~size_t(0));
+    }
+
+    static const MemoryLimits &getMemoryLimits()
+    {
+        return memoryLimits;
+    }
+
+    // applied to each client's sockets as they're created
+    static void setSocketOptions(const SocketOptions &tcp, const SocketOptions &udp)
+    {
+        tcpSocketOptions = tcp;
+        udpSocketOptions = udp;
+    }
+
+    // 0 sends RP frames right away, otherwise they're queued until the main loop flushes them
+    static void setFlushInterval(std::chrono::milliseconds interval)
+    {
+        flushInterval = interval;
+    }
+
+    static std::chrono::milliseconds getFlushInterval()
+    {
+        return flushInterval;
+    }
+
+    // UDP sockets are handed to the pipeline's I/O threads as they're connected, null handles them here
+    static void setPipeline(Pipeline *pipeline)
+    {
+        Client::pipeline = pipeline;
+    }
+
+    // if there's a running pipeline and a UDP socket
+    void attachPipeline();
+
+    // called by the pipeline when it stops
+    void detachPipeline(RPReceiver &&receiver);
+
+    // the UDP socket is read by an I/O thread
+    bool isPipelined() const
+    {
+        return pipelineId != 0;
+    }
+
+    bool hasQueuedOutput() const
+    {
+        return !queuedFrames.empty();
+    }
+
+    // sends all queued frames in as few syscalls as possible
+    void flushOutput();
+
+    Socket &getTCPIncomingSocket()
+    {
+        return tcpIncoming;
+    }
+
+    void setTCPIncomingSocket(Socket &&socket)
+    {
+        tcpIncoming = std::move(socket);
+        tcpIncoming.setOptions(tcpSocketOptions);
+    }
+
+    Socket &getTCPOutgoingSocket()
+    {
+        return tcpOutgoing;
+    }
+
+    // the outgoing connection is still connecting or has output waiting
+    bool wantsTCPWrite() const
+    {
+        return tcpConnecting || !tcpOutput.empty();
+    }
+
+    // the outgoing socket is writable
+    void handleTCPWrite();
+
+    Socket &getUDPSocket()
+    {
+        return udpSocket;
+    }
+
+    // RP frames go through the shared socket instead of the client's own
+    bool usesSharedUDP() const
+    {
+        return udpAddress != nullptr;
+    }
+
+    // the client's address is the key in the client list, this checks the port
+    bool isSharedUDPSource(const SocketAddress &addr) const
+    {
+        return udpAddress && addr.getPort() == udpAddress->getPort();
+    }
+
+    // the shared socket the client's frames arrive on, replies go out through the same one
+    void setUDPReplySocket(Socket *socket)
+    {
+        udpReplySocket = socket;
+    }
+
+    // RP frames are sent through this (and received by the main loop) instead of a socket per client, null to disable
+    static void setSharedUDPSocket(Socket *socket)
+    {
+        sharedUDPSocket = socket;
+    }
+
+    uint32_t getSystemPlayerId() const
+    {
+        return systemPlayerId;
+    }
+
+    void setDebug(bool debug)
+    {
+        this->debug = debug;
+    }
+
+    // for a hot restart, the address isn't included as it's the key in the client list
+    void serialize(StateWriter &writer) const;
+    bool deserialize(StateReader &reader);
+
+    // don't touch the network, only capture/count what would be sent
+    void setReplayMode(bool replayMode)
+    {
+        this->replayMode = replayMode;
+    }
+
+private:
+    bool handleDPlayCommand(DPSPCommand command, const uint8_t *data, size_t len, bool viaRP = false);
+    void handleGroupCommand(DPSPCommand command, const uint8_t *data, size_t len);
+    void handleCompletedRPMessage(const uint8_t *data, size_t len);
+    void sendRPAck(const RPFrameHeader &header);
+    bool getRelayTargets(uint32_t rawId, bool &isGroup);
+    void relayLocoMessage(const uint8_t *data, size_t len);
+    void relayPlayerMessage(const uint8_t *data, size_t len, bool viaRP);
+    void sendInitialLocoMessage();
+    void updateUser(const uint8_t *data, size_t len, const uint8_t *postcards, uint64_t postcardHash);
+    void sendRequestIdReply(uint32_t id, uint32_t result = DPResult_OK);
+    bool sendDPlayMessage(DPSPCommand command, uint32_t fromId, const uint8_t *data, size_t len, bool viaRP);
+    void handlePingReply(uint32_t tickCount);
+    std::chrono::nanoseconds getTimeSinceArrival() const;
+    Player *getOwnPlayer(uint32_t rawId);
+    Group *getOwnGroup(uint32_t rawId);
+    void addRosterChange(DPSPCommand command, uint32_t playerId, uint32_t memberId = 0);
+    void updateDegraded();
+    bool sendTCP(const uint8_t *data, size_t len);
+    bool sendTCP(const iovec *iov, int iovCount);
+    // ackKey identifies an ack, a queued one for the same frame is replaced instead of sending both
+    bool sendUDP(const uint8_t *data, size_t len, uint32_t ackKey = 0);
+    bool sendUDP(const iovec *iov, int iovCount, uint32_t ackKey = 0);
+    bool checkOutgoingSocket();
+    void closeOutgoingSocket();
+    void fillOutgoingHeader(DPSPMessageHeader *header, size_t size, DPSPCommand command);
+    void fillSessionDesc(DPSessionDesc2 *desc);
+
+    Session &session;
+
+    std::string address;
+
+    int outgoingPort;
+    Socket tcpIncoming, tcpOutgoing;
+
+    Socket udpSocket;
+
+    // with the shared socket, where to send
+    static Socket *sharedUDPSocket;
+    std::unique_ptr<SocketAddress> udpAddress;
+    Socket *udpReplySocket = nullptr; // sharedUDPSocket until something arrives
+
+    Socket &getSharedUDPSocket() const
+    {
+        return udpReplySocket ? *udpReplySocket : *sharedUDPSocket;
+    }
+
+    bool hasUDP() const
+    {
+        return udpSocket.getFd() != -1 || udpAddress;
+    }
+
+    static SocketOptions tcpSocketOptions, udpSocketOptions;
+
+    // the outgoing connection doesn't block, anything the socket won't take yet waits here
+    bool tcpConnecting = false;
+    std::vector<uint8_t> tcpOutput;
+
+    uint32_t systemPlayerId = ~0u;
+    JoinState joinState = JoinState::New;
+
+    bool debug = false; // extra logging for this client
+    bool replayMode = false;
+
+    std::chrono::steady_clock::time_point createdTime;
+
+    // liveness, anything counts (including acks)
+    static ClientTimeouts timeouts;
+
+    static MemoryLimits memoryLimits;
+
+    std::chrono::steady_clock::time_point lastReceiveTime;
+
+    // for the packet being handled, the epoch if the socket doesn't have timestamps
+    std::chrono::system_clock::time_point packetArrival;
+    DelayStats queueDelay, ackDelay;
+
+    // "reliable protocol" related
+    RPReceiver rpReceiver;
+
+    uint8_t nextSendMessageId = 1;
+
+    // outgoing frames waiting for a flush, packed into one buffer
+    struct QueuedFrame
+    {
+        uint32_t offset, len;
+        uint32_t ackKey;
+    };
+
+    static std::chrono::milliseconds flushInterval;
+
+    static Pipeline *pipeline;
+    uint32_t pipelineId = 0;
+
+    std::vector<uint8_t> queuedData;
+    std::vector<QueuedFrame> queuedFrames;
+
+    std::vector<Client *> relayTargets; // reused for each relayed message
+
+    uint32_t rosterSerial = ~0u; // when we sent the player list, ~0 until then
+
+    // pings, one in flight at a time
+    static LatencyLimits latencyLimits;
+
+    LatencyStats latency;
+    std::chrono::steady_clock::time_point nextPingTime;
+    bool pingPending = false;
+    uint32_t pendingPingTick = 0;
+    bool degraded = false;
+
+    // loco
+    uint32_t userValue = ~0u; // from the user registry, sent in 1002
+    std::string userName;
+    bool userCounted = false;
+};
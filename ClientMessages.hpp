@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "DirectPlayMessage.hpp"
+#include "LocoMessage.hpp"
+#include "ReliableProtocol.hpp"
+
+// what a LEGO Loco client sends while joining and playing, for the tools that pretend to be one (LoadGen, Sim)
+// port is the one the client listens on (TCP and UDP)
+
+inline void fillClientHeader(uint8_t *buf, size_t size, DPSPCommand command, uint16_t port)
+{
+    auto header = reinterpret_cast<DPSPMessageHeader *>(buf);
+
+    header->sizeToken = size | 0xFAB << 20;
+
+    header->sockaddr.family = 2;
+    header->sockaddr.port = htons(port);
+    header->sockaddr.addr = 0;
+    memset(header->sockaddr.padding, 0, 8);
+
+    memcpy(header->signature, "play", 4);
+    header->command = command;
+    header->version = 14;
+}
+
+inline void fillClientPackedPlayer(DPPackedPlayer *player, size_t size, uint32_t flags, uint32_t id, uint32_t systemPlayerId, uint32_t shortNameLength,
+                                   uint32_t spDataSize)
+{
+    player->size = size;
+    player->flags = flags;
+    player->playerId = id;
+    player->shortNameLength = shortNameLength;
+    player->longNameLength = 0;
+    player->serviceProviderDataSize = spDataSize;
+    player->playerDataSize = 0;
+    player->numberOfPlayers = 0;
+    player->systemPlayerId = systemPlayerId;
+    player->fixedSize = 48;
+    player->playerVersion = 14;
+    player->parentId = 0;
+}
+
+// to the broadcast port
+inline std::vector<uint8_t> makeEnumSessions(const uint8_t *appGUID, uint16_t port)
+{
+    std::vector<uint8_t> buf(sizeof(DPSPMessageHeader) + sizeof(DPSPMessageEnumSessions));
+    auto message = reinterpret_cast<DPSPMessageEnumSessions *>(buf.data() + sizeof(DPSPMessageHeader));
+
+    fillClientHeader(buf.data(), buf.size(), DPSPCommand::EnumSessions, port);
+    memcpy(message->applicationGUID, appGUID, 16);
+    message->passwordOffset = 0;
+    message->flags = EnumSessions_Joinable | EnumSessions_All;
+
+    return buf;
+}
+
+inline std::vector<uint8_t> makeRequestPlayerId(bool system, uint16_t port)
+{
+    std::vector<uint8_t> buf(sizeof(DPSPMessageHeader) + sizeof(DPSPMessageRequestPlayerId));
+    auto message = reinterpret_cast<DPSPMessageRequestPlayerId *>(buf.data() + sizeof(DPSPMessageHeader));
+
+    fillClientHeader(buf.data(), buf.size(), DPSPCommand::RequestPlayerId, port);
+    message->flags = system ? RequestPlayerId_System : 0;
+
+    return buf;
+}
+
+// the system player with the two sockaddrs
+inline std::vector<uint8_t> makeAddForwardRequest(uint32_t systemPlayerId, uint16_t port)
+{
+    DPSockaddrIn spData[2] = {};
+    spData[0].family = spData[1].family = 2;
+    spData[0].port = spData[1].port = htons(port);
+
+    size_t playerSize = sizeof(DPPackedPlayer) + sizeof(spData);
+    size_t size = sizeof(DPSPMessageHeader) + sizeof(DPSPMessageAddForwardRequest) + playerSize + 2 + 4;
+
+    std::vector<uint8_t> buf(size);
+    auto message = reinterpret_cast<DPSPMessageAddForwardRequest *>(buf.data() + sizeof(DPSPMessageHeader));
+    auto player = reinterpret_cast<DPPackedPlayer *>(message + 1);
+    auto ptr = reinterpret_cast<uint8_t *>(player + 1);
+
+    fillClientHeader(buf.data(), size, DPSPCommand::AddForwardRequest, port);
+
+    message->idTo = 0;
+    message->playerId = systemPlayerId;
+    message->groupId = 0;
+    message->createOffset = 28;
+    message->passwordOffset = 0;
+
+    fillClientPackedPlayer(player, playerSize, DPPlayer_System | DPPlayer_SendingMachine, systemPlayerId, systemPlayerId, 0, sizeof(spData));
+
+    memcpy(ptr, spData, sizeof(spData));
+    ptr += sizeof(spData);
+
+    // empty password + tick count
+    *ptr++ = 0;
+    *ptr++ = 0;
+    memset(ptr, 0, 4);
+
+    return buf;
+}
+
+inline std::vector<uint8_t> makeCreatePlayer(uint32_t systemPlayerId, uint32_t playerId, const std::u16string &shortName, uint16_t port)
+{
+    size_t nameSize = (shortName.length() + 1) * 2;
+    size_t playerSize = sizeof(DPPackedPlayer) + nameSize;
+    size_t size = sizeof(DPSPMessageHeader) + sizeof(DPSPMessageCreatePlayer) + playerSize;
+
+    std::vector<uint8_t> buf(size);
+    auto message = reinterpret_cast<DPSPMessageCreatePlayer *>(buf.data() + sizeof(DPSPMessageHeader));
+    auto player = reinterpret_cast<DPPackedPlayer *>(message + 1);
+
+    fillClientHeader(buf.data(), size, DPSPCommand::CreatePlayer, port);
+
+    message->idTo = 0;
+    message->playerId = playerId;
+    message->groupId = 0;
+    message->createOffset = 28;
+    message->passwordOffset = 0;
+
+    fillClientPackedPlayer(player, playerSize, 0, playerId, systemPlayerId, nameSize, 0);
+    memcpy(player + 1, shortName.c_str(), nameSize);
+
+    return buf;
+}
+
+// a reliable RP frame with a 1004 (postcard) if there is one, otherwise a 1002
+// userValue is the one from the server's 1002, the game sends it back with postcards
+inline void fillLocoFrame(std::vector<uint8_t> &buf, uint32_t systemPlayerId, uint32_t playerId, uint16_t serverPlayerId, uint8_t messageId,
+                          uint32_t userValue, const std::vector<uint8_t> *postcard)
+{
+    size_t payloadSize = postcard ? sizeof(LocoMessageHeader) + 4 + postcard->size() : sizeof(LocoCmd1002);
+    buf.resize(getRPHeaderSize(systemPlayerId & 0xFFFF, 0) + payloadSize);
+
+    uint8_t flags = DPRPFrame_Reliable | DPRPFrame_Start | DPRPFrame_End | DPRPFrame_SendAck;
+    auto ptr = fillRPHeader(buf.data(), systemPlayerId & 0xFFFF, 0, flags, messageId, 1, 0);
+    auto header = reinterpret_cast<LocoMessageHeader *>(ptr);
+
+    header->dstPlayerId = serverPlayerId;
+    header->srcPlayerId = playerId;
+    header->command = postcard ? 1004 : 1002;
+    header->magic = 300;
+
+    if(postcard)
+    {
+        memcpy(ptr + sizeof(LocoMessageHeader), &userValue, 4);
+        memcpy(ptr + sizeof(LocoMessageHeader) + 4, postcard->data(), postcard->size());
+    }
+    else
+    {
+        auto message = reinterpret_cast<LocoCmd1002 *>(ptr);
+        message->userValue = 0xFFFFFFFF;
+        message->unk = 0;
+    }
+}
+
+// the server measures latency with pings, data is an RP frame's payload
+// returns the length of the reply frame, 0 if it wasn't a ping
+inline size_t fillPingReply(uint8_t *buf, size_t bufLen, const uint8_t *data, size_t len, uint32_t systemPlayerId, uint8_t messageId)
+{
+    const size_t headerSize = sizeof(DPSPMessageHeader) - offsetof(DPSPMessageHeader, signature);
+
+    if(len < headerSize + sizeof(DPSPMessagePing) || memcmp(data, "play", 4) != 0 || bufLen < 10 + headerSize + sizeof(DPSPMessagePing))
+        return 0;
+
+    DPSPMessageHeader header;
+    memcpy(header.signature, data, headerSize);
+
+    if(header.command != DPSPCommand::Ping)
+        return 0;
+
+    DPSPMessagePing ping;
+    memcpy(&ping, data + headerSize, sizeof(ping));
+
+    uint8_t flags = DPRPFrame_Command | DPRPFrame_Start | DPRPFrame_End;
+    auto ptr = fillRPHeader(buf, systemPlayerId & 0xFFFF, 0, flags, messageId, 1, 0);
+
+    header.command = DPSPCommand::PingReply;
+    memcpy(ptr, header.signature, headerSize);
+    ptr += headerSize;
+
+    DPSPMessagePing reply{systemPlayerId, ping.tickCount};
+    memcpy(ptr, &reply, sizeof(reply));
+    ptr += sizeof(reply);
+
+    return ptr - buf;
+}
@@ -0,0 +1,3 @@
+#include "Clock.hpp"
+
+Clock *Clock::current = nullptr;
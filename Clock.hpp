@@ -0,0 +1,47 @@
+#pragma once
+
+#include <chrono>
+
+// the time everything the server schedules (ticks, timeouts, pings, tick counts) is based on
+// the steady clock unless another one is set, which has to happen before anything reads it (see VirtualClock)
+class Clock
+{
+public:
+    using time_point = std::chrono::steady_clock::time_point;
+
+    virtual ~Clock() = default;
+
+    virtual time_point getTime() const = 0;
+
+    static time_point now()
+    {
+        return current ? current->getTime() : std::chrono::steady_clock::now();
+    }
+
+    // nullptr goes back to the steady clock
+    static void setCurrent(Clock *clock)
+    {
+        current = clock;
+    }
+
+private:
+    static Clock *current;
+};
+
+// only moves when told to, for running simulations faster than real time
+class VirtualClock final : public Clock
+{
+public:
+    time_point getTime() const override
+    {
+        return time;
+    }
+
+    void advance(std::chrono::steady_clock::duration duration)
+    {
+        time += duration;
+    }
+
+private:
+    time_point time{std::chrono::hours(1)}; // far enough from the epoch that nothing looks unset
+};
@@ -0,0 +1,129 @@
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "ConfigWatcher.hpp"
+#include "Logger.hpp"
+
+// editors tend to write a few times in a row
+static constexpr int settleTimeMs = 100;
+
+ConfigWatcher::~ConfigWatcher()
+{
+    stop();
+}
+
+bool ConfigWatcher::start(const std::filesystem::path &path)
+{
+    stop();
+
+    this->path = path;
+
+    // watch the directory, replacing the file (write + rename) would lose a watch on the file itself
+    auto dir = path.parent_path();
+    if(dir.empty())
+        dir = ".";
+
+    inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    stopFd = eventfd(0, EFD_CLOEXEC);
+    readyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(inotifyFd == -1 || stopFd == -1 || readyFd == -1 || inotify_add_watch(inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+        stop();
+        return false;
+    }
+
+    thread = std::thread(&ConfigWatcher::run, this);
+
+    return true;
+}
+
+void ConfigWatcher::stop()
+{
+    if(thread.joinable())
+    {
+        uint64_t value = 1;
+        write(stopFd, &value, sizeof(value));
+        thread.join();
+    }
+
+    for(auto fd : {inotifyFd, stopFd, readyFd})
+    {
+        if(fd != -1)
+            close(fd);
+    }
+
+    inotifyFd = stopFd = readyFd = -1;
+}
+
+std::unique_ptr<IniFile> ConfigWatcher::takeConfig()
+{
+    uint64_t value;
+    read(readyFd, &value, sizeof(value));
+
+    std::lock_guard lock(mutex);
+    return std::move(pending);
+}
+
+void ConfigWatcher::run()
+{
+    auto fileName = path.filename().string();
+
+    pollfd fds[2]{};
+    fds[0].fd = inotifyFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = stopFd;
+    fds[1].events = POLLIN;
+
+    bool changed = false;
+
+    while(true)
+    {
+        // wait for things to settle once something has changed
+        int ret = poll(fds, 2, changed ? settleTimeMs : -1);
+
+        if(ret < 0)
+            continue;
+
+        if(fds[1].revents)
+            return;
+
+        if(ret == 0)
+        {
+            changed = false;
+
+            auto config = std::make_unique<IniFile>(path);
+
+            // probably caught it half-written or it was removed, there'll be another event
+            if(config->isEmpty())
+                continue;
+
+            {
+                std::lock_guard lock(mutex);
+                pending = std::move(config);
+            }
+
+            uint64_t value = 1;
+            write(readyFd, &value, sizeof(value));
+            continue;
+        }
+
+        alignas(inotify_event) char buf[4096];
+        ssize_t len;
+
+        while((len = read(inotifyFd, buf, sizeof(buf))) > 0)
+        {
+            for(ssize_t off = 0; off < len;)
+            {
+                auto event = reinterpret_cast<const inotify_event *>(buf + off);
+
+                if(event->len && fileName == event->name)
+                    changed = true;
+
+                off += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+}
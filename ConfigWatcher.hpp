@@ -0,0 +1,45 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "IniFile.hpp"
+
+// watches the config file with inotify, parsing it on a background thread when it changes
+// the main loop selects on getFd and picks up the result with takeConfig
+class ConfigWatcher final
+{
+public:
+    ConfigWatcher() = default;
+    ConfigWatcher(ConfigWatcher &) = delete;
+
+    ~ConfigWatcher();
+
+    bool start(const std::filesystem::path &path);
+    void stop();
+
+    // readable when there's a new config
+    int getFd() const
+    {
+        return readyFd;
+    }
+
+    // null if nothing has changed
+    std::unique_ptr<IniFile> takeConfig();
+
+private:
+    void run();
+
+    std::filesystem::path path;
+
+    int inotifyFd = -1;
+    int stopFd = -1;
+    int readyFd = -1;
+
+    std::thread thread;
+
+    std::mutex mutex;
+    std::unique_ptr<IniFile> pending;
+};
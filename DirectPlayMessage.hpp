@@ -226,7 +226,13 @@ struct DPSPMessageRequestPlayerId
 };
 static_assert(sizeof(DPSPMessageRequestPlayerId) == 4);
 
-// requestgroupid ...
+// RequestGroupId is the same as RequestPlayerId, without the flags being used
+
+enum DPResult : uint32_t
+{
+    DPResult_OK                = 0,
+    DPResult_CantCreatePlayer  = 0x88770046,
+};
 
 struct DPSPMessageRequestPlayerReply
 {
@@ -238,10 +244,38 @@ struct DPSPMessageRequestPlayerReply
 
     uint32_t sspiProviderOffset;
     uint32_t capiProviderOffset;
-    uint32_t result;
+    uint32_t result; // DPResult
 };
 static_assert(sizeof(DPSPMessageRequestPlayerReply) == 40);
 
+// CreateGroup is the same as CreatePlayer
+
+// also used for DeletePlayerFromGroup, AddShortcutToGroup (playerId is the child group),
+// DeleteShortcutFromGroup, DeleteGroup (playerId is ignored) and DeletePlayer (groupId is ignored)
+struct DPSPMessageAddPlayerToGroup
+{
+    // header
+
+    uint32_t idTo; // ignored/zero
+    uint32_t playerId;
+    uint32_t groupId;
+    uint32_t createOffset; // ignored/zero
+    uint32_t passwordOffset; // ignored/zero
+};
+static_assert(sizeof(DPSPMessageAddPlayerToGroup) == 20);
+
+// only sent to the host if the session has DPSession_RouteThroughHost
+struct DPSPMessagePlayerMessage
+{
+    // header
+
+    uint32_t idFrom;
+    uint32_t idTo; // 0 for all players
+
+    // message data
+};
+static_assert(sizeof(DPSPMessagePlayerMessage) == 8);
+
 // this is just AddForwardRequest with ignored fields...
 struct DPSPMessageCreatePlayer
 {
@@ -253,10 +287,37 @@ struct DPSPMessageCreatePlayer
     uint32_t createOffset; // must be 28
     uint32_t passwordOffset; // ignored/zero
 
-    // player info
+    // player info, 6 reserved bytes
 };
 static_assert(sizeof(DPSPMessageCreatePlayer) == 20);
 
+// offsets here are from the signature, like createOffset
+struct DPSPMessagePlayerDataChanged
+{
+    // header
+
+    uint32_t idTo; // ignored/zero
+    uint32_t playerId;
+    uint32_t dataSize;
+    uint32_t dataOffset; // 24
+
+    // data
+};
+static_assert(sizeof(DPSPMessagePlayerDataChanged) == 16);
+
+struct DPSPMessagePlayerNameChanged
+{
+    // header
+
+    uint32_t idTo; // ignored/zero
+    uint32_t playerId;
+    uint32_t shortNameOffset; // 0 if there isn't one
+    uint32_t longNameOffset;
+
+    // names, null terminated
+};
+static_assert(sizeof(DPSPMessagePlayerNameChanged) == 16);
+
 // ...
 
 struct DPSPMessageAddForwardRequest
@@ -289,6 +350,16 @@ struct DPSPMessagePacket
 };
 static_assert(sizeof(DPSPMessagePacket) == 40);
 
+// PingReply is the same, with the tick count copied from the ping
+struct DPSPMessagePing
+{
+    // header
+
+    uint32_t idFrom; // system player
+    uint32_t tickCount;
+};
+static_assert(sizeof(DPSPMessagePing) == 8);
+
 // ...
 
 struct DPSPMessageSuperEnumPlayersReply
@@ -0,0 +1,314 @@
+#include <algorithm>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "HotRestart.hpp"
+#include "Logger.hpp"
+
+// bump if the state format changes, processes with different versions refuse to hand over
+static constexpr uint32_t handOffVersion = 4;
+
+static constexpr size_t maxFdsPerMessage = 64; // well under SCM_MAX_FD
+static constexpr size_t maxChunkSize = 32 * 1024;
+static constexpr size_t maxStateSize = 256 * 1024 * 1024;
+static constexpr int timeoutSeconds = 5;
+
+// every message is one of these, except for the state data
+struct HandOffMessage
+{
+    char magic[4]; // BTHQ(uest), BTHS (state header), BTHF (fds), BTOK, BTDN (done)
+    uint32_t version;
+    uint64_t stateSize;
+    uint32_t fdCount;
+    uint32_t reserved;
+};
+static_assert(sizeof(HandOffMessage) == 24);
+
+static bool sendMessage(int fd, const char *magic, uint64_t stateSize = 0, uint32_t fdCount = 0, const int *fds = nullptr)
+{
+    HandOffMessage message{};
+    memcpy(message.magic, magic, 4);
+    message.version = handOffVersion;
+    message.stateSize = stateSize;
+    message.fdCount = fdCount;
+
+    iovec iov{&message, sizeof(message)};
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int) * maxFdsPerMessage)];
+
+    if(fds && fdCount)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(message);
+}
+
+// any fds received are appended
+static bool recvMessage(int fd, HandOffMessage &message, const char *magic, std::vector<int> *fds = nullptr)
+{
+    iovec iov{&message, sizeof(message)};
+
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    alignas(cmsghdr) uint8_t control[CMSG_SPACE(sizeof(int) * maxFdsPerMessage)];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    auto len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+
+    for(auto cmsg = CMSG_FIRSTHDR(&msg); len > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for(size_t i = 0; i < count; i++)
+        {
+            int newFd;
+            memcpy(&newFd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+            // don't leak anything we weren't expecting
+            if(fds)
+                fds->push_back(newFd);
+            else
+                ::close(newFd);
+        }
+    }
+
+    if(len != sizeof(message) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+        return false;
+
+    return memcmp(message.magic, magic, 4) == 0 && message.version == handOffVersion;
+}
+
+static void setTimeouts(int fd)
+{
+    timeval timeout{timeoutSeconds, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static bool makeAddress(const char *path, sockaddr_un &addr)
+{
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return false;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    return true;
+}
+
+HotRestart::~HotRestart()
+{
+    close();
+}
+
+bool HotRestart::listen(const char *path)
+{
+    close();
+
+    sockaddr_un addr;
+    if(!makeAddress(path, addr))
+        return false;
+
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    if(listenFd == -1)
+        return false;
+
+    // left over from a crash, or belongs to the process we took over from
+    unlink(path);
+
+    struct stat st;
+
+    if(bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1 || ::listen(listenFd, 1) == -1 || stat(path, &st) == -1)
+    {
+        close();
+        return false;
+    }
+
+    this->path = path;
+    listenInode = st.st_ino;
+
+    return true;
+}
+
+void HotRestart::close()
+{
+    if(connFd != -1)
+        ::close(connFd);
+
+    connFd = -1;
+
+    if(listenFd == -1)
+        return;
+
+    ::close(listenFd);
+    listenFd = -1;
+
+    // only remove the socket if it's still ours, the new process has replaced it after a hand off
+    struct stat st;
+    if(stat(path.c_str(), &st) == 0 && st.st_ino == listenInode)
+        unlink(path.c_str());
+}
+
+bool HotRestart::handOff(const StateWriter &state)
+{
+    connFd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+
+    if(connFd == -1)
+        return false;
+
+    setTimeouts(connFd);
+
+    HandOffMessage message{};
+
+    if(!recvMessage(connFd, message, "BTHQ"))
+    {
+        LOG_WARNING(General, "bad hot restart request (version %u, ours is %u)", message.version, handOffVersion);
+        ::close(connFd);
+        connFd = -1;
+        return false;
+    }
+
+    if(!sendState(state) || !recvMessage(connFd, message, "BTOK"))
+    {
+        LOG_ERROR(General, "hot restart failed, carrying on");
+        ::close(connFd);
+        connFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+void HotRestart::finishHandOff()
+{
+    if(connFd == -1)
+        return;
+
+    sendMessage(connFd, "BTDN");
+
+    ::close(connFd);
+    connFd = -1;
+}
+
+bool HotRestart::takeOver(const char *path, std::vector<uint8_t> &state, std::vector<int> &fds)
+{
+    sockaddr_un addr;
+    if(!makeAddress(path, addr))
+        return false;
+
+    connFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+
+    if(connFd == -1)
+        return false;
+
+    setTimeouts(connFd);
+
+    HandOffMessage header{};
+
+    bool ok = ::connect(connFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0
+           && sendMessage(connFd, "BTHQ")
+           && recvMessage(connFd, header, "BTHS")
+           && header.stateSize <= maxStateSize;
+
+    // fds
+    while(ok && fds.size() < header.fdCount)
+    {
+        HandOffMessage message{};
+        ok = recvMessage(connFd, message, "BTHF", &fds) && fds.size() <= header.fdCount;
+    }
+
+    // then the data
+    if(ok)
+        state.resize(header.stateSize);
+
+    for(size_t offset = 0; ok && offset < state.size();)
+    {
+        auto len = recv(connFd, state.data() + offset, std::min(maxChunkSize, state.size() - offset), 0);
+
+        if(len <= 0)
+            ok = false;
+        else
+            offset += len;
+    }
+
+    if(!ok)
+    {
+        for(auto fd : fds)
+            ::close(fd);
+
+        fds.clear();
+        state.clear();
+
+        ::close(connFd);
+        connFd = -1;
+    }
+
+    return ok;
+}
+
+bool HotRestart::confirmTakeOver()
+{
+    if(connFd == -1)
+        return false;
+
+    HandOffMessage message{};
+    bool ok = sendMessage(connFd, "BTOK") && recvMessage(connFd, message, "BTDN");
+
+    ::close(connFd);
+    connFd = -1;
+
+    return ok;
+}
+
+bool HotRestart::sendState(const StateWriter &state)
+{
+    auto &data = state.getData();
+    auto &fds = state.getFds();
+
+    if(!sendMessage(connFd, "BTHS", data.size(), fds.size()))
+        return false;
+
+    for(size_t i = 0; i < fds.size(); i += maxFdsPerMessage)
+    {
+        auto count = std::min(maxFdsPerMessage, fds.size() - i);
+
+        if(!sendMessage(connFd, "BTHF", 0, count, fds.data() + i))
+            return false;
+    }
+
+    for(size_t offset = 0; offset < data.size();)
+    {
+        auto len = send(connFd, data.data() + offset, std::min(maxChunkSize, data.size() - offset), MSG_NOSIGNAL);
+
+        if(len <= 0)
+            return false;
+
+        offset += len;
+    }
+
+    return true;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "StateBuffer.hpp"
+
+// hands the server over to a new process without disconnecting anyone
+// the running server listens on a unix socket, a new one (started with --hot-restart) connects to it and gets
+// the serialized state and every socket (as SCM_RIGHTS), then confirms it's taken over and the old process exits
+// if anything fails before that, the old process carries on
+
+class HotRestart final
+{
+public:
+    HotRestart() = default;
+    HotRestart(HotRestart &) = delete;
+
+    ~HotRestart();
+
+    // old process
+    bool listen(const char *path);
+    void close();
+
+    int getFd() const
+    {
+        return listenFd;
+    }
+
+    // accepts the new process, returns true once it has taken over
+    bool handOff(const StateWriter &state);
+
+    // releases the new process once we've stopped using anything it needs
+    void finishHandOff();
+
+    // new process
+    bool takeOver(const char *path, std::vector<uint8_t> &state, std::vector<int> &fds);
+
+    // call once the state is restored, false if the old process gave up on us
+    bool confirmTakeOver();
+
+private:
+    bool sendState(const StateWriter &state);
+
+    std::string path;
+    int listenFd = -1;
+    uint64_t listenInode = 0;
+
+    int connFd = -1;
+};
@@ -6,7 +6,7 @@
 
 IniFile::IniFile(const std::filesystem::path &path)
 {
-    std::fstream stream(path);
+    std::ifstream stream(path);
     load(stream);
 }
 
@@ -58,6 +58,72 @@ std::optional<int> IniFile::getIntValue(std::string_view sectionName, std::strin
     return value;
 }
 
+void IniFile::setValue(std::string_view sectionName, std::string_view key, std::optional<std::string_view> value)
+{
+    auto it = sections.find(sectionName);
+
+    if(!value)
+    {
+        if(it != sections.end())
+        {
+            auto valueIt = it->second.find(key);
+            if(valueIt != it->second.end())
+                it->second.erase(valueIt);
+
+            if(it->second.empty())
+                sections.erase(it);
+        }
+        return;
+    }
+
+    if(it == sections.end())
+        it = sections.emplace(sectionName, Section{}).first;
+
+    auto valueIt = it->second.find(key);
+    if(valueIt != it->second.end())
+        valueIt->second = *value;
+    else
+        it->second.emplace(key, *value);
+}
+
+std::vector<std::string> IniFile::diff(const IniFile &other) const
+{
+    std::vector<std::string> ret;
+
+    auto diffSection = [&ret](const std::string &name, const Section *a, const Section *b)
+    {
+        // in a and not in b, or different
+        for(auto &value : *a)
+        {
+            auto it = b ? b->find(value.first) : a->end();
+
+            if(!b || it == b->end() || it->second != value.second)
+                ret.push_back(name + "/" + value.first);
+        }
+
+        // only in b
+        if(b)
+        {
+            for(auto &value : *b)
+            {
+                if(a->find(value.first) == a->end())
+                    ret.push_back(name + "/" + value.first);
+            }
+        }
+    };
+
+    for(auto &section : sections)
+        diffSection(section.first, &section.second, other.getSection(section.first));
+
+    for(auto &section : other.sections)
+    {
+        if(!getSection(section.first))
+            diffSection(section.first, &section.second, nullptr);
+    }
+
+    return ret;
+}
+
 void IniFile::load(std::istream &stream)
 {
     std::string line;
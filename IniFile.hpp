@@ -4,6 +4,8 @@
 #include <istream>
 #include <map>
 #include <optional>
+#include <string>
+#include <vector>
 
 class IniFile final
 {
@@ -18,6 +20,17 @@ public:
     std::optional<std::string_view> getValue(std::string_view sectionName, std::string_view key) const;
     std::optional<int> getIntValue(std::string_view sectionName, std::string_view key) const;
 
+    // no value removes it
+    void setValue(std::string_view sectionName, std::string_view key, std::optional<std::string_view> value);
+
+    bool isEmpty() const
+    {
+        return sections.empty();
+    }
+
+    // "Section/Key" for each value that's different or only in one of the files
+    std::vector<std::string> diff(const IniFile &other) const;
+
 private:
     void load(std::istream &stream);
 
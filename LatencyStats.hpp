@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+
+// thresholds for acting on ping results, 0 disables each of them
+struct LatencyLimits
+{
+    uint32_t pingIntervalMs = 2000;
+    uint32_t maxJoinRTTMs = 0; // using the TCP RTT from the handshake
+    uint32_t degradedRTTMs = 300;
+    uint32_t degradedJitterMs = 100;
+    uint32_t degradedLostPings = 2; // in a row
+};
+
+// round trip times from pings for one client
+// smoothing is the same as TCP (RFC 6298) for the RTT and RTP (RFC 3550) for the jitter
+class LatencyStats final
+{
+public:
+    // powers of two from 1ms, the last is everything above 1s
+    static constexpr int numBuckets = 12;
+
+    void addSample(uint32_t rttMs)
+    {
+        if(!samples)
+        {
+            smoothedRTT = rttMs;
+            minRTT = maxRTT = rttMs;
+        }
+        else
+        {
+            int32_t delta = rttMs - lastRTT;
+            jitter += (std::abs(delta) - jitter) / 16.0f;
+            smoothedRTT += (static_cast<float>(rttMs) - smoothedRTT) / 8.0f;
+
+            minRTT = std::min(minRTT, rttMs);
+            maxRTT = std::max(maxRTT, rttMs);
+        }
+
+        lastRTT = rttMs;
+        samples++;
+        lostInARow = 0;
+
+        int bucket = 0;
+        for(uint32_t bound = 1; bucket < numBuckets - 1 && rttMs >= bound; bound *= 2)
+            bucket++;
+
+        buckets[bucket]++;
+    }
+
+    void addLoss()
+    {
+        lost++;
+        lostInARow++;
+    }
+
+    bool isDegraded(const LatencyLimits &limits) const
+    {
+        return (limits.degradedRTTMs && samples && smoothedRTT > limits.degradedRTTMs)
+            || (limits.degradedJitterMs && samples > 1 && jitter > limits.degradedJitterMs)
+            || (limits.degradedLostPings && lostInARow >= limits.degradedLostPings);
+    }
+
+    uint32_t getLastRTT() const
+    {
+        return lastRTT;
+    }
+
+    float getSmoothedRTT() const
+    {
+        return smoothedRTT;
+    }
+
+    float getJitter() const
+    {
+        return jitter;
+    }
+
+    uint32_t getMinRTT() const
+    {
+        return minRTT;
+    }
+
+    uint32_t getMaxRTT() const
+    {
+        return maxRTT;
+    }
+
+    uint32_t getSampleCount() const
+    {
+        return samples;
+    }
+
+    uint32_t getLostCount() const
+    {
+        return lost;
+    }
+
+    const uint32_t *getBuckets() const
+    {
+        return buckets;
+    }
+
+private:
+    uint32_t lastRTT = 0;
+    float smoothedRTT = 0.0f;
+    float jitter = 0.0f;
+    uint32_t minRTT = 0, maxRTT = 0;
+
+    uint32_t samples = 0;
+    uint32_t lost = 0, lostInARow = 0;
+
+    uint32_t buckets[numBuckets] = {};
+};
+
+// time packets from one client spent with us, from the kernel receive timestamps
+class DelayStats final
+{
+public:
+    void add(std::chrono::nanoseconds delay)
+    {
+        count++;
+        total += delay;
+        max = std::max(max, delay);
+    }
+
+    float getMeanMs() const
+    {
+        return count ? std::chrono::duration<float, std::milli>(total).count() / count : 0.0f;
+    }
+
+    float getMaxMs() const
+    {
+        return std::chrono::duration<float, std::milli>(max).count();
+    }
+
+    uint32_t getCount() const
+    {
+        return count;
+    }
+
+private:
+    uint32_t count = 0;
+    std::chrono::nanoseconds total{0}, max{0};
+};
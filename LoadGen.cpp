@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/select.h>
+
+#include "Clock.hpp"
+#include "ClientMessages.hpp"
+#include "DirectPlayMessage.hpp"
+#include "LocoMessage.hpp"
+#include "ReliableProtocol.hpp"
+#include "Session.hpp"
+#include "Socket.hpp"
+#include "Unicode.hpp"
+
+// simulates LEGO Loco clients joining a server and sending loco messages
+// every client gets its own loopback address as the server keys clients by ip, so the server should listen on a single address
+// (ListenAddr=::ffff:127.0.0.1) to leave the port free on the others, and MaxPlayers has to be at least the number of clients
+
+struct LoadGenOptions
+{
+    std::string serverAddr = "::ffff:127.0.0.1";
+    uint16_t port = 31415;
+    uint8_t appGUID[16];
+
+    int numClients = 10;
+    int ipPrefix = 1; // 127.x.y.z
+    std::chrono::milliseconds rampTime{0};
+    std::chrono::seconds duration{10};
+    std::chrono::milliseconds timeout{2000};
+
+    size_t postcardSize = 256;
+};
+
+struct ClientResult
+{
+    bool joined = false;
+    std::chrono::nanoseconds joinTime{0};
+    std::chrono::nanoseconds playTime{0};
+
+    uint64_t messagesSent = 0;
+    uint64_t messagesReceived = 0;
+    uint64_t timeouts = 0;
+
+    std::string error;
+};
+
+class SimClient final
+{
+public:
+    SimClient(int index, const LoadGenOptions &options) : options(options), tcpListen(SocketType::TCP), tcpIncoming(SocketType::TCP),
+                                                           tcpOutgoing(SocketType::TCP), udpSocket(SocketType::UDP)
+    {
+        address = "::ffff:127." + std::to_string(options.ipPrefix) + "." + std::to_string(index / 250) + "." + std::to_string(index % 250 + 1);
+        shortName = u"Load" + convertUTF8ToUCS2(std::to_string(index));
+    }
+
+    void run(ClientResult &result, Clock::time_point playEnd)
+    {
+        auto start = Clock::now();
+
+        if(!join(result))
+            return;
+
+        result.joined = true;
+        result.joinTime = Clock::now() - start;
+
+        auto playStart = Clock::now();
+        play(result, playEnd);
+        result.playTime = Clock::now() - playStart;
+    }
+
+private:
+    bool join(ClientResult &result)
+    {
+        // we need to be listening before asking for anything
+        if(!tcpListen.listen(address.c_str(), options.port) || !udpSocket.bind(address.c_str(), options.port))
+            return fail(result, "failed to bind " + address);
+
+        setTimeout(udpSocket);
+
+        // enum sessions goes to the broadcast port
+        {
+            auto buf = makeEnumSessions(options.appGUID, options.port);
+
+            SocketAddress broadcastAddr(options.serverAddr.c_str(), 47624);
+            size_t len = buf.size();
+            if(!udpSocket.send(buf.data(), len, &broadcastAddr))
+                return fail(result, "failed to send enum sessions");
+        }
+
+        // the server connects back to us to reply
+        if(!waitReadable(tcpListen))
+            return fail(result, "no connection from server");
+
+        auto incoming = tcpListen.accept();
+        if(!incoming)
+            return fail(result, "accept failed");
+
+        tcpIncoming = std::move(*incoming);
+        setTimeout(tcpIncoming);
+
+        if(!readReply(DPSPCommand::EnumSessionsReply))
+            return fail(result, "no enum sessions reply");
+
+        // ... and we connect to it to send everything else
+        if(!tcpOutgoing.connect(options.serverAddr.c_str(), options.port, 0, address.c_str()))
+            return fail(result, "failed to connect to server");
+
+        // system player
+        systemPlayerId = requestPlayerId(true);
+        if(systemPlayerId == ~0u)
+            return fail(result, "no system player id");
+
+        auto addForward = makeAddForwardRequest(systemPlayerId, options.port);
+        size_t len = addForward.size();
+        if(!tcpOutgoing.sendAll(addForward.data(), len))
+            return fail(result, "failed to send add forward");
+
+        if(!readReply(DPSPCommand::SuperEnumPlayersReply))
+            return fail(result, "no super enum players reply");
+
+        // and the real one
+        playerId = requestPlayerId(false);
+        if(playerId == ~0u)
+            return fail(result, "no player id");
+
+        auto createPlayer = makeCreatePlayer(systemPlayerId, playerId, shortName, options.port);
+        len = createPlayer.size();
+        if(!tcpOutgoing.sendAll(createPlayer.data(), len))
+            return fail(result, "failed to send create player");
+
+        // joined once the server sends the first loco message
+        while(true)
+        {
+            uint8_t buf[2048];
+            int len = udpSocket.recv(buf, sizeof(buf));
+
+            if(len <= 0)
+                return fail(result, "no initial loco message");
+
+            RPFrameHeader header;
+            if(!parseRPHeader(buf, len, header) || len - header.length < sizeof(LocoCmd1002))
+                continue;
+
+            auto message = reinterpret_cast<const LocoCmd1002 *>(buf + header.length);
+
+            if(message->header.magic == 300 && message->header.command == 1002)
+            {
+                serverPlayerId = header.fromId;
+                userValue = message->userValue;
+                return true;
+            }
+        }
+    }
+
+    void play(ClientResult &result, Clock::time_point playEnd)
+    {
+        std::vector<uint8_t> postcard(options.postcardSize);
+        for(size_t i = 0; i < postcard.size(); i++)
+            postcard[i] = i;
+
+        std::vector<uint8_t> buf;
+        uint8_t messageId = 0;
+        SocketAddress serverAddr(options.serverAddr.c_str(), options.port);
+
+        while(Clock::now() < playEnd)
+        {
+            // alternate postcards and 1002s
+            bool isPostcard = messageId & 1;
+            messageId++;
+
+            fillLocoFrame(buf, systemPlayerId, playerId, serverPlayerId, messageId, userValue, isPostcard ? &postcard : nullptr);
+
+            size_t len = buf.size();
+            if(!udpSocket.send(buf.data(), len, &serverAddr))
+                break;
+
+            result.messagesSent++;
+
+            // wait for the ack, counting anything else that arrives
+            while(true)
+            {
+                uint8_t reply[65536];
+                int replyLen = udpSocket.recv(reply, sizeof(reply));
+
+                if(replyLen <= 0)
+                {
+                    result.timeouts++;
+                    break;
+                }
+
+                result.messagesReceived++;
+
+                RPFrameHeader replyHeader;
+                if(!parseRPHeader(reply, replyLen, replyHeader))
+                    continue;
+
+                if((replyHeader.flags & DPRPFrame_Ack) && replyHeader.messageId == messageId)
+                    break;
+
+                answerPing(reply + replyHeader.length, replyLen - replyHeader.length, serverAddr);
+            }
+        }
+    }
+
+    // the server measures latency with these
+    void answerPing(const uint8_t *data, size_t len, const SocketAddress &serverAddr)
+    {
+        uint8_t buf[32];
+        size_t replyLen = fillPingReply(buf, sizeof(buf), data, len, systemPlayerId, pingReplyId);
+
+        if(!replyLen)
+            return;
+
+        pingReplyId++;
+        udpSocket.send(buf, replyLen, &serverAddr);
+    }
+
+    uint32_t requestPlayerId(bool system)
+    {
+        auto buf = makeRequestPlayerId(system, options.port);
+
+        size_t len = buf.size();
+        if(!tcpOutgoing.sendAll(buf.data(), len) || !readReply(DPSPCommand::RequestPlayerReply))
+            return ~0u;
+
+        if(replyBuffer.size() < sizeof(DPSPMessageHeader) + sizeof(DPSPMessageRequestPlayerReply))
+            return ~0u;
+
+        auto reply = reinterpret_cast<const DPSPMessageRequestPlayerReply *>(replyBuffer.data() + sizeof(DPSPMessageHeader));
+        return reply->id;
+    }
+
+    // reads one message from the server into replyBuffer
+    bool readReply(DPSPCommand expected)
+    {
+        uint32_t sizeToken;
+        if(tcpIncoming.recv(&sizeToken, 4, MSG_WAITALL) != 4)
+            return false;
+
+        size_t size = sizeToken & 0xFFFFF;
+        if(size < sizeof(DPSPMessageHeader))
+            return false;
+
+        replyBuffer.resize(size);
+        memcpy(replyBuffer.data(), &sizeToken, 4);
+
+        if(tcpIncoming.recv(replyBuffer.data() + 4, size - 4, MSG_WAITALL) != static_cast<int>(size - 4))
+            return false;
+
+        auto header = reinterpret_cast<const DPSPMessageHeader *>(replyBuffer.data());
+        return header->command == expected;
+    }
+
+    bool waitReadable(Socket &socket)
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(socket.getFd(), &fds);
+
+        timeval timeout{0, static_cast<suseconds_t>(options.timeout.count() * 1000)};
+        timeout.tv_sec = timeout.tv_usec / 1000000;
+        timeout.tv_usec %= 1000000;
+
+        return select(socket.getFd() + 1, &fds, nullptr, nullptr, &timeout) == 1;
+    }
+
+    void setTimeout(Socket &socket)
+    {
+        timeval timeout{0, static_cast<suseconds_t>(options.timeout.count() * 1000)};
+        timeout.tv_sec = timeout.tv_usec / 1000000;
+        timeout.tv_usec %= 1000000;
+
+        setsockopt(socket.getFd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+
+    bool fail(ClientResult &result, std::string error)
+    {
+        result.error = std::move(error);
+        return false;
+    }
+
+    const LoadGenOptions &options;
+
+    std::string address;
+    std::u16string shortName;
+
+    Socket tcpListen, tcpIncoming, tcpOutgoing;
+    Socket udpSocket;
+
+    uint32_t systemPlayerId = ~0u, playerId = ~0u;
+    uint16_t serverPlayerId = 0;
+    uint32_t userValue = ~0u; // from the server's 1002
+    uint8_t pingReplyId = 128; // away from the ids used for loco messages
+
+    std::vector<uint8_t> replyBuffer;
+};
+
+int main(int argc, char *argv[])
+{
+    LoadGenOptions options;
+    std::string_view guid = "4625cdf9-7f57-d211-9426-00a0244bda7a";
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string_view arg(argv[i]);
+        bool hasValue = i + 1 < argc;
+
+        if(arg == "--server" && hasValue)
+            options.serverAddr = argv[++i];
+        else if(arg == "--port" && hasValue)
+            options.port = atoi(argv[++i]);
+        else if(arg == "--guid" && hasValue)
+            guid = argv[++i];
+        else if(arg == "--clients" && hasValue)
+            options.numClients = std::max(1, atoi(argv[++i]));
+        else if(arg == "--ip-prefix" && hasValue)
+            options.ipPrefix = atoi(argv[++i]);
+        else if(arg == "--ramp" && hasValue)
+            options.rampTime = std::chrono::milliseconds(atoi(argv[++i]));
+        else if(arg == "--duration" && hasValue)
+            options.duration = std::chrono::seconds(atoi(argv[++i]));
+        else if(arg == "--timeout" && hasValue)
+            options.timeout = std::chrono::milliseconds(atoi(argv[++i]));
+        else if(arg == "--postcard-size" && hasValue)
+            options.postcardSize = atoi(argv[++i]);
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--server addr] [--port n] [--guid app-guid] [--clients n] [--ip-prefix n]"
+                      << " [--ramp ms] [--duration s] [--timeout ms] [--postcard-size bytes]\n";
+            return 1;
+        }
+    }
+
+    if(!parseGUID(guid, options.appGUID))
+    {
+        std::cerr << "invalid GUID " << guid << "\n";
+        return 1;
+    }
+
+    std::vector<ClientResult> results(options.numClients);
+    std::vector<std::thread> threads;
+
+    auto start = Clock::now();
+    auto playEnd = start + options.rampTime + options.timeout + options.duration;
+
+    for(int i = 0; i < options.numClients; i++)
+    {
+        auto startDelay = options.rampTime * i / options.numClients;
+
+        threads.emplace_back([i, &options, &results, start, startDelay, playEnd]
+        {
+            std::this_thread::sleep_until(start + startDelay);
+
+            SimClient client(i, options);
+            client.run(results[i], playEnd);
+        });
+    }
+
+    for(auto &thread : threads)
+        thread.join();
+
+    auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+    // join latencies
+    std::vector<double> joinTimes;
+    uint64_t sent = 0, received = 0, timeouts = 0;
+    double totalPlayTime = 0.0;
+
+    for(int i = 0; i < options.numClients; i++)
+    {
+        auto &result = results[i];
+
+        if(result.joined)
+        {
+            joinTimes.push_back(std::chrono::duration<double, std::milli>(result.joinTime).count());
+            totalPlayTime += std::chrono::duration<double>(result.playTime).count();
+        }
+        else
+            printf("client %i failed: %s\n", i, result.error.c_str());
+
+        sent += result.messagesSent;
+        received += result.messagesReceived;
+        timeouts += result.timeouts;
+    }
+
+    printf("%zu/%i clients joined in %.3fs\n", joinTimes.size(), options.numClients, elapsed);
+
+    if(!joinTimes.empty())
+    {
+        std::sort(joinTimes.begin(), joinTimes.end());
+
+        auto percentile = [&joinTimes](double p)
+        {
+            return joinTimes[static_cast<size_t>(p * (joinTimes.size() - 1))];
+        };
+
+        printf("join latency: p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n", percentile(0.5), percentile(0.9), percentile(0.99), joinTimes.back());
+    }
+
+    printf("messages: %llu sent, %llu received, %llu timeouts\n", (unsigned long long)sent, (unsigned long long)received, (unsigned long long)timeouts);
+
+    // clients play from when they join until the same end time, so use the average
+    if(totalPlayTime > 0.0)
+        printf("sustained: %.0f msgs/s\n", (sent + received) / (totalPlayTime / joinTimes.size()));
+
+    return joinTimes.size() == static_cast<size_t>(options.numClients) ? 0 : 1;
+}
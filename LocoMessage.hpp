@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdint>
+
+// loco game messages
+
+struct LocoMessageHeader
+{
+    uint32_t dstPlayerId; // with the xor
+    uint32_t srcPlayerId;
+    uint16_t command; // something like that
+    uint16_t magic; // has to be 300
+};
+static_assert(sizeof(LocoMessageHeader) == 12);
+
+struct LocoCmd1002
+{
+    LocoMessageHeader header;
+
+    uint32_t userValue; // written to the .usr file and sent back in later messages
+    uint8_t unk; // does... something?
+};
@@ -0,0 +1,331 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdarg>
+#include <cstdio>
+#include <ctime>
+#include <string>
+
+#include "IniFile.hpp"
+#include "Logger.hpp"
+
+Logger &Logger::get()
+{
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger()
+{
+    for(size_t i = 0; i < ringSize; i++)
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+
+    for(auto &level : levels)
+        level.store(LogLevel::Info, std::memory_order_relaxed);
+}
+
+Logger::~Logger()
+{
+    stop();
+}
+
+void Logger::start()
+{
+    if(running.exchange(true))
+        return;
+
+    thread = std::thread(&Logger::drainThread, this);
+}
+
+void Logger::stop()
+{
+    if(!running.exchange(false))
+        return;
+
+    thread.join();
+
+    // anything left
+    drain();
+}
+
+void Logger::configure(const IniFile &config)
+{
+    auto section = config.getSection("Log");
+
+    // back to the defaults first, so that removing a value works when reloading
+    setLevel(LogLevel::Info);
+
+    if(!section)
+        return;
+
+    LogLevel level;
+
+    // default for everything first
+    auto it = section->find("Level");
+    if(it != section->end())
+    {
+        if(parseLevel(it->second, level))
+            setLevel(level);
+        else
+            LOG_WARNING(General, "bad log level \"%s\"", it->second.c_str());
+    }
+
+    // then per-category overrides
+    for(int i = 0; i < static_cast<int>(LogCategory::Count); i++)
+    {
+        auto category = static_cast<LogCategory>(i);
+        it = section->find(getCategoryName(category));
+
+        if(it == section->end())
+            continue;
+
+        if(parseLevel(it->second, level))
+            setLevel(category, level);
+        else
+            LOG_WARNING(General, "bad log level \"%s\" for %s", it->second.c_str(), getCategoryName(category));
+    }
+}
+
+void Logger::setLevel(LogLevel level)
+{
+    for(auto &l : levels)
+        l.store(level, std::memory_order_relaxed);
+}
+
+void Logger::setLevel(LogCategory category, LogLevel level)
+{
+    levels[static_cast<int>(category)].store(level, std::memory_order_relaxed);
+}
+
+void Logger::log(LogCategory category, LogLevel level, const char *format, ...)
+{
+    auto record = beginRecord();
+
+    if(!record)
+        return;
+
+    record->time = std::chrono::system_clock::now();
+    record->level = level;
+    record->category = category;
+
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(record->text, maxRecordText, format, args);
+    va_end(args);
+
+    // truncated
+    if(len < 0)
+        len = 0;
+    else if(len >= static_cast<int>(maxRecordText))
+        len = maxRecordText - 1;
+
+    record->length = len;
+
+    commitRecord(record);
+}
+
+void Logger::logHex(LogCategory category, LogLevel level, const uint8_t *data, size_t len)
+{
+    if(!isEnabled(category, level))
+        return;
+
+    static const char digits[] = "0123456789ABCDEF";
+    const size_t bytesPerLine = 32;
+
+    for(size_t off = 0; off < len; off += bytesPerLine)
+    {
+        auto record = beginRecord();
+
+        if(!record)
+            return;
+
+        record->time = std::chrono::system_clock::now();
+        record->level = level;
+        record->category = category;
+
+        auto lineLen = std::min(bytesPerLine, len - off);
+        auto out = record->text;
+
+        *out++ = '\t';
+
+        for(size_t i = 0; i < lineLen; i++)
+        {
+            auto b = data[off + i];
+            *out++ = digits[b >> 4];
+            *out++ = digits[b & 0xF];
+            *out++ = ' ';
+        }
+
+        record->length = out - record->text;
+
+        commitRecord(record);
+    }
+}
+
+uint64_t Logger::getDroppedCount() const
+{
+    return dropped.load(std::memory_order_relaxed);
+}
+
+const char *Logger::getLevelName(LogLevel level)
+{
+    switch(level)
+    {
+        case LogLevel::Debug:
+            return "debug";
+        case LogLevel::Info:
+            return "info";
+        case LogLevel::Warning:
+            return "warning";
+        case LogLevel::Error:
+            return "error";
+        case LogLevel::None:
+            return "none";
+    }
+
+    return "";
+}
+
+const char *Logger::getCategoryName(LogCategory category)
+{
+    switch(category)
+    {
+        case LogCategory::General:
+            return "General";
+        case LogCategory::Net:
+            return "Net";
+        case LogCategory::DPlay:
+            return "DPlay";
+        case LogCategory::RP:
+            return "RP";
+        case LogCategory::Loco:
+            return "Loco";
+
+        case LogCategory::Count:
+            break;
+    }
+
+    return "";
+}
+
+bool Logger::parseLevel(std::string_view str, LogLevel &level)
+{
+    for(int i = 0; i <= static_cast<int>(LogLevel::None); i++)
+    {
+        auto name = std::string_view(getLevelName(static_cast<LogLevel>(i)));
+
+        if(name.length() != str.length())
+            continue;
+
+        // case insensitive
+        bool match = true;
+        for(size_t c = 0; c < name.length() && match; c++)
+            match = name[c] == std::tolower(str[c]);
+
+        if(match)
+        {
+            level = static_cast<LogLevel>(i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+Logger::Record *Logger::beginRecord()
+{
+    // bounded MPMC queue (only ever one consumer)
+    auto pos = writePos.load(std::memory_order_relaxed);
+
+    while(true)
+    {
+        auto record = &ring[pos & (ringSize - 1)];
+        auto seq = record->sequence.load(std::memory_order_acquire);
+        auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+        if(diff == 0)
+        {
+            if(writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                return record;
+        }
+        else if(diff < 0)
+        {
+            // full
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        else
+            pos = writePos.load(std::memory_order_relaxed);
+    }
+}
+
+void Logger::commitRecord(Record *record)
+{
+    auto pos = record->sequence.load(std::memory_order_relaxed);
+    record->sequence.store(pos + 1, std::memory_order_release);
+
+    // nothing to drain it, do it now
+    if(!running.load(std::memory_order_relaxed))
+        drain();
+}
+
+void Logger::drainThread()
+{
+    while(running.load(std::memory_order_relaxed))
+    {
+        if(!drain())
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+}
+
+size_t Logger::drain()
+{
+    // only one thread can consume
+    if(draining.exchange(true, std::memory_order_acquire))
+        return 0;
+
+    std::string out, err;
+    size_t count = 0;
+
+    while(true)
+    {
+        auto record = &ring[readPos & (ringSize - 1)];
+        auto seq = record->sequence.load(std::memory_order_acquire);
+
+        if(seq != readPos + 1)
+            break;
+
+        // format the prefix
+        auto time = std::chrono::system_clock::to_time_t(record->time);
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(record->time.time_since_epoch()).count() % 1000;
+
+        struct tm tm;
+        localtime_r(&time, &tm);
+
+        char prefix[64];
+        int prefixLen = snprintf(prefix, sizeof(prefix), "%02i:%02i:%02i.%03i [%s] %s: ", tm.tm_hour, tm.tm_min, tm.tm_sec, int(ms),
+                                 getCategoryName(record->category), getLevelName(record->level));
+
+        auto &dest = record->level >= LogLevel::Warning ? err : out;
+        dest.append(prefix, prefixLen).append(record->text, record->length).append("\n");
+
+        record->sequence.store(readPos + ringSize, std::memory_order_release);
+        readPos++;
+        count++;
+    }
+
+    if(!out.empty())
+    {
+        fwrite(out.data(), 1, out.length(), stdout);
+        fflush(stdout);
+    }
+
+    if(!err.empty())
+    {
+        fwrite(err.data(), 1, err.length(), stderr);
+        fflush(stderr);
+    }
+
+    draining.store(false, std::memory_order_release);
+
+    return count;
+}
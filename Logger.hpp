@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <thread>
+
+class IniFile;
+
+enum class LogLevel : uint8_t
+{
+    Debug,
+    Info,
+    Warning,
+    Error,
+    None, // only used as a filter
+};
+
+enum class LogCategory : uint8_t
+{
+    General,
+    Net,
+    DPlay,
+    RP,
+    Loco,
+
+    Count
+};
+
+// formats records into a fixed size lock-free ring, a background thread writes them out
+// if the ring is full, records are dropped instead of blocking the caller
+class Logger final
+{
+public:
+    static Logger &get();
+
+    ~Logger();
+
+    void start();
+    void stop();
+
+    void configure(const IniFile &config);
+
+    void setLevel(LogLevel level);
+    void setLevel(LogCategory category, LogLevel level);
+
+    bool isEnabled(LogCategory category, LogLevel level) const
+    {
+        return level >= levels[static_cast<int>(category)].load(std::memory_order_relaxed);
+    }
+
+    void log(LogCategory category, LogLevel level, const char *format, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 4, 5)))
+#endif
+    ;
+
+    // one record per line of 32 bytes
+    void logHex(LogCategory category, LogLevel level, const uint8_t *data, size_t len);
+
+    uint64_t getDroppedCount() const;
+
+    static const char *getLevelName(LogLevel level);
+    static const char *getCategoryName(LogCategory category);
+
+    static bool parseLevel(std::string_view str, LogLevel &level);
+
+private:
+    static constexpr size_t ringSize = 4096; // must be a power of two
+    static constexpr size_t maxRecordText = 232;
+
+    struct Record
+    {
+        std::atomic<size_t> sequence;
+
+        std::chrono::system_clock::time_point time;
+        LogLevel level;
+        LogCategory category;
+        uint16_t length;
+        char text[maxRecordText];
+    };
+
+    Logger();
+
+    Record *beginRecord();
+    void commitRecord(Record *record);
+
+    void drainThread();
+    size_t drain();
+
+    Record ring[ringSize];
+
+    alignas(64) std::atomic<size_t> writePos{0};
+    alignas(64) size_t readPos = 0;
+
+    std::atomic<uint64_t> dropped{0};
+
+    std::atomic<LogLevel> levels[static_cast<int>(LogCategory::Count)];
+
+    std::atomic<bool> draining{false};
+
+    std::atomic<bool> running{false};
+    std::thread thread;
+};
+
+// these check the level before doing any formatting
+#define LOG(category, level, ...) \
+    do { \
+        auto &logger_ = Logger::get(); \
+        if(logger_.isEnabled(LogCategory::category, LogLevel::level)) \
+            logger_.log(LogCategory::category, LogLevel::level, __VA_ARGS__); \
+    } while(0)
+
+#define LOG_DEBUG(category, ...) LOG(category, Debug, __VA_ARGS__)
+#define LOG_INFO(category, ...) LOG(category, Info, __VA_ARGS__)
+#define LOG_WARNING(category, ...) LOG(category, Warning, __VA_ARGS__)
+#define LOG_ERROR(category, ...) LOG(category, Error, __VA_ARGS__)
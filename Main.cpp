@@ -1,1234 +1,770 @@
-#include <cassert>
-#include <charconv>
+#include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <vector>
 
 #include <arpa/inet.h>
+#include <signal.h>
 #include <sys/select.h>
 
+#include "Capture.hpp"
+#include "Client.hpp"
+#include "Clock.hpp"
+#include "ConfigWatcher.hpp"
 #include "DirectPlayMessage.hpp"
+#include "HotRestart.hpp"
 #include "IniFile.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "Pipeline.hpp"
+#include "PostcardStore.hpp"
+#include "Probes.hpp"
+#include "ServerLoop.hpp"
+#include "ServerMetrics.hpp"
+#include "Session.hpp"
 #include "Socket.hpp"
+#include "Trace.hpp"
+#include "UserRegistry.hpp"
 
-// loco game messages
+static constexpr auto clientReportInterval = std::chrono::seconds(1);
 
-struct LocoMessageHeader
-{
-    uint32_t dstPlayerId; // with the xor
-    uint32_t srcPlayerId;
-    uint16_t command; // something like that
-    uint16_t magic; // has to be 300
-};
-static_assert(sizeof(LocoMessageHeader) == 12);
-
-struct LocoCmd1002
-{
-    LocoMessageHeader header;
+// per shared UDP socket per main loop iteration, so one busy socket can't hold everything else up
+static constexpr int maxSharedUDPReads = 64;
 
-    uint32_t userValue; // written to the .usr file and sent back in later messages
-    uint8_t unk; // does... something?
-};
+static volatile sig_atomic_t quitRequested = 0;
 
-
-static std::u16string convertUTF8ToUCS2(std::string_view u8)
+static void handleQuitSignal(int)
 {
-    std::u16string ret;
-    ret.reserve(u8.size()); // pessimistic
+    quitRequested = 1;
+}
 
-    auto end = u8.end();
+static std::vector<std::string> getDebugClients(const IniFile &config)
+{
+    std::vector<std::string> debugClients;
+    auto debugClientsValue = config.getValue("Log", "DebugClients");
 
-    for(auto it = u8.begin(); it != end; ++it)
+    if(debugClientsValue)
     {
-        auto c = static_cast<unsigned>(*it);
-        if(c < 0x80)
-            ret += c;
-        else if((c & 0xE0) == 0xC0)
+        auto str = *debugClientsValue;
+        while(!str.empty())
         {
-            // two byte seq
-            if(++it == end)
-                break;
+            auto end = str.find_first_of(", ");
+            if(end != 0)
+                debugClients.emplace_back(str.substr(0, end));
 
-            auto c1 = static_cast<unsigned>(*it);
-            ret += static_cast<char16_t>((c & 0x1F) << 6 | (c1 & 0x3F));
-        }
-        else if((c & 0xF0) == 0xE0)
-        {
-            // three bytes
-            if(++it == end)
+            if(end == std::string_view::npos)
                 break;
 
-            auto c1 = static_cast<unsigned>(*it);
-            if(++it == end)
-                break;
-
-            auto c2 = static_cast<unsigned>(*it);
-
-            ret += static_cast<char16_t>((c & 0x0F) << 12 | (c1 & 0x3F) << 6 | (c2 & 0x3F));
+            str.remove_prefix(end + 1);
         }
-        else
-            break;
     }
 
-    return ret;
+    return debugClients;
 }
 
-static std::string convertUCS2ToUTF8(std::u16string_view u16)
+static uint32_t getSessionFlags(const IniFile &config)
 {
-    std::string ret;
-    ret.reserve(u16.length()); // optimistic
+    // copying values returned by game in a regular multiplayer session...
+    uint32_t sessionFlags = DPSession_ReliableProtocol | DPSession_OptimiseLatency;
 
-    for(auto &c : u16)
-    {
-        assert(c < 0xD800 || c >= 0xE000); // not UTF-16, no surrogates
+    // for clients that can't reach each other (NAT), messages between players go through us
+    if(config.getIntValue("Server", "RouteThroughHost").value_or(0))
+        sessionFlags |= DPSession_RouteThroughHost;
 
-        if(c <= 0x7F)
-            ret += static_cast<char>(c);
-        else if(c <= 0x7FF)
-        {
-            ret += static_cast<char>(0xC0 | c >> 6);
-            ret += static_cast<char>(0x80 | (c & 0x3F));
-        }
-        else // <= 0xFFFF
-        {
-            ret += static_cast<char>(0xE0 | c >> 12);
-            ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
-            ret += static_cast<char>(0x80 | (c & 0x3F));
-        }
-    }
+    // clients ping each other (and us), dropping players that stop answering
+    if(config.getIntValue("Latency", "KeepAlive").value_or(0))
+        sessionFlags |= DPSession_PingTimer;
 
-    return ret;
+    return sessionFlags;
 }
 
-class Player final
+// the flags that getSessionFlags can change
+static constexpr uint32_t configSessionFlags = DPSession_RouteThroughHost | DPSession_PingTimer;
+
+static LatencyLimits getLatencyLimits(const IniFile &config)
 {
-public:
-    Player(uint32_t id, uint32_t systemPlayerId, uint32_t flags) : id(id), flags(flags), systemPlayerId(systemPlayerId)
-    {
-    }
+    LatencyLimits limits;
 
-    ~Player()
-    {
-        delete[] serviceProviderData;
-        delete[] data;
-    }
+    limits.pingIntervalMs = config.getIntValue("Latency", "PingInterval").value_or(limits.pingIntervalMs);
+    limits.maxJoinRTTMs = config.getIntValue("Latency", "MaxJoinRTT").value_or(limits.maxJoinRTTMs);
+    limits.degradedRTTMs = config.getIntValue("Latency", "DegradedRTT").value_or(limits.degradedRTTMs);
+    limits.degradedJitterMs = config.getIntValue("Latency", "DegradedJitter").value_or(limits.degradedJitterMs);
+    limits.degradedLostPings = config.getIntValue("Latency", "DegradedLostPings").value_or(limits.degradedLostPings);
 
-    uint32_t getId() const
-    {
-        return id;
-    }
+    return limits;
+}
 
-    uint32_t getSystemPlayerId() const
-    {
-        return systemPlayerId;
-    }
+static ClientTimeouts getClientTimeouts(const IniFile &config)
+{
+    ClientTimeouts timeouts;
 
-    uint32_t getFlags() const
-    {
-        return flags;
-    }
+    timeouts.idleSeconds = config.getIntValue("Server", "ClientTimeout").value_or(timeouts.idleSeconds);
+    timeouts.handshakeSeconds = config.getIntValue("Server", "HandshakeTimeout").value_or(timeouts.handshakeSeconds);
 
-    void setShortName(std::string name)
-    {
-        shortName = std::move(name);
-    }
+    return timeouts;
+}
 
-    void setLongName(std::string name)
-    {
-        longName = std::move(name);
-    }
+static MemoryLimits getMemoryLimits(const IniFile &config)
+{
+    MemoryLimits limits;
 
-    uint32_t getServiceProviderDataLen() const
-    {
-        return serviceProviderDataLen;
-    }
+    limits.clientBytes = config.getIntValue("Limits", "ClientMemoryKB").value_or(limits.clientBytes / 1024) * size_t(1024);
+    limits.sessionBytes = config.getIntValue("Limits", "SessionMemoryKB").value_or(limits.sessionBytes / 1024) * size_t(1024);
+    limits.messageBytes = config.getIntValue("Limits", "MaxMessageKB").value_or(limits.messageBytes / 1024) * size_t(1024);
 
-    const uint8_t *getServiceProviderData() const
-    {
-        return serviceProviderData;
-    }
+    return limits;
+}
 
-    void setServiceProviderData(const uint8_t *data, uint32_t len)
-    {
-        delete[] serviceProviderData;
+// one section per socket role
+static SocketOptions getSocketOptions(const IniFile &config, std::string_view section)
+{
+    SocketOptions options;
 
-        serviceProviderData = new uint8_t[len];
-        serviceProviderDataLen = len;
+    options.receiveBuffer = config.getIntValue(section, "ReceiveBuffer");
+    options.sendBuffer = config.getIntValue(section, "SendBuffer");
 
-        memcpy(serviceProviderData, data, len);
-    }
+    if(auto noDelay = config.getIntValue(section, "NoDelay"))
+        options.noDelay = *noDelay != 0;
 
-private:
-    uint32_t id;
-    uint32_t flags;
+    options.dscp = config.getIntValue(section, "DSCP");
+    options.busyPoll = config.getIntValue(section, "BusyPoll");
+    options.maxReceiveBuffer = config.getIntValue(section, "AutoTuneMax").value_or(0);
+    options.timestamps = config.getIntValue(section, "Timestamps").value_or(0) != 0;
 
-    uint32_t systemPlayerId;
+    return options;
+}
 
-    std::string shortName, longName;
+static PipelineConfig getPipelineConfig(const IniFile &config)
+{
+    PipelineConfig pipelineConfig;
 
-    uint8_t *serviceProviderData = nullptr;
-    uint32_t serviceProviderDataLen = 0;
+    pipelineConfig.ioThreads = config.getIntValue("Pipeline", "IOThreads").value_or(0);
+    pipelineConfig.logicThreadCPU = config.getIntValue("Pipeline", "LogicThreadCPU").value_or(-1);
 
-    uint8_t *data = nullptr;
-    uint32_t dataLen;
-};
+    // comma separated, in thread order
+    auto cpus = config.getValue("Pipeline", "IOThreadCPUs").value_or("");
 
-class Session final
-{
-public:
-    Session(std::string name, uint8_t *appGUID, uint32_t flags) : name(std::move(name)), flags(flags)
+    while(!cpus.empty())
     {
-        memset(guid, 1, 16); // TODO: generate valid guid
-        memcpy(this->appGUID, appGUID, 16);
+        auto end = cpus.find_first_of(", ");
+        if(end != 0)
+            pipelineConfig.ioThreadCPUs.push_back(atoi(std::string(cpus.substr(0, end)).c_str()));
 
-        startTime = std::chrono::steady_clock::now();
-    }
+        if(end == std::string_view::npos)
+            break;
 
-    const uint8_t *getGUID() const
-    {
-        return guid;
+        cpus.remove_prefix(end + 1);
     }
 
-    const uint8_t *getAppGUID() const
-    {
-        return appGUID;
-    }
+    return pipelineConfig;
+}
 
-    const std::string &getName() const
-    {
-        return name;
-    }
+// grows receive buffers that are overflowing
+static void autoTuneSocket(Socket &socket, const std::string &name)
+{
+    uint32_t newDrops;
+    auto size = socket.autoTuneReceiveBuffer(newDrops);
 
-    uint32_t getFlags() const
-    {
-        return flags;
-    }
+    if(newDrops)
+        serverMetrics.socketDrops->inc(newDrops);
 
-    uint32_t getMaxPlayers() const
+    if(size)
     {
-        return maxPlayers;
+        LOG_INFO(Net, "%s dropped %u packets, receive buffer now %i bytes", name.c_str(), newDrops, size);
+        serverMetrics.socketBufferGrows->inc();
     }
+}
 
-    uint32_t getCurrentPlayers() const
+static const char *getJoinStateName(JoinState state)
+{
+    switch(state)
     {
-        // count non-system players
-        uint32_t ret = 0;
-        for(auto &player : players)
-        {
-            if(!(player.second.getFlags() & DPPlayer_System))
-                ret++;
-        }
-        return ret;
+        case JoinState::New:
+            return "new";
+        case JoinState::SystemPlayer:
+            return "system_player";
+        case JoinState::PlayerList:
+            return "player_list";
+        case JoinState::Joined:
+            return "joined";
     }
 
-    uint32_t getIdXor() const
-    {
-        return idXor;
-    }
+    return "unknown";
+}
 
-    uint32_t adjustId(uint32_t id) const
-    {
-        return id ^ idXor;
-    }
+// plain text table for the metrics server
+static std::string getClientReport(const std::map<std::string, Client> &clients)
+{
+    std::string report = "# address system_player rtt_ms srtt_ms jitter_ms min_ms max_ms pings lost tcp_rtt_ms degraded queue_ms queue_max_ms ack_ms ack_max_ms state mem_bytes\n";
+    char line[256];
 
-    uint32_t getTickCount() const
+    for(auto &client : clients)
     {
-        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime).count();
-    }
+        auto &stats = client.second.getLatencyStats();
 
-    Player &createNewSystemPlayer(uint32_t flags = 0)
-    {
-        auto newId = allocPlayerId();
-        return players.emplace(newId, Player{newId, newId, flags | DPPlayer_System}).first->second;
-    }
+        auto &queueDelay = client.second.getQueueDelayStats();
+        auto &ackDelay = client.second.getAckDelayStats();
 
-    Player &createNewPlayer(uint32_t systemPlayerId, uint32_t flags = 0)
-    {
-        auto newId = allocPlayerId();
-        return players.emplace(newId, Player{newId, systemPlayerId, flags}).first->second;
+        snprintf(line, sizeof(line), "%s %u %u %.1f %.1f %u %u %u %u %u %i %.3f %.3f %.3f %.3f %s %zu\n", client.first.c_str(), client.second.getSystemPlayerId(),
+                 stats.getLastRTT(), stats.getSmoothedRTT(), stats.getJitter(), stats.getMinRTT(), stats.getMaxRTT(), stats.getSampleCount(),
+                 stats.getLostCount(), client.second.getTCPRTTMs(), client.second.isDegraded(),
+                 queueDelay.getMeanMs(), queueDelay.getMaxMs(), ackDelay.getMeanMs(), ackDelay.getMaxMs(),
+                 getJoinStateName(client.second.getJoinState()), client.second.getMemoryUsage() + client.second.getPlayerMemoryUsage());
+        report += line;
     }
 
-    void deletePlayer(uint32_t id)
-    {
-        auto it = players.find(id);
-
-        if(it == players.end())
-            return;
+    return report;
+}
 
-        if(it->second.getFlags() & DPPlayer_System)
-        {
-            // system player, remove all non-system players
-            // this also includes the system player as its system player is itself...
-            for(auto it2 = players.begin(); it2 != players.end();)
-            {
-                if(it2->second.getSystemPlayerId() == id)
-                    it2 = players.erase(it2);
-                else
-                    ++it2;
-            }
-        }
-        else
-            players.erase(it);
-    }
+// values that can change while running, everything else needs a restart
+static bool isLiveConfigKey(std::string_view key)
+{
+    return key == "Server/SessionName" || key == "Server/MaxPlayers" || key == "Server/RouteThroughHost" || key == "Server/ClientTimeout"
+        || key == "Server/HandshakeTimeout" || key == "Server/FlushInterval" || key.compare(0, 4, "Log/") == 0
+        || key.compare(0, 8, "Latency/") == 0 || key.compare(0, 6, "Trace/") == 0 || key.compare(0, 7, "Limits/") == 0;
+}
 
-    Player *getPlayer(uint32_t id)
-    {
-        auto it = players.find(id);
+// applies everything or nothing, returns false if the new config was rejected
+// anything that needs a restart is put back to the old value in newConfig, so that it's what's in effect and still differs next time
+static bool applyConfig(const IniFile &oldConfig, IniFile &newConfig, Session &session, std::map<std::string, Client> &clients,
+                        std::vector<std::string> &debugClients)
+{
+    auto changes = oldConfig.diff(newConfig);
 
-        if(it != players.end())
-            return &it->second;
+    if(changes.empty())
+        return true;
 
-        return nullptr;
-    }
+    auto sessionName = newConfig.getValue("Server", "SessionName");
 
-    const std::map<uint32_t, Player> &getPlayers() const
+    if(!sessionName || sessionName->empty())
     {
-        return players;
+        LOG_WARNING(General, "config reload: no session name, ignoring the new config");
+        return false;
     }
 
-    Player *getLocalSystemPlayer()
+    int liveChanges = 0;
+
+    for(auto &key : changes)
     {
-        for(auto &player : players)
+        if(isLiveConfigKey(key))
         {
-            auto playerFlags = player.second.getFlags();
-            if((playerFlags & DPPlayer_System) && (playerFlags & DPPlayer_SendingMachine))
-                return &player.second;
+            liveChanges++;
+            continue;
         }
 
-        return nullptr;
-    }
+        LOG_WARNING(General, "config reload: %s changed, this needs a restart", key.c_str());
 
-private:
-    uint32_t allocPlayerId()
-    {
-        // TODO: less bad id alloc
-        // should be "a zero-based value not shared by an existing identifier" | "a zero-based value that is incremented to provide uniqueness" << 16
-        uint32_t newId = players.size() | idUnique << 16;
-        
-        while(players.find(newId) != players.end())
-            newId++;
-
-        return newId;   
+        auto split = key.find('/');
+        auto section = std::string_view(key).substr(0, split), name = std::string_view(key).substr(split + 1);
+        newConfig.setValue(section, name, oldConfig.getValue(section, name));
     }
 
-    uint8_t guid[16];
-    uint8_t appGUID[16];
-
-    std::string name;
-    uint32_t flags;
+    if(!liveChanges)
+        return true;
 
-    uint32_t maxPlayers = 10; // TODO
-    uint32_t idXor = 0; // TODO: init
-    uint32_t idUnique = 1; // TODO: incremented at some point
+    session.setName(std::string(*sessionName));
+    session.setMaxPlayers(newConfig.getIntValue("Server", "MaxPlayers").value_or(10));
 
-    std::chrono::steady_clock::time_point startTime;
+    // only the flags we set from the config
+    session.setFlags((session.getFlags() & ~configSessionFlags) | (getSessionFlags(newConfig) & configSessionFlags));
 
-    std::map<uint32_t, Player> players;
-};
+    Logger::get().configure(newConfig);
+    Tracer::get().configure(newConfig);
 
-class Client final
-{
-public:
-    Client(Session &session, std::string address, int outgoingPort) : session(session), address(std::move(address)), outgoingPort(outgoingPort), tcpIncoming(SocketType::TCP), tcpOutgoing(SocketType::TCP), udpSocket(SocketType::UDP)
-    {
-    }
+    Client::setLatencyLimits(getLatencyLimits(newConfig));
+    Client::setTimeouts(getClientTimeouts(newConfig));
+    Client::setMemoryLimits(getMemoryLimits(newConfig));
+    Client::setFlushInterval(std::chrono::milliseconds(newConfig.getIntValue("Server", "FlushInterval").value_or(0)));
 
-    Client(Client &&other) : Client(other.session, other.address, other.outgoingPort)
-    {
-        *this = std::move(other);
-    }
+    debugClients = getDebugClients(newConfig);
 
-    ~Client()
-    {
-        if(systemPlayerId != ~0u)
-            session.deletePlayer(systemPlayerId);
-    }
+    for(auto &client : clients)
+        client.second.setDebug(std::find(debugClients.begin(), debugClients.end(), client.first) != debugClients.end());
 
-    Client &operator=(Client &&other)
-    {
-        if(this != &other)
-        {
-            session = other.session;
+    LOG_INFO(General, "config reload: applied %i changes", liveChanges);
 
-            address = std::move(other.address);
-    
-            outgoingPort = other.outgoingPort;
-            tcpIncoming = std::move(other.tcpIncoming);
-            tcpOutgoing = std::move(other.tcpOutgoing);
-    
-            systemPlayerId = other.systemPlayerId;
+    return true;
+}
 
-            other.systemPlayerId = -1;
-        }
+int main(int argc, char *argv[])
+{
+    // get config
+    IniFile config("./config.ini");
 
-        return *this;
-    }
+    auto port = config.getIntValue("Server", "Port");
+    auto addr = config.getValue("Server", "ListenAddr");
+    auto sessionName = config.getValue("Server", "SessionName");
+    auto guid = config.getValue("Server", "AppGUID");
 
-    bool handleDPlayPacket(const uint8_t *data, size_t &len)
+    if(!port || !addr || !sessionName || !guid)
     {
-        if(len < sizeof(DPSPMessageHeader))
-        {
-            // not enough data for a header
-            len = 0;
-            return false;
-        }
-
-        // something something byte-order something
-        auto header = reinterpret_cast<const DPSPMessageHeader *>(data);
-
-        auto packetSize = header->sizeToken & 0xFFFFF;
-        //auto token = header->sizeToken >> 20;
-
-        if(len < packetSize)
-        {
-            // not enough data
-            len = packetSize;
-            return false;
-        }
-
-        len = packetSize;
-
-        if(memcmp(header->signature, "play", 4) != 0)
-            return false;
+        std::cerr << "failed to get config from config.ini\n";
+        std::cerr << "port: " << port.value_or(-1) << ", addr: " << addr.value_or("MISSING") 
+                  << ", session name: " << sessionName.value_or("MISSING") << ", guid: " << guid.value_or("MISSING") << "\n";
+        return 1;
+    }
 
-        // only handle dx9
-        if(header->version != 14)
-            return false;
+    // parse guid
+    uint8_t appGUID[16];
 
-        return handleDPlayCommand(header->command, data + sizeof(DPSPMessageHeader), len - sizeof(DPSPMessageHeader));
+    if(guid->length() != 36)
+    {
+        std::cerr << "invalid GUID " << *guid << "(" << guid->length() << ")\n";
+        return 1;
     }
 
-    void handleUDPRead()
+    if(!parseGUID(*guid, appGUID))
     {
-        // this is for data received after joining a session
-        uint8_t buf[2048];
-        int len = udpSocket.recv(buf, sizeof(buf));
-        
-        // zero for disconnected is a tcp thing...?
-        if(len <= 0)
-            return;
+        std::cerr << "failed to pares GUID " << *guid << "\n";
+        return 1;
+    }
 
-        // assume we're using the "reliable protocol"
+    // optional args
+    bool hotRestart = false;
 
-        if(len < 6)
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
         {
-            std::cerr << "short frame? " << len << "\n";
-            return;
+            auto capturePath = argv[++i];
+            if(!CaptureWriter::get().open(capturePath))
+            {
+                std::cerr << "failed to open capture file " << capturePath << "\n";
+                return 1;
+            }
         }
-
-        auto ptr = buf;
-        auto end = ptr + len;
-
-        // variable length ids
-        uint16_t fromId, toId;
-
-        fromId = *ptr++;
-
-        if(fromId & 0x80)
-            fromId = (fromId & 0x7F) | (*ptr++) << 7;
-
-        if(fromId & 0x4000)
-            fromId = (fromId & 0x3FF) | (*ptr++) << 14;
-
-        toId = *ptr++;
-
-        if(toId & 0x80)
-            toId = (toId & 0x7F) | (*ptr++) << 7;
-
-        if(toId & 0x4000)
-            toId = (toId & 0x3FF) | (*ptr++) << 14;
-
-        size_t idLen = ptr - buf; // not counted in total data
-
-        // make sure we have enough for the rest of the header
-        if(end - ptr < 4)
+        else if(strcmp(argv[i], "--hot-restart") == 0)
+            hotRestart = true;
+        else
         {
-            std::cerr << "short frame? " << len << "\n";
-            return;
+            std::cerr << "unknown argument " << argv[i] << "\n";
+            return 1;
         }
+    }
 
-        uint8_t flags = *ptr++;
-        uint8_t messageId = *ptr++;
-        uint8_t sequence = *ptr++;
-        uint8_t serial = *ptr++;
+    auto restartPath = config.getValue("Server", "RestartSocket");
 
-        if(flags & DPRPFrame_Extended)
-        {
-            std::cerr << "ext flags\n";
-            return;
-        }
+    if(hotRestart && !restartPath)
+    {
+        std::cerr << "--hot-restart needs RestartSocket in config.ini\n";
+        return 1;
+    }
 
-        size_t dataLen = end - ptr;
+    Logger::get().configure(config);
+    Logger::get().start();
 
-        dataReceived += len - idLen;
+    Tracer::get().configure(config);
 
-        // validate player indices
-        if(toId != 0)
-        {
-            std::cerr << "frame to " << toId << "\n";
-            return;
-        }
+    LOG_INFO(General, "starting server on %.*s, port %i, app guid: %.*s, session name: %.*s", int(addr->length()), addr->data(), *port,
+             int(guid->length()), guid->data(), int(sessionName->length()), sessionName->data());
 
-        // check message id
-        // if no ongoing/completed recv, first recv = message id
-        // if message id outside first ongoing/completed recv -> +23, discard
-        // if not receiving this id, add to list
-        // if already received, send ack (prev one got lost)
+    // clients to log everything for
+    auto debugClients = getDebugClients(config);
 
-        // send nack if unexpected sequence
-        // ... or don't as sequence numbers are always 1 and nacks are unimplemented?
+    // take over from a running server, its sockets and state replace the usual setup
+    HotRestart restart;
+    std::string restartPathStr(restartPath.value_or(""));
+    std::vector<uint8_t> restartState;
+    std::vector<int> restartFds;
+    auto takeOverStart = std::chrono::steady_clock::now();
 
-        if(flags & DPRPFrame_Ack)
-        {
-            std::cout << "rp ack" << std::endl;
-        }
-        else if((flags & DPRPFrame_Start) && (flags & DPRPFrame_End))
-        {
-            // single frame message, avoid all the copying
-            handleCompletedRPMessage(ptr, dataLen);
-        }
-        else
-        {
-            // basic message assembly
-            if(flags & DPRPFrame_Start)
-            {
-                if(currentMessageId != -1)
-                    std::cerr << "rp multi msg\n";
+    if(hotRestart && !restart.takeOver(restartPathStr.c_str(), restartState, restartFds))
+    {
+        LOG_ERROR(General, "failed to take over from the server at %s", restartPathStr.c_str());
+        Logger::get().stop();
+        return 1;
+    }
 
-                currentMessageId = messageId;
-                nextMessageSequence = sequence + 1;
+    StateReader restartReader(restartState, restartFds);
 
-                // copy initial data
-                messageBuffer.resize(dataLen);
-                memcpy(messageBuffer.data(), ptr, dataLen);
-            }
-            else if(sequence == nextMessageSequence)
-            {
-                // append
-                auto offset = messageBuffer.size();
-                messageBuffer.resize(offset + dataLen);
-                memcpy(messageBuffer.data() + offset, ptr, dataLen);
-
-                nextMessageSequence++;
-            }
-            else
-            {
-                std::cerr << "rp seq err\n";
-                return;
-            }
-            
-            if(flags & DPRPFrame_End)
-            {
-                handleCompletedRPMessage(messageBuffer.data(), messageBuffer.size());
-                currentMessageId = -1;
-            }
-        }
+    // setup sockets
+    Socket tcpListen(SocketType::TCP);
+    Socket udpListen(SocketType::UDP);
 
-        // send ack if requested or end of message
-        if(flags & (DPRPFrame_End | DPRPFrame_SendAck))
-        {
-            // send ack
-            uint8_t replyFlags = DPRPFrame_Ack | (flags & DPRPFrame_Reliable); // reliably ack a reliable packet
-            auto replySize = getRPHeaderSize(toId, fromId) + 8;
-            auto replyBuf = new uint8_t[replySize];
+    // annoying, but not as annoying as trying to pass a string_view to inet_pton
+    std::string addrStr(*addr);
 
-            auto ptr = fillRPHeader(replyBuf, toId, fromId, replyFlags, messageId, sequence, serial);
+    // RP frames for all clients, instead of a connected socket each, the kernel spreads clients over them by address
+    std::vector<Socket> sharedUDP;
 
-            *reinterpret_cast<uint32_t *>(ptr) = dataReceived;
-            *reinterpret_cast<uint32_t *>(ptr + 4) = session.getTickCount();
+    if(hotRestart)
+    {
+        tcpListen = Socket(SocketType::TCP, restartReader.readFd());
+        udpListen = Socket(SocketType::UDP, restartReader.readFd());
 
-            if(!udpSocket.send(replyBuf, replySize))
-            {
-                std::cerr << "Failed to send ack!\n";
-            }
+        // the clients that joined through these still need them, whatever the config says
+        auto sharedCount = restartReader.read<uint32_t>();
 
-            delete[] replyBuf;
-        }
+        for(uint32_t i = 0; i < sharedCount && !restartReader.hasFailed(); i++)
+            sharedUDP.emplace_back(SocketType::UDP, restartReader.readFd());
     }
-
-    Socket &getTCPIncomingSocket()
+    else if(!tcpListen.listen(addrStr.c_str(), *port))
     {
-        return tcpIncoming;
+        LOG_ERROR(Net, "failed to listen on port %i", *port);
+        return 1;
     }
-
-    void setTCPIncomingSocket(Socket &&socket)
+    // directplay broadcast port
+    else if(!udpListen.bind(addrStr.c_str(), 47624))
     {
-        tcpIncoming = std::move(socket);
+        LOG_ERROR(Net, "failed to bind broadcast port");
+        return 1;
     }
-
-    Socket &getUDPSocket()
+    else
     {
-        return udpSocket;
-    }
+        int sharedCount = config.getIntValue("Server", "SharedUDPSockets").value_or(0);
 
-private:
-    bool handleDPlayCommand(DPSPCommand command, const uint8_t *data, size_t len)
-    {
-        // data/len don't include header here
-        switch(command)
+        for(int i = 0; i < sharedCount; i++)
         {
-            case DPSPCommand::EnumSessions:
+            if(!sharedUDP.emplace_back(SocketType::UDP).bind(addrStr.c_str(), *port, sharedCount > 1))
             {
-                auto cmd = reinterpret_cast<const DPSPMessageEnumSessions *>(data);
-                // TODO: password?
-                std::cout << "enum sessions " << cmd->passwordOffset << " " << cmd->flags << std::endl;
-
-                // don't reply if app mismatch
-                if(memcmp(cmd->applicationGUID, session.getAppGUID(), 16) != 0)
-                {
-                    std::cerr << "app guid mismatch\n";
-                    return true;
-                }
-
-                // reply
-                if(checkOutgoingSocket())
-                {
-                    auto sessionName = convertUTF8ToUCS2(session.getName());
-                    size_t replySize = sizeof(DPSPMessageHeader) + sizeof(DPSPMessageEnumSessionsReply) + (sessionName.length() + 1) * 2;
-
-                    auto replyBuffer = new uint8_t[replySize];
-                    auto header = reinterpret_cast<DPSPMessageHeader *>(replyBuffer);
-                    auto replyMessage = reinterpret_cast<DPSPMessageEnumSessionsReply *>(replyBuffer + sizeof(DPSPMessageHeader));
-
-                    fillOutgoingHeader(header, replySize, DPSPCommand::EnumSessionsReply);
-                    fillSessionDesc(&replyMessage->sessionDescription);
-
-                    replyMessage->nameOffset = sizeof(DPSPMessageEnumSessionsReply) + 8;
-
-                    // copy the name
-                    memcpy(replyBuffer + sizeof(DPSPMessageHeader) + sizeof(DPSPMessageEnumSessionsReply), sessionName.data(), sessionName.length() * 2);
-                    replyBuffer[replySize - 2] = 0;
-                    replyBuffer[replySize - 1] = 0;
-
-                    if(!tcpOutgoing.sendAll(replyBuffer, replySize))
-                    {
-                        std::cerr << "Failed to send enum sessions reply!\n";
-                    }
-
-                    delete[] replyBuffer;
-                }
-                return true;
+                LOG_ERROR(Net, "failed to bind shared UDP socket %i on port %i", i, *port);
+                return 1;
             }
+        }
+    }
 
-            case DPSPCommand::RequestPlayerId:
-            {
-                auto cmd = reinterpret_cast<const DPSPMessageRequestPlayerId *>(data);
-
-                bool isSystem = cmd->flags & RequestPlayerId_System;
-
-                if(isSystem && systemPlayerId != ~0u)
-                {
-                    std::cerr << "client requesting system player id when they already have one\n";
-                    return true;
-                }
-
-                std::cout << "req player id " << isSystem << std::endl;
-
-                auto &newPlayer = isSystem ? session.createNewSystemPlayer() : session.createNewPlayer(systemPlayerId);
-                
-                if(isSystem)
-                    systemPlayerId = newPlayer.getId();
-
-                if(checkOutgoingSocket())
-                {
-                    size_t replySize = sizeof(DPSPMessageHeader) + sizeof(DPSPMessageRequestPlayerReply);
-
-                    auto replyBuffer = new uint8_t[replySize];
-                    auto header = reinterpret_cast<DPSPMessageHeader *>(replyBuffer);
-                    auto replyMessage = reinterpret_cast<DPSPMessageRequestPlayerReply *>(replyBuffer + sizeof(DPSPMessageHeader));
-
-                    fillOutgoingHeader(header, replySize, DPSPCommand::RequestPlayerReply);
-
-                    // zero out security info
-                    memset(replyMessage, 0, sizeof(DPSPMessageRequestPlayerReply));
-
-                    replyMessage->id = session.adjustId(newPlayer.getId());
-
-                    if(!tcpOutgoing.sendAll(replyBuffer, replySize))
-                    {
-                        std::cerr << "Failed to send request id reply!\n";
-                    }
-                    delete[] replyBuffer;
-                }
-                return true;
-            }
-
-            case DPSPCommand::CreatePlayer:
-            {
-                auto cmd = reinterpret_cast<const DPSPMessageCreatePlayer *>(data);
-                auto ptr = data + cmd->createOffset - 8;
-                auto playerInfo = reinterpret_cast<const DPPackedPlayer *>(ptr);
-
-                ptr += sizeof(DPPackedPlayer);
-
-                auto player = session.getPlayer(session.adjustId(playerInfo->playerId));
-
-                if(!player)
-                {
-                    std::cerr << "player not found for create!\n";
-                    return true;
-                }
-
-                // short name
-                std::u16string_view shortName(reinterpret_cast<const char16_t *>(ptr), playerInfo->shortNameLength / 2);
-                ptr += playerInfo->shortNameLength;
-                player->setShortName(convertUCS2ToUTF8(shortName));
-
-                // long name
-                std::u16string_view longName(reinterpret_cast<const char16_t *>(ptr), playerInfo->longNameLength / 2);
-                ptr += playerInfo->longNameLength;
-                player->setShortName(convertUCS2ToUTF8(longName));
+    // also reapplied after a hot restart, the drop counting isn't part of the fd
+    if(!tcpListen.setOptions(getSocketOptions(config, "ListenSocket")) || !udpListen.setOptions(getSocketOptions(config, "BroadcastSocket")))
+        LOG_WARNING(Net, "failed to set some listen socket options");
 
-                // service provider data
-                if(playerInfo->serviceProviderDataSize)
-                {
-                    player->setServiceProviderData(ptr, playerInfo->serviceProviderDataSize);
-                    ptr += playerInfo->serviceProviderDataSize;
-                }
+    Client::setSocketOptions(getSocketOptions(config, "ClientTCPSocket"), getSocketOptions(config, "ClientUDPSocket"));
 
-                // no reply
+    if(!sharedUDP.empty())
+    {
+        for(auto &socket : sharedUDP)
+            socket.setOptions(getSocketOptions(config, "ClientUDPSocket"));
 
-                // is this the right place to open the socket?
-                // it's the last thing sent before switching to UDP...
-                // (and we're connecting the socket, it's only used to send to this client)
-                if(!udpSocket.connect(address.c_str(), outgoingPort, outgoingPort))
-                    std::cerr << "failed to connect UDP socket\n";
+        Client::setSharedUDPSocket(&sharedUDP[0]);
+        LOG_INFO(Net, "sending and receiving RP frames through %zu shared UDP sockets", sharedUDP.size());
+    }
 
-                sendInitialLocoMessage();
+    Session session(std::string(*sessionName), appGUID, getSessionFlags(config));
+    session.setMaxPlayers(config.getIntValue("Server", "MaxPlayers").value_or(10));
 
-                return true;
-            }
+    Client::setLatencyLimits(getLatencyLimits(config));
+    Client::setTimeouts(getClientTimeouts(config));
+    Client::setMemoryLimits(getMemoryLimits(config));
+    Client::setFlushInterval(std::chrono::milliseconds(config.getIntValue("Server", "FlushInterval").value_or(0)));
 
-            case DPSPCommand::AddForwardRequest:
-            {
-                auto cmd = reinterpret_cast<const DPSPMessageAddForwardRequest *>(data);
-                auto ptr = data + cmd->createOffset - 8;
-                auto playerInfo = reinterpret_cast<const DPPackedPlayer *>(ptr);
-                auto password = std::u16string_view(reinterpret_cast<const char16_t *>(data + cmd->createOffset - 8 + playerInfo->size));
-                auto tickCount = *reinterpret_cast<const uint32_t *>(data + cmd->createOffset - 8 + playerInfo->size + (password.length() + 1) * 2);
+    bool restored = true;
 
-                ptr += sizeof(DPPackedPlayer);
-
-                auto player = session.getPlayer(session.adjustId(playerInfo->playerId));
+    // create local system player
+    if(hotRestart)
+        restored = session.deserialize(restartReader);
+    else
+        session.createLocalSystemPlayer(*port);
 
-                if(!player)
-                {
-                    std::cerr << "player not found for add fwd!\n";
-                    return true;
-                }
+    // declared first so that it outlives the clients
+    Pipeline pipeline(session);
 
-                std::u16string_view shortName(reinterpret_cast<const char16_t *>(ptr), playerInfo->shortNameLength / 2);
-                ptr += playerInfo->shortNameLength;
-                player->setShortName(convertUCS2ToUTF8(shortName));
+    std::map<std::string, Client> clients;
 
-                // long name
-                std::u16string_view longName(reinterpret_cast<const char16_t *>(ptr), playerInfo->longNameLength / 2);
-                ptr += playerInfo->longNameLength;
-                player->setShortName(convertUCS2ToUTF8(longName));
+    auto createClient = [&](const std::string &key)
+    {
+        auto it = clients.try_emplace(key, session, key, *port).first;
 
-                // service provider data
-                if(playerInfo->serviceProviderDataSize)
-                {
-                    player->setServiceProviderData(ptr, playerInfo->serviceProviderDataSize);
-                    ptr += playerInfo->serviceProviderDataSize;
-                }
+        if(std::find(debugClients.begin(), debugClients.end(), key) != debugClients.end())
+            it->second.setDebug(true);
 
-                // TODO: player data
+        return it;
+    };
 
-                if(checkOutgoingSocket())
-                {
-                    // if session flags & DPSession_ServerPlayerOnly return EnumPlayersReply instead
-
-                    // this is a big one
-                    size_t replySize = sizeof(DPSPMessageHeader) + sizeof(DPSPMessageSuperEnumPlayersReply);
-
-                    // session description + name
-                    auto sessionName = convertUTF8ToUCS2(session.getName());
-                    replySize += sizeof(DPSessionDesc2) + (sessionName.length() + 1) * 2;
-
-                    auto &players = session.getPlayers();
-                    replySize += sizeof(DPSuperPackedPlayer) * players.size();
-
-                    for(auto &player : players)
-                    {
-                        // TODO: + names and data
-                        auto spDataLen = player.second.getServiceProviderDataLen();
-                        if(spDataLen)
-                            replySize += spDataLen + 1; // we only support sockets so this will always be 32
-                    }
-
-                    auto replyBuffer = new uint8_t[replySize];
-                    auto header = reinterpret_cast<DPSPMessageHeader *>(replyBuffer);
-                    auto ptr = replyBuffer + sizeof(DPSPMessageHeader);
-                    auto replyMessage = reinterpret_cast<DPSPMessageSuperEnumPlayersReply *>(ptr);
-
-                    fillOutgoingHeader(header, replySize, DPSPCommand::SuperEnumPlayersReply);
-
-                    replyMessage->playerCount = players.size();
-                    replyMessage->groupCount = 0;
-                    replyMessage->shortcutCount = 0;
-                    replyMessage->passwordOffset = 0;
-
-                    // session
-                    ptr += sizeof(DPSPMessageSuperEnumPlayersReply);
-                    replyMessage->descriptionOffset = ptr - replyBuffer - 20;
-                    auto sessionDesc = reinterpret_cast<DPSessionDesc2 *>(ptr);
-                    fillSessionDesc(sessionDesc);
-
-                    // session name
-                    ptr += sizeof(DPSessionDesc2);
-                    replyMessage->nameOffset = ptr - replyBuffer - 20;
-                    memcpy(ptr, sessionName.data(), sessionName.length() * 2);
-
-                    // null terminate
-                    ptr += sessionName.length() * 2;
-                    *ptr++ = 0;
-                    *ptr++ = 0;
-
-                    // players
-                    replyMessage->packedOffset = ptr - replyBuffer - 20;
-                    for(auto &player : players)
-                    {
-                        auto superPlayer = reinterpret_cast<DPSuperPackedPlayer *>(ptr);
-
-                        superPlayer->size = 16;
-                        superPlayer->flags = player.second.getFlags();
-                        superPlayer->id = session.adjustId(player.first);
-                        superPlayer->playerInfoMask = 0;
-
-                        if(superPlayer->flags & DPPlayer_System)
-                            superPlayer->versionOrSystemPlayerId = 14; // version
-                        else
-                            superPlayer->versionOrSystemPlayerId = player.second.getSystemPlayerId();
-
-                        ptr += sizeof(DPSuperPackedPlayer);
-                        // TODO: names + data
-
-                        // service provider data
-                        auto spDataLen = player.second.getServiceProviderDataLen();
-                        if(spDataLen)
-                        {
-                            superPlayer->playerInfoMask |= 1 << DPSuperPlayer_ServiceProviderDataShift;
-                            *ptr++ = spDataLen;
-
-                            memcpy(ptr, player.second.getServiceProviderData(), spDataLen);
-
-                            ptr += spDataLen;
-                        }
-                    }
-
-                    if(!tcpOutgoing.sendAll(replyBuffer, replySize))
-                    {
-                        std::cerr << "Failed to send add forward reply!\n";
-                    }
-                    delete[] replyBuffer;
-                }
-
-                return true;
-            }
+    if(hotRestart)
+    {
+        auto clientCount = restartReader.read<uint32_t>();
 
-            case DPSPCommand::Packet:
-            {
-                auto cmd = reinterpret_cast<const DPSPMessagePacket *>(data);
-                auto packetData = data + sizeof(DPSPMessagePacket);
+        for(uint32_t i = 0; i < clientCount && !restartReader.hasFailed(); i++)
+            createClient(restartReader.readString())->second.deserialize(restartReader);
 
-                if(cmd->totalPackets == 1)
-                {
-                    // don't have the optional fields
-                    auto headerSize = sizeof(DPSPMessageHeader) - offsetof(DPSPMessageHeader, signature);
-                    DPSPMessageHeader packetHeader;
-                    memcpy(&packetHeader.signature, packetData, headerSize);
-
-                    if(packetHeader.version != 14 || memcmp(packetHeader.signature, "play", 4) != 0)
-                    {
-                        std::cerr << "bad nested packet\n";
-                    }
-                    else
-                        return handleDPlayCommand(packetHeader.command, packetData + headerSize, cmd->dataSize - headerSize);
-                }
-                else
-                {
-                    //FIXME: actually re-assemble the packet
-                    std::cerr << "packet " << cmd->packetIndex << "/" << cmd->totalPackets << "\n";
-                }
-                return true;
-            }
+        // the old server keeps going if we don't confirm
+        if(!restored || restartReader.hasFailed() || !restartReader.isAtEnd())
+        {
+            LOG_ERROR(General, "failed to restore state from the old server");
+            clients.clear();
+            Logger::get().stop();
+            return 1;
+        }
 
-            default:
-                std::cerr << "unhandled dplay cmd " << int(command) << "(size " << len << ")\n";
+        if(!restart.confirmTakeOver())
+        {
+            LOG_ERROR(General, "old server didn't hand over");
+            clients.clear();
+            Logger::get().stop();
+            return 1;
         }
 
-        return false;
+        auto time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - takeOverStart).count();
+        LOG_INFO(General, "took over %zu clients, %u players in %.2fms", clients.size(), session.getCurrentPlayers(), time);
     }
 
-    void handleCompletedRPMessage(const uint8_t *data, size_t len)
+    // receive/ack on I/O threads, everything else stays on this one
+    auto pipelineConfig = getPipelineConfig(config);
+
+    // the I/O threads each own whole client sockets
+    if(pipelineConfig.ioThreads > 0 && !sharedUDP.empty())
     {
-        if(memcmp(data, "play", 4) == 0)
-        {
-            // the data is a dplay message
-            auto headerSize = sizeof(DPSPMessageHeader) - offsetof(DPSPMessageHeader, signature);
-            DPSPMessageHeader packetHeader;
-            memcpy(&packetHeader.signature, data, headerSize);
-            
-            handleDPlayCommand(packetHeader.command, data + headerSize, len - headerSize);
-            return;
-        }
+        LOG_WARNING(General, "the pipeline can't be used with shared UDP sockets, handling everything on the main thread");
+        pipelineConfig.ioThreads = 0;
+    }
+
+    if(pipelineConfig.logicThreadCPU >= 0 && !Pipeline::setThreadCPU(pipelineConfig.logicThreadCPU))
+        LOG_WARNING(General, "failed to pin the main thread to CPU %i", pipelineConfig.logicThreadCPU);
 
-        if(len >= 12)
+    if(pipelineConfig.ioThreads > 0)
+    {
+        if(pipeline.start(pipelineConfig, getSocketOptions(config, "ClientUDPSocket")))
         {
-            // check for loco-specific message
-            auto locoHeader = reinterpret_cast<const LocoMessageHeader *>(data);
-            if(locoHeader->magic == 300)
-            {
-                std::cout << "loco msg " << locoHeader->command << " from " << session.adjustId(locoHeader->srcPlayerId) << " to "
-                          << session.adjustId(locoHeader->dstPlayerId) << " len " << (len - 12) << std::endl;
+            LOG_INFO(General, "started %i pipeline I/O threads", pipelineConfig.ioThreads);
+            Client::setPipeline(&pipeline);
 
-                if(locoHeader->command == 1004) // postcards?
-                {
-                    // this message has the value from the initial 1002 message
-                    // followed by the number of postcards (twice?)
-                    // then some postcard data, which seems to be in a slightly different format than the .crd files
-                    // (and also might have some junk at the start...)
-
-                    // echo
-                    auto srcId = session.getLocalSystemPlayer()->getId();
-                    auto dstId = systemPlayerId;
-                    uint8_t msgFlags = DPRPFrame_Command | DPRPFrame_Start | DPRPFrame_End;
-                    size_t messageSize = getRPHeaderSize(srcId & 0xFFFF, dstId & 0xFFFF) + len;
-
-                    auto messageBuffer = new uint8_t[messageSize];
-                    auto echoData = fillRPHeader(messageBuffer, srcId & 0xFFFF, dstId & 0xFFFF, msgFlags, 2, 1, 0); // TODO: message ids
-                    auto echoHeader = reinterpret_cast<LocoMessageHeader *>(echoData);
-
-                    memcpy(echoData, data, len);
-
-                    echoHeader->dstPlayerId = session.adjustId(dstId);
-                    echoHeader->srcPlayerId = 0;//session.adjustId(srcId);
-
-                    // FIXME: this packet is huge, should split it
-                    if(!udpSocket.send(messageBuffer, messageSize))
-                    {
-                        std::cerr << "failed to send 1004 echo\n";
-                    }
-                }
-                return;
-            }
+            // taken over from the old server
+            for(auto &client : clients)
+                client.second.attachPipeline();
         }
+        else
+            LOG_ERROR(General, "failed to start the pipeline, handling everything on the main thread");
+    }
 
-        std::cout << "rp msg len " << len << std::endl;
-        std::cout << "\t";
+    // metrics endpoint
+    MetricsServer metricsServer;
+    auto metricsPort = config.getIntValue("Metrics", "Port");
 
-        for(size_t i = 0; i < len; i++)
-        {
-            auto b = data[i];
-            auto hi = b >> 4;
-            auto lo = b & 0xF;
+    if(metricsPort)
+    {
+        std::string metricsAddr(config.getValue("Metrics", "ListenAddr").value_or("::1"));
 
-            std::cout << static_cast<char>(hi > 9 ? 'A' + hi - 10 : '0' + hi)
-                      << static_cast<char>(lo > 9 ? 'A' + lo - 10 : '0' + lo)
-                      << " ";
-        }
+        metricsServer.setPageHandler("/trace.json", []{ return Tracer::get().exportChromeTrace(); });
+        metricsServer.setPageHandler("/trace.folded", []{ return Tracer::get().exportFoldedStacks(); });
 
-        std::cout << std::endl;
+        if(metricsServer.start(metricsAddr.c_str(), *metricsPort))
+            LOG_INFO(General, "serving metrics on %s, port %i", metricsAddr.c_str(), *metricsPort);
+        else
+            LOG_ERROR(General, "failed to start metrics server on port %i", *metricsPort);
     }
 
-    void sendInitialLocoMessage()
+    // postcards are kept across restarts
+    auto postcardPath = config.getValue("Postcards", "Path");
+
+    if(postcardPath)
     {
-        // this gets the game to send things
-        // another interesting command is 1000, which I think sends back the game version
-        // regular multiplayer session use at least 1008-1014, 1017-1018
-        auto srcId = session.getLocalSystemPlayer()->getId();
-        auto dstId = systemPlayerId;
-        uint8_t msgFlags = DPRPFrame_Command | DPRPFrame_Start | DPRPFrame_End;
-        size_t messageSize = getRPHeaderSize(srcId & 0xFFFF, dstId & 0xFFFF) + sizeof(LocoCmd1002);
+        auto maxSizeMB = config.getIntValue("Postcards", "MaxSizeMB").value_or(1024);
 
-        auto messageBuffer = new uint8_t[messageSize];
-        auto data = fillRPHeader(messageBuffer, srcId & 0xFFFF, dstId & 0xFFFF, msgFlags, 1, 1, 0); // TODO: message ids
-        auto message = reinterpret_cast<LocoCmd1002 *>(data);
+        if(!PostcardStore::get().open(std::string(*postcardPath), static_cast<size_t>(maxSizeMB) * 1024 * 1024))
+            LOG_ERROR(General, "failed to open postcard store %.*s", int(postcardPath->length()), postcardPath->data());
+    }
 
-        // seems a bit redundant
-        message->header.dstPlayerId = session.adjustId(dstId);
-        message->header.srcPlayerId = 0;
+    // so are the user values we hand out in loco 1002
+    auto userPath = config.getValue("Users", "Path");
 
-        message->header.command = 1002;
-        message->header.magic = 300;
+    if(userPath && !UserRegistry::get().open(std::string(*userPath).c_str()))
+        LOG_ERROR(General, "failed to open user registry %.*s", int(userPath->length()), userPath->data());
 
-        message->userValue = 0xFFFFFFFF;
-        message->unk = 0;
+    // for the next hot restart
+    if(restartPath && !restart.listen(restartPathStr.c_str()))
+        LOG_ERROR(General, "failed to listen for hot restarts on %s", restartPathStr.c_str());
 
-        if(!udpSocket.send(messageBuffer, messageSize))
-        {
-            std::cerr << "Failed to send cmd1002!\n";
-        }
-
-        delete[] messageBuffer;
-    }
+    // pick up config changes while running, diffed against the last config that was applied
+    ConfigWatcher configWatcher;
+    std::unique_ptr<IniFile> reloadedConfig;
+    const IniFile *runningConfig = &config;
 
-    bool checkOutgoingSocket()
-    {
-        // TODO: add an isConnected? (or some more accurate name for an fd existing)
-        if(tcpOutgoing.getFd() != -1)
-            return true;
+    if(!configWatcher.start("./config.ini"))
+        LOG_WARNING(General, "failed to watch config.ini, changes need a restart");
 
-        std::cout << "Open outgoing to " << address << std::endl;
+    // exit cleanly so that logs/captures get flushed
+    struct sigaction quitAction = {};
+    quitAction.sa_handler = handleQuitSignal;
+    sigaction(SIGINT, &quitAction, nullptr);
+    sigaction(SIGTERM, &quitAction, nullptr);
 
-        if(!tcpOutgoing.connect(address.c_str(), outgoingPort))
-        {
-            std::cerr << "failed to open outgoing connection to " << address << "\n";
-            return false;
-        }
+    // sending to a client that's gone (YouAreDead, DeletePlayer) should fail, not kill us
+    signal(SIGPIPE, SIG_IGN);
 
-        return true;
-    }
+    ServerLoop loop(session, clients);
+    auto nextClientReport = Clock::now();
 
-    void fillOutgoingHeader(DPSPMessageHeader *header, size_t size, DPSPCommand command)
+    while(!quitRequested)
     {
-        header->sizeToken = size | 0xFAB << 20;
-
-        header->sockaddr.family = 2;
-        header->sockaddr.port = htons(outgoingPort);
-        header->sockaddr.addr = 0;
-        memset(header->sockaddr.padding, 0, 8);
+        // TODO: select wrapper
+        fd_set fds, writeFds;
+        int maxFd = -1;
+        FD_ZERO(&fds);
+        FD_ZERO(&writeFds);
 
-        memcpy(header->signature, "play", 4);
-        header->command = command;
-        header->version = 14;
-    }
+        auto addFd = [&fds, &maxFd](int fd)
+        {
+            FD_SET(fd, &fds);
 
-    void fillSessionDesc(DPSessionDesc2 *desc)
-    {
-        desc->size = sizeof(DPSessionDesc2);
-        desc->flags = session.getFlags();
-        memcpy(desc->instanceGUID, session.getGUID(), 16);
-        memcpy(desc->applicationGUID, session.getAppGUID(), 16);
-        desc->maxPlayers = session.getMaxPlayers();
-        desc->currentPlayerCount = session.getCurrentPlayers();
-
-        desc->sessionName = 0;
-        desc->password = 0;
-
-        desc->reserved1 = session.getIdXor();
-        desc->reserved2 = 0;
-
-        desc->applicationDefined1 = 0;
-        desc->applicationDefined2 = 0;
-        desc->applicationDefined3 = 0;
-        desc->applicationDefined4 = 0;
-    }
+            if(fd > maxFd)
+                maxFd = fd;
+        };
 
-    // reliable protocol
-    size_t getRPHeaderSize(uint16_t from, uint16_t to)
-    {
-        size_t ret = 4;
+        addFd(tcpListen.getFd());
+        addFd(udpListen.getFd());
 
-        if(to < 128)
-            ret += 1;
-        else if(to < 16384)
-            ret += 2;
-        else
-            ret += 3;
+        for(auto &socket : sharedUDP)
+            addFd(socket.getFd());
 
-        if(from < 128)
-            ret += 1;
-        else if(from < 16384)
-            ret += 2;
-        else
-            ret += 3;
+        if(restart.getFd() != -1)
+            addFd(restart.getFd());
 
-        return ret;
-    }
+        if(configWatcher.getFd() != -1)
+            addFd(configWatcher.getFd());
 
-    uint8_t *fillRPHeader(uint8_t *data, uint16_t from, uint16_t to, uint8_t flags, uint8_t messageId, uint8_t sequence, uint8_t serial)
-    {
-        // from
-        if(from < 128)
-            *data++ = from & 0x7F;
-        else if(from < 14384)
-        {
-            *data++ = (from & 0x7F) | 0x80;
-            *data++ = from >> 7;
-        }
-        else
+        if(pipeline.isRunning())
         {
-            *data++ = (from & 0x7F) | 0x80;
-            *data++ = ((from >> 7) & 0x7F) | 0x80;
-            *data++ = from >> 14;
-        }
+            addFd(pipeline.getFd());
 
-        // to
-        if(to < 128)
-            *data++ = to & 0x7F;
-        else if(to < 14384)
-        {
-            *data++ = (to & 0x7F) | 0x80;
-            *data++ = to >> 7;
+            // everything sent since the last time round
+            pipeline.flush();
         }
-        else
-        {
-            *data++ = (to & 0x7F) | 0x80;
-            *data++ = ((to >> 7) & 0x7F) | 0x80;
-            *data++ = to >> 14;
-        }
-
-        // flags
-        *data++ = flags;
 
-        // nack has ext flags here (but ext flags aren't implemented)
-        // ... and neither are nacks
+        bool queuedOutput = false;
 
-        *data++ = messageId;
-        *data++ = sequence;
-        *data++ = serial; // not for nack
+        for(auto &client : clients)
+        {
+            queuedOutput = queuedOutput || client.second.hasQueuedOutput();
 
-        return data;
-    }
+            int fd = client.second.getTCPIncomingSocket().getFd();
+            if(fd != -1)
+                addFd(fd);
 
-    Session &session;
+            fd = client.second.getUDPSocket().getFd();
+            if(fd != -1 && !client.second.isPipelined())
+                addFd(fd);
 
-    std::string address;
+            // still connecting or has output the socket wouldn't take
+            fd = client.second.getTCPOutgoingSocket().getFd();
+            if(fd != -1 && client.second.wantsTCPWrite())
+            {
+                FD_SET(fd, &writeFds);
+                maxFd = std::max(maxFd, fd);
+            }
+        }
 
-    int outgoingPort;
-    Socket tcpIncoming, tcpOutgoing;
+        auto selectStart = Clock::now();
 
-    Socket udpSocket;
+        // wake up for the next tick, or sooner if there's output waiting
+        auto wakeTime = loop.getWakeTime(queuedOutput);
+        auto untilTick = std::chrono::duration_cast<std::chrono::microseconds>(std::max(wakeTime - selectStart, std::chrono::steady_clock::duration::zero()));
+        timeval timeout{static_cast<time_t>(untilTick.count() / 1000000), static_cast<suseconds_t>(untilTick.count() % 1000000)};
 
-    uint32_t systemPlayerId = ~0u;
+        int ready;
 
-    // "reliable protocol" related
-    uint32_t dataReceived = 0;
+        {
+            TRACE_SPAN("select");
+            ready = select(maxFd + 1, &fds, &writeFds, nullptr, &timeout);
+        }
 
-    // TODO: docs suggest that multiple messages can be in flight at once
-    int currentMessageId = -1;
-    uint8_t nextMessageSequence = 0;
-    std::vector<uint8_t> messageBuffer;
-};
+        auto now = Clock::now();
+        serverMetrics.selectTime->observe(now - selectStart);
 
-int main(int argc, char *argv[])
-{
-    // get config
-    IniFile config("./config.ini");
+        if(loop.update(now, queuedOutput))
+        {
+            autoTuneSocket(udpListen, "broadcast socket");
 
-    auto port = config.getIntValue("Server", "Port");
-    auto addr = config.getValue("Server", "ListenAddr");
-    auto sessionName = config.getValue("Server", "SessionName");
-    auto guid = config.getValue("Server", "AppGUID");
+            for(size_t i = 0; i < sharedUDP.size(); i++)
+                autoTuneSocket(sharedUDP[i], "shared UDP socket " + std::to_string(i));
 
-    if(!port || !addr || !sessionName || !guid)
-    {
-        std::cerr << "failed to get config from config.ini\n";
-        std::cerr << "port: " << port.value_or(-1) << ", addr: " << addr.value_or("MISSING") 
-                  << ", session name: " << sessionName.value_or("MISSING") << ", guid: " << guid.value_or("MISSING") << "\n";
-        return 1;
-    }
+            for(auto &client : clients)
+                autoTuneSocket(client.second.getUDPSocket(), client.first);
 
-    // parse guid
-    uint8_t appGUID[16];
+            // the last partial chunk of spans, so the exports are at most a tick behind
+            Tracer::get().flushThread();
 
-    if(guid->length() != 36)
-    {
-        std::cerr << "invalid GUID " << *guid << "(" << guid->length() << ")\n";
-        return 1;
-    }
+            if(now >= nextClientReport)
+            {
+                metricsServer.setPage("/clients", getClientReport(clients));
+                nextClientReport = now + clientReportInterval;
+            }
+        }
 
-    auto start = guid->data();
-    auto end = start + guid->length();
-    for(int i = 0; i < 16; i++)
-    {
-        // skip separators
-        if(*start == '-')
-            start++;
+        // fds aren't valid on error (also hit on signals)
+        if(ready <= 0)
+            continue;
 
-        if(start + 2 > end)
-            break;
+        HistogramTimer loopTimer(*serverMetrics.mainLoopTime);
+        TRACE_SPAN("mainLoop");
 
-        auto res = std::from_chars(start, start + 2, appGUID[i], 16);
+        // a new server wants to take over, nothing else is handled after this
+        if(restart.getFd() != -1 && FD_ISSET(restart.getFd(), &fds))
+        {
+            auto handOffStart = std::chrono::steady_clock::now();
 
-        if(res.ec != std::errc{})
-            break;
-        
-        start = res.ptr;
-    }
+            // the new server won't know about these, the other clients have to hear about the last joins and leaves now
+            loop.broadcastRosterChanges();
 
-    if(start != end)
-    {
-        std::cerr << "failed to pares GUID " << *guid << "\n";
-        return 1;
-    }
+            for(auto &client : clients)
+                client.second.flushOutput();
 
-    std::cout << "starting server on " << *addr << ", port " << *port << ", app guid: " << *guid << ", session name: " << *sessionName << std::endl;
+            // finishes what the I/O threads had and gives the RP state back to the clients
+            pipeline.stop();
 
-    // setup sockets
-    Socket tcpListen(SocketType::TCP);
-    Socket udpListen(SocketType::UDP);
+            StateWriter state;
+            state.writeFd(tcpListen.getFd());
+            state.writeFd(udpListen.getFd());
 
-    // annoying, but not as annoying as trying to pass a string_view to inet_pton
-    std::string addrStr(*addr);
+            state.write<uint32_t>(sharedUDP.size());
+            for(auto &socket : sharedUDP)
+                state.writeFd(socket.getFd());
 
-    // TODO: logging?
-    if(!tcpListen.listen(addrStr.c_str(), *port))
-    {
-        return 1;
-    }
+            session.serialize(state);
 
-    // directplay broadcast port
-    if(!udpListen.bind(addrStr.c_str(), 47624))
-    {
-        return 1;
-    }
+            state.write<uint32_t>(clients.size());
+            for(auto &client : clients)
+            {
+                state.writeString(client.first);
+                client.second.serialize(state);
+            }
 
-    // copying values returned by game in a regular multiplayer session...
-    uint32_t sessionFlags = /*DPSession_PingTimer |*/ DPSession_ReliableProtocol | DPSession_OptimiseLatency;
-    Session session(std::string(*sessionName), appGUID, sessionFlags);
+            if(restart.handOff(state))
+            {
+                // the new server needs the metrics port
+                metricsServer.stop();
+                restart.finishHandOff();
 
-    // create local system player
-    auto &localPlayer = session.createNewSystemPlayer(DPPlayer_NameServer | DPPlayer_SendingMachine);
-  
-    // set service provider data (2x sockaddr with addr=0.0.0.0)
-    // these are the TCP and UDP ports
-    DPSockaddrIn spData[2] = {};
-    spData[0].family = spData[1].family = 2;
-    spData[0].port = spData[1].port = htons(*port);
-    localPlayer.setServiceProviderData(reinterpret_cast<uint8_t *>(spData), sizeof(spData));
+                auto time = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - handOffStart).count();
+                LOG_INFO(General, "handed off %zu clients (%zu bytes, %zu sockets) in %.2fms", clients.size(), state.getData().size(),
+                         state.getFds().size(), time);
+                break;
+            }
 
-    std::map<std::string, Client> clients;
+            // the new server gave up, carry on as before
+            if(pipelineConfig.ioThreads > 0 && pipeline.start(pipelineConfig, getSocketOptions(*runningConfig, "ClientUDPSocket")))
+            {
+                for(auto &client : clients)
+                    client.second.attachPipeline();
+            }
 
-    while(true)
-    {
-        // TODO: select wrapper
-        fd_set fds;
-        int maxFd = -1;
-        FD_ZERO(&fds);
+            continue;
+        }
 
-        auto addFd = [&fds, &maxFd](int fd)
+        // parsed on the watcher thread, applying it is cheap
+        if(configWatcher.getFd() != -1 && FD_ISSET(configWatcher.getFd(), &fds))
         {
-            FD_SET(fd, &fds);
+            auto newConfig = configWatcher.takeConfig();
 
-            if(fd > maxFd)
-                maxFd = fd;
-        };
-
-        addFd(tcpListen.getFd());
-        addFd(udpListen.getFd());
+            if(newConfig)
+            {
+                bool applied = applyConfig(*runningConfig, *newConfig, session, clients, debugClients);
 
-        for(auto &client : clients)
-        {
-            int fd = client.second.getTCPIncomingSocket().getFd();
-            if(fd != -1)
-                addFd(fd);
+                (applied ? serverMetrics.configReloads : serverMetrics.configReloadsRejected)->inc();
 
-            fd = client.second.getUDPSocket().getFd();
-            if(fd != -1)
-                addFd(fd);
+                if(applied)
+                {
+                    reloadedConfig = std::move(newConfig);
+                    runningConfig = reloadedConfig.get();
+                }
+            }
         }
 
-        int ready = select(maxFd + 1, &fds, nullptr, nullptr, nullptr);
-
-        if(ready < 0)
-        {} // ohno
-        else if(ready == 0)
-            continue;
+        // messages the I/O threads received (and acked)
+        if(pipeline.isRunning() && FD_ISSET(pipeline.getFd(), &fds))
+            pipeline.dispatch();
 
         // check sockets
         if(FD_ISSET(tcpListen.getFd(), &fds))
@@ -1238,14 +774,16 @@ int main(int argc, char *argv[])
 
             if(newSock)
             {
-                std::cout << "tcp accept " << addr.toString(true) << std::endl;
+                LOG_INFO(Net, "tcp accept %s", addr.toString(true).c_str());
 
                 auto key = addr.toString(); // assuming one client per ip, not sure we can do better...
 
+                PROBE1(client_accept, key.c_str());
+
                 auto it = clients.find(key);
 
                 if(it == clients.end())
-                    it = clients.emplace(key, Client{session, key, *port}).first;
+                    it = createClient(key);
 
                 it->second.setTCPIncomingSocket(std::move(newSock.value()));
             }
@@ -1256,67 +794,92 @@ int main(int argc, char *argv[])
             uint8_t buf[2048];
             SocketAddress addr;
             int len = udpListen.recv(buf, sizeof(buf), &addr);
-            std::cout << "udp recv " << len << " from " << addr.toString(true) << std::endl;
+            LOG_DEBUG(Net, "udp recv %i from %s", len, addr.toString(true).c_str());
 
             // get client
             auto key = addr.toString();
-
             auto it = clients.find(key);
 
             if(it == clients.end())
-                it = clients.emplace(key, Client{session, key, *port}).first;
+                it = createClient(key);
+
+            loop.handleBroadcastPacket(it, buf, len, udpListen.getReceiveTime());
+        }
+
+        for(auto &socket : sharedUDP)
+        {
+            if(!FD_ISSET(socket.getFd(), &fds))
+                continue;
+
+            for(int i = 0; i < maxSharedUDPReads; i++)
+            {
+                uint8_t buf[2048];
+                SocketAddress addr;
+                int len = socket.recv(buf, sizeof(buf), &addr, MSG_DONTWAIT);
+
+                if(len <= 0)
+                    break;
+
+                // only joined clients are expected here, from the port they told us about
+                auto it = clients.find(addr.toString());
+
+                if(it == clients.end() || !it->second.isSharedUDPSource(addr))
+                {
+                    LOG_DEBUG(Net, "shared udp recv %i from unknown %s", len, addr.toString(true).c_str());
+                    serverMetrics.udpUnknownSources->inc();
+                    PROBE2(drop, "udp_unknown_source", addr.toString().c_str());
+                    continue;
+                }
 
-            // parse directplay packet
-            size_t parsedLen = len;
-            it->second.handleDPlayPacket(buf, parsedLen);
+                CaptureWriter::get().record(CaptureType::RPIn, it->first, buf, len);
 
-            // should have one packet
-            if(parsedLen != static_cast<size_t>(len))
-                std::cerr << "udp packet size mismatch " << parsedLen << "/" << len << "\n";
+                // with SO_REUSEPORT the kernel keeps a client on one socket, so spread the sends the same way
+                it->second.setUDPReplySocket(&socket);
+                it->second.handleRPFrame(buf, len, socket.getReceiveTime());
+            }
         }
 
         // check client sockets
         for(auto it = clients.begin(); it != clients.end();)
         {
-            auto &client = *it;
-            int fd = client.second.getTCPIncomingSocket().getFd();
+            int fd = it->second.getTCPIncomingSocket().getFd();
             if(fd != -1 && FD_ISSET(fd, &fds))
             {
-                // TODO: move most of this to client
-                auto &socket = client.second.getTCPIncomingSocket();
-                uint8_t buf[2048];
-                int len = socket.recv(buf, sizeof(buf));
+                auto next = loop.handleTCPRead(it);
 
-                if(len == 0)
+                // disconnected
+                if(next != it)
                 {
-                    // disconnect
-                    std::cout << "tcp disconnect " << client.first << std::endl;
-                    socket.close();
-
-                    it = clients.erase(it);
+                    it = next;
                     continue;
                 }
-                else if(len > 0)
-                {
-                    std::cout << "tcp recv " << len << " from " << client.first << std::endl;
+            }
 
-                    // FIXME: buffering
-                    size_t parsedLen = len;
-                    client.second.handleDPlayPacket(buf, parsedLen);
+            auto &client = *it;
 
-                    // FIXME: can have multiple packets
-                    if(parsedLen != static_cast<size_t>(len))
-                        std::cerr << "tcp need buf " << parsedLen << "/" << len << "\n";
-                }
-            }
+            fd = client.second.getTCPOutgoingSocket().getFd();
+            if(fd != -1 && FD_ISSET(fd, &writeFds))
+                client.second.handleTCPWrite();
 
             fd = client.second.getUDPSocket().getFd();
-            if(fd != -1 && FD_ISSET(fd, &fds))
+            if(fd != -1 && !client.second.isPipelined() && FD_ISSET(fd, &fds))
                client.second.handleUDPRead();
 
             ++it;
         }
+
+        serverMetrics.clients->set(clients.size());
+        serverMetrics.players->set(session.getCurrentPlayers());
     }
 
+    LOG_INFO(General, "shutting down");
+
+    configWatcher.stop();
+    clients.clear();
+    CaptureWriter::get().close();
+    PostcardStore::get().close();
+    UserRegistry::get().close();
+    Logger::get().stop();
+
     return 0;
 }
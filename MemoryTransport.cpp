@@ -0,0 +1,505 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <initializer_list>
+
+#include <arpa/inet.h>
+
+#include "MemoryTransport.hpp"
+
+MemoryTransport::MemoryTransport(const MemoryTransportOptions &options) : options(options), random(options.seed)
+{
+    parseAddress(options.localAddr.c_str(), 0, localAddr);
+}
+
+int MemoryTransport::connect(SocketType type, const char *addr, uint16_t port, uint16_t sourcePort, const char *sourceAddr, bool wait)
+{
+    Endpoint endpoint;
+    endpoint.type = type;
+
+    if(!parseAddress(addr, port, endpoint.remote) || !parseAddress(sourceAddr ? sourceAddr : options.localAddr.c_str(), sourcePort, endpoint.local))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if(!sourcePort)
+        endpoint.local.sin6_port = htons(nextEphemeralPort++);
+
+    endpoint.connected = true;
+
+    if(type == SocketType::UDP)
+    {
+        int fd = addEndpoint(std::move(endpoint));
+        addBinding(fd, *getEndpoint(fd));
+        return fd;
+    }
+
+    // anything listening on the address, or on all of them
+    int listenFd = -1;
+
+    for(auto &to : {endpoint.remote, sockaddr_in6{AF_INET6, endpoint.remote.sin6_port, 0, in6addr_any, 0}})
+    {
+        auto it = bindings.find(getBindingKey(type, to));
+
+        if(it != bindings.end() && !it->second.empty() && getEndpoint(it->second.front())->listening)
+        {
+            listenFd = it->second.front();
+            break;
+        }
+    }
+
+    if(listenFd == -1)
+    {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    // the accepted end
+    Endpoint accepted;
+    accepted.type = type;
+    accepted.local = endpoint.remote;
+    accepted.remote = endpoint.local;
+    accepted.connected = true;
+
+    int fd = addEndpoint(std::move(endpoint));
+    int acceptedFd = addEndpoint(std::move(accepted));
+
+    getEndpoint(fd)->peer = acceptedFd;
+    getEndpoint(acceptedFd)->peer = fd;
+
+    getEndpoint(listenFd)->pendingAccepts.push_back(acceptedFd);
+    activeFds.insert(listenFd);
+
+    return fd;
+}
+
+int MemoryTransport::bind(SocketType type, const char *addr, uint16_t port, bool reusePort)
+{
+    Endpoint endpoint;
+    endpoint.type = type;
+
+    if(!parseAddress(addr, port, endpoint.local))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // like SO_REUSEADDR, only a listener or an unconnected UDP socket is a conflict
+    auto it = bindings.find(getBindingKey(type, endpoint.local));
+
+    if(it != bindings.end() && !reusePort)
+    {
+        for(auto fd : it->second)
+        {
+            auto &other = *getEndpoint(fd);
+
+            if(other.listening || type == SocketType::UDP)
+            {
+                errno = EADDRINUSE;
+                return -1;
+            }
+        }
+    }
+
+    int fd = addEndpoint(std::move(endpoint));
+    addBinding(fd, *getEndpoint(fd));
+
+    return fd;
+}
+
+int MemoryTransport::accept(int fd, SocketAddress *addr)
+{
+    auto endpoint = getEndpoint(fd);
+
+    if(!endpoint || !endpoint->listening)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // the other end may have given up already, that's only noticed when reading
+    if(endpoint->pendingAccepts.empty())
+    {
+        errno = EWOULDBLOCK;
+        return -1;
+    }
+
+    int newFd = endpoint->pendingAccepts.front();
+    endpoint->pendingAccepts.pop_front();
+
+    if(endpoint->pendingAccepts.empty())
+        activeFds.erase(fd);
+
+    if(addr && addr->getAddr())
+        memcpy(addr->getAddr(), &getEndpoint(newFd)->remote, sizeof(sockaddr_in6));
+
+    return newFd;
+}
+
+bool MemoryTransport::listen(int fd)
+{
+    auto endpoint = getEndpoint(fd);
+
+    if(!endpoint || endpoint->type != SocketType::TCP)
+        return false;
+
+    endpoint->listening = true;
+    return true;
+}
+
+int MemoryTransport::recv(int fd, void *data, size_t len, SocketAddress *addr, int flags)
+{
+    auto endpoint = getEndpoint(fd);
+
+    if(!endpoint || endpoint->listening)
+    {
+        errno = endpoint ? EINVAL : EBADF;
+        return -1;
+    }
+
+    auto now = Clock::now();
+    auto out = static_cast<uint8_t *>(data);
+    size_t copied = 0;
+
+    while(!endpoint->received.empty() && endpoint->received.front().arrival <= now && copied < len)
+    {
+        auto &packet = endpoint->received.front();
+
+        if(addr && addr->getAddr())
+            memcpy(addr->getAddr(), &packet.from, sizeof(sockaddr_in6));
+
+        size_t packetLen = packet.data.size() - packet.offset;
+        size_t copyLen = std::min(packetLen, len - copied);
+
+        memcpy(out + copied, packet.data.data() + packet.offset, copyLen);
+        copied += copyLen;
+
+        // anything past the end of a datagram is lost
+        if(endpoint->type == SocketType::UDP || copyLen == packetLen)
+        {
+            endpoint->receivedBytes -= packet.data.size();
+            endpoint->received.pop_front();
+        }
+        else
+            packet.offset += copyLen;
+
+        if(endpoint->type == SocketType::UDP)
+            break;
+    }
+
+    if(endpoint->received.empty() && !endpoint->peerClosed)
+        activeFds.erase(fd);
+
+    if(copied)
+        return copied;
+
+    // everything from before the close has been read
+    if(endpoint->type == SocketType::TCP && endpoint->peerClosed && endpoint->received.empty())
+        return 0;
+
+    errno = EWOULDBLOCK;
+    return -1;
+}
+
+ssize_t MemoryTransport::send(int fd, const iovec *iov, int iovCount, const SocketAddress *addr, int flags)
+{
+    auto endpoint = getEndpoint(fd);
+
+    if(!endpoint || endpoint->listening)
+    {
+        errno = endpoint ? EINVAL : EBADF;
+        return -1;
+    }
+
+    size_t len = 0;
+    for(int i = 0; i < iovCount; i++)
+        len += iov[i].iov_len;
+
+    std::vector<uint8_t> data;
+    data.reserve(len);
+
+    for(int i = 0; i < iovCount; i++)
+    {
+        auto base = static_cast<const uint8_t *>(iov[i].iov_base);
+        data.insert(data.end(), base, base + iov[i].iov_len);
+    }
+
+    if(endpoint->type == SocketType::TCP)
+    {
+        if(endpoint->peerClosed)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        if(endpoint->peer == -1)
+        {
+            errno = ENOTCONN;
+            return -1;
+        }
+
+        auto &peer = *getEndpoint(endpoint->peer);
+        size_t room = options.receiveBuffer - std::min(peer.receivedBytes, options.receiveBuffer);
+
+        if(!room)
+        {
+            errno = EWOULDBLOCK;
+            return -1;
+        }
+
+        data.resize(std::min(len, room));
+        len = data.size();
+
+        deliver(endpoint->peer, endpoint->local, std::move(data));
+        return len;
+    }
+
+    sockaddr_in6 to;
+
+    if(addr && addr->getAddr())
+        memcpy(&to, addr->getAddr(), sizeof(to));
+    else if(endpoint->connected)
+        to = endpoint->remote;
+    else
+    {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+
+    // sent as far as the sender can tell
+    if(options.lossPercent && static_cast<int>(random() % 100) < options.lossPercent)
+    {
+        droppedCount++;
+        return len;
+    }
+
+    auto from = endpoint->local;
+    if(IN6_IS_ADDR_UNSPECIFIED(&from.sin6_addr))
+        from.sin6_addr = localAddr.sin6_addr;
+
+    int targetFd = findDatagramTarget(to, from);
+
+    if(targetFd == -1 || getEndpoint(targetFd)->receivedBytes + len > options.receiveBuffer)
+    {
+        droppedCount++;
+        return len;
+    }
+
+    deliver(targetFd, from, std::move(data));
+    return len;
+}
+
+int MemoryTransport::getPendingError(int fd)
+{
+    return getEndpoint(fd) ? 0 : EBADF;
+}
+
+int MemoryTransport::close(int fd)
+{
+    auto endpoint = getEndpoint(fd);
+
+    if(!endpoint)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    // never accepted, so nothing else will close them
+    auto pendingAccepts = std::move(endpoint->pendingAccepts);
+
+    if(endpoint->peer != -1)
+    {
+        auto &peer = *getEndpoint(endpoint->peer);
+        peer.peer = -1;
+        peer.peerClosed = true;
+
+        activeFds.insert(endpoint->peer);
+    }
+
+    if(endpoint->bound)
+        removeBinding(fd, *endpoint);
+
+    endpoints[fd - firstFd].reset();
+    activeFds.erase(fd);
+
+    for(auto pendingFd : pendingAccepts)
+        close(pendingFd);
+
+    return 0;
+}
+
+bool MemoryTransport::isReadable(int fd) const
+{
+    auto endpoint = getEndpoint(fd);
+
+    if(!endpoint)
+        return false;
+
+    if(endpoint->listening)
+        return !endpoint->pendingAccepts.empty();
+
+    if(!endpoint->received.empty())
+        return endpoint->received.front().arrival <= Clock::now();
+
+    return endpoint->peerClosed;
+}
+
+bool MemoryTransport::isWritable(int fd) const
+{
+    auto endpoint = getEndpoint(fd);
+
+    if(!endpoint || endpoint->listening)
+        return false;
+
+    // writing to a closed stream fails right away
+    if(endpoint->type == SocketType::UDP || endpoint->peer == -1)
+        return true;
+
+    return getEndpoint(endpoint->peer)->receivedBytes < options.receiveBuffer;
+}
+
+std::vector<int> MemoryTransport::getReadableFds() const
+{
+    std::vector<int> fds;
+
+    for(auto fd : activeFds)
+    {
+        if(isReadable(fd))
+            fds.push_back(fd);
+    }
+
+    return fds;
+}
+
+int MemoryTransport::addEndpoint(Endpoint &&endpoint)
+{
+    endpoints.push_back(std::make_unique<Endpoint>(std::move(endpoint)));
+    return firstFd + endpoints.size() - 1;
+}
+
+MemoryTransport::Endpoint *MemoryTransport::getEndpoint(int fd)
+{
+    if(fd < firstFd || static_cast<size_t>(fd - firstFd) >= endpoints.size())
+        return nullptr;
+
+    return endpoints[fd - firstFd].get();
+}
+
+const MemoryTransport::Endpoint *MemoryTransport::getEndpoint(int fd) const
+{
+    return const_cast<MemoryTransport *>(this)->getEndpoint(fd);
+}
+
+bool MemoryTransport::parseAddress(const char *addr, uint16_t port, sockaddr_in6 &out) const
+{
+    out = {};
+    out.sin6_family = AF_INET6;
+    out.sin6_port = htons(port);
+
+    return inet_pton(AF_INET6, addr, &out.sin6_addr) == 1;
+}
+
+std::string MemoryTransport::getBindingKey(SocketType type, const sockaddr_in6 &addr)
+{
+    std::string key(1 + sizeof(addr.sin6_addr) + sizeof(addr.sin6_port), 0);
+
+    key[0] = type == SocketType::TCP ? 't' : 'u';
+    memcpy(key.data() + 1, &addr.sin6_addr, sizeof(addr.sin6_addr));
+    memcpy(key.data() + 1 + sizeof(addr.sin6_addr), &addr.sin6_port, sizeof(addr.sin6_port));
+
+    return key;
+}
+
+void MemoryTransport::addBinding(int fd, Endpoint &endpoint)
+{
+    auto key = getBindingKey(endpoint.type, endpoint.local);
+
+    if(endpoint.connected)
+        connectedBindings[key + getBindingKey(endpoint.type, endpoint.remote)] = fd;
+    else
+        bindings[key].push_back(fd);
+
+    endpoint.bound = true;
+}
+
+void MemoryTransport::removeBinding(int fd, Endpoint &endpoint)
+{
+    endpoint.bound = false;
+
+    if(endpoint.connected)
+    {
+        auto it = connectedBindings.find(getBindingKey(endpoint.type, endpoint.local) + getBindingKey(endpoint.type, endpoint.remote));
+
+        if(it != connectedBindings.end() && it->second == fd)
+            connectedBindings.erase(it);
+
+        return;
+    }
+
+    auto it = bindings.find(getBindingKey(endpoint.type, endpoint.local));
+
+    if(it == bindings.end())
+        return;
+
+    it->second.erase(std::remove(it->second.begin(), it->second.end(), fd), it->second.end());
+
+    if(it->second.empty())
+        bindings.erase(it);
+}
+
+int MemoryTransport::findDatagramTarget(const sockaddr_in6 &to, const sockaddr_in6 &from)
+{
+    auto anyTo = sockaddr_in6{AF_INET6, to.sin6_port, 0, in6addr_any, 0};
+    auto fromKey = getBindingKey(SocketType::UDP, from);
+
+    // connected to the sender first, the specific address before everything
+    for(auto &addr : {to, anyTo})
+    {
+        auto it = connectedBindings.find(getBindingKey(SocketType::UDP, addr) + fromKey);
+
+        if(it != connectedBindings.end())
+            return it->second;
+    }
+
+    // then spread over the unconnected ones by the sender (like SO_REUSEPORT)
+    for(auto &addr : {to, anyTo})
+    {
+        auto it = bindings.find(getBindingKey(SocketType::UDP, addr));
+
+        if(it != bindings.end() && !it->second.empty())
+            return it->second[hash(hashBasis, reinterpret_cast<const uint8_t *>(&from.sin6_addr), sizeof(from.sin6_addr)) % it->second.size()];
+    }
+
+    return -1;
+}
+
+void MemoryTransport::deliver(int fd, const sockaddr_in6 &from, std::vector<uint8_t> &&data)
+{
+    auto &target = *getEndpoint(fd);
+
+    digest = hash(digest, data.data(), data.size());
+
+    target.receivedBytes += data.size();
+    target.received.push_back({Clock::now() + options.latency, from, std::move(data)});
+
+    activeFds.insert(fd);
+}
+
+uint64_t MemoryTransport::hash(uint64_t value, const uint8_t *data, size_t len)
+{
+    // everything sent goes through this
+    size_t i = 0;
+
+    for(; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        value = (value ^ word) * 1099511628211ull;
+    }
+
+    for(; i < len; i++)
+        value = (value ^ data[i]) * 1099511628211ull;
+
+    return value;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "Clock.hpp"
+#include "Transport.hpp"
+
+struct MemoryTransportOptions
+{
+    std::string localAddr = "::1"; // the source of anything that wasn't bound to an address
+    std::chrono::microseconds latency{0}; // one way, by Clock::now()
+    int lossPercent = 0; // datagrams only
+    uint32_t seed = 1; // for the losses
+
+    size_t receiveBuffer = 256 * 1024; // per socket, datagrams past it are dropped and streams stop taking more
+};
+
+// sockets that only exist inside this process, for running the server and simulated clients in one thread
+// nothing blocks, connects complete right away (or are refused) and everything sent is queued on the receiving socket
+// with the same sends in the same order the results are always the same, getDigest can be used to check
+// not thread safe, fds are numbered from firstFd so they can't be mistaken for real ones (or used with select)
+class MemoryTransport final : public Transport
+{
+public:
+    static constexpr int firstFd = 1 << 20;
+
+    MemoryTransport(const MemoryTransportOptions &options = {});
+
+    int connect(SocketType type, const char *addr, uint16_t port, uint16_t sourcePort, const char *sourceAddr, bool wait) override;
+    int bind(SocketType type, const char *addr, uint16_t port, bool reusePort) override;
+    int accept(int fd, SocketAddress *addr) override;
+
+    bool listen(int fd) override;
+
+    int recv(int fd, void *data, size_t len, SocketAddress *addr, int flags) override;
+    ssize_t send(int fd, const iovec *iov, int iovCount, const SocketAddress *addr, int flags) override;
+
+    int getPendingError(int fd) override;
+
+    int close(int fd) override;
+
+    // what select would say
+    bool isReadable(int fd) const;
+    bool isWritable(int fd) const;
+
+    // everything readable, in fd order, without checking every socket
+    std::vector<int> getReadableFds() const;
+
+    // datagrams lost/without a socket to go to/past the receive buffer
+    uint64_t getDroppedCount() const
+    {
+        return droppedCount;
+    }
+
+    // of everything delivered, in order
+    uint64_t getDigest() const
+    {
+        return digest;
+    }
+
+private:
+    struct Packet
+    {
+        Clock::time_point arrival;
+        sockaddr_in6 from;
+        std::vector<uint8_t> data;
+        size_t offset = 0; // streams can be read in parts
+    };
+
+    struct Endpoint
+    {
+        SocketType type;
+        sockaddr_in6 local{};
+        sockaddr_in6 remote{};
+        bool bound = false, connected = false, listening = false;
+
+        std::deque<int> pendingAccepts;
+
+        int peer = -1; // the other end of a stream
+        bool peerClosed = false;
+
+        std::deque<Packet> received;
+        size_t receivedBytes = 0;
+    };
+
+    int addEndpoint(Endpoint &&endpoint);
+    Endpoint *getEndpoint(int fd);
+    const Endpoint *getEndpoint(int fd) const;
+
+    bool parseAddress(const char *addr, uint16_t port, sockaddr_in6 &out) const;
+    static std::string getBindingKey(SocketType type, const sockaddr_in6 &addr);
+
+    void addBinding(int fd, Endpoint &endpoint);
+    void removeBinding(int fd, Endpoint &endpoint);
+
+    // the socket a datagram from "from" to "to" ends up on, -1 if there isn't one
+    int findDatagramTarget(const sockaddr_in6 &to, const sockaddr_in6 &from);
+
+    void deliver(int fd, const sockaddr_in6 &from, std::vector<uint8_t> &&data);
+
+    // FNV-1a, but on words
+    static constexpr uint64_t hashBasis = 14695981039346656037ull;
+    static uint64_t hash(uint64_t value, const uint8_t *data, size_t len);
+
+    MemoryTransportOptions options;
+    sockaddr_in6 localAddr{};
+
+    std::vector<std::unique_ptr<Endpoint>> endpoints; // by fd - firstFd, fds aren't reused
+    std::unordered_map<std::string, std::vector<int>> bindings; // fds by type/address/port, unconnected
+    std::unordered_map<std::string, int> connectedBindings; // UDP, by local and remote address/port
+
+    std::set<int> activeFds; // anything queued (maybe still in flight), a closed peer or connections to accept
+    uint16_t nextEphemeralPort = 49152;
+
+    std::mt19937 random;
+
+    uint64_t droppedCount = 0;
+    uint64_t digest = hashBasis;
+};
@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <cstring>
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "Logger.hpp"
+#include "Metrics.hpp"
+
+const uint32_t Histogram::defaultBoundsUs[numBuckets]{
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 100000, 1000000, ~0u
+};
+
+const uint32_t Histogram::rttBoundsUs[numBuckets]{
+    1000, 5000, 10000, 20000, 30000, 50000, 75000, 100000, 150000, 200000, 300000, 500000, 1000000, 2000000, 5000000, ~0u
+};
+
+void Histogram::observe(std::chrono::nanoseconds duration)
+{
+    auto ns = duration.count() < 0 ? 0 : static_cast<uint64_t>(duration.count());
+    auto us = ns / 1000;
+
+    int bucket = 0;
+    while(bucket < numBuckets - 1 && us > bucketBoundsUs[bucket])
+        bucket++;
+
+    MetricsRegistry::add(firstSlot + bucket, 1);
+    MetricsRegistry::add(firstSlot + numBuckets, 1);
+    MetricsRegistry::add(firstSlot + numBuckets + 1, ns);
+}
+
+MetricsRegistry &MetricsRegistry::get()
+{
+    static MetricsRegistry registry;
+    return registry;
+}
+
+Counter &MetricsRegistry::addCounter(const std::string &name, const std::string &help, const std::string &labels)
+{
+    auto slot = allocSlots(1);
+
+    std::lock_guard lock(mutex);
+
+    auto &metric = metrics.emplace_back(Metric{name, help, labels, Type::Counter, {}, {}, {}});
+    metric.counter = std::make_unique<Counter>(slot);
+
+    return *metric.counter;
+}
+
+Gauge &MetricsRegistry::addGauge(const std::string &name, const std::string &help, const std::string &labels)
+{
+    std::lock_guard lock(mutex);
+
+    auto &metric = metrics.emplace_back(Metric{name, help, labels, Type::Gauge, {}, {}, {}});
+    metric.gauge = std::make_unique<Gauge>();
+
+    return *metric.gauge;
+}
+
+Histogram &MetricsRegistry::addHistogram(const std::string &name, const std::string &help, const std::string &labels, const uint32_t *bucketBoundsUs)
+{
+    auto slot = allocSlots(Histogram::numBuckets + 2);
+
+    std::lock_guard lock(mutex);
+
+    auto &metric = metrics.emplace_back(Metric{name, help, labels, Type::Histogram, {}, {}, {}});
+    metric.histogram = std::make_unique<Histogram>(slot, bucketBoundsUs);
+
+    return *metric.histogram;
+}
+
+std::string MetricsRegistry::format()
+{
+    std::lock_guard lock(mutex);
+
+    std::string ret;
+    const std::string *lastName = nullptr;
+
+    auto withLabels = [](const std::string &labels, const std::string &extra = "")
+    {
+        if(labels.empty() && extra.empty())
+            return std::string();
+
+        std::string ret = "{" + labels;
+        if(!labels.empty() && !extra.empty())
+            ret += ",";
+
+        return ret + extra + "}";
+    };
+
+    for(auto &metric : metrics)
+    {
+        // only one HELP/TYPE for each name (metrics with labels are registered together)
+        if(!lastName || *lastName != metric.name)
+        {
+            const char *typeName = "";
+            switch(metric.type)
+            {
+                case Type::Counter:
+                    typeName = "counter";
+                    break;
+                case Type::Gauge:
+                    typeName = "gauge";
+                    break;
+                case Type::Histogram:
+                    typeName = "histogram";
+                    break;
+            }
+
+            ret.append("# HELP ").append(metric.name).append(" ").append(metric.help).append("\n");
+            ret.append("# TYPE ").append(metric.name).append(" ").append(typeName).append("\n");
+            lastName = &metric.name;
+        }
+
+        switch(metric.type)
+        {
+            case Type::Counter:
+                ret.append(metric.name).append(withLabels(metric.labels)).append(" ").append(std::to_string(sumSlot(metric.counter->slot))).append("\n");
+                break;
+
+            case Type::Gauge:
+                ret.append(metric.name).append(withLabels(metric.labels)).append(" ").append(std::to_string(metric.gauge->get())).append("\n");
+                break;
+
+            case Type::Histogram:
+            {
+                auto firstSlot = metric.histogram->firstSlot;
+                auto bucketBoundsUs = metric.histogram->bucketBoundsUs;
+                uint64_t cumulative = 0;
+
+                for(int i = 0; i < Histogram::numBuckets; i++)
+                {
+                    cumulative += sumSlot(firstSlot + i);
+
+                    std::string le;
+                    if(i == Histogram::numBuckets - 1)
+                        le = "le=\"+Inf\"";
+                    else
+                    {
+                        char buf[32];
+                        snprintf(buf, sizeof(buf), "le=\"%g\"", bucketBoundsUs[i] / 1000000.0);
+                        le = buf;
+                    }
+
+                    ret.append(metric.name).append("_bucket").append(withLabels(metric.labels, le)).append(" ").append(std::to_string(cumulative)).append("\n");
+                }
+
+                char sum[32];
+                snprintf(sum, sizeof(sum), "%.9f", sumSlot(firstSlot + Histogram::numBuckets + 1) / 1000000000.0);
+
+                ret.append(metric.name).append("_sum").append(withLabels(metric.labels)).append(" ").append(sum).append("\n");
+                ret.append(metric.name).append("_count").append(withLabels(metric.labels)).append(" ").append(std::to_string(sumSlot(firstSlot + Histogram::numBuckets))).append("\n");
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+uint64_t MetricsRegistry::getCounterValue(const Counter &counter)
+{
+    std::lock_guard lock(mutex);
+    return sumSlot(counter.slot);
+}
+
+MetricsRegistry::ThreadSlots::ThreadSlots()
+{
+    for(auto &value : values)
+        value.store(0, std::memory_order_relaxed);
+
+    auto &registry = MetricsRegistry::get();
+    std::lock_guard lock(registry.mutex);
+    registry.threads.push_back(this);
+}
+
+MetricsRegistry::ThreadSlots::~ThreadSlots()
+{
+    auto &registry = MetricsRegistry::get();
+    std::lock_guard lock(registry.mutex);
+
+    // keep the totals
+    for(unsigned i = 0; i < maxSlots; i++)
+        registry.retired[i] += values[i].load(std::memory_order_relaxed);
+
+    registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+}
+
+unsigned MetricsRegistry::allocSlots(unsigned count)
+{
+    std::lock_guard lock(mutex);
+
+    if(nextSlot + count > maxSlots)
+    {
+        // share the last slots, the numbers will be wrong but it won't crash
+        LOG_ERROR(General, "out of metric slots!");
+        return maxSlots - count;
+    }
+
+    auto ret = nextSlot;
+    nextSlot += count;
+    return ret;
+}
+
+MetricsRegistry::ThreadSlots &MetricsRegistry::getThreadSlots()
+{
+    static thread_local ThreadSlots slots;
+    return slots;
+}
+
+uint64_t MetricsRegistry::sumSlot(unsigned slot)
+{
+    // mutex should be held
+    uint64_t ret = retired[slot];
+
+    for(auto &thread : threads)
+        ret += thread->values[slot].load(std::memory_order_relaxed);
+
+    return ret;
+}
+
+MetricsServer::MetricsServer() : listenSocket(SocketType::TCP)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+    stop();
+}
+
+bool MetricsServer::start(const char *addr, uint16_t port)
+{
+    if(!listenSocket.listen(addr, port))
+        return false;
+
+    running = true;
+    thread = std::thread(&MetricsServer::run, this);
+
+    return true;
+}
+
+void MetricsServer::stop()
+{
+    if(!running.exchange(false))
+        return;
+
+    // wakes up the select so we don't wait for the timeout
+    shutdown(listenSocket.getFd(), SHUT_RDWR);
+
+    thread.join();
+
+    // free the port for whoever is next (a hot restart)
+    listenSocket.close();
+}
+
+void MetricsServer::setPage(const std::string &path, std::string body)
+{
+    std::lock_guard lock(pagesMutex);
+    pages[path] = std::move(body);
+}
+
+void MetricsServer::setPageHandler(const std::string &path, std::function<std::string()> handler)
+{
+    std::lock_guard lock(pagesMutex);
+    pageHandlers[path] = std::move(handler);
+}
+
+void MetricsServer::run()
+{
+    while(running)
+    {
+        // wake up every now and then to check if we should stop
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(listenSocket.getFd(), &fds);
+
+        timeval timeout{0, 250000};
+
+        if(select(listenSocket.getFd() + 1, &fds, nullptr, nullptr, &timeout) <= 0)
+            continue;
+
+        auto socket = listenSocket.accept();
+
+        if(socket)
+            handleConnection(*socket);
+    }
+}
+
+void MetricsServer::handleConnection(Socket &socket)
+{
+    // don't let a client hold us forever
+    timeval timeout{1, 0};
+    setsockopt(socket.getFd(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket.getFd(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // read until the end of the headers
+    std::string request;
+    char buf[1024];
+
+    while(request.find("\r\n\r\n") == std::string::npos && request.length() < 8192)
+    {
+        int len = socket.recv(buf, sizeof(buf));
+        if(len <= 0)
+            return;
+
+        request.append(buf, len);
+    }
+
+    std::string body, status;
+
+    if(request.compare(0, 13, "GET /metrics ") == 0 || request.compare(0, 6, "GET / ") == 0)
+    {
+        status = "200 OK";
+        body = MetricsRegistry::get().format();
+    }
+    else
+    {
+        // GET /path HTTP/1.1
+        auto pathEnd = request.find(' ', 4);
+        std::string path = request.compare(0, 4, "GET ") == 0 && pathEnd != std::string::npos ? request.substr(4, pathEnd - 4) : "";
+
+        std::function<std::string()> handler;
+
+        {
+            std::lock_guard lock(pagesMutex);
+            auto it = pages.find(path);
+
+            if(it != pages.end())
+            {
+                status = "200 OK";
+                body = it->second;
+            }
+            else
+            {
+                auto handlerIt = pageHandlers.find(path);
+                if(handlerIt != pageHandlers.end())
+                    handler = handlerIt->second;
+            }
+        }
+
+        // without the lock, these can be slow
+        if(handler)
+        {
+            status = "200 OK";
+            body = handler();
+        }
+        else if(status.empty())
+        {
+            status = "404 Not Found";
+            body = "not found\n";
+        }
+    }
+
+    std::string response = "HTTP/1.1 " + status + "\r\n"
+                           "Content-Type: text/plain; version=0.0.4\r\n"
+                           "Content-Length: " + std::to_string(body.length()) + "\r\n"
+                           "Connection: close\r\n\r\n" + body;
+
+    size_t len = response.length();
+    socket.sendAll(response.data(), len);
+}
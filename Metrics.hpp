@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Socket.hpp"
+
+// counters and histograms are split into per-thread slots that are only written by the owning thread
+// scraping sums the slots from all threads
+class MetricsRegistry;
+
+class Counter final
+{
+public:
+    Counter(unsigned slot) : slot(slot) {}
+
+    void inc(uint64_t value = 1);
+
+private:
+    friend class MetricsRegistry;
+
+    unsigned slot;
+};
+
+class Gauge final
+{
+public:
+    void set(int64_t value)
+    {
+        this->value.store(value, std::memory_order_relaxed);
+    }
+
+    void add(int64_t value)
+    {
+        this->value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    int64_t get() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<int64_t> value{0};
+};
+
+// a fixed number of buckets, from 1us to 1s unless the histogram is for network round trips
+class Histogram final
+{
+public:
+    static constexpr int numBuckets = 16;
+    static const uint32_t defaultBoundsUs[numBuckets]; // last is +Inf
+    static const uint32_t rttBoundsUs[numBuckets]; // 1ms to 5s, mostly 5-300ms
+
+    Histogram(unsigned firstSlot, const uint32_t *bucketBoundsUs) : firstSlot(firstSlot), bucketBoundsUs(bucketBoundsUs) {}
+
+    void observe(std::chrono::nanoseconds duration);
+
+private:
+    friend class MetricsRegistry;
+
+    // buckets, then count and sum (ns)
+    unsigned firstSlot;
+
+    const uint32_t *bucketBoundsUs;
+};
+
+// times a scope
+class HistogramTimer final
+{
+public:
+    HistogramTimer(Histogram &histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+
+    ~HistogramTimer()
+    {
+        histogram.observe(std::chrono::steady_clock::now() - start);
+    }
+
+private:
+    Histogram &histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+class MetricsRegistry final
+{
+public:
+    static MetricsRegistry &get();
+
+    // labels are in prometheus format without the braces (a="b",c="d")
+    Counter &addCounter(const std::string &name, const std::string &help, const std::string &labels = "");
+    Gauge &addGauge(const std::string &name, const std::string &help, const std::string &labels = "");
+    Histogram &addHistogram(const std::string &name, const std::string &help, const std::string &labels = "",
+                            const uint32_t *bucketBoundsUs = Histogram::defaultBoundsUs);
+
+    // prometheus text format
+    std::string format();
+
+    uint64_t getCounterValue(const Counter &counter);
+
+private:
+    friend class Counter;
+    friend class Histogram;
+
+    static constexpr unsigned maxSlots = 4096;
+
+    struct ThreadSlots
+    {
+        ThreadSlots();
+        ~ThreadSlots();
+
+        std::atomic<uint64_t> values[maxSlots];
+    };
+
+    enum class Type
+    {
+        Counter,
+        Gauge,
+        Histogram,
+    };
+
+    struct Metric
+    {
+        std::string name, help, labels;
+        Type type;
+
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Histogram> histogram;
+    };
+
+    MetricsRegistry() = default;
+
+    unsigned allocSlots(unsigned count);
+
+    static ThreadSlots &getThreadSlots();
+
+    // only written by the owner, so no need for an atomic increment
+    static void add(unsigned slot, uint64_t value)
+    {
+        auto &v = getThreadSlots().values[slot];
+        v.store(v.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    uint64_t sumSlot(unsigned slot);
+
+    std::mutex mutex;
+
+    std::vector<Metric> metrics;
+    unsigned nextSlot = 0;
+
+    std::vector<ThreadSlots *> threads;
+    uint64_t retired[maxSlots] = {}; // totals from threads that have exited
+};
+
+inline void Counter::inc(uint64_t value)
+{
+    MetricsRegistry::add(slot, value);
+}
+
+// serves the registry over HTTP on its own thread so a slow scrape can't hold up the main loop
+class MetricsServer final
+{
+public:
+    MetricsServer();
+    ~MetricsServer();
+
+    bool start(const char *addr, uint16_t port);
+    void stop();
+
+    // extra plain text pages, safe to call from any thread
+    void setPage(const std::string &path, std::string body);
+
+    // pages generated on the server thread for each request, the handler has to be thread safe
+    void setPageHandler(const std::string &path, std::function<std::string()> handler);
+
+private:
+    void run();
+    void handleConnection(Socket &socket);
+
+    Socket listenSocket;
+
+    std::mutex pagesMutex;
+    std::map<std::string, std::string> pages;
+    std::map<std::string, std::function<std::string()>> pageHandlers;
+
+    std::atomic<bool> running{false};
+    std::thread thread;
+};
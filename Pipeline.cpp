@@ -0,0 +1,599 @@
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include "Capture.hpp"
+#include "Client.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "Pipeline.hpp"
+#include "Probes.hpp"
+#include "ServerMetrics.hpp"
+#include "Session.hpp"
+#include "Trace.hpp"
+
+// per socket per iteration, so one busy client can't starve the others
+static constexpr int maxFramesPerRead = 32;
+
+// same as the main loop tick, for the auto-tuning and trace flushes
+static constexpr auto housekeepingInterval = std::chrono::milliseconds(100);
+
+static bool createWakePipe(int &readFd, int &writeFd)
+{
+    int fds[2];
+
+    if(pipe(fds) != 0)
+        return false;
+
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    readFd = fds[0];
+    writeFd = fds[1];
+
+    return true;
+}
+
+static void closeWakePipe(int &readFd, int &writeFd)
+{
+    if(readFd != -1)
+        close(readFd);
+
+    if(writeFd != -1)
+        close(writeFd);
+
+    readFd = writeFd = -1;
+}
+
+Pipeline::Pipeline(const Session &session) : session(session)
+{
+}
+
+Pipeline::~Pipeline()
+{
+    stop();
+}
+
+bool Pipeline::start(const PipelineConfig &config, const SocketOptions &udpOptions)
+{
+    if(isRunning() || config.ioThreads <= 0)
+        return false;
+
+    this->udpOptions = udpOptions;
+
+    if(!createWakePipe(wakeRead, wakeWrite))
+    {
+        LOG_ERROR(General, "failed to create pipeline wake pipe");
+        return false;
+    }
+
+    running = true;
+
+    for(int i = 0; i < config.ioThreads; i++)
+    {
+        auto &thread = *threads.emplace_back(std::make_unique<IOThread>());
+
+        if(static_cast<size_t>(i) < config.ioThreadCPUs.size())
+            thread.cpu = config.ioThreadCPUs[i];
+
+        if(!createWakePipe(thread.wakeRead, thread.wakeWrite))
+        {
+            LOG_ERROR(General, "failed to create pipeline wake pipe");
+            stop();
+            return false;
+        }
+
+        thread.thread = std::thread(&Pipeline::runIOThread, this, std::ref(thread));
+    }
+
+    return true;
+}
+
+void Pipeline::stop()
+{
+    if(!isRunning())
+        return;
+
+    running = false;
+
+    for(auto &thread : threads)
+    {
+        wake(thread->wakeWrite, thread->wakePending);
+
+        if(thread->thread.joinable())
+            thread->thread.join();
+    }
+
+    // the threads are gone, anything they didn't get to is done here (sends go straight to the sockets now)
+    for(auto &thread : threads)
+    {
+        Output output;
+        while(thread->outputs.pop(output))
+            handleOutput(*thread, output);
+
+        sendQueuedFrames(*thread);
+    }
+
+    for(auto &thread : threads)
+    {
+        PipelineInput input;
+        while(thread->inputs.pop(input))
+            dispatchInput(input);
+
+        for(auto &held : thread->heldInputs)
+            dispatchInput(held);
+
+        thread->heldInputs.clear();
+    }
+
+    // the clients handle their own frames again
+    for(auto &thread : threads)
+    {
+        for(auto &ioClient : thread->clients)
+        {
+            auto it = clients.find(ioClient.first);
+
+            if(it != clients.end())
+                it->second->detachPipeline(std::move(ioClient.second->receiver));
+        }
+
+        closeWakePipe(thread->wakeRead, thread->wakeWrite);
+    }
+
+    threads.clear();
+    clients.clear();
+
+    closeWakePipe(wakeRead, wakeWrite);
+}
+
+uint32_t Pipeline::addClient(Client *client, const Socket &socket, const std::string &address, RPReceiver &&receiver)
+{
+    if(!isRunning())
+        return 0;
+
+    int fd = dup(socket.getFd());
+
+    if(fd == -1)
+    {
+        LOG_ERROR(Net, "failed to duplicate UDP socket for %s", address.c_str());
+        return 0;
+    }
+
+    auto ioClient = std::make_unique<IOClient>(fd);
+    ioClient->address = address;
+    ioClient->receiver = std::move(receiver);
+
+    // the drop counting and timestamps are per socket object
+    ioClient->socket.setOptions(udpOptions);
+
+    auto id = nextClientId++;
+
+    if(nextClientId == 0)
+        nextClientId = 1;
+
+    clients.emplace(id, client);
+    pushOutput(getThread(id), {Output::Type::AddClient, id, {}, std::move(ioClient)});
+
+    return id;
+}
+
+void Pipeline::removeClient(uint32_t id)
+{
+    if(!isRunning() || !clients.erase(id))
+        return;
+
+    pushOutput(getThread(id), {Output::Type::RemoveClient, id, {}, nullptr});
+}
+
+void Pipeline::send(uint32_t id, const iovec *iov, int iovCount)
+{
+    std::vector<uint8_t> frame;
+
+    for(int i = 0; i < iovCount; i++)
+    {
+        auto base = static_cast<const uint8_t *>(iov[i].iov_base);
+        frame.insert(frame.end(), base, base + iov[i].iov_len);
+    }
+
+    auto &thread = getThread(id);
+
+    // stopping, the thread has exited
+    if(!running.load(std::memory_order_relaxed))
+    {
+        auto it = thread.clients.find(id);
+
+        if(it != thread.clients.end())
+        {
+            size_t len = frame.size();
+            it->second->socket.send(frame.data(), len);
+        }
+
+        return;
+    }
+
+    pushOutput(thread, {Output::Type::Frame, id, std::move(frame), nullptr});
+}
+
+void Pipeline::dispatch()
+{
+    clearWake(wakeRead, wakePending);
+
+    TRACE_SPAN("pipelineDispatch");
+
+    for(auto &thread : threads)
+    {
+        PipelineInput input;
+        size_t count = 0;
+
+        while(thread->inputs.pop(input))
+        {
+            dispatchInput(input);
+
+            // come back after everything else has had a turn
+            if(++count == queueSize)
+            {
+                wake(wakeWrite, wakePending);
+                break;
+            }
+        }
+    }
+}
+
+void Pipeline::flush()
+{
+    for(auto &thread : threads)
+    {
+        if(thread->needsWake)
+        {
+            wake(thread->wakeWrite, thread->wakePending);
+            thread->needsWake = false;
+        }
+    }
+}
+
+bool Pipeline::setThreadCPU(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    return false;
+#endif
+}
+
+void Pipeline::runIOThread(IOThread &thread)
+{
+    if(thread.cpu >= 0 && !setThreadCPU(thread.cpu))
+        LOG_WARNING(General, "failed to pin I/O thread to CPU %i", thread.cpu);
+
+    auto nextHousekeeping = std::chrono::steady_clock::now() + housekeepingInterval;
+    uint8_t buf[2048];
+
+    while(running.load(std::memory_order_relaxed))
+    {
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(thread.wakeRead, &fds);
+
+        int maxFd = thread.wakeRead;
+
+        // anything else waits in the socket buffers until the logic thread catches up
+        bool holding = !thread.heldInputs.empty();
+
+        if(!holding)
+        {
+            for(auto &client : thread.clients)
+            {
+                int fd = client.second->socket.getFd();
+                FD_SET(fd, &fds);
+                maxFd = std::max(maxFd, fd);
+            }
+        }
+
+        auto untilHousekeeping = std::chrono::duration_cast<std::chrono::microseconds>(nextHousekeeping - std::chrono::steady_clock::now());
+
+        if(holding)
+            untilHousekeeping = std::min(untilHousekeeping, std::chrono::microseconds(1000));
+
+        untilHousekeeping = std::max(untilHousekeeping, std::chrono::microseconds(0));
+
+        timeval timeout{static_cast<time_t>(untilHousekeeping.count() / 1000000), static_cast<suseconds_t>(untilHousekeeping.count() % 1000000)};
+
+        int ready;
+
+        {
+            TRACE_SPAN("ioSelect");
+            ready = select(maxFd + 1, &fds, nullptr, nullptr, &timeout);
+        }
+
+        // sends first, they can also add/remove clients
+        clearWake(thread.wakeRead, thread.wakePending);
+
+        {
+            TRACE_SPAN("ioSend");
+
+            Output output;
+            while(thread.outputs.pop(output))
+                handleOutput(thread, output);
+
+            sendQueuedFrames(thread);
+        }
+
+        while(!thread.heldInputs.empty() && thread.inputs.push(std::move(thread.heldInputs.front())))
+        {
+            thread.heldInputs.pop_front();
+            thread.inputsPushed = true;
+        }
+
+        if(ready > 0 && !holding)
+        {
+            TRACE_SPAN("ioReceive");
+
+            for(auto &client : thread.clients)
+            {
+                auto &ioClient = *client.second;
+
+                if(!FD_ISSET(ioClient.socket.getFd(), &fds))
+                    continue;
+
+                ioClient.sentInput = false;
+
+                for(int i = 0; i < maxFramesPerRead; i++)
+                {
+                    int len = ioClient.socket.recv(buf, sizeof(buf), MSG_DONTWAIT);
+
+                    if(len <= 0)
+                        break;
+
+                    handleFrame(thread, client.first, ioClient, buf, len);
+                }
+            }
+        }
+
+        if(thread.inputsPushed)
+        {
+            wake(wakeWrite, wakePending);
+            thread.inputsPushed = false;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+
+        if(now >= nextHousekeeping)
+        {
+            for(auto &client : thread.clients)
+            {
+                uint32_t newDrops;
+                auto newSize = client.second->socket.autoTuneReceiveBuffer(newDrops);
+
+                serverMetrics.socketDrops->inc(newDrops);
+
+                if(newSize)
+                {
+                    LOG_INFO(Net, "%s dropped %u packets, receive buffer now %i bytes", client.second->address.c_str(), newDrops, newSize);
+                    serverMetrics.socketBufferGrows->inc();
+                }
+            }
+
+            Tracer::get().flushThread();
+
+            nextHousekeeping = now + housekeepingInterval;
+        }
+    }
+}
+
+void Pipeline::handleOutput(IOThread &thread, Output &output)
+{
+    switch(output.type)
+    {
+        case Output::Type::Frame:
+        {
+            auto it = thread.clients.find(output.clientId);
+
+            if(it == thread.clients.end())
+                break;
+
+            auto &client = *it->second;
+
+            if(client.queuedFrames.empty())
+                thread.clientsToSend.push_back(&client);
+
+            client.queuedFrames.push_back(std::move(output.frame));
+            break;
+        }
+
+        case Output::Type::AddClient:
+            thread.clients[output.clientId] = std::move(output.client);
+            break;
+
+        case Output::Type::RemoveClient:
+        {
+            auto it = thread.clients.find(output.clientId);
+
+            if(it == thread.clients.end())
+                break;
+
+            // everything before the removal still goes out
+            auto &client = *it->second;
+
+            if(!client.queuedFrames.empty())
+            {
+                sendFrames(client);
+                thread.clientsToSend.erase(std::find(thread.clientsToSend.begin(), thread.clientsToSend.end(), &client));
+            }
+
+            thread.clients.erase(it);
+            break;
+        }
+    }
+}
+
+void Pipeline::sendQueuedFrames(IOThread &thread)
+{
+    for(auto &client : thread.clientsToSend)
+        sendFrames(*client);
+
+    thread.clientsToSend.clear();
+}
+
+void Pipeline::sendFrames(IOClient &client)
+{
+    // same batch limit as Client::flushOutput
+    static constexpr int maxBatch = 64;
+    iovec packets[maxBatch];
+
+    auto &frames = client.queuedFrames;
+
+    for(size_t first = 0; first < frames.size(); first += maxBatch)
+    {
+        int count = static_cast<int>(std::min(frames.size() - first, size_t(maxBatch)));
+
+        for(int i = 0; i < count; i++)
+        {
+            packets[i].iov_base = frames[first + i].data();
+            packets[i].iov_len = frames[first + i].size();
+        }
+
+        serverMetrics.rpFlushes->inc();
+
+        int sent = client.socket.sendBatch(packets, count);
+
+        if(sent < count)
+            LOG_WARNING(RP, "only sent %i of %i queued frames to %s", sent, count, client.address.c_str());
+    }
+
+    frames.clear();
+}
+
+void Pipeline::handleFrame(IOThread &thread, uint32_t id, IOClient &client, const uint8_t *data, size_t len)
+{
+    TRACE_SPAN("ioHandleFrame");
+
+    serverMetrics.rpPacketsReceived->inc();
+    serverMetrics.rpBytesReceived->inc(len);
+
+    CaptureWriter::get().record(CaptureType::RPIn, client.address, data, len);
+
+    HistogramTimer timer(*serverMetrics.rpFrameTime);
+
+    PipelineInput input{id, client.socket.getReceiveTime(), {}, {}};
+
+    bool hasArrival = input.arrival != std::chrono::system_clock::time_point{};
+
+    auto getTimeSinceArrival = [&input]
+    {
+        return std::max(std::chrono::nanoseconds(std::chrono::system_clock::now() - input.arrival), std::chrono::nanoseconds(0));
+    };
+
+    if(hasArrival)
+        serverMetrics.rpQueueDelay->observe(getTimeSinceArrival());
+
+    RPReceivedFrame frame;
+    bool valid = client.receiver.handleFrame(data, len, frame);
+
+    auto &header = frame.header;
+
+    if(valid)
+        PROBE6(rp_frame, client.address.c_str(), header.fromId, header.toId, header.flags, header.messageId, header.sequence);
+
+    if(valid && frame.message)
+        PROBE3(rp_message, client.address.c_str(), header.messageId, frame.messageLen);
+
+    // acked before the message is handled, that's the point of this
+    if(valid && frame.needsAck)
+    {
+        uint8_t ack[RPReceiver::maxAckSize];
+        size_t ackLen = client.receiver.fillAck(ack, header, session.getTickCount());
+
+        CaptureWriter::get().record(CaptureType::RPOut, client.address, ack, ackLen);
+
+        serverMetrics.rpPacketsSent->inc();
+        serverMetrics.rpBytesSent->inc(ackLen);
+
+        if(!client.socket.send(ack, ackLen))
+            LOG_ERROR(RP, "Failed to send ack!");
+        else
+        {
+            serverMetrics.rpAcksSent->inc();
+            PROBE3(rp_ack, client.address.c_str(), header.messageId, header.sequence);
+
+            if(hasArrival)
+            {
+                input.ackDelay = getTimeSinceArrival();
+                serverMetrics.rpAckDelay->observe(input.ackDelay);
+            }
+        }
+    }
+
+    if(valid && frame.message)
+        input.message.assign(frame.message, frame.message + frame.messageLen);
+    else if(client.sentInput)
+        return; // the logic thread already knows it's alive
+
+    client.sentInput = true;
+    pushInput(thread, std::move(input));
+}
+
+void Pipeline::pushInput(IOThread &thread, PipelineInput &&input)
+{
+    if(thread.heldInputs.empty() && thread.inputs.push(std::move(input)))
+    {
+        thread.inputsPushed = true;
+        return;
+    }
+
+    serverMetrics.pipelineInputsHeld->inc();
+    thread.heldInputs.push_back(std::move(input));
+}
+
+void Pipeline::pushOutput(IOThread &thread, Output &&output)
+{
+    if(!thread.outputs.push(std::move(output)))
+    {
+        serverMetrics.pipelineOutputsHeld->inc();
+
+        // the I/O threads never wait for us, so this can't deadlock
+        wake(thread.wakeWrite, thread.wakePending);
+
+        while(!thread.outputs.push(std::move(output)))
+            std::this_thread::yield();
+    }
+
+    thread.needsWake = true;
+}
+
+void Pipeline::dispatchInput(PipelineInput &input)
+{
+    // may have been removed while this was queued
+    auto it = clients.find(input.clientId);
+
+    if(it != clients.end())
+        it->second->handlePipelineInput(input);
+}
+
+void Pipeline::wake(int fd, std::atomic<bool> &pending)
+{
+    if(pending.exchange(true, std::memory_order_acq_rel))
+        return;
+
+    // full just means it's already readable
+    char byte = 0;
+    [[maybe_unused]] auto written = write(fd, &byte, 1);
+}
+
+void Pipeline::clearWake(int fd, std::atomic<bool> &pending)
+{
+    // drain first, a wake in between would otherwise leave the flag set with nothing in the pipe
+    // anything pushed before the store is picked up by the caller, which empties the queues after this
+    char buf[64];
+    while(read(fd, buf, sizeof(buf)) > 0) {}
+
+    pending.store(false, std::memory_order_release);
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "ReliableProtocol.hpp"
+#include "SPSCQueue.hpp"
+#include "Socket.hpp"
+
+class Client;
+class Session;
+
+struct PipelineConfig
+{
+    int ioThreads = 0; // 0 handles everything on the main thread
+    std::vector<int> ioThreadCPUs; // in thread order, missing or -1 isn't pinned
+    int logicThreadCPU = -1;
+};
+
+// from an I/O thread to the logic thread
+struct PipelineInput
+{
+    uint32_t clientId;
+
+    std::chrono::system_clock::time_point arrival; // kernel receive time of the last frame, if the socket has timestamps
+    std::chrono::nanoseconds ackDelay{0}; // arrival to the ack being sent, 0 if not acked/timestamped
+
+    std::vector<uint8_t> message; // empty if the frames didn't complete one, only to show the client is alive
+};
+
+// client UDP sockets are read by I/O threads that reassemble RP messages and ack them right away
+// completed messages go to the logic (main) thread, its frames go back through the same I/O thread
+// everything except the I/O threads themselves is called from the logic thread
+class Pipeline final
+{
+public:
+    Pipeline(const Session &session);
+    ~Pipeline();
+
+    bool start(const PipelineConfig &config, const SocketOptions &udpOptions);
+
+    // handles everything still queued, then gives the RP state back to the clients
+    void stop();
+
+    bool isRunning() const
+    {
+        return !threads.empty();
+    }
+
+    // readable when there's something to dispatch
+    int getFd() const
+    {
+        return wakeRead;
+    }
+
+    // the socket is duplicated, the client keeps its copy
+    uint32_t addClient(Client *client, const Socket &socket, const std::string &address, RPReceiver &&receiver);
+    void removeClient(uint32_t id);
+
+    void send(uint32_t id, const iovec *iov, int iovCount);
+
+    // hands everything received to the clients
+    void dispatch();
+
+    // wakes the I/O threads that have frames to send, call once per main loop iteration
+    void flush();
+
+    // pins the calling thread
+    static bool setThreadCPU(int cpu);
+
+private:
+    // owned by an I/O thread
+    struct IOClient
+    {
+        IOClient(int fd) : socket(SocketType::UDP, fd) {}
+
+        Socket socket;
+        std::string address;
+        RPReceiver receiver;
+
+        std::vector<std::vector<uint8_t>> queuedFrames;
+        bool sentInput = false; // this iteration
+    };
+
+    // from the logic thread to an I/O thread
+    struct Output
+    {
+        enum class Type : uint8_t
+        {
+            Frame,
+            AddClient,
+            RemoveClient,
+        };
+
+        Type type;
+        uint32_t clientId;
+        std::vector<uint8_t> frame;
+        std::unique_ptr<IOClient> client;
+    };
+
+    struct IOThread
+    {
+        IOThread() : inputs(queueSize), outputs(queueSize) {}
+
+        std::thread thread;
+        int cpu = -1;
+
+        int wakeRead = -1, wakeWrite = -1;
+        std::atomic<bool> wakePending{false};
+        bool needsWake = false; // logic thread side
+
+        SPSCQueue<PipelineInput> inputs;
+        SPSCQueue<Output> outputs;
+
+        // I/O thread only, until the thread has stopped
+        std::unordered_map<uint32_t, std::unique_ptr<IOClient>> clients;
+        std::vector<IOClient *> clientsToSend;
+        std::deque<PipelineInput> heldInputs; // the queue was full
+        bool inputsPushed = false; // this iteration
+    };
+
+    static constexpr size_t queueSize = 8192;
+
+    void runIOThread(IOThread &thread);
+    void handleOutput(IOThread &thread, Output &output);
+    void sendQueuedFrames(IOThread &thread);
+    void sendFrames(IOClient &client);
+    void handleFrame(IOThread &thread, uint32_t id, IOClient &client, const uint8_t *data, size_t len);
+    void pushInput(IOThread &thread, PipelineInput &&input);
+
+    void pushOutput(IOThread &thread, Output &&output);
+    void dispatchInput(PipelineInput &input);
+
+    static void wake(int fd, std::atomic<bool> &pending);
+    static void clearWake(int fd, std::atomic<bool> &pending);
+
+    IOThread &getThread(uint32_t clientId)
+    {
+        return *threads[clientId % threads.size()];
+    }
+
+    const Session &session;
+
+    SocketOptions udpOptions;
+
+    std::atomic<bool> running{false};
+    std::vector<std::unique_ptr<IOThread>> threads;
+
+    // the I/O threads wake the logic thread through this
+    int wakeRead = -1, wakeWrite = -1;
+    std::atomic<bool> wakePending{false};
+
+    uint32_t nextClientId = 1;
+    std::unordered_map<uint32_t, Client *> clients;
+};
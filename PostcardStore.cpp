@@ -0,0 +1,380 @@
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Logger.hpp"
+#include "PostcardStore.hpp"
+
+static constexpr uint32_t initialSlotCount = 1024;
+static constexpr uint64_t dataGrowSize = 1024 * 1024;
+
+static void insertSlot(PostcardIndexSlot *slots, uint32_t slotCount, uint64_t hash, uint64_t offset)
+{
+    auto mask = slotCount - 1;
+
+    for(auto i = hash & mask;; i = (i + 1) & mask)
+    {
+        if(!slots[i].offset)
+        {
+            // offset marks the slot as used, so write it last
+            slots[i].hash = hash;
+            slots[i].offset = offset;
+            return;
+        }
+    }
+}
+
+PostcardStore &PostcardStore::get()
+{
+    static PostcardStore store;
+    return store;
+}
+
+PostcardStore::~PostcardStore()
+{
+    close();
+}
+
+bool PostcardStore::open(const std::string &path, size_t maxDataSize)
+{
+    close();
+
+    this->path = path;
+
+    // data file
+    auto dataPath = path + ".dat";
+    dataFd = ::open(dataPath.c_str(), O_RDWR | O_CREAT, 0644);
+
+    struct stat st;
+    if(dataFd == -1 || fstat(dataFd, &st) == -1)
+    {
+        LOG_ERROR(General, "failed to open postcard data %s", dataPath.c_str());
+        close();
+        return false;
+    }
+
+    dataFileSize = st.st_size;
+
+    // reserve the whole range up front, so the mapping never moves
+    dataMapSize = std::max(maxDataSize, static_cast<size_t>(dataFileSize));
+    auto map = mmap(nullptr, dataMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, dataFd, 0);
+
+    if(map == MAP_FAILED)
+    {
+        LOG_ERROR(General, "failed to map postcard data %s", dataPath.c_str());
+        close();
+        return false;
+    }
+
+    dataMap = static_cast<uint8_t *>(map);
+
+    auto dataHeader = reinterpret_cast<PostcardDataHeader *>(dataMap);
+
+    if(dataFileSize == 0)
+    {
+        if(!ensureDataSize(sizeof(PostcardDataHeader)))
+        {
+            close();
+            return false;
+        }
+
+        memcpy(dataHeader->magic, "BTPD", 4);
+        dataHeader->version = 1;
+    }
+    else if(dataFileSize < sizeof(PostcardDataHeader) || memcmp(dataHeader->magic, "BTPD", 4) != 0 || dataHeader->version != 1)
+    {
+        LOG_ERROR(General, "%s is not a postcard data file", dataPath.c_str());
+        close();
+        return false;
+    }
+
+    // index file
+    auto indexPath = path + ".idx";
+    indexFd = ::open(indexPath.c_str(), O_RDWR | O_CREAT, 0644);
+
+    if(indexFd == -1 || fstat(indexFd, &st) == -1)
+    {
+        LOG_ERROR(General, "failed to open postcard index %s", indexPath.c_str());
+        close();
+        return false;
+    }
+
+    bool newIndex = st.st_size == 0;
+
+    if(newIndex)
+    {
+        indexMapSize = sizeof(PostcardIndexHeader) + initialSlotCount * sizeof(PostcardIndexSlot);
+
+        if(ftruncate(indexFd, indexMapSize) == -1)
+        {
+            LOG_ERROR(General, "failed to create postcard index %s", indexPath.c_str());
+            close();
+            return false;
+        }
+    }
+    else
+        indexMapSize = st.st_size;
+
+    map = mmap(nullptr, indexMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+
+    if(map == MAP_FAILED)
+    {
+        LOG_ERROR(General, "failed to map postcard index %s", indexPath.c_str());
+        indexMap = nullptr;
+        close();
+        return false;
+    }
+
+    indexMap = static_cast<uint8_t *>(map);
+    indexHeader = reinterpret_cast<PostcardIndexHeader *>(indexMap);
+    slots = reinterpret_cast<PostcardIndexSlot *>(indexHeader + 1);
+
+    if(newIndex)
+    {
+        memcpy(indexHeader->magic, "BTPI", 4);
+        indexHeader->version = 1;
+        indexHeader->slotCount = initialSlotCount;
+        indexHeader->count = 0;
+        indexHeader->dataEnd = sizeof(PostcardDataHeader);
+    }
+    else if(indexMapSize < sizeof(PostcardIndexHeader) || memcmp(indexHeader->magic, "BTPI", 4) != 0 || indexHeader->version != 1
+            || indexMapSize != sizeof(PostcardIndexHeader) + indexHeader->slotCount * sizeof(PostcardIndexSlot)
+            || indexHeader->dataEnd > dataFileSize)
+    {
+        LOG_ERROR(General, "%s is not a postcard index, or doesn't match the data", indexPath.c_str());
+        close();
+        return false;
+    }
+
+    LOG_INFO(General, "postcard store %s: %u postcards, %llu bytes", path.c_str(), indexHeader->count,
+             static_cast<unsigned long long>(indexHeader->dataEnd));
+
+    return true;
+}
+
+void PostcardStore::close()
+{
+    if(indexMap)
+        munmap(indexMap, indexMapSize);
+
+    if(dataMap)
+        munmap(dataMap, dataMapSize);
+
+    if(indexFd != -1)
+        ::close(indexFd);
+
+    if(dataFd != -1)
+        ::close(dataFd);
+
+    indexFd = dataFd = -1;
+    indexMap = dataMap = nullptr;
+    indexHeader = nullptr;
+    slots = nullptr;
+}
+
+const uint8_t *PostcardStore::store(const uint8_t *data, uint32_t len, bool *isNew)
+{
+    return store(data, len, hash(data, len), isNew);
+}
+
+const uint8_t *PostcardStore::store(const uint8_t *data, uint32_t len, uint64_t dataHash, bool *isNew)
+{
+    if(!isOpen())
+        return nullptr;
+
+    if(auto slot = findSlot(dataHash, data, len))
+    {
+        if(isNew)
+            *isNew = false;
+
+        return dataMap + slot->offset + sizeof(PostcardRecordHeader);
+    }
+
+    // keep the load factor under 1/2
+    if((indexHeader->count + 1) * 2 > indexHeader->slotCount && !growIndex())
+        return nullptr;
+
+    auto offset = indexHeader->dataEnd;
+    auto recordSize = sizeof(PostcardRecordHeader) + ((len + 7) & ~7ull);
+
+    if(!ensureDataSize(offset + recordSize))
+    {
+        LOG_WARNING(General, "postcard store full");
+        return nullptr;
+    }
+
+    auto record = reinterpret_cast<PostcardRecordHeader *>(dataMap + offset);
+    record->hash = dataHash;
+    record->length = len;
+    record->reserved = 0;
+    memcpy(record + 1, data, len);
+
+    // only index it once the data is written, anything after dataEnd is ignored on open
+    insertSlot(slots, indexHeader->slotCount, dataHash, offset);
+    indexHeader->count++;
+    indexHeader->dataEnd = offset + recordSize;
+
+    if(isNew)
+        *isNew = true;
+
+    return reinterpret_cast<const uint8_t *>(record + 1);
+}
+
+const uint8_t *PostcardStore::find(const uint8_t *data, uint32_t len) const
+{
+    return find(hash(data, len), data, len);
+}
+
+const uint8_t *PostcardStore::find(uint64_t dataHash, const uint8_t *data, uint32_t len) const
+{
+    if(!isOpen())
+        return nullptr;
+
+    auto slot = findSlot(dataHash, data, len);
+
+    return slot ? dataMap + slot->offset + sizeof(PostcardRecordHeader) : nullptr;
+}
+
+uint32_t PostcardStore::getCount() const
+{
+    return indexHeader ? indexHeader->count : 0;
+}
+
+uint64_t PostcardStore::getDataSize() const
+{
+    return indexHeader ? indexHeader->dataEnd : 0;
+}
+
+uint64_t PostcardStore::hash(const uint8_t *data, size_t len)
+{
+    // not cryptographic, matches are compared byte for byte
+    const uint64_t mul = 0x9E3779B97F4A7C15ull;
+    uint64_t h = len * mul;
+
+    for(; len >= 8; data += 8, len -= 8)
+    {
+        uint64_t k;
+        memcpy(&k, data, 8);
+
+        k *= 0x87C37B91114253D5ull;
+        k ^= k >> 31;
+        h = (h ^ k) * mul;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data, len);
+    h = (h ^ tail) * mul;
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+const PostcardIndexSlot *PostcardStore::findSlot(uint64_t hash, const uint8_t *data, uint32_t len) const
+{
+    auto mask = indexHeader->slotCount - 1;
+
+    // there's always at least one empty slot
+    for(auto i = hash & mask;; i = (i + 1) & mask)
+    {
+        auto &slot = slots[i];
+
+        if(!slot.offset)
+            return nullptr;
+
+        if(slot.hash != hash)
+            continue;
+
+        auto record = reinterpret_cast<const PostcardRecordHeader *>(dataMap + slot.offset);
+
+        if(record->length == len && memcmp(record + 1, data, len) == 0)
+            return &slot;
+    }
+}
+
+bool PostcardStore::growIndex()
+{
+    // build the bigger index next to the old one, then replace it
+    auto newSlotCount = indexHeader->slotCount * 2;
+    auto newSize = sizeof(PostcardIndexHeader) + newSlotCount * sizeof(PostcardIndexSlot);
+
+    auto indexPath = path + ".idx";
+    auto tmpPath = indexPath + ".tmp";
+
+    int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd == -1)
+        return false;
+
+    void *map = MAP_FAILED;
+
+    if(ftruncate(fd, newSize) == 0)
+        map = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(map == MAP_FAILED)
+    {
+        LOG_ERROR(General, "failed to grow postcard index");
+        ::close(fd);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    auto newHeader = static_cast<PostcardIndexHeader *>(map);
+    auto newSlots = reinterpret_cast<PostcardIndexSlot *>(newHeader + 1);
+
+    *newHeader = *indexHeader;
+    newHeader->slotCount = newSlotCount;
+
+    for(uint32_t i = 0; i < indexHeader->slotCount; i++)
+    {
+        if(slots[i].offset)
+            insertSlot(newSlots, newSlotCount, slots[i].hash, slots[i].offset);
+    }
+
+    if(rename(tmpPath.c_str(), indexPath.c_str()) == -1)
+    {
+        LOG_ERROR(General, "failed to replace postcard index");
+        munmap(map, newSize);
+        ::close(fd);
+        unlink(tmpPath.c_str());
+        return false;
+    }
+
+    munmap(indexMap, indexMapSize);
+    ::close(indexFd);
+
+    indexFd = fd;
+    indexMap = static_cast<uint8_t *>(map);
+    indexMapSize = newSize;
+    indexHeader = newHeader;
+    slots = newSlots;
+
+    return true;
+}
+
+bool PostcardStore::ensureDataSize(uint64_t size)
+{
+    if(size <= dataFileSize)
+        return true;
+
+    if(size > dataMapSize)
+        return false;
+
+    // grow in chunks
+    auto newSize = std::min(static_cast<uint64_t>(dataMapSize), (size + dataGrowSize - 1) / dataGrowSize * dataGrowSize);
+
+    if(ftruncate(dataFd, newSize) == -1)
+    {
+        LOG_ERROR(General, "failed to grow postcard data");
+        return false;
+    }
+
+    dataFileSize = newSize;
+    return true;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// content-addressed storage for postcard data
+// blobs are appended to a data file, an open-addressing hash index lives in a second file
+// both are mapped, so nothing needs to be rebuilt on startup and stored blobs can be sent straight from the mapping
+
+struct PostcardDataHeader
+{
+    char magic[4]; // "BTPD"
+    uint32_t version;
+};
+static_assert(sizeof(PostcardDataHeader) == 8);
+
+struct PostcardRecordHeader
+{
+    uint64_t hash;
+    uint32_t length;
+    uint32_t reserved;
+
+    // data, padded to 8 bytes
+};
+static_assert(sizeof(PostcardRecordHeader) == 16);
+
+struct PostcardIndexHeader
+{
+    char magic[4]; // "BTPI"
+    uint32_t version;
+    uint32_t slotCount; // power of two
+    uint32_t count;
+    uint64_t dataEnd; // where the next record goes
+};
+static_assert(sizeof(PostcardIndexHeader) == 24);
+
+struct PostcardIndexSlot
+{
+    uint64_t hash;
+    uint64_t offset; // of the record header, 0 if empty
+};
+static_assert(sizeof(PostcardIndexSlot) == 16);
+
+class PostcardStore final
+{
+public:
+    static PostcardStore &get();
+
+    ~PostcardStore();
+
+    // opens/creates path.dat and path.idx, the data file can't grow past maxDataSize
+    bool open(const std::string &path, size_t maxDataSize);
+    void close();
+
+    bool isOpen() const
+    {
+        return dataMap != nullptr;
+    }
+
+    // returns the stored copy (which is valid until close), or null if the store is full
+    const uint8_t *store(const uint8_t *data, uint32_t len, bool *isNew = nullptr);
+    const uint8_t *store(const uint8_t *data, uint32_t len, uint64_t dataHash, bool *isNew = nullptr); // hash is hash(data, len)
+
+    const uint8_t *find(const uint8_t *data, uint32_t len) const;
+    const uint8_t *find(uint64_t dataHash, const uint8_t *data, uint32_t len) const; // only compares, for a known hash
+
+    uint32_t getCount() const;
+    uint64_t getDataSize() const;
+
+    static uint64_t hash(const uint8_t *data, size_t len);
+
+private:
+    PostcardStore() = default;
+
+    const PostcardIndexSlot *findSlot(uint64_t hash, const uint8_t *data, uint32_t len) const;
+    bool growIndex();
+    bool ensureDataSize(uint64_t size);
+
+    std::string path;
+
+    int dataFd = -1;
+    uint8_t *dataMap = nullptr;
+    size_t dataMapSize = 0; // reserved, can be bigger than the file
+    uint64_t dataFileSize = 0;
+
+    int indexFd = -1;
+    uint8_t *indexMap = nullptr;
+    size_t indexMapSize = 0;
+
+    PostcardIndexHeader *indexHeader = nullptr;
+    PostcardIndexSlot *slots = nullptr;
+};
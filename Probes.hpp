@@ -0,0 +1,44 @@
+#pragma once
+
+// USDT probes (provider "bricktrain") for attaching bpftrace/perf to a running server, see tools/bpftrace
+// each one is a single nop until something attaches, arguments are only evaluated then
+// needs sys/sdt.h (systemtap-sdt-dev/systemtap-sdt-devel) when building, otherwise they compile to nothing
+// list them with: bpftrace -l 'usdt:./BrickTrainServer:*'
+//
+// client_accept(address)
+// dplay_command(address, command, len, viaRP)
+// rp_frame(address, fromId, toId, flags, messageId, sequence)
+// rp_message(address, messageId, len)
+// rp_ack(address, messageId, sequence)
+// loco_message(address, command, srcPlayerId, dstPlayerId, len)
+// player_create(id, systemPlayerId)
+// player_delete(id, systemPlayerId)
+// drop(reason, address), address is empty if it isn't known
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_USDT_PROBES 1
+#endif
+#endif
+
+#ifdef HAVE_USDT_PROBES
+
+#define PROBE1(name, a) DTRACE_PROBE1(bricktrain, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(bricktrain, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(bricktrain, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(bricktrain, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(bricktrain, name, a, b, c, d, e)
+#define PROBE6(name, a, b, c, d, e, f) DTRACE_PROBE6(bricktrain, name, a, b, c, d, e, f)
+
+#else
+
+// the arguments are still "used" (but not evaluated) so nothing that's only there for a probe warns
+#define PROBE1(name, a) do { (void)sizeof(a); } while(0)
+#define PROBE2(name, a, b) do { PROBE1(name, a); (void)sizeof(b); } while(0)
+#define PROBE3(name, a, b, c) do { PROBE2(name, a, b); (void)sizeof(c); } while(0)
+#define PROBE4(name, a, b, c, d) do { PROBE3(name, a, b, c); (void)sizeof(d); } while(0)
+#define PROBE5(name, a, b, c, d, e) do { PROBE4(name, a, b, c, d); (void)sizeof(e); } while(0)
+#define PROBE6(name, a, b, c, d, e, f) do { PROBE5(name, a, b, c, d, e); (void)sizeof(f); } while(0)
+
+#endif
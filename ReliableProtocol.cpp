@@ -0,0 +1,268 @@
+#include <cstring>
+
+#include "DirectPlayMessage.hpp"
+#include "Logger.hpp"
+#include "Probes.hpp"
+#include "ReliableProtocol.hpp"
+#include "ServerMetrics.hpp"
+
+static bool parseRPId(const uint8_t *&ptr, const uint8_t *end, uint16_t &id)
+{
+    if(ptr == end)
+        return false;
+
+    id = *ptr++;
+
+    if(id & 0x80)
+    {
+        if(ptr == end)
+            return false;
+
+        id = (id & 0x7F) | (*ptr++) << 7;
+    }
+
+    if(id & 0x4000)
+    {
+        if(ptr == end)
+            return false;
+
+        id = (id & 0x3FFF) | (*ptr++) << 14;
+    }
+
+    return true;
+}
+
+static uint8_t *fillRPId(uint8_t *data, uint16_t id)
+{
+    if(id < 128)
+        *data++ = id & 0x7F;
+    else if(id < 16384)
+    {
+        *data++ = (id & 0x7F) | 0x80;
+        *data++ = id >> 7;
+    }
+    else
+    {
+        *data++ = (id & 0x7F) | 0x80;
+        *data++ = ((id >> 7) & 0x7F) | 0x80;
+        *data++ = id >> 14;
+    }
+
+    return data;
+}
+
+bool parseRPHeader(const uint8_t *data, size_t len, RPFrameHeader &header)
+{
+    auto ptr = data;
+    auto end = data + len;
+
+    // variable length ids
+    if(!parseRPId(ptr, end, header.fromId) || !parseRPId(ptr, end, header.toId))
+        return false;
+
+    header.idLength = ptr - data;
+
+    // make sure we have enough for the rest of the header
+    if(end - ptr < 4)
+        return false;
+
+    header.flags = *ptr++;
+    header.messageId = *ptr++;
+    header.sequence = *ptr++;
+    header.serial = *ptr++;
+
+    header.length = ptr - data;
+
+    return true;
+}
+
+size_t getRPHeaderSize(uint16_t from, uint16_t to)
+{
+    size_t ret = 4;
+
+    if(to < 128)
+        ret += 1;
+    else if(to < 16384)
+        ret += 2;
+    else
+        ret += 3;
+
+    if(from < 128)
+        ret += 1;
+    else if(from < 16384)
+        ret += 2;
+    else
+        ret += 3;
+
+    return ret;
+}
+
+uint8_t *fillRPHeader(uint8_t *data, uint16_t from, uint16_t to, uint8_t flags, uint8_t messageId, uint8_t sequence, uint8_t serial)
+{
+    data = fillRPId(data, from);
+    data = fillRPId(data, to);
+
+    // flags
+    *data++ = flags;
+
+    // nack has ext flags here (but ext flags aren't implemented)
+    // ... and neither are nacks
+
+    *data++ = messageId;
+    *data++ = sequence;
+    *data++ = serial; // not for nack
+
+    return data;
+}
+
+std::atomic<size_t> RPReceiver::maxMessageSize{1024 * 1024};
+
+bool RPReceiver::handleFrame(const uint8_t *data, size_t len, RPReceivedFrame &frame)
+{
+    auto &header = frame.header;
+
+    frame.message = nullptr;
+    frame.messageLen = 0;
+    frame.needsAck = false;
+
+    if(!parseRPHeader(data, len, header))
+    {
+        LOG_WARNING(RP, "short frame? %zu", len);
+        serverMetrics.rpShortFrames->inc();
+        PROBE2(drop, "rp_short_frame", "");
+        return false;
+    }
+
+    auto flags = header.flags;
+
+    if(flags & DPRPFrame_Extended)
+    {
+        LOG_WARNING(RP, "ext flags");
+        return false;
+    }
+
+    auto ptr = data + header.length;
+    size_t dataLen = len - header.length;
+
+    dataReceived += len - header.idLength;
+
+    serverMetrics.rpFramesReceived->inc();
+
+    // validate player indices
+    if(header.toId != 0)
+    {
+        LOG_WARNING(RP, "frame to %i", header.toId);
+        return false;
+    }
+
+    // check message id
+    // if no ongoing/completed recv, first recv = message id
+    // if message id outside first ongoing/completed recv -> +23, discard
+    // if not receiving this id, add to list
+    // if already received, send ack (prev one got lost)
+
+    // send nack if unexpected sequence
+    // ... or don't as sequence numbers are always 1 and nacks are unimplemented?
+
+    if(flags & DPRPFrame_Ack)
+    {
+        LOG_DEBUG(RP, "rp ack");
+    }
+    else if((flags & DPRPFrame_Start) && (flags & DPRPFrame_End))
+    {
+        // single frame message, avoid all the copying
+        frame.message = ptr;
+        frame.messageLen = dataLen;
+    }
+    else
+    {
+        // basic message assembly
+        if(flags & DPRPFrame_Start)
+        {
+            if(currentMessageId != -1)
+                LOG_WARNING(RP, "rp multi msg");
+
+            currentMessageId = header.messageId;
+            nextMessageSequence = header.sequence + 1;
+
+            if(messageBuffer.capacity() > maxRetainedBuffer)
+                messageBuffer = std::vector<uint8_t>();
+
+            // copy initial data
+            messageBuffer.resize(dataLen);
+            memcpy(messageBuffer.data(), ptr, dataLen);
+        }
+        else if(currentMessageId != -1 && header.sequence == nextMessageSequence)
+        {
+            if(messageBuffer.size() + dataLen > maxMessageSize.load(std::memory_order_relaxed))
+            {
+                LOG_WARNING(RP, "rp message over %zu bytes", maxMessageSize.load(std::memory_order_relaxed));
+                serverMetrics.rpMessagesTooBig->inc();
+                PROBE2(drop, "rp_message_too_big", "");
+                dropMessage();
+                return false;
+            }
+
+            // append
+            auto offset = messageBuffer.size();
+            messageBuffer.resize(offset + dataLen);
+            memcpy(messageBuffer.data() + offset, ptr, dataLen);
+
+            nextMessageSequence++;
+        }
+        else
+        {
+            LOG_WARNING(RP, "rp seq err");
+            serverMetrics.rpSeqErrors->inc();
+            PROBE2(drop, "rp_seq_err", "");
+            return false;
+        }
+
+        if(flags & DPRPFrame_End)
+        {
+            frame.message = messageBuffer.data();
+            frame.messageLen = messageBuffer.size();
+            currentMessageId = -1;
+        }
+    }
+
+    // ack if requested or end of message
+    frame.needsAck = flags & (DPRPFrame_End | DPRPFrame_SendAck);
+
+    return true;
+}
+
+size_t RPReceiver::fillAck(uint8_t *data, const RPFrameHeader &header, uint32_t tickCount) const
+{
+    uint8_t flags = DPRPFrame_Ack | (header.flags & DPRPFrame_Reliable); // reliably ack a reliable packet
+
+    auto ptr = fillRPHeader(data, header.toId, header.fromId, flags, header.messageId, header.sequence, header.serial);
+
+    memcpy(ptr, &dataReceived, 4);
+    memcpy(ptr + 4, &tickCount, 4);
+
+    return ptr + 8 - data;
+}
+
+void RPReceiver::dropMessage()
+{
+    // the rest of its frames are sequence errors
+    currentMessageId = -1;
+    messageBuffer = std::vector<uint8_t>();
+}
+
+void RPReceiver::serialize(StateWriter &writer) const
+{
+    writer.write(dataReceived);
+    writer.write<int32_t>(currentMessageId);
+    writer.write(nextMessageSequence);
+    writer.writeBytes(messageBuffer.data(), messageBuffer.size());
+}
+
+void RPReceiver::deserialize(StateReader &reader)
+{
+    dataReceived = reader.read<uint32_t>();
+    currentMessageId = reader.read<int32_t>();
+    nextMessageSequence = reader.read<uint8_t>();
+    messageBuffer = reader.readBytes();
+}
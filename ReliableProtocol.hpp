@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "StateBuffer.hpp"
+
+// DirectPlay "reliable protocol" frame headers
+// variable length from/to ids, then flags, message id, sequence and serial
+
+// max data we put in one frame, keeps frames under a typical MTU
+constexpr size_t maxRPFramePayload = 1400;
+
+struct RPFrameHeader
+{
+    uint16_t fromId, toId;
+
+    uint8_t flags;
+    uint8_t messageId;
+    uint8_t sequence;
+    uint8_t serial;
+
+    size_t idLength; // not counted in the ack data total
+    size_t length; // including the ids
+};
+
+// returns false if the frame is too short
+bool parseRPHeader(const uint8_t *data, size_t len, RPFrameHeader &header);
+
+size_t getRPHeaderSize(uint16_t from, uint16_t to);
+uint8_t *fillRPHeader(uint8_t *data, uint16_t from, uint16_t to, uint8_t flags, uint8_t messageId, uint8_t sequence, uint8_t serial);
+
+// an incoming frame after RPReceiver has handled it
+struct RPReceivedFrame
+{
+    RPFrameHeader header;
+
+    // a completed message, points into the frame or the receiver's buffer until the next frame
+    const uint8_t *message = nullptr;
+    size_t messageLen = 0;
+
+    bool needsAck = false;
+};
+
+// reassembles incoming frames into messages and keeps the totals for acking them
+class RPReceiver final
+{
+public:
+    static constexpr size_t maxAckSize = 10 + 8; // largest header + data
+
+    // returns false if the frame should be dropped
+    bool handleFrame(const uint8_t *data, size_t len, RPReceivedFrame &frame);
+
+    // returns the size
+    size_t fillAck(uint8_t *data, const RPFrameHeader &header, uint32_t tickCount) const;
+
+    // same for a resent frame, so a queued ack can be replaced
+    static uint32_t getAckKey(const RPFrameHeader &header)
+    {
+        return 1 << 16 | header.messageId << 8 | header.sequence;
+    }
+
+    // reassembled messages over this are dropped, shared by all receivers (and the pipeline's threads)
+    static void setMaxMessageSize(size_t size)
+    {
+        maxMessageSize.store(size, std::memory_order_relaxed);
+    }
+
+    // the reassembly buffer
+    size_t getMemoryUsage() const
+    {
+        return messageBuffer.capacity();
+    }
+
+    void serialize(StateWriter &writer) const;
+    void deserialize(StateReader &reader);
+
+private:
+    // kept between messages up to this, so one big message doesn't hold on to memory
+    static constexpr size_t maxRetainedBuffer = 16 * 1024;
+
+    static std::atomic<size_t> maxMessageSize;
+
+    void dropMessage();
+
+    uint32_t dataReceived = 0;
+
+    // TODO: docs suggest that multiple messages can be in flight at once
+    int currentMessageId = -1;
+    uint8_t nextMessageSequence = 0;
+    std::vector<uint8_t> messageBuffer;
+};
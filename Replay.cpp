@@ -0,0 +1,242 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include "Capture.hpp"
+#include "Client.hpp"
+#include "IniFile.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "ServerMetrics.hpp"
+#include "Session.hpp"
+#include "Trace.hpp"
+
+// feeds a capture from the server back through the client handlers
+
+static void printLatencies(const char *name, std::vector<uint64_t> &times)
+{
+    if(times.empty())
+        return;
+
+    std::sort(times.begin(), times.end());
+
+    auto percentile = [&times](double p)
+    {
+        auto index = static_cast<size_t>(p * (times.size() - 1));
+        return times[index] / 1000.0;
+    };
+
+    uint64_t total = 0;
+    for(auto &t : times)
+        total += t;
+
+    printf("%-10s %8zu msgs, mean %8.2fus, p50 %8.2fus, p90 %8.2fus, p99 %8.2fus, p99.9 %8.2fus, max %8.2fus\n", name, times.size(),
+           total / 1000.0 / times.size(), percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), times.back() / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *capturePath = nullptr;
+    const char *configPath = "./config.ini";
+    const char *tracePath = nullptr;
+    bool recordedSpeed = false;
+    bool verbose = false;
+    int iterations = 1;
+
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--speed") == 0 && i + 1 < argc)
+        {
+            i++;
+            if(strcmp(argv[i], "recorded") == 0)
+                recordedSpeed = true;
+            else if(strcmp(argv[i], "max") != 0)
+            {
+                std::cerr << "unknown speed " << argv[i] << "\n";
+                return 1;
+            }
+        }
+        else if(strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+            configPath = argv[++i];
+        else if(strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = std::max(1, atoi(argv[++i]));
+        else if(strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            tracePath = argv[++i];
+        else if(strcmp(argv[i], "--verbose") == 0)
+            verbose = true;
+        else if(!capturePath && argv[i][0] != '-')
+            capturePath = argv[i];
+        else
+        {
+            std::cerr << "unknown argument " << argv[i] << "\n";
+            return 1;
+        }
+    }
+
+    if(!capturePath)
+    {
+        std::cerr << "usage: " << argv[0] << " capture.bin [--speed max|recorded] [--iterations n] [--config config.ini] [--trace trace.json] [--verbose]\n";
+        return 1;
+    }
+
+    // same setup as the server
+    IniFile config(configPath);
+
+    auto port = config.getIntValue("Server", "Port");
+    auto sessionName = config.getValue("Server", "SessionName");
+    auto guid = config.getValue("Server", "AppGUID");
+
+    uint8_t appGUID[16];
+
+    if(!port || !sessionName || !guid || !parseGUID(*guid, appGUID))
+    {
+        std::cerr << "failed to get config from " << configPath << "\n";
+        return 1;
+    }
+
+    // default to quiet, logging would dominate the timings
+    if(verbose)
+        Logger::get().configure(config);
+    else
+        Logger::get().setLevel(LogLevel::Warning);
+
+    Logger::get().start();
+
+    // spans add a little to the timings
+    if(tracePath)
+        Tracer::get().setEnabled(true);
+
+    // load the whole thing so file reads don't end up in the timings
+    std::vector<CaptureReader::Record> records;
+
+    {
+        CaptureReader reader;
+
+        if(!reader.open(capturePath))
+        {
+            std::cerr << "failed to open capture " << capturePath << "\n";
+            return 1;
+        }
+
+        CaptureReader::Record record;
+        while(reader.read(record))
+            records.push_back(record);
+    }
+
+    std::vector<uint64_t> dplayTimes, rpTimes;
+    size_t inputBytes = 0, capturedOutputs = 0;
+
+    auto &metrics = MetricsRegistry::get();
+    auto outputsBefore = metrics.getCounterValue(*serverMetrics.tcpPacketsSent) + metrics.getCounterValue(*serverMetrics.rpPacketsSent);
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    for(int iteration = 0; iteration < iterations; iteration++)
+    {
+        uint32_t sessionFlags = DPSession_ReliableProtocol | DPSession_OptimiseLatency;
+        if(config.getIntValue("Server", "RouteThroughHost").value_or(0))
+            sessionFlags |= DPSession_RouteThroughHost;
+        Session session(std::string(*sessionName), appGUID, sessionFlags);
+        session.setMaxPlayers(config.getIntValue("Server", "MaxPlayers").value_or(10));
+        session.createLocalSystemPlayer(*port);
+
+        std::map<std::string, Client> clients;
+        std::vector<RosterMessage> rosterMessages;
+
+        auto iterationStart = std::chrono::steady_clock::now();
+
+        for(auto &record : records)
+        {
+            if(recordedSpeed)
+                std::this_thread::sleep_until(iterationStart + std::chrono::nanoseconds(record.timestamp));
+
+            if(record.type == CaptureType::TCPOut || record.type == CaptureType::RPOut)
+            {
+                capturedOutputs++;
+                continue;
+            }
+
+            if(record.type == CaptureType::Disconnect)
+            {
+                // same as a clean disconnect, a timeout would have also sent YouAreDead
+                auto it = clients.find(record.key);
+                if(it != clients.end())
+                    it->second.leave(false);
+
+                clients.erase(record.key);
+                continue;
+            }
+
+            auto it = clients.find(record.key);
+
+            if(it == clients.end())
+            {
+                it = clients.try_emplace(record.key, session, record.key, *port).first;
+                it->second.setReplayMode(true);
+            }
+
+            auto &client = it->second;
+            inputBytes += record.data.size();
+
+            auto handleStart = std::chrono::steady_clock::now();
+
+            if(record.type == CaptureType::RPIn)
+            {
+                client.handleRPFrame(record.data.data(), record.data.size());
+                rpTimes.push_back((std::chrono::steady_clock::now() - handleStart).count());
+            }
+            else
+            {
+                size_t parsedLen = record.data.size();
+                client.handleDPlayPacket(record.data.data(), parsedLen);
+                dplayTimes.push_back((std::chrono::steady_clock::now() - handleStart).count());
+            }
+
+            // there's no tick here, send them right away
+            if(!session.getRosterChanges().empty())
+            {
+                Client::encodeRosterChanges(session, rosterMessages);
+
+                for(auto &other : clients)
+                    other.second.sendRosterChanges(rosterMessages);
+
+                session.clearRosterChanges();
+            }
+        }
+    }
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+    auto outputs = metrics.getCounterValue(*serverMetrics.tcpPacketsSent) + metrics.getCounterValue(*serverMetrics.rpPacketsSent) - outputsBefore;
+    auto inputs = dplayTimes.size() + rpTimes.size();
+
+    Logger::get().stop();
+
+    printf("replayed %zu records (%zu inputs) x %i in %.3fs\n", records.size(), inputs / iterations, iterations, elapsed);
+    printf("throughput: %.0f msgs/s, %.2f MB/s\n", inputs / elapsed, inputBytes / elapsed / 1000000.0);
+    printf("outputs: %zu (captured %zu)\n", size_t(outputs), capturedOutputs);
+
+    printLatencies("dplay", dplayTimes);
+    printLatencies("rp", rpTimes);
+
+    if(tracePath)
+    {
+        Tracer::get().flushThread();
+
+        std::ofstream traceFile(tracePath);
+        traceFile << Tracer::get().exportChromeTrace();
+
+        if(!traceFile)
+        {
+            std::cerr << "failed to write trace " << tracePath << "\n";
+            return 1;
+        }
+    }
+
+    return 0;
+}
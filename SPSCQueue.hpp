@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// bounded lock-free ring for exactly one producer thread and one consumer thread
+template<class T>
+class SPSCQueue final
+{
+public:
+    // rounded up to a power of two
+    explicit SPSCQueue(size_t capacity)
+    {
+        size_t size = 1;
+        while(size < capacity)
+            size <<= 1;
+
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    SPSCQueue(const SPSCQueue &) = delete;
+
+    // producer only, false if full
+    bool push(T &&value)
+    {
+        auto pos = tail.load(std::memory_order_relaxed);
+
+        if(pos - cachedHead > mask)
+        {
+            cachedHead = head.load(std::memory_order_acquire);
+
+            if(pos - cachedHead > mask)
+                return false;
+        }
+
+        slots[pos & mask] = std::move(value);
+        tail.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // consumer only, false if empty
+    bool pop(T &value)
+    {
+        auto pos = head.load(std::memory_order_relaxed);
+
+        if(pos == cachedTail)
+        {
+            cachedTail = tail.load(std::memory_order_acquire);
+
+            if(pos == cachedTail)
+                return false;
+        }
+
+        value = std::move(slots[pos & mask]);
+        head.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+private:
+    std::vector<T> slots;
+    size_t mask;
+
+    // each side keeps a copy of the other's position to avoid touching its cache line on every call
+    alignas(64) std::atomic<size_t> head{0};
+    size_t cachedTail = 0;
+
+    alignas(64) std::atomic<size_t> tail{0};
+    size_t cachedHead = 0;
+};
@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <functional>
+
+#include "Capture.hpp"
+#include "Logger.hpp"
+#include "Probes.hpp"
+#include "ServerLoop.hpp"
+#include "ServerMetrics.hpp"
+#include "Trace.hpp"
+
+ServerLoop::ServerLoop(Session &session, ClientMap &clients) : session(session), clients(clients)
+{
+    nextTick = nextFlush = Clock::now() + tickInterval;
+}
+
+bool ServerLoop::hasQueuedOutput() const
+{
+    for(auto &client : clients)
+    {
+        if(client.second.hasQueuedOutput())
+            return true;
+    }
+
+    return false;
+}
+
+Clock::time_point ServerLoop::getWakeTime(bool queuedOutput) const
+{
+    return queuedOutput ? std::min(nextTick, nextFlush) : nextTick;
+}
+
+bool ServerLoop::update(Clock::time_point now, bool queuedOutput)
+{
+    // everything queued since the last flush goes out together, the first after a quiet spell goes right away
+    if(now >= nextFlush)
+    {
+        if(queuedOutput)
+        {
+            TRACE_SPAN("flush");
+
+            for(auto &client : clients)
+                client.second.flushOutput();
+        }
+
+        nextFlush = now + Client::getFlushInterval();
+    }
+
+    if(now < nextTick)
+        return false;
+
+    tick(now);
+    nextTick = now + tickInterval;
+
+    return true;
+}
+
+void ServerLoop::handleBroadcastPacket(ClientMap::iterator it, const uint8_t *data, int len, std::chrono::system_clock::time_point arrival)
+{
+    if(len <= 0)
+        return;
+
+    serverMetrics.broadcastPacketsReceived->inc();
+    serverMetrics.broadcastBytesReceived->inc(len);
+
+    CaptureWriter::get().record(CaptureType::BroadcastIn, it->first, data, len);
+
+    // parse directplay packet
+    size_t parsedLen = len;
+    it->second.handleDPlayPacket(data, parsedLen, arrival);
+
+    // should have one packet
+    if(parsedLen != static_cast<size_t>(len))
+    {
+        LOG_WARNING(Net, "udp packet size mismatch %zu/%i", parsedLen, len);
+        serverMetrics.udpSizeMismatches->inc();
+        PROBE2(drop, "udp_size_mismatch", it->first.c_str());
+    }
+}
+
+ServerLoop::ClientMap::iterator ServerLoop::handleTCPRead(ClientMap::iterator it)
+{
+    // TODO: move most of this to client
+    auto &client = *it;
+    auto &socket = client.second.getTCPIncomingSocket();
+    uint8_t buf[2048];
+    int len = socket.recv(buf, sizeof(buf));
+
+    if(len == 0)
+    {
+        // disconnect
+        LOG_INFO(Net, "tcp disconnect %s", client.first.c_str());
+        CaptureWriter::get().record(CaptureType::Disconnect, client.first, nullptr, 0);
+        serverMetrics.clientsDisconnected->inc();
+        socket.close();
+
+        client.second.leave(false);
+
+        return clients.erase(it);
+    }
+    else if(len > 0)
+    {
+        LOG_DEBUG(Net, "tcp recv %i from %s", len, client.first.c_str());
+
+        serverMetrics.tcpPacketsReceived->inc();
+        serverMetrics.tcpBytesReceived->inc(len);
+
+        CaptureWriter::get().record(CaptureType::TCPIn, client.first, buf, len);
+
+        // FIXME: buffering
+        size_t parsedLen = len;
+        client.second.handleDPlayPacket(buf, parsedLen, socket.getReceiveTime());
+
+        // FIXME: can have multiple packets
+        if(parsedLen != static_cast<size_t>(len))
+        {
+            LOG_WARNING(Net, "tcp need buf %zu/%i", parsedLen, len);
+            serverMetrics.tcpNeedBufs->inc();
+            PROBE2(drop, "tcp_need_buf", client.first.c_str());
+        }
+    }
+
+    return it;
+}
+
+void ServerLoop::broadcastRosterChanges()
+{
+    // everything that changed since the last tick, one write per client
+    if(session.getRosterChanges().empty())
+        return;
+
+    Client::encodeRosterChanges(session, rosterMessages);
+
+    for(auto &client : clients)
+        client.second.sendRosterChanges(rosterMessages);
+
+    session.clearRosterChanges();
+}
+
+void ServerLoop::tick(Clock::time_point now)
+{
+    TRACE_SPAN("tick");
+
+    for(auto it = clients.begin(); it != clients.end();)
+    {
+        if(it->second.hasTimedOut(now))
+        {
+            LOG_INFO(Net, "timed out %s", it->first.c_str());
+            CaptureWriter::get().record(CaptureType::Disconnect, it->first, nullptr, 0);
+            serverMetrics.clientsTimedOut->inc();
+
+            it->second.leave(true);
+            it = clients.erase(it);
+            continue;
+        }
+
+        it->second.update(now);
+        ++it;
+    }
+
+    checkMemoryLimits();
+
+    broadcastRosterChanges();
+
+    serverMetrics.clients->set(clients.size());
+    serverMetrics.players->set(session.getCurrentPlayers());
+}
+
+// removes clients over their own limit, then the largest ones until everything fits in the session limit
+void ServerLoop::checkMemoryLimits()
+{
+    auto &limits = Client::getMemoryLimits();
+
+    auto remove = [this](ClientMap::iterator it, size_t bytes)
+    {
+        LOG_WARNING(Net, "%s is using %zu bytes, removing it", it->first.c_str(), bytes);
+        CaptureWriter::get().record(CaptureType::Disconnect, it->first, nullptr, 0);
+        serverMetrics.clientsOverMemory->inc();
+
+        it->second.leave(true);
+        return clients.erase(it);
+    };
+
+    // players are counted against their client's limit, and in the session for the total
+    std::vector<std::pair<size_t, std::string>> usage;
+    size_t clientTotal = 0;
+
+    for(auto it = clients.begin(); it != clients.end();)
+    {
+        auto bytes = it->second.getMemoryUsage();
+        auto playerBytes = it->second.getPlayerMemoryUsage();
+
+        if(limits.clientBytes && bytes + playerBytes > limits.clientBytes)
+        {
+            it = remove(it, bytes + playerBytes);
+            continue;
+        }
+
+        usage.emplace_back(bytes + playerBytes, it->first);
+        clientTotal += bytes;
+        ++it;
+    }
+
+    auto sessionBytes = session.getMemoryUsage();
+
+    if(limits.sessionBytes && clientTotal + sessionBytes > limits.sessionBytes)
+    {
+        std::sort(usage.begin(), usage.end(), std::greater<>());
+
+        for(auto &client : usage)
+        {
+            if(clientTotal + sessionBytes <= limits.sessionBytes)
+                break;
+
+            auto it = clients.find(client.second);
+            auto bytes = it->second.getMemoryUsage();
+
+            remove(it, client.first);
+
+            clientTotal -= bytes;
+            sessionBytes = session.getMemoryUsage();
+        }
+    }
+
+    serverMetrics.clientMemory->set(clientTotal);
+    serverMetrics.sessionMemory->set(sessionBytes);
+
+    auto players = session.getCurrentPlayers();
+    serverMetrics.memoryPerPlayer->set(players ? (clientTotal + sessionBytes) / players : 0);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "Client.hpp"
+#include "Clock.hpp"
+#include "Session.hpp"
+
+// the parts of the main loop that don't depend on how sockets are waited for
+// (flushing, ticks, timeouts, memory limits, roster changes and reading clients' TCP)
+// shared by the server and the simulator, so that the simulator runs the same code
+class ServerLoop final
+{
+public:
+    // how often clients get to do periodic work (pings)
+    static constexpr auto tickInterval = std::chrono::milliseconds(100);
+
+    using ClientMap = std::map<std::string, Client>;
+
+    ServerLoop(Session &session, ClientMap &clients);
+    ServerLoop(ServerLoop &) = delete;
+
+    // anything waiting for a flush
+    bool hasQueuedOutput() const;
+
+    // when update has something to do, the next tick or sooner if there's output waiting
+    Clock::time_point getWakeTime(bool queuedOutput) const;
+
+    // flushes output and ticks if it's time, returns true if it ticked
+    bool update(Clock::time_point now, bool queuedOutput);
+
+    // a packet from the broadcast socket (EnumSessions), it is the client for the source address
+    void handleBroadcastPacket(ClientMap::iterator it, const uint8_t *data, int len, std::chrono::system_clock::time_point arrival);
+
+    // sends the roster changes since the last tick, done every tick and before handing off to a new server
+    void broadcastRosterChanges();
+
+    // the client's incoming TCP socket is readable, it's removed if it disconnected
+    // returns the next client in that case, it otherwise
+    ClientMap::iterator handleTCPRead(ClientMap::iterator it);
+
+private:
+    void tick(Clock::time_point now);
+    void checkMemoryLimits();
+
+    Session &session;
+    ClientMap &clients;
+
+    Clock::time_point nextTick, nextFlush;
+
+    std::vector<RosterMessage> rosterMessages;
+};
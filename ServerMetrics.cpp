@@ -0,0 +1,95 @@
+#include <string>
+
+#include "ServerMetrics.hpp"
+
+ServerMetrics serverMetrics;
+
+ServerMetrics::ServerMetrics()
+{
+    auto &registry = MetricsRegistry::get();
+
+    tcpPacketsReceived = &registry.addCounter("packets_received_total", "Packets received", "transport=\"tcp\"");
+    broadcastPacketsReceived = &registry.addCounter("packets_received_total", "Packets received", "transport=\"udp_broadcast\"");
+    rpPacketsReceived = &registry.addCounter("packets_received_total", "Packets received", "transport=\"rp\"");
+
+    tcpBytesReceived = &registry.addCounter("bytes_received_total", "Bytes received", "transport=\"tcp\"");
+    broadcastBytesReceived = &registry.addCounter("bytes_received_total", "Bytes received", "transport=\"udp_broadcast\"");
+    rpBytesReceived = &registry.addCounter("bytes_received_total", "Bytes received", "transport=\"rp\"");
+
+    tcpPacketsSent = &registry.addCounter("packets_sent_total", "Packets sent", "transport=\"tcp\"");
+    rpPacketsSent = &registry.addCounter("packets_sent_total", "Packets sent", "transport=\"rp\"");
+
+    tcpBytesSent = &registry.addCounter("bytes_sent_total", "Bytes sent", "transport=\"tcp\"");
+    rpBytesSent = &registry.addCounter("bytes_sent_total", "Bytes sent", "transport=\"rp\"");
+
+    rpSeqErrors = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"rp_seq_err\"");
+    rpShortFrames = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"rp_short_frame\"");
+    udpSizeMismatches = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"udp_size_mismatch\"");
+    tcpNeedBufs = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"tcp_need_buf\"");
+    unhandledCommands = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"unhandled_command\"");
+    playerMessagesDropped = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"player_message_unroutable\"");
+    rpMessagesTooBig = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"rp_message_too_big\"");
+    malformedCommands = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"malformed_command\"");
+    udpUnknownSources = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"udp_unknown_source\"");
+    locoNotOwned = &registry.addCounter("dropped_total", "Dropped packets/messages", "reason=\"loco_message_not_owned\"");
+
+    for(int i = 0; i < maxCommand; i++)
+        commands[i] = &registry.addCounter("dplay_commands_total", "DirectPlay commands handled", "command=\"" + std::to_string(i) + "\"");
+
+    for(int i = 0; i < maxCommand; i++)
+        commandTimes[i] = &registry.addHistogram("dplay_command_duration_seconds", "Time spent handling DirectPlay commands", "command=\"" + std::to_string(i) + "\"");
+
+    for(int i = 0; i < maxCommand; i++)
+        commandQueueDelays[i] = &registry.addHistogram("dplay_command_queue_delay_seconds", "Time from the kernel receiving a DirectPlay command to handling it (timestamped sockets only)", "command=\"" + std::to_string(i) + "\"");
+
+    rpFramesReceived = &registry.addCounter("rp_frames_received_total", "Reliable protocol frames received");
+    rpAcksSent = &registry.addCounter("rp_acks_sent_total", "Reliable protocol acks sent");
+    rpAcksCoalesced = &registry.addCounter("rp_acks_coalesced_total", "Queued acks replaced by a newer one for the same frame");
+    rpMessages = &registry.addCounter("rp_messages_total", "Reliable protocol messages completed");
+    rpFlushes = &registry.addCounter("rp_flushes_total", "Batches of queued reliable protocol frames sent");
+    rpFrameTime = &registry.addHistogram("rp_frame_duration_seconds", "Time spent handling a reliable protocol frame");
+
+    locoRelayed = &registry.addCounter("loco_messages_relayed_total", "Loco messages relayed to another player", "type=\"direct\"");
+    locoBroadcasts = &registry.addCounter("loco_messages_relayed_total", "Loco messages relayed to another player", "type=\"broadcast\"");
+    locoUnroutable = &registry.addCounter("loco_messages_unroutable_total", "Loco messages for an unknown player");
+
+    playerMessagesRelayed = &registry.addCounter("dplay_player_messages_relayed_total", "DirectPlay player messages forwarded by the host");
+
+    postcardsStored = &registry.addCounter("postcards_total", "Postcard messages stored", "result=\"new\"");
+    postcardsDeduplicated = &registry.addCounter("postcards_total", "Postcard messages stored", "result=\"duplicate\"");
+    usersCreated = &registry.addCounter("loco_users_total", "Users seen by postcard upload", "result=\"new\"");
+    usersReturning = &registry.addCounter("loco_users_total", "Users seen by postcard upload", "result=\"returning\"");
+    configReloads = &registry.addCounter("config_reloads_total", "Config file reloads", "result=\"applied\"");
+    configReloadsRejected = &registry.addCounter("config_reloads_total", "Config file reloads", "result=\"rejected\"");
+    pingsSent = &registry.addCounter("dplay_pings_total", "DirectPlay pings", "direction=\"out\"");
+    pingsAnswered = &registry.addCounter("dplay_pings_total", "DirectPlay pings", "direction=\"in\"");
+    pingsLost = &registry.addCounter("dplay_pings_lost_total", "Pings sent by us that weren't answered before the next one");
+    joinsRejectedLatency = &registry.addCounter("dplay_joins_rejected_total", "Clients turned away before getting a player", "reason=\"latency\"");
+    joinsRejectedFull = &registry.addCounter("dplay_joins_rejected_total", "Clients turned away before getting a player", "reason=\"full\"");
+    clientsDisconnected = &registry.addCounter("clients_removed_total", "Clients removed from the session", "reason=\"disconnect\"");
+    clientsTimedOut = &registry.addCounter("clients_removed_total", "Clients removed from the session", "reason=\"timeout\"");
+    clientsOverMemory = &registry.addCounter("clients_removed_total", "Clients removed from the session", "reason=\"memory\"");
+    rosterChanges = &registry.addCounter("dplay_roster_changes_total", "Players created, deleted or changed, before coalescing");
+    rosterMessagesSent = &registry.addCounter("dplay_roster_messages_sent_total", "CreatePlayer/DeletePlayer/PlayerDataChanged/PlayerNameChanged messages sent to other clients");
+    rosterBatchesSent = &registry.addCounter("dplay_roster_batches_sent_total", "Writes of roster messages, at most one per client per tick");
+    socketDrops = &registry.addCounter("socket_receive_drops_total", "UDP packets dropped by the kernel with a full receive buffer (auto-tuned sockets only)");
+    socketBufferGrows = &registry.addCounter("socket_receive_buffer_grows_total", "UDP receive buffers grown by the auto-tuner");
+    pipelineInputsHeld = &registry.addCounter("pipeline_queue_full_total", "Messages that found a pipeline queue full (input: held by an I/O thread, output: the logic thread waited)", "queue=\"input\"");
+    pipelineOutputsHeld = &registry.addCounter("pipeline_queue_full_total", "Messages that found a pipeline queue full (input: held by an I/O thread, output: the logic thread waited)", "queue=\"output\"");
+    tcpSendsDeferred = &registry.addCounter("tcp_sends_deferred_total", "Outgoing TCP sends that had to wait for the connection to open or the socket to be writable");
+
+    handshakeTime = &registry.addHistogram("handshake_duration_seconds", "Time from first contact to CreatePlayer");
+    mainLoopTime = &registry.addHistogram("main_loop_duration_seconds", "Time spent handling events in each main loop iteration");
+    selectTime = &registry.addHistogram("select_wait_seconds", "Time spent waiting in select");
+    pingRTT = &registry.addHistogram("dplay_ping_rtt_seconds", "Round trip time of pings sent to clients", "", Histogram::rttBoundsUs);
+    rpQueueDelay = &registry.addHistogram("rp_frame_queue_delay_seconds", "Time RP frames waited in the socket before being read (timestamped sockets only)");
+    rpAckDelay = &registry.addHistogram("rp_ack_delay_seconds", "Time from the kernel receiving an RP frame to sending its ack (timestamped sockets only)");
+
+    clients = &registry.addGauge("clients", "Connected clients");
+    players = &registry.addGauge("players", "Non-system players in the session");
+    degradedClients = &registry.addGauge("clients_degraded", "Clients over the latency/jitter/loss limits");
+
+    clientMemory = &registry.addGauge("memory_bytes", "Bytes held for clients and the session, as counted against the memory limits", "area=\"clients\"");
+    sessionMemory = &registry.addGauge("memory_bytes", "Bytes held for clients and the session, as counted against the memory limits", "area=\"session\"");
+    memoryPerPlayer = &registry.addGauge("memory_bytes_per_player", "Client and session bytes divided by the non-system players");
+}
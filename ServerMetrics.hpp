@@ -0,0 +1,66 @@
+#pragma once
+
+#include "DirectPlayMessage.hpp"
+#include "Metrics.hpp"
+
+struct ServerMetrics
+{
+    ServerMetrics();
+
+    Counter &getCommandCounter(DPSPCommand command)
+    {
+        auto index = static_cast<int>(command);
+        return *commands[index < maxCommand ? index : 0];
+    }
+
+    Histogram &getCommandTime(DPSPCommand command)
+    {
+        auto index = static_cast<int>(command);
+        return *commandTimes[index < maxCommand ? index : 0];
+    }
+
+    Histogram &getCommandQueueDelay(DPSPCommand command)
+    {
+        auto index = static_cast<int>(command);
+        return *commandQueueDelays[index < maxCommand ? index : 0];
+    }
+
+    static constexpr int maxCommand = static_cast<int>(DPSPCommand::SuperEnumPlayersReply) + 1;
+
+    Counter *tcpPacketsReceived, *broadcastPacketsReceived, *rpPacketsReceived;
+    Counter *tcpBytesReceived, *broadcastBytesReceived, *rpBytesReceived;
+    Counter *tcpPacketsSent, *rpPacketsSent;
+    Counter *tcpBytesSent, *rpBytesSent;
+
+    Counter *rpSeqErrors, *rpShortFrames, *udpSizeMismatches, *tcpNeedBufs, *unhandledCommands;
+    Counter *rpMessagesTooBig, *malformedCommands, *udpUnknownSources, *locoNotOwned;
+
+    Counter *commands[maxCommand]; // 0 is anything unknown
+    Histogram *commandTimes[maxCommand];
+    Histogram *commandQueueDelays[maxCommand]; // from the kernel timestamp
+
+    Counter *rpFramesReceived, *rpAcksSent, *rpAcksCoalesced, *rpMessages, *rpFlushes;
+    Histogram *rpFrameTime;
+
+    Counter *locoRelayed, *locoBroadcasts, *locoUnroutable;
+    Counter *playerMessagesRelayed, *playerMessagesDropped;
+    Counter *postcardsStored, *postcardsDeduplicated;
+    Counter *usersCreated, *usersReturning;
+    Counter *configReloads, *configReloadsRejected;
+    Counter *pingsSent, *pingsAnswered, *pingsLost;
+    Counter *joinsRejectedLatency, *joinsRejectedFull;
+    Counter *clientsDisconnected, *clientsTimedOut, *clientsOverMemory;
+    Counter *rosterChanges, *rosterMessagesSent, *rosterBatchesSent;
+    Counter *socketDrops, *socketBufferGrows;
+    Counter *pipelineInputsHeld, *pipelineOutputsHeld;
+    Counter *tcpSendsDeferred;
+
+    Histogram *handshakeTime, *mainLoopTime, *selectTime;
+    Histogram *pingRTT;
+    Histogram *rpQueueDelay, *rpAckDelay;
+
+    Gauge *clients, *players, *degradedClients;
+    Gauge *clientMemory, *sessionMemory, *memoryPerPlayer;
+};
+
+extern ServerMetrics serverMetrics;
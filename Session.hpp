@@ -0,0 +1,899 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "Clock.hpp"
+#include "DirectPlayMessage.hpp"
+#include "Probes.hpp"
+#include "StateBuffer.hpp"
+
+// xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx
+inline bool parseGUID(std::string_view str, uint8_t *guid)
+{
+    auto start = str.data();
+    auto end = start + str.length();
+    for(int i = 0; i < 16; i++)
+    {
+        // skip separators
+        if(start < end && *start == '-')
+            start++;
+
+        if(start + 2 > end)
+            break;
+
+        auto res = std::from_chars(start, start + 2, guid[i], 16);
+
+        if(res.ec != std::errc{})
+            break;
+        
+        start = res.ptr;
+    }
+
+    return start == end;
+}
+
+class Player final
+{
+public:
+    Player(uint32_t id, uint32_t systemPlayerId, uint32_t flags) : id(id), flags(flags), systemPlayerId(systemPlayerId)
+    {
+    }
+
+    ~Player()
+    {
+        if(memoryCounter)
+            *memoryCounter -= getMemoryUsage();
+
+        delete[] serviceProviderData;
+        delete[] data;
+    }
+
+    uint32_t getId() const
+    {
+        return id;
+    }
+
+    uint32_t getSystemPlayerId() const
+    {
+        return systemPlayerId;
+    }
+
+    uint32_t getFlags() const
+    {
+        return flags;
+    }
+
+    const std::string &getShortName() const
+    {
+        return shortName;
+    }
+
+    void setShortName(std::string name)
+    {
+        auto oldUsage = getMemoryUsage();
+        shortName = std::move(name);
+        updateMemoryCounter(oldUsage);
+    }
+
+    const std::string &getLongName() const
+    {
+        return longName;
+    }
+
+    void setLongName(std::string name)
+    {
+        auto oldUsage = getMemoryUsage();
+        longName = std::move(name);
+        updateMemoryCounter(oldUsage);
+    }
+
+    uint32_t getServiceProviderDataLen() const
+    {
+        return serviceProviderDataLen;
+    }
+
+    const uint8_t *getServiceProviderData() const
+    {
+        return serviceProviderData;
+    }
+
+    void setServiceProviderData(const uint8_t *data, uint32_t len)
+    {
+        auto oldUsage = getMemoryUsage();
+
+        delete[] serviceProviderData;
+
+        serviceProviderData = new uint8_t[len];
+        serviceProviderDataLen = len;
+
+        memcpy(serviceProviderData, data, len);
+
+        updateMemoryCounter(oldUsage);
+    }
+
+    uint32_t getDataLen() const
+    {
+        return dataLen;
+    }
+
+    const uint8_t *getData() const
+    {
+        return data;
+    }
+
+    void setData(const uint8_t *data, uint32_t len)
+    {
+        auto oldUsage = getMemoryUsage();
+
+        delete[] this->data;
+
+        this->data = new uint8_t[len];
+        dataLen = len;
+
+        memcpy(this->data, data, len);
+
+        updateMemoryCounter(oldUsage);
+    }
+
+    // including the map node, roughly
+    size_t getMemoryUsage() const
+    {
+        return sizeof(*this) + 32 + shortName.capacity() + longName.capacity() + serviceProviderDataLen + dataLen;
+    }
+
+    // the owner's total, kept up to date by every change from here on
+    void setMemoryCounter(size_t *counter)
+    {
+        memoryCounter = counter;
+        *memoryCounter += getMemoryUsage();
+    }
+
+    // everything but the constructor args
+    void serialize(StateWriter &writer) const
+    {
+        writer.writeString(shortName);
+        writer.writeString(longName);
+        writer.writeBytes(serviceProviderData, serviceProviderDataLen);
+        writer.writeBytes(data, dataLen);
+    }
+
+    void deserialize(StateReader &reader)
+    {
+        setShortName(reader.readString());
+        setLongName(reader.readString());
+
+        auto spData = reader.readBytes();
+        if(!spData.empty())
+            setServiceProviderData(spData.data(), spData.size());
+
+        auto playerData = reader.readBytes();
+        if(!playerData.empty())
+            setData(playerData.data(), playerData.size());
+    }
+
+private:
+    void updateMemoryCounter(size_t oldUsage)
+    {
+        if(memoryCounter)
+            *memoryCounter = *memoryCounter - oldUsage + getMemoryUsage();
+    }
+
+    uint32_t id;
+    uint32_t flags;
+
+    uint32_t systemPlayerId;
+
+    std::string shortName, longName;
+
+    uint8_t *serviceProviderData = nullptr;
+    uint32_t serviceProviderDataLen = 0;
+
+    uint8_t *data = nullptr;
+    uint32_t dataLen = 0;
+
+    size_t *memoryCounter = nullptr;
+};
+
+// membership is kept as sorted ids, small and cheap to scan when sending to the group
+class Group final
+{
+public:
+    Group(uint32_t id, uint32_t ownerId, uint32_t flags) : id(id), ownerId(ownerId), flags(flags)
+    {
+    }
+
+    ~Group()
+    {
+        if(memoryCounter)
+            *memoryCounter -= getMemoryUsage();
+    }
+
+    uint32_t getId() const
+    {
+        return id;
+    }
+
+    // the system player of the client that created it
+    uint32_t getOwnerId() const
+    {
+        return ownerId;
+    }
+
+    uint32_t getFlags() const
+    {
+        return flags;
+    }
+
+    uint32_t getParentId() const
+    {
+        return parentId;
+    }
+
+    void setParentId(uint32_t parentId)
+    {
+        this->parentId = parentId;
+    }
+
+    const std::string &getShortName() const
+    {
+        return shortName;
+    }
+
+    void setShortName(std::string name)
+    {
+        auto oldUsage = getMemoryUsage();
+        shortName = std::move(name);
+        updateMemoryCounter(oldUsage);
+    }
+
+    const std::string &getLongName() const
+    {
+        return longName;
+    }
+
+    void setLongName(std::string name)
+    {
+        auto oldUsage = getMemoryUsage();
+        longName = std::move(name);
+        updateMemoryCounter(oldUsage);
+    }
+
+    const std::vector<uint32_t> &getMembers() const
+    {
+        return members;
+    }
+
+    bool hasMember(uint32_t playerId) const
+    {
+        return std::binary_search(members.begin(), members.end(), playerId);
+    }
+
+    bool addMember(uint32_t playerId)
+    {
+        auto oldUsage = getMemoryUsage();
+        bool ret = insertSorted(members, playerId);
+        updateMemoryCounter(oldUsage);
+        return ret;
+    }
+
+    // doesn't shrink, so the usage doesn't change
+    bool removeMember(uint32_t playerId)
+    {
+        return eraseSorted(members, playerId);
+    }
+
+    // other groups
+    const std::vector<uint32_t> &getShortcuts() const
+    {
+        return shortcuts;
+    }
+
+    bool addShortcut(uint32_t groupId)
+    {
+        auto oldUsage = getMemoryUsage();
+        bool ret = insertSorted(shortcuts, groupId);
+        updateMemoryCounter(oldUsage);
+        return ret;
+    }
+
+    bool removeShortcut(uint32_t groupId)
+    {
+        return eraseSorted(shortcuts, groupId);
+    }
+
+    // everything but the constructor args
+    size_t getMemoryUsage() const
+    {
+        return sizeof(*this) + 32 + shortName.capacity() + longName.capacity() + (members.capacity() + shortcuts.capacity()) * 4;
+    }
+
+    // the owner's total, kept up to date by every change from here on
+    void setMemoryCounter(size_t *counter)
+    {
+        memoryCounter = counter;
+        *memoryCounter += getMemoryUsage();
+    }
+
+    void serialize(StateWriter &writer) const
+    {
+        writer.write(parentId);
+        writer.writeString(shortName);
+        writer.writeString(longName);
+
+        writer.write<uint32_t>(members.size());
+        for(auto member : members)
+            writer.write(member);
+
+        writer.write<uint32_t>(shortcuts.size());
+        for(auto shortcut : shortcuts)
+            writer.write(shortcut);
+    }
+
+    void deserialize(StateReader &reader)
+    {
+        auto oldUsage = getMemoryUsage();
+
+        parentId = reader.read<uint32_t>();
+        shortName = reader.readString();
+        longName = reader.readString();
+
+        // written sorted
+        auto count = reader.read<uint32_t>();
+        for(uint32_t i = 0; i < count && !reader.hasFailed(); i++)
+            members.push_back(reader.read<uint32_t>());
+
+        count = reader.read<uint32_t>();
+        for(uint32_t i = 0; i < count && !reader.hasFailed(); i++)
+            shortcuts.push_back(reader.read<uint32_t>());
+
+        updateMemoryCounter(oldUsage);
+    }
+
+private:
+    void updateMemoryCounter(size_t oldUsage)
+    {
+        if(memoryCounter)
+            *memoryCounter = *memoryCounter - oldUsage + getMemoryUsage();
+    }
+
+    static bool insertSorted(std::vector<uint32_t> &ids, uint32_t id)
+    {
+        auto it = std::lower_bound(ids.begin(), ids.end(), id);
+        if(it != ids.end() && *it == id)
+            return false;
+
+        ids.insert(it, id);
+        return true;
+    }
+
+    static bool eraseSorted(std::vector<uint32_t> &ids, uint32_t id)
+    {
+        auto it = std::lower_bound(ids.begin(), ids.end(), id);
+        if(it == ids.end() || *it != id)
+            return false;
+
+        ids.erase(it);
+        return true;
+    }
+
+    uint32_t id;
+    uint32_t ownerId;
+    uint32_t flags;
+    uint32_t parentId = 0;
+
+    std::string shortName, longName;
+
+    std::vector<uint32_t> members;
+    std::vector<uint32_t> shortcuts;
+
+    size_t *memoryCounter = nullptr;
+};
+
+class Client;
+
+// a player or group change the other clients haven't been told about yet
+struct RosterChange
+{
+    DPSPCommand command; // CreatePlayer, DeletePlayer, PlayerDataChanged, PlayerNameChanged or any of the group commands
+    uint32_t playerId; // or group
+    uint32_t systemPlayerId; // the owner isn't told about its own players
+    uint32_t serial; // clients that got the player list after this already know
+    uint32_t memberId; // the player/shortcut for group membership changes
+};
+
+class Session final
+{
+public:
+    Session(std::string name, const uint8_t *appGUID, uint32_t flags) : name(std::move(name)), flags(flags)
+    {
+        memset(guid, 1, 16); // TODO: generate valid guid
+        memcpy(this->appGUID, appGUID, 16);
+
+        startTime = Clock::now();
+    }
+
+    const uint8_t *getGUID() const
+    {
+        return guid;
+    }
+
+    const uint8_t *getAppGUID() const
+    {
+        return appGUID;
+    }
+
+    const std::string &getName() const
+    {
+        return name;
+    }
+
+    void setName(std::string name)
+    {
+        this->name = std::move(name);
+    }
+
+    uint32_t getFlags() const
+    {
+        return flags;
+    }
+
+    void setFlags(uint32_t flags)
+    {
+        this->flags = flags;
+    }
+
+    uint32_t getMaxPlayers() const
+    {
+        return maxPlayers;
+    }
+
+    void setMaxPlayers(uint32_t maxPlayers)
+    {
+        this->maxPlayers = maxPlayers;
+    }
+
+    uint32_t getCurrentPlayers() const
+    {
+        // count non-system players
+        uint32_t ret = 0;
+        for(auto &player : players)
+        {
+            if(!(player.second.getFlags() & DPPlayer_System))
+                ret++;
+        }
+        return ret;
+    }
+
+    uint32_t getIdXor() const
+    {
+        return idXor;
+    }
+
+    uint32_t adjustId(uint32_t id) const
+    {
+        return id ^ idXor;
+    }
+
+    uint32_t getTickCount() const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - startTime).count();
+    }
+
+    Player &createNewSystemPlayer(uint32_t flags = 0)
+    {
+        auto newId = allocPlayerId();
+        PROBE2(player_create, newId, newId);
+        auto &player = players.emplace(newId, Player{newId, newId, flags | DPPlayer_System}).first->second;
+        player.setMemoryCounter(&ownerMemory[newId]);
+        return player;
+    }
+
+    Player &createLocalSystemPlayer(uint16_t port)
+    {
+        auto &localPlayer = createNewSystemPlayer(DPPlayer_NameServer | DPPlayer_SendingMachine);
+
+        // set service provider data (2x sockaddr with addr=0.0.0.0)
+        // these are the TCP and UDP ports
+        DPSockaddrIn spData[2] = {};
+        spData[0].family = spData[1].family = 2;
+        spData[0].port = spData[1].port = htons(port);
+        localPlayer.setServiceProviderData(reinterpret_cast<uint8_t *>(spData), sizeof(spData));
+
+        return localPlayer;
+    }
+
+    Player &createNewPlayer(uint32_t systemPlayerId, uint32_t flags = 0)
+    {
+        auto newId = allocPlayerId();
+        PROBE2(player_create, newId, systemPlayerId);
+        auto &player = players.emplace(newId, Player{newId, systemPlayerId, flags}).first->second;
+        player.setMemoryCounter(&ownerMemory[systemPlayerId]);
+        return player;
+    }
+
+    void deletePlayer(uint32_t id)
+    {
+        auto it = players.find(id);
+
+        if(it == players.end())
+            return;
+
+        if(it->second.getFlags() & DPPlayer_System)
+        {
+            // system player, remove all non-system players
+            // this also includes the system player as its system player is itself...
+            for(auto it2 = players.begin(); it2 != players.end();)
+            {
+                if(it2->second.getSystemPlayerId() == id)
+                {
+                    PROBE2(player_delete, it2->first, id);
+                    removeRoute(it2->first);
+                    removeFromGroups(it2->first);
+                    it2 = players.erase(it2);
+                }
+                else
+                    ++it2;
+            }
+
+            // and the groups it created
+            for(auto it2 = groups.begin(); it2 != groups.end();)
+            {
+                auto groupId = it2->first;
+                bool owned = it2->second.getOwnerId() == id;
+                ++it2;
+
+                if(owned)
+                    deleteGroup(groupId);
+            }
+
+            // everything it owned is gone
+            ownerMemory.erase(id);
+        }
+        else
+        {
+            PROBE2(player_delete, id, it->second.getSystemPlayerId());
+            removeRoute(id);
+            removeFromGroups(id);
+            players.erase(it);
+        }
+    }
+
+    // groups share the id space with players
+    Group &createNewGroup(uint32_t ownerId, uint32_t flags = 0)
+    {
+        auto newId = allocPlayerId();
+        auto &group = groups.emplace(newId, Group{newId, ownerId, flags}).first->second;
+        group.setMemoryCounter(&ownerMemory[ownerId]);
+        return group;
+    }
+
+    void deleteGroup(uint32_t id)
+    {
+        if(!groups.erase(id))
+            return;
+
+        for(auto &group : groups)
+        {
+            group.second.removeShortcut(id);
+
+            if(group.second.getParentId() == id)
+                group.second.setParentId(0);
+        }
+    }
+
+    Group *getGroup(uint32_t id)
+    {
+        auto it = groups.find(id);
+
+        if(it != groups.end())
+            return &it->second;
+
+        return nullptr;
+    }
+
+    const std::map<uint32_t, Group> &getGroups() const
+    {
+        return groups;
+    }
+
+    // the clients that own the members of a group, each only once
+    void getGroupClients(const Group &group, std::vector<Client *> &clients) const
+    {
+        for(auto &member : group.getMembers())
+        {
+            auto client = getPlayerClient(member);
+
+            if(client && std::find(clients.begin(), clients.end(), client) == clients.end())
+                clients.push_back(client);
+        }
+    }
+
+    Player *getPlayer(uint32_t id)
+    {
+        auto it = players.find(id);
+
+        if(it != players.end())
+            return &it->second;
+
+        return nullptr;
+    }
+
+    const std::map<uint32_t, Player> &getPlayers() const
+    {
+        return players;
+    }
+
+    // routing for relayed messages, players are owned by the client that created them
+    void setPlayerClient(uint32_t id, Client *client)
+    {
+        auto index = id & 0xFFFF;
+
+        if(index >= routes.size())
+            routes.resize(index + 1);
+
+        routes[index] = {id, client};
+
+        if(std::find(routeClients.begin(), routeClients.end(), client) == routeClients.end())
+            routeClients.push_back(client);
+    }
+
+    // O(1), the low bits of an id are unique
+    Client *getPlayerClient(uint32_t id) const
+    {
+        auto index = id & 0xFFFF;
+
+        if(index < routes.size() && routes[index].id == id)
+            return routes[index].client;
+
+        return nullptr;
+    }
+
+    // all clients that own a player, for broadcasts
+    const std::vector<Client *> &getRouteClients() const
+    {
+        return routeClients;
+    }
+
+    // changes are coalesced until the main loop sends them all and clears the list
+    void addRosterChange(DPSPCommand command, uint32_t playerId, uint32_t systemPlayerId, uint32_t memberId = 0)
+    {
+        rosterSerial++;
+
+        if(command == DPSPCommand::DeletePlayer || command == DPSPCommand::DeleteGroup)
+        {
+            // anything else pending is pointless now, the delete is still needed by anyone who already has the player
+            rosterChanges.erase(std::remove_if(rosterChanges.begin(), rosterChanges.end(), [playerId](const RosterChange &change)
+            {
+                return change.playerId == playerId || change.memberId == playerId;
+            }), rosterChanges.end());
+        }
+        else if(command == DPSPCommand::PlayerDataChanged || command == DPSPCommand::PlayerNameChanged)
+        {
+            // the latest data/name is read when sending
+            for(auto &change : rosterChanges)
+            {
+                if(change.command == command && change.playerId == playerId)
+                {
+                    change.serial = rosterSerial;
+                    return;
+                }
+            }
+        }
+
+        rosterChanges.push_back({command, playerId, systemPlayerId, rosterSerial, memberId});
+    }
+
+    const std::vector<RosterChange> &getRosterChanges() const
+    {
+        return rosterChanges;
+    }
+
+    void clearRosterChanges()
+    {
+        rosterChanges.clear();
+    }
+
+    // taken when sending the player list
+    uint32_t getRosterSerial() const
+    {
+        return rosterSerial;
+    }
+
+    // everything, for the session memory limit
+    // players and groups are counted as they change, this only adds up the owners
+    size_t getMemoryUsage() const
+    {
+        size_t ret = sizeof(*this) + name.capacity();
+
+        for(auto &owner : ownerMemory)
+            ret += owner.second + 32;
+
+        ret += routes.capacity() * sizeof(Route) + routeClients.capacity() * sizeof(Client *);
+        ret += rosterChanges.capacity() * sizeof(RosterChange);
+
+        return ret;
+    }
+
+    // the players and groups created by a client, counted against its own limit
+    size_t getMemoryUsage(uint32_t systemPlayerId) const
+    {
+        auto it = ownerMemory.find(systemPlayerId);
+        return it != ownerMemory.end() ? it->second : 0;
+    }
+
+    // for a hot restart, routes aren't included as they're rebuilt by the clients
+    void serialize(StateWriter &writer) const
+    {
+        writer.write(guid);
+        writer.write(appGUID);
+        writer.writeString(name);
+        writer.write(flags);
+        writer.write(maxPlayers);
+        writer.write(idXor);
+        writer.write(idUnique);
+        writer.write<int64_t>(startTime.time_since_epoch().count()); // steady clock, same for every process on the machine
+
+        writer.write<uint32_t>(players.size());
+        for(auto &player : players)
+        {
+            writer.write(player.second.getId());
+            writer.write(player.second.getSystemPlayerId());
+            writer.write(player.second.getFlags());
+            player.second.serialize(writer);
+        }
+
+        writer.write<uint32_t>(groups.size());
+        for(auto &group : groups)
+        {
+            writer.write(group.second.getId());
+            writer.write(group.second.getOwnerId());
+            writer.write(group.second.getFlags());
+            group.second.serialize(writer);
+        }
+    }
+
+    // replaces everything
+    bool deserialize(StateReader &reader)
+    {
+        // these point at their owner's counter
+        players.clear();
+        groups.clear();
+        ownerMemory.clear();
+        routes.clear();
+        routeClients.clear();
+
+        reader.read(guid);
+
+        // the game (or at least its version) shouldn't change under the players
+        uint8_t newAppGUID[16];
+        reader.read(newAppGUID);
+
+        if(memcmp(newAppGUID, appGUID, sizeof(appGUID)) != 0)
+            return false;
+
+        name = reader.readString();
+        flags = reader.read<uint32_t>();
+        maxPlayers = reader.read<uint32_t>();
+        idXor = reader.read<uint32_t>();
+        idUnique = reader.read<uint32_t>();
+        startTime = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(reader.read<int64_t>()));
+
+        auto count = reader.read<uint32_t>();
+        for(uint32_t i = 0; i < count && !reader.hasFailed(); i++)
+        {
+            auto id = reader.read<uint32_t>();
+            auto systemPlayerId = reader.read<uint32_t>();
+            auto playerFlags = reader.read<uint32_t>();
+
+            auto &player = players.emplace(id, Player{id, systemPlayerId, playerFlags}).first->second;
+            player.deserialize(reader);
+            player.setMemoryCounter(&ownerMemory[systemPlayerId]);
+        }
+
+        count = reader.read<uint32_t>();
+        for(uint32_t i = 0; i < count && !reader.hasFailed(); i++)
+        {
+            auto id = reader.read<uint32_t>();
+            auto ownerId = reader.read<uint32_t>();
+            auto groupFlags = reader.read<uint32_t>();
+
+            auto &group = groups.emplace(id, Group{id, ownerId, groupFlags}).first->second;
+            group.deserialize(reader);
+            group.setMemoryCounter(&ownerMemory[ownerId]);
+        }
+
+        return !reader.hasFailed();
+    }
+
+    Player *getLocalSystemPlayer()
+    {
+        for(auto &player : players)
+        {
+            auto playerFlags = player.second.getFlags();
+            if((playerFlags & DPPlayer_System) && (playerFlags & DPPlayer_SendingMachine))
+                return &player.second;
+        }
+
+        return nullptr;
+    }
+
+private:
+    uint32_t allocPlayerId()
+    {
+        // TODO: less bad id alloc
+        // should be "a zero-based value not shared by an existing identifier" | "a zero-based value that is incremented to provide uniqueness" << 16
+        uint32_t newId = (players.size() + groups.size()) | idUnique << 16;
+        
+        while(players.find(newId) != players.end() || groups.find(newId) != groups.end())
+            newId++;
+
+        return newId;   
+    }
+
+    void removeFromGroups(uint32_t playerId)
+    {
+        for(auto &group : groups)
+            group.second.removeMember(playerId);
+    }
+
+    void removeRoute(uint32_t id)
+    {
+        auto index = id & 0xFFFF;
+
+        if(index >= routes.size() || routes[index].id != id)
+            return;
+
+        auto client = routes[index].client;
+        routes[index] = {};
+
+        // drop the client from the broadcast list if that was its last player
+        for(auto &route : routes)
+        {
+            if(route.client == client)
+                return;
+        }
+
+        routeClients.erase(std::remove(routeClients.begin(), routeClients.end(), client), routeClients.end());
+    }
+
+    struct Route
+    {
+        uint32_t id = ~0u;
+        Client *client = nullptr;
+    };
+
+    uint8_t guid[16];
+    uint8_t appGUID[16];
+
+    std::string name;
+    uint32_t flags;
+
+    uint32_t maxPlayers = 10;
+    uint32_t idXor = 0; // TODO: init
+    uint32_t idUnique = 1; // TODO: incremented at some point
+
+    std::chrono::steady_clock::time_point startTime;
+
+    // bytes used by each system player's players and groups, before them as they point in here
+    std::unordered_map<uint32_t, size_t> ownerMemory;
+
+    std::map<uint32_t, Player> players;
+    std::map<uint32_t, Group> groups;
+
+    std::vector<Route> routes; // indexed by id & 0xFFFF
+    std::vector<Client *> routeClients;
+
+    std::vector<RosterChange> rosterChanges;
+    uint32_t rosterSerial = 0;
+};
@@ -0,0 +1,690 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Client.hpp"
+#include "ClientMessages.hpp"
+#include "Clock.hpp"
+#include "DirectPlayMessage.hpp"
+#include "Logger.hpp"
+#include "MemoryTransport.hpp"
+#include "ServerLoop.hpp"
+#include "Session.hpp"
+#include "Socket.hpp"
+#include "Unicode.hpp"
+
+// runs the server and simulated LEGO Loco clients in one thread, over in-memory sockets and a virtual clock
+// the same arguments always give the same results (the digest covers everything sent), usually much faster than real time
+// the server side is the main loop from Main.cpp (through ServerLoop), without the pipeline/shared UDP sockets/anything from config.ini
+
+struct SimOptions
+{
+    std::string serverAddr = "::ffff:10.0.0.1";
+    uint16_t port = 31415;
+    uint8_t appGUID[16];
+
+    int numClients = 100;
+    std::chrono::milliseconds rampTime{1000};
+    std::chrono::seconds duration{10};
+    std::chrono::milliseconds timeout{2000};
+    std::chrono::milliseconds messageInterval{100};
+    std::chrono::microseconds step{1000}; // virtual time per loop iteration
+
+    size_t postcardSize = 256;
+
+    MemoryTransportOptions transport;
+};
+
+struct SimResults
+{
+    std::vector<double> joinTimes, ackTimes; // ms
+    uint64_t messagesSent = 0, messagesReceived = 0, timeouts = 0;
+};
+
+class SimServer final
+{
+public:
+    SimServer(MemoryTransport &transport, const SimOptions &options)
+        : transport(transport), options(options), session("Sim", options.appGUID, DPSession_ReliableProtocol | DPSession_OptimiseLatency),
+          tcpListen(SocketType::TCP), udpListen(SocketType::UDP), loop(session, clients)
+    {
+        session.setMaxPlayers(options.numClients);
+        session.createLocalSystemPlayer(options.port);
+    }
+
+    ~SimServer()
+    {
+        // before the sockets go
+        clients.clear();
+    }
+
+    bool start()
+    {
+        return tcpListen.listen("::", options.port) && udpListen.bind("::", 47624);
+    }
+
+    // the timed parts of the main loop, every iteration
+    void update()
+    {
+        for(auto &client : clients)
+        {
+            int fd = client.second.getTCPOutgoingSocket().getFd();
+            if(fd != -1 && client.second.wantsTCPWrite() && transport.isWritable(fd))
+                client.second.handleTCPWrite();
+        }
+
+        loop.update(Clock::now(), loop.hasQueuedOutput());
+    }
+
+    // the rest, for one readable socket, false if it isn't the server's
+    bool handleReadable(int fd)
+    {
+        if(fd == tcpListen.getFd())
+        {
+            SocketAddress addr;
+
+            while(auto newSock = tcpListen.accept(&addr))
+            {
+                auto it = getClient(addr.toString());
+                it->second.setTCPIncomingSocket(std::move(newSock.value()));
+                addClientFds(*it);
+            }
+
+            return true;
+        }
+
+        if(fd == udpListen.getFd())
+        {
+            while(transport.isReadable(fd))
+            {
+                uint8_t buf[2048];
+                SocketAddress addr;
+                int len = udpListen.recv(buf, sizeof(buf), &addr);
+
+                auto it = getClient(addr.toString());
+
+                loop.handleBroadcastPacket(it, buf, len, {});
+                addClientFds(*it);
+            }
+
+            return true;
+        }
+
+        auto fdIt = clientFds.find(fd);
+
+        if(fdIt == clientFds.end())
+            return false;
+
+        // fds aren't reused, this one's client may be gone
+        auto it = clients.find(fdIt->second);
+
+        if(it == clients.end())
+            return true;
+
+        auto &client = it->second;
+
+        if(fd == client.getTCPIncomingSocket().getFd())
+        {
+            // disconnected
+            if(loop.handleTCPRead(it) != it)
+                return true;
+        }
+        else if(fd == client.getUDPSocket().getFd())
+        {
+            while(transport.isReadable(fd))
+                client.handleUDPRead();
+        }
+
+        // joining opens the UDP socket
+        addClientFds(*it);
+
+        return true;
+    }
+
+    size_t getClientCount() const
+    {
+        return clients.size();
+    }
+
+private:
+    ServerLoop::ClientMap::iterator getClient(const std::string &key)
+    {
+        auto it = clients.find(key);
+
+        if(it == clients.end())
+            it = clients.try_emplace(key, session, key, options.port).first;
+
+        return it;
+    }
+
+    void addClientFds(ServerLoop::ClientMap::value_type &client)
+    {
+        for(int fd : {client.second.getTCPIncomingSocket().getFd(), client.second.getUDPSocket().getFd()})
+        {
+            if(fd != -1)
+                clientFds[fd] = client.first;
+        }
+    }
+
+    MemoryTransport &transport;
+    const SimOptions &options;
+
+    Session session;
+
+    Socket tcpListen, udpListen;
+
+    ServerLoop::ClientMap clients;
+    std::unordered_map<int, std::string> clientFds;
+
+    ServerLoop loop;
+};
+
+// the same steps as the load generator, but never waits
+class SimClient final
+{
+public:
+    SimClient(int index, const SimOptions &options) : options(options), tcpListen(SocketType::TCP), tcpIncoming(SocketType::TCP),
+                                                      tcpOutgoing(SocketType::TCP), udpSocket(SocketType::UDP)
+    {
+        address = "::ffff:10." + std::to_string(1 + index / 62500) + "." + std::to_string(index / 250 % 250) + "." + std::to_string(index % 250 + 2);
+        shortName = u"Sim" + convertUTF8ToUCS2(std::to_string(index));
+
+        postcard.resize(options.postcardSize);
+        for(size_t i = 0; i < postcard.size(); i++)
+            postcard[i] = i;
+    }
+
+    bool hasFailed() const
+    {
+        return state == State::Failed;
+    }
+
+    bool hasJoined() const
+    {
+        return state == State::Playing;
+    }
+
+    const std::string &getError() const
+    {
+        return error;
+    }
+
+    // the sockets that can be readable
+    std::vector<int> getFds() const
+    {
+        return {tcpListen.getFd(), tcpIncoming.getFd(), udpSocket.getFd()};
+    }
+
+    void start()
+    {
+        startTime = Clock::now();
+
+        if(!tcpListen.listen(address.c_str(), options.port) || !udpSocket.bind(address.c_str(), options.port))
+            return fail("failed to bind " + address);
+
+        state = State::EnumSessions;
+        sendEnumSessions();
+    }
+
+    void handleReadable(MemoryTransport &transport, int fd, SimResults &results)
+    {
+        if(state == State::NotStarted || state == State::Failed)
+            return;
+
+        // the server connects back to us to reply (and again if it closed the connection)
+        if(fd == tcpListen.getFd())
+        {
+            while(auto incoming = tcpListen.accept())
+                tcpIncoming = std::move(*incoming);
+        }
+        else if(fd == tcpIncoming.getFd())
+            readTCP(transport);
+        else if(fd == udpSocket.getFd())
+        {
+            while(state != State::Failed && transport.isReadable(fd))
+            {
+                uint8_t buf[65536];
+                int len = udpSocket.recv(buf, sizeof(buf));
+
+                if(len > 0)
+                    handleFrame(buf, len, results);
+            }
+        }
+    }
+
+    // timeouts and sending, every iteration
+    void update(SimResults &results, Clock::time_point playEnd)
+    {
+        if(state == State::NotStarted || state == State::Failed)
+            return;
+
+        auto now = Clock::now();
+
+        if(state != State::Playing)
+        {
+            if(now - startTime > options.timeout)
+                fail(getWaitingFor());
+
+            // like the game, in case the broadcast got lost
+            else if(state == State::EnumSessions && now >= nextSendTime)
+                sendEnumSessions();
+
+            return;
+        }
+
+        if(awaitingAck && now - sentTime > options.timeout)
+        {
+            results.timeouts++;
+            awaitingAck = false;
+        }
+
+        if(awaitingAck || now < nextSendTime || now >= playEnd)
+            return;
+
+        // alternate postcards and 1002s
+        bool isPostcard = messageId & 1;
+        messageId++;
+
+        fillLocoFrame(sendBuffer, systemPlayerId, playerId, serverPlayerId, messageId, userValue, isPostcard ? &postcard : nullptr);
+
+        SocketAddress serverAddr(options.serverAddr.c_str(), options.port);
+        size_t len = sendBuffer.size();
+
+        if(!udpSocket.send(sendBuffer.data(), len, &serverAddr))
+            return fail("failed to send loco message");
+
+        results.messagesSent++;
+        awaitingAck = true;
+        sentTime = now;
+        nextSendTime = now + options.messageInterval;
+    }
+
+private:
+    enum class State
+    {
+        NotStarted,
+        EnumSessions,
+        SystemPlayerId,
+        PlayerList,
+        PlayerId,
+        InitialLocoMessage,
+        Playing,
+        Failed,
+    };
+
+    // same as the load generator's errors
+    const char *getWaitingFor() const
+    {
+        switch(state)
+        {
+            case State::EnumSessions:
+                return "no enum sessions reply";
+            case State::SystemPlayerId:
+                return "no system player id";
+            case State::PlayerList:
+                return "no super enum players reply";
+            case State::PlayerId:
+                return "no player id";
+            case State::InitialLocoMessage:
+                return "no initial loco message";
+            default:
+                return "";
+        }
+    }
+
+    void sendEnumSessions()
+    {
+        auto buf = makeEnumSessions(options.appGUID, options.port);
+
+        SocketAddress broadcastAddr(options.serverAddr.c_str(), 47624);
+        size_t len = buf.size();
+        if(!udpSocket.send(buf.data(), len, &broadcastAddr))
+            return fail("failed to send enum sessions");
+
+        nextSendTime = Clock::now() + enumSessionsInterval;
+    }
+
+    void readTCP(MemoryTransport &transport)
+    {
+        while(tcpIncoming.getFd() != -1 && transport.isReadable(tcpIncoming.getFd()))
+        {
+            uint8_t buf[4096];
+            int len = tcpIncoming.recv(buf, sizeof(buf));
+
+            if(len <= 0)
+                break;
+
+            tcpBuffer.insert(tcpBuffer.end(), buf, buf + len);
+        }
+
+        // everything that isn't part of joining (roster changes) is skipped
+        while(tcpBuffer.size() >= sizeof(DPSPMessageHeader) && state != State::Failed)
+        {
+            uint32_t sizeToken;
+            memcpy(&sizeToken, tcpBuffer.data(), 4);
+
+            size_t size = sizeToken & 0xFFFFF;
+
+            if(size < sizeof(DPSPMessageHeader))
+                return fail("bad message size from server");
+
+            if(tcpBuffer.size() < size)
+                break;
+
+            handleMessage(tcpBuffer.data(), size);
+            tcpBuffer.erase(tcpBuffer.begin(), tcpBuffer.begin() + size);
+        }
+    }
+
+    void handleMessage(const uint8_t *data, size_t size)
+    {
+        auto header = reinterpret_cast<const DPSPMessageHeader *>(data);
+
+        if(header->command == DPSPCommand::EnumSessionsReply && state == State::EnumSessions)
+        {
+            if(!tcpOutgoing.connect(options.serverAddr.c_str(), options.port, 0, address.c_str(), false))
+                return fail("failed to connect to server");
+
+            sendTCP(makeRequestPlayerId(true, options.port));
+            state = State::SystemPlayerId;
+        }
+        else if(header->command == DPSPCommand::RequestPlayerReply && (state == State::SystemPlayerId || state == State::PlayerId))
+        {
+            if(size < sizeof(DPSPMessageHeader) + sizeof(DPSPMessageRequestPlayerReply))
+                return fail("short player id reply");
+
+            DPSPMessageRequestPlayerReply reply;
+            memcpy(&reply, data + sizeof(DPSPMessageHeader), sizeof(reply));
+
+            if(state == State::SystemPlayerId)
+            {
+                systemPlayerId = reply.id;
+                sendTCP(makeAddForwardRequest(systemPlayerId, options.port));
+                state = State::PlayerList;
+            }
+            else
+            {
+                playerId = reply.id;
+                sendTCP(makeCreatePlayer(systemPlayerId, playerId, shortName, options.port));
+                state = State::InitialLocoMessage;
+            }
+        }
+        else if(header->command == DPSPCommand::SuperEnumPlayersReply && state == State::PlayerList)
+        {
+            sendTCP(makeRequestPlayerId(false, options.port));
+            state = State::PlayerId;
+        }
+    }
+
+    void handleFrame(const uint8_t *buf, int len, SimResults &results)
+    {
+        auto now = Clock::now();
+
+        RPFrameHeader header;
+        if(!parseRPHeader(buf, len, header))
+            return;
+
+        auto payload = buf + header.length;
+        size_t payloadLen = len - header.length;
+
+        // joined once the server sends the first loco message
+        if(state == State::InitialLocoMessage)
+        {
+            if(payloadLen < sizeof(LocoCmd1002))
+                return;
+
+            LocoCmd1002 message;
+            memcpy(&message, payload, sizeof(message));
+
+            if(message.header.magic == 300 && message.header.command == 1002)
+            {
+                serverPlayerId = header.fromId;
+                userValue = message.userValue;
+
+                results.joinTimes.push_back(std::chrono::duration<double, std::milli>(now - startTime).count());
+                state = State::Playing;
+                nextSendTime = now;
+            }
+
+            return;
+        }
+
+        if(state != State::Playing)
+            return;
+
+        results.messagesReceived++;
+
+        if((header.flags & DPRPFrame_Ack) && header.messageId == messageId && awaitingAck)
+        {
+            results.ackTimes.push_back(std::chrono::duration<double, std::milli>(now - sentTime).count());
+            awaitingAck = false;
+            return;
+        }
+
+        uint8_t reply[32];
+        size_t replyLen = fillPingReply(reply, sizeof(reply), payload, payloadLen, systemPlayerId, pingReplyId);
+
+        if(replyLen)
+        {
+            pingReplyId++;
+
+            SocketAddress serverAddr(options.serverAddr.c_str(), options.port);
+            udpSocket.send(reply, replyLen, &serverAddr);
+        }
+    }
+
+    void sendTCP(const std::vector<uint8_t> &buf)
+    {
+        // the server reads at least this much at a time, so this never has to wait for it
+        size_t len = buf.size();
+
+        if(!tcpOutgoing.sendAll(buf.data(), len))
+            fail("failed to send to server");
+    }
+
+    void fail(std::string error)
+    {
+        this->error = std::move(error);
+        state = State::Failed;
+    }
+
+    static constexpr auto enumSessionsInterval = std::chrono::milliseconds(500);
+
+    const SimOptions &options;
+
+    std::string address;
+    std::u16string shortName;
+
+    State state = State::NotStarted;
+    std::string error;
+    Clock::time_point startTime;
+
+    Socket tcpListen, tcpIncoming, tcpOutgoing;
+    Socket udpSocket;
+
+    std::vector<uint8_t> tcpBuffer;
+
+    uint32_t systemPlayerId = ~0u, playerId = ~0u;
+    uint16_t serverPlayerId = 0;
+    uint32_t userValue = ~0u;
+
+    std::vector<uint8_t> postcard, sendBuffer;
+    uint8_t messageId = 0;
+    uint8_t pingReplyId = 128; // away from the ids used for loco messages
+    bool awaitingAck = false;
+    Clock::time_point sentTime, nextSendTime;
+};
+
+static void printPercentiles(const char *name, std::vector<double> &times)
+{
+    if(times.empty())
+        return;
+
+    std::sort(times.begin(), times.end());
+
+    auto percentile = [&times](double p)
+    {
+        return times[static_cast<size_t>(p * (times.size() - 1))];
+    };
+
+    printf("%s: p50 %.2fms, p90 %.2fms, p99 %.2fms, max %.2fms\n", name, percentile(0.5), percentile(0.9), percentile(0.99), times.back());
+}
+
+int main(int argc, char *argv[])
+{
+    SimOptions options;
+    std::string_view guid = "4625cdf9-7f57-d211-9426-00a0244bda7a";
+    bool verbose = false;
+
+    for(int i = 1; i < argc; i++)
+    {
+        std::string_view arg(argv[i]);
+        bool hasValue = i + 1 < argc;
+
+        if(arg == "--clients" && hasValue)
+            options.numClients = std::max(1, atoi(argv[++i]));
+        else if(arg == "--ramp" && hasValue)
+            options.rampTime = std::chrono::milliseconds(atoi(argv[++i]));
+        else if(arg == "--duration" && hasValue)
+            options.duration = std::chrono::seconds(atoi(argv[++i]));
+        else if(arg == "--timeout" && hasValue)
+            options.timeout = std::chrono::milliseconds(atoi(argv[++i]));
+        else if(arg == "--interval" && hasValue)
+            options.messageInterval = std::chrono::milliseconds(atoi(argv[++i]));
+        else if(arg == "--step" && hasValue)
+            options.step = std::chrono::microseconds(std::max(1, atoi(argv[++i])));
+        else if(arg == "--postcard-size" && hasValue)
+            options.postcardSize = atoi(argv[++i]);
+        else if(arg == "--latency" && hasValue)
+            options.transport.latency = std::chrono::microseconds(atoi(argv[++i]));
+        else if(arg == "--loss" && hasValue)
+            options.transport.lossPercent = std::clamp(atoi(argv[++i]), 0, 100);
+        else if(arg == "--seed" && hasValue)
+            options.transport.seed = strtoul(argv[++i], nullptr, 10);
+        else if(arg == "--verbose")
+            verbose = true;
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--clients n] [--ramp ms] [--duration s] [--timeout ms] [--interval ms] [--step us]"
+                      << " [--postcard-size bytes] [--latency us] [--loss percent] [--seed n] [--verbose]\n";
+            return 1;
+        }
+    }
+
+    parseGUID(guid, options.appGUID);
+
+    // default to quiet, there's a lot of clients
+    Logger::get().setLevel(verbose ? LogLevel::Debug : LogLevel::Warning);
+    Logger::get().start();
+
+    // everything from here on is simulated
+    VirtualClock clock;
+    Clock::setCurrent(&clock);
+
+    options.transport.localAddr = options.serverAddr;
+    MemoryTransport transport(options.transport);
+    Transport::setCurrent(&transport);
+
+    SimResults results;
+    int joined = 0, failed = 0;
+
+    auto realStart = std::chrono::steady_clock::now();
+    auto simStart = clock.getTime();
+    auto playEnd = simStart + options.rampTime + options.timeout + options.duration;
+
+    {
+        SimServer server(transport, options);
+
+        if(!server.start())
+        {
+            std::cerr << "failed to start server\n";
+            return 1;
+        }
+
+        std::vector<std::unique_ptr<SimClient>> clients;
+        std::unordered_map<int, SimClient *> clientFds;
+        int started = 0;
+
+        auto addClientFds = [&clientFds](SimClient &client)
+        {
+            for(int fd : client.getFds())
+            {
+                if(fd != -1)
+                    clientFds[fd] = &client;
+            }
+        };
+
+        while(clock.getTime() < playEnd)
+        {
+            // spread over the ramp time
+            while(started < options.numClients && clock.getTime() - simStart >= options.rampTime * started / options.numClients)
+            {
+                clients.push_back(std::make_unique<SimClient>(started++, options));
+                clients.back()->start();
+                addClientFds(*clients.back());
+            }
+
+            for(auto &client : clients)
+                client->update(results, playEnd);
+
+            // only what has something to read, there's too many sockets to check them all
+            for(int fd : transport.getReadableFds())
+            {
+                if(server.handleReadable(fd))
+                    continue;
+
+                auto it = clientFds.find(fd);
+
+                if(it != clientFds.end())
+                {
+                    it->second->handleReadable(transport, fd, results);
+                    addClientFds(*it->second);
+                }
+            }
+
+            server.update();
+
+            clock.advance(options.step);
+        }
+
+        for(int i = 0; i < started; i++)
+        {
+            if(clients[i]->hasJoined())
+                joined++;
+            else
+            {
+                printf("client %i failed: %s\n", i, clients[i]->hasFailed() ? clients[i]->getError().c_str() : "still joining");
+                failed++;
+            }
+        }
+
+        printf("%i/%i clients joined, %zu still connected\n", joined, options.numClients, server.getClientCount());
+
+        // sockets close while the transport is still there
+    }
+
+    Transport::setCurrent(nullptr);
+
+    auto simulated = std::chrono::duration<double>(clock.getTime() - simStart).count();
+    auto real = std::chrono::duration<double>(std::chrono::steady_clock::now() - realStart).count();
+
+    printPercentiles("join latency", results.joinTimes);
+    printPercentiles("ack latency", results.ackTimes);
+
+    printf("messages: %llu sent, %llu received, %llu timeouts, %llu datagrams dropped\n", (unsigned long long)results.messagesSent,
+           (unsigned long long)results.messagesReceived, (unsigned long long)results.timeouts, (unsigned long long)transport.getDroppedCount());
+    printf("simulated %.1fs in %.2fs (%.1fx)\n", simulated, real, simulated / real);
+    printf("digest %016llx\n", (unsigned long long)transport.getDigest());
+
+    Clock::setCurrent(nullptr);
+    Logger::get().stop();
+
+    return joined == options.numClients ? 0 : 1;
+}
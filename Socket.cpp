@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
@@ -6,12 +7,24 @@
 #else
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#if defined(__linux__)
+#include <linux/net_tstamp.h>
+#endif
+#include <fcntl.h>
 #include <unistd.h>
 #endif
 
+#include "Metrics.hpp"
 #include "Socket.hpp"
+#include "Transport.hpp"
+
+static Histogram &recvTime = MetricsRegistry::get().addHistogram("socket_syscall_duration_seconds", "Time spent in socket syscalls", "op=\"recv\"");
+static Histogram &sendTime = MetricsRegistry::get().addHistogram("socket_syscall_duration_seconds", "Time spent in socket syscalls", "op=\"send\"");
+static Histogram &acceptTime = MetricsRegistry::get().addHistogram("socket_syscall_duration_seconds", "Time spent in socket syscalls", "op=\"accept\"");
+static Histogram &connectTime = MetricsRegistry::get().addHistogram("socket_syscall_duration_seconds", "Time spent in socket syscalls", "op=\"connect\"");
 
 SocketAddress::SocketAddress()
 {
@@ -99,15 +112,17 @@ std::string SocketAddress::toString(bool withPort)
     return ip;
 }
 
-Socket::Socket(SocketType type) : type(type)
+Transport *Transport::current = nullptr;
+
+Socket::Socket(SocketType type) : type(type), transport(Transport::getCurrent())
 {
 }
 
-Socket::Socket(SocketType type, int fd) : type(type), fd(fd)
+Socket::Socket(SocketType type, int fd) : type(type), fd(fd), transport(Transport::getCurrent())
 {
 }
 
-Socket::Socket(Socket &&other) : fd(-1)
+Socket::Socket(Socket &&other) : fd(-1), transport(nullptr)
 {
     *this = std::move(other);
 }
@@ -126,6 +141,13 @@ Socket &Socket::operator=(Socket &&other)
 
         type = other.type;
         fd = other.fd;
+        transport = other.transport;
+
+        maxReceiveBuffer = other.maxReceiveBuffer;
+        timestamps = other.timestamps;
+        receiveTime = other.receiveTime;
+        dropCount = other.dropCount;
+        tunedDropCount = other.tunedDropCount;
 
         other.fd = -1;
     }
@@ -133,11 +155,17 @@ Socket &Socket::operator=(Socket &&other)
     return *this;
 }
 
-bool Socket::connect(const char *addr, uint16_t port, uint16_t sourcePort)
+bool Socket::connect(const char *addr, uint16_t port, uint16_t sourcePort, const char *sourceAddr, bool wait)
 {
     if(fd != -1)
         return false;
 
+    if(transport)
+    {
+        fd = transport->connect(type, addr, port, sourcePort, sourceAddr, wait);
+        return fd != -1;
+    }
+
     // lookup address and try to connect
     auto portStr = std::to_string(port);
 
@@ -156,14 +184,25 @@ bool Socket::connect(const char *addr, uint16_t port, uint16_t sourcePort)
         if(fd == -1)
             continue;
 
-        if(sourcePort != 0)
+        if(sourcePort != 0 || sourceAddr)
         {
-            // bind if we want a specific source port
+            // bind if we want a specific source port/address
             struct sockaddr_in6 sinAddr = {};
             sinAddr.sin6_family = AF_INET6;
             sinAddr.sin6_port = htons(sourcePort);
             sinAddr.sin6_addr = in6addr_any;
 
+            if(sourceAddr && inet_pton(AF_INET6, sourceAddr, &sinAddr.sin6_addr) != 1)
+            {
+                close();
+                fd = -1;
+                continue;
+            }
+
+            // every client's UDP socket uses the same source port
+            int yes = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char *>(&yes), sizeof(int));
+
             if(::bind(fd, (struct sockaddr *)&sinAddr, sizeof(sinAddr)) == -1)
             {
                 close();
@@ -172,9 +211,25 @@ bool Socket::connect(const char *addr, uint16_t port, uint16_t sourcePort)
             }
         }
 
-        if(::connect(fd, p->ai_addr, p->ai_addrlen) == -1)
+        // stays non-blocking after connecting
+        if(!wait)
+        {
+#ifdef _WIN32
+            u_long nonBlocking = 1;
+            ioctlsocket(fd, FIONBIO, &nonBlocking);
+#else
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+        }
+
+        int res;
+        {
+            HistogramTimer timer(connectTime);
+            res = ::connect(fd, p->ai_addr, p->ai_addrlen);
+        }
+
+        if(res == -1 && !(!wait && wouldBlock()))
         {
-            // TODO: if EINPROGRESS, non-blocking connect
             close();
             fd = -1;
             continue;
@@ -188,11 +243,17 @@ bool Socket::connect(const char *addr, uint16_t port, uint16_t sourcePort)
     return fd != -1;
 }
 
-bool Socket::bind(const char *addr, uint16_t port)
+bool Socket::bind(const char *addr, uint16_t port, bool reusePort)
 {
     if(fd != -1)
         return false;
 
+    if(transport)
+    {
+        fd = transport->bind(type, addr, port, reusePort);
+        return fd != -1;
+    }
+
     fd = socket(AF_INET6, getSockType(), 0);
 
     if(fd == -1)
@@ -206,6 +267,20 @@ bool Socket::bind(const char *addr, uint16_t port)
         return false;
     }
 
+#ifdef SO_REUSEPORT
+    if(reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<char *>(&yes), sizeof(int)) == -1)
+    {
+        close();
+        return false;
+    }
+#else
+    if(reusePort)
+    {
+        close();
+        return false;
+    }
+#endif
+
     // allow IPv4 connections
     yes = 0; // no
     if(setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char *>(&yes), sizeof(int)) == -1)
@@ -239,7 +314,7 @@ bool Socket::listen(const char *addr, uint16_t port)
     if(!bind(addr, port))
         return false;
 
-    if(::listen(fd, 1) == -1)
+    if(transport ? !transport->listen(fd) : ::listen(fd, SOMAXCONN) == -1)
     {
         close();
         return false;
@@ -258,9 +333,63 @@ int Socket::recv(void *data, size_t len, SocketAddress *addr, int flags)
     auto sockAddr = addr ? addr->getAddr() : nullptr;
     socklen_t addrLen = sizeof(sockaddr_storage);
 
-    int ret = ::recvfrom(fd, reinterpret_cast<char *>(data), len, flags, sockAddr, sockAddr ? &addrLen : nullptr);
+    int ret;
+
+    if(transport)
+    {
+        ret = transport->recv(fd, data, len, addr, flags);
+        receiveTime = {};
+    }
+#if defined(__linux__)
+    else if(maxReceiveBuffer || timestamps)
+    {
+        // same as below, but with the drop count/timestamp
+        iovec iov{data, len};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(timespec) * 3)];
+
+        msghdr msg{};
+        msg.msg_name = sockAddr;
+        msg.msg_namelen = sockAddr ? addrLen : 0;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        {
+            HistogramTimer timer(recvTime);
+            ret = ::recvmsg(fd, &msg, flags);
+        }
+
+        receiveTime = {};
+
+        // the drop count is only included when something has been dropped
+        for(auto cmsg = CMSG_FIRSTHDR(&msg); ret > 0 && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if(cmsg->cmsg_level != SOL_SOCKET)
+                continue;
+
+            if(cmsg->cmsg_type == SO_RXQ_OVFL)
+                memcpy(&dropCount, CMSG_DATA(cmsg), sizeof(dropCount));
+            else if(cmsg->cmsg_type == SCM_TIMESTAMPING)
+            {
+                // software, (deprecated), hardware
+                timespec ts[3];
+                memcpy(ts, CMSG_DATA(cmsg), sizeof(ts));
+
+                auto sinceEpoch = std::chrono::seconds(ts[0].tv_sec) + std::chrono::nanoseconds(ts[0].tv_nsec);
+                receiveTime = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(sinceEpoch));
+            }
+        }
+    }
+#endif
+    else
+    {
+        HistogramTimer timer(recvTime);
+        ret = ::recvfrom(fd, reinterpret_cast<char *>(data), len, flags, sockAddr, sockAddr ? &addrLen : nullptr);
+    }
 
-    if(ret == 0)
+    // an empty datagram isn't a disconnect
+    if(ret == 0 && type == SocketType::TCP)
     {
         // disconnected
         close();
@@ -284,9 +413,16 @@ bool Socket::send(const void *data, size_t &len, int flags)
 
 bool Socket::send(const void *data, size_t &len, const SocketAddress *addr, int flags)
 {
+    if(transport)
+    {
+        iovec iov{const_cast<void *>(data), len};
+        return send(&iov, 1, len, addr, flags);
+    }
+
     auto sockAddr = addr ? addr->getAddr() : nullptr;
     socklen_t addrLen = sizeof(sockaddr_storage);
 
+    HistogramTimer timer(sendTime);
     auto sent = ::sendto(fd, reinterpret_cast<const char *>(data), len, flags, sockAddr, addrLen);
 
     if(sent < 0)
@@ -297,19 +433,129 @@ bool Socket::send(const void *data, size_t &len, const SocketAddress *addr, int
     return true;
 }
 
+bool Socket::send(const iovec *iov, int iovCount, size_t &len, int flags)
+{
+    return send(iov, iovCount, len, nullptr, flags);
+}
+
+bool Socket::send(const iovec *iov, int iovCount, size_t &len, const SocketAddress *addr, int flags)
+{
+    if(transport)
+    {
+        auto sent = transport->send(fd, iov, iovCount, addr, flags);
+
+        if(sent < 0)
+            return false;
+
+        len = sent;
+
+        return true;
+    }
+
+    msghdr msg{};
+    msg.msg_name = addr ? const_cast<sockaddr *>(addr->getAddr()) : nullptr;
+    msg.msg_namelen = addr ? sizeof(sockaddr_in6) : 0;
+    msg.msg_iov = const_cast<iovec *>(iov);
+    msg.msg_iovlen = iovCount;
+
+    HistogramTimer timer(sendTime);
+    auto sent = ::sendmsg(fd, &msg, flags);
+
+    if(sent < 0)
+        return false;
+
+    len = sent;
+
+    return true;
+}
+
+int Socket::sendBatch(const iovec *packets, int count, int flags)
+{
+    return sendBatch(packets, count, nullptr, flags);
+}
+
+int Socket::sendBatch(const iovec *packets, int count, const SocketAddress *addr, int flags)
+{
+    if(transport)
+    {
+        int sent = 0;
+
+        for(; sent < count; sent++)
+        {
+            if(transport->send(fd, packets + sent, 1, addr, flags) < 0)
+                break;
+        }
+
+        return sent;
+    }
+
+    auto sockAddr = addr ? const_cast<sockaddr *>(addr->getAddr()) : nullptr;
+
+    HistogramTimer timer(sendTime);
+
+#if defined(__linux__)
+    static constexpr int maxBatch = 64;
+    mmsghdr msgs[maxBatch];
+
+    int sent = 0;
+
+    while(sent < count)
+    {
+        int batch = std::min(count - sent, maxBatch);
+
+        for(int i = 0; i < batch; i++)
+        {
+            msgs[i] = {};
+            msgs[i].msg_hdr.msg_name = sockAddr;
+            msgs[i].msg_hdr.msg_namelen = sockAddr ? sizeof(sockaddr_in6) : 0;
+            msgs[i].msg_hdr.msg_iov = const_cast<iovec *>(packets + sent + i);
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int ret = ::sendmmsg(fd, msgs, batch, flags);
+
+        if(ret <= 0)
+            break;
+
+        sent += ret;
+    }
+
+    return sent;
+#else
+    int sent = 0;
+
+    for(; sent < count; sent++)
+    {
+        if(::sendto(fd, reinterpret_cast<const char *>(packets[sent].iov_base), packets[sent].iov_len, flags, sockAddr, sockAddr ? sizeof(sockaddr_in6) : 0) < 0)
+            break;
+    }
+
+    return sent;
+#endif
+}
+
 bool Socket::sendAll(const void *data, size_t &len, int flags)
 {
     // doesn't make much sense on a UDP socket
     if(type != SocketType::TCP)
         return false;
 
+    if(transport)
+    {
+        iovec iov{const_cast<void *>(data), len};
+        return sendAll(&iov, 1, len, flags);
+    }
+
     size_t total_sent = 0;
     size_t to_send = len;
     int sent = 0;
 
     while(to_send)
     {
-        sent = ::send(fd, reinterpret_cast<const char *>(data) + total_sent, to_send, flags);
+        {
+            HistogramTimer timer(sendTime);
+            sent = ::send(fd, reinterpret_cast<const char *>(data) + total_sent, to_send, flags);
+        }
         if(sent == -1)
             break;
         total_sent += sent;
@@ -320,6 +566,55 @@ bool Socket::sendAll(const void *data, size_t &len, int flags)
     return sent != -1;
 }
 
+bool Socket::sendAll(const iovec *iov, int iovCount, size_t &len, int flags)
+{
+    if(type != SocketType::TCP)
+        return false;
+
+    // copy so we can skip what has been sent
+    iovec remaining[16];
+    if(iovCount > 16)
+        return false;
+
+    std::copy(iov, iov + iovCount, remaining);
+
+    msghdr msg{};
+    msg.msg_iov = remaining;
+    msg.msg_iovlen = iovCount;
+
+    size_t total_sent = 0;
+    ssize_t sent = 0;
+
+    while(msg.msg_iovlen)
+    {
+        {
+            HistogramTimer timer(sendTime);
+            sent = transport ? transport->send(fd, msg.msg_iov, msg.msg_iovlen, nullptr, flags) : ::sendmsg(fd, &msg, flags);
+        }
+        if(sent == -1)
+            break;
+
+        total_sent += sent;
+
+        // skip anything fully sent, then adjust the partially sent buffer
+        while(msg.msg_iovlen && static_cast<size_t>(sent) >= msg.msg_iov->iov_len)
+        {
+            sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if(msg.msg_iovlen)
+        {
+            msg.msg_iov->iov_base = static_cast<uint8_t *>(msg.msg_iov->iov_base) + sent;
+            msg.msg_iov->iov_len -= sent;
+        }
+    }
+
+    len = total_sent;
+    return sent != -1;
+}
+
 std::optional<Socket> Socket::accept(SocketAddress *addr)
 {
     if(type != SocketType::TCP)
@@ -328,7 +623,15 @@ std::optional<Socket> Socket::accept(SocketAddress *addr)
     auto sockAddr = addr ? addr->getAddr() : nullptr;
     socklen_t addrLen = sizeof(sockaddr_storage);
 
-    int newFd = ::accept(fd, sockAddr, sockAddr ? &addrLen : nullptr);
+    int newFd;
+
+    if(transport)
+        newFd = transport->accept(fd, addr);
+    else
+    {
+        HistogramTimer timer(acceptTime);
+        newFd = ::accept(fd, sockAddr, sockAddr ? &addrLen : nullptr);
+    }
 
     if(newFd == -1)
         return {};
@@ -336,12 +639,139 @@ std::optional<Socket> Socket::accept(SocketAddress *addr)
     return Socket(type, newFd);
 }
 
+bool Socket::setOptions(const SocketOptions &options)
+{
+    if(fd == -1)
+        return false;
+
+    // nothing to set
+    if(transport)
+        return true;
+
+    auto setInt = [this](int level, int name, int value)
+    {
+        return setsockopt(fd, level, name, reinterpret_cast<char *>(&value), sizeof(value)) == 0;
+    };
+
+    bool ok = true;
+
+    if(options.receiveBuffer)
+        ok = setInt(SOL_SOCKET, SO_RCVBUF, *options.receiveBuffer) && ok;
+
+    if(options.sendBuffer)
+        ok = setInt(SOL_SOCKET, SO_SNDBUF, *options.sendBuffer) && ok;
+
+    if(options.noDelay && type == SocketType::TCP)
+        ok = setInt(IPPROTO_TCP, TCP_NODELAY, *options.noDelay) && ok;
+
+    if(options.dscp)
+    {
+        // the class for IPv6, TOS for IPv4 mapped addresses (which fails on a pure IPv6 socket, so it's ignored)
+        ok = setInt(IPPROTO_IPV6, IPV6_TCLASS, *options.dscp << 2) && ok;
+        setInt(IPPROTO_IP, IP_TOS, *options.dscp << 2);
+    }
+
+#ifdef SO_BUSY_POLL
+    if(options.busyPoll)
+        ok = setInt(SOL_SOCKET, SO_BUSY_POLL, *options.busyPoll) && ok;
+#endif
+
+#if defined(__linux__)
+    // software receive timestamps, kept by recv
+    int timestampFlags = options.timestamps ? SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE : 0;
+
+    if(setInt(SOL_SOCKET, SO_TIMESTAMPING, timestampFlags))
+        timestamps = options.timestamps;
+    else if(options.timestamps)
+        ok = false;
+#endif
+
+#ifdef SO_RXQ_OVFL
+    if(options.maxReceiveBuffer && type == SocketType::UDP)
+    {
+        if(setInt(SOL_SOCKET, SO_RXQ_OVFL, 1))
+            maxReceiveBuffer = options.maxReceiveBuffer;
+        else
+            ok = false;
+    }
+    else
+        maxReceiveBuffer = 0;
+#endif
+
+    return ok;
+}
+
+int Socket::getReceiveBufferSize() const
+{
+    if(transport)
+        return 0;
+
+    int size = 0;
+    socklen_t len = sizeof(size);
+
+    if(getsockopt(fd, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<char *>(&size), &len) == -1)
+        return 0;
+
+    return size;
+}
+
+std::chrono::system_clock::time_point Socket::getReceiveTime() const
+{
+    return receiveTime;
+}
+
+uint32_t Socket::getDropCount() const
+{
+    return dropCount;
+}
+
+int Socket::autoTuneReceiveBuffer(uint32_t &newDrops)
+{
+    newDrops = dropCount - tunedDropCount;
+
+    if(!maxReceiveBuffer || !newDrops || fd == -1)
+        return 0;
+
+    tunedDropCount = dropCount;
+
+    // the kernel reports double what was set
+    int current = getReceiveBufferSize() / 2;
+
+    if(current >= maxReceiveBuffer)
+        return 0;
+
+    int size = std::min(current * 2, maxReceiveBuffer);
+
+    // the forced version ignores rmem_max, but needs CAP_NET_ADMIN
+#ifdef SO_RCVBUFFORCE
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, reinterpret_cast<char *>(&size), sizeof(size)) == 0)
+        return size;
+#endif
+
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<char *>(&size), sizeof(size)) == -1)
+        return 0;
+
+    // stuck at rmem_max
+    auto newSize = getReceiveBufferSize() / 2;
+
+    return newSize > current ? newSize : 0;
+}
+
 int Socket::close()
 {
+    if(fd == -1)
+        return 0;
+
+    int oldFd = fd;
+    fd = -1;
+
+    if(transport)
+        return transport->close(oldFd);
+
 #ifdef _WIN32
-    return closesocket(fd);
+    return closesocket(oldFd);
 #else
-    return ::close(fd);
+    return ::close(oldFd);
 #endif
 }
 
@@ -363,6 +793,31 @@ int Socket::getSockType() const
     return 0;
 }
 
+int Socket::getPendingError()
+{
+    if(transport)
+        return transport->getPendingError(fd);
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&error), &len) == -1)
+        return getLastError();
+
+    return error;
+}
+
+bool Socket::wouldBlock()
+{
+    int error = getLastError();
+
+#ifdef _WIN32
+    return error == WSAEWOULDBLOCK;
+#else
+    return error == EAGAIN || error == EWOULDBLOCK || error == EINPROGRESS;
+#endif
+}
+
 int Socket::getLastError()
 {
 #ifdef _WIN32
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <optional>
@@ -8,8 +9,11 @@
 // FIXME
 #else
 #include <sys/socket.h> // sockaddr, socklen_t
+#include <sys/uio.h> // iovec
 #endif
 
+class Transport;
+
 class SocketAddress final
 {
 public:
@@ -35,6 +39,18 @@ enum class SocketType
     UDP
 };
 
+// unset values are left at the OS default
+struct SocketOptions
+{
+    std::optional<int> receiveBuffer, sendBuffer; // bytes
+    std::optional<bool> noDelay; // TCP only
+    std::optional<int> dscp; // 0-63
+    std::optional<int> busyPoll; // microseconds
+
+    int maxReceiveBuffer = 0; // UDP auto-tuning limit, 0 disables it (and counting drops)
+    bool timestamps = false; // kernel (software) receive times, see getReceiveTime
+};
+
 class Socket final
 {
 public:
@@ -47,8 +63,10 @@ public:
 
     Socket &operator=(Socket &&other);
 
-    bool connect(const char *addr, uint16_t port, uint16_t sourcePort = 0);
-    bool bind(const char *addr, uint16_t port);
+    // without waiting the socket is left non-blocking, it's connected when writable (check getPendingError)
+    bool connect(const char *addr, uint16_t port, uint16_t sourcePort = 0, const char *sourceAddr = nullptr, bool wait = true);
+    // reusePort lets several sockets bind the same port, the kernel spreads incoming packets over them by source
+    bool bind(const char *addr, uint16_t port, bool reusePort = false);
     bool listen(const char *addr, uint16_t port);
 
     int recv(void *data, size_t len, int flags = 0);
@@ -58,10 +76,42 @@ public:
     bool send(const void *data, size_t &len, const SocketAddress *addr, int flags = 0);
     bool sendAll(const void *data, size_t &len, int flags = 0);
 
+    // gathers multiple buffers into one packet
+    bool send(const iovec *iov, int iovCount, size_t &len, int flags = 0);
+    bool send(const iovec *iov, int iovCount, size_t &len, const SocketAddress *addr, int flags = 0);
+    bool sendAll(const iovec *iov, int iovCount, size_t &len, int flags = 0);
+
+    // one packet per iovec, all to addr (or the connected address), returns how many were sent
+    int sendBatch(const iovec *packets, int count, int flags = 0);
+    int sendBatch(const iovec *packets, int count, const SocketAddress *addr, int flags = 0);
+
     std::optional<Socket> accept(SocketAddress *addr = nullptr);
 
+    // everything that can be applied is, returns false if anything failed
+    bool setOptions(const SocketOptions &options);
+
+    int getReceiveBufferSize() const;
+
+    // when the kernel received the last packet returned by recv (for TCP, the last segment of it)
+    // the epoch if timestamps aren't enabled
+    std::chrono::system_clock::time_point getReceiveTime() const;
+
+    // packets the kernel dropped because the receive buffer was full, updated by recv
+    // only counted if the options enabled auto-tuning
+    uint32_t getDropCount() const;
+
+    // doubles the receive buffer (up to the limit in the options) if anything was dropped since the last call
+    // returns the new size, 0 if it didn't change
+    int autoTuneReceiveBuffer(uint32_t &newDrops);
+
     int close();
 
+    // SO_ERROR, the result of a non-blocking connect
+    int getPendingError();
+
+    // the last call failed because it would have blocked (or a connect is in progress)
+    bool wouldBlock();
+
     int getFd() const;
 
 private:
@@ -70,4 +120,12 @@ private:
 
     SocketType type;
     int fd = -1;
+
+    Transport *transport; // nullptr for the OS
+
+    int maxReceiveBuffer = 0;
+    uint32_t dropCount = 0, tunedDropCount = 0;
+
+    bool timestamps = false;
+    std::chrono::system_clock::time_point receiveTime;
 };
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// flat encoding of the server state for a hot restart
+// only ever read back by a process of the same version, so no attempt at compatibility
+// file descriptors are collected separately (to be passed with SCM_RIGHTS), the data has their index
+
+class StateWriter final
+{
+public:
+    template<class T>
+    void write(const T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        auto ptr = reinterpret_cast<const uint8_t *>(&value);
+        data.insert(data.end(), ptr, ptr + sizeof(T));
+    }
+
+    void writeBytes(const uint8_t *bytes, uint32_t len)
+    {
+        write(len);
+        data.insert(data.end(), bytes, bytes + len);
+    }
+
+    void writeString(std::string_view str)
+    {
+        writeBytes(reinterpret_cast<const uint8_t *>(str.data()), str.length());
+    }
+
+    void writeFd(int fd)
+    {
+        if(fd == -1)
+            write<int32_t>(-1);
+        else
+        {
+            write<int32_t>(fds.size());
+            fds.push_back(fd);
+        }
+    }
+
+    const std::vector<uint8_t> &getData() const
+    {
+        return data;
+    }
+
+    const std::vector<int> &getFds() const
+    {
+        return fds;
+    }
+
+private:
+    std::vector<uint8_t> data;
+    std::vector<int> fds;
+};
+
+// reads fail softly, returning zeroes, check hasFailed at the end
+class StateReader final
+{
+public:
+    StateReader(const std::vector<uint8_t> &data, const std::vector<int> &fds) : data(data), fds(fds)
+    {
+    }
+
+    template<class T>
+    T read()
+    {
+        T value{};
+        read(value);
+        return value;
+    }
+
+    // also works for arrays
+    template<class T>
+    void read(T &value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>);
+
+        if(offset + sizeof(T) > data.size())
+        {
+            memset(&value, 0, sizeof(T));
+            failed = true;
+        }
+        else
+        {
+            memcpy(&value, data.data() + offset, sizeof(T));
+            offset += sizeof(T);
+        }
+    }
+
+    std::vector<uint8_t> readBytes()
+    {
+        auto len = read<uint32_t>();
+
+        if(offset + len > data.size())
+        {
+            failed = true;
+            return {};
+        }
+
+        std::vector<uint8_t> ret(data.begin() + offset, data.begin() + offset + len);
+        offset += len;
+        return ret;
+    }
+
+    std::string readString()
+    {
+        auto bytes = readBytes();
+        return std::string(bytes.begin(), bytes.end());
+    }
+
+    int readFd()
+    {
+        auto index = read<int32_t>();
+
+        if(index == -1)
+            return -1;
+
+        if(index < 0 || static_cast<size_t>(index) >= fds.size())
+        {
+            failed = true;
+            return -1;
+        }
+
+        return fds[index];
+    }
+
+    bool hasFailed() const
+    {
+        return failed;
+    }
+
+    bool isAtEnd() const
+    {
+        return offset == data.size();
+    }
+
+private:
+    const std::vector<uint8_t> &data;
+    const std::vector<int> &fds;
+
+    size_t offset = 0;
+    bool failed = false;
+};
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#include "IniFile.hpp"
+#include "Logger.hpp"
+#include "Trace.hpp"
+
+std::atomic<bool> Tracer::enabled{false};
+
+Tracer &Tracer::get()
+{
+    static Tracer tracer;
+    return tracer;
+}
+
+void Tracer::configure(const IniFile &config)
+{
+    {
+        std::lock_guard lock(mutex);
+        maxEvents = std::max(config.getIntValue("Trace", "BufferEvents").value_or(200000), int(chunkEvents));
+    }
+
+    setEnabled(config.getIntValue("Trace", "Enabled").value_or(0) != 0);
+}
+
+void Tracer::setEnabled(bool enabled)
+{
+    if(this->enabled.exchange(enabled, std::memory_order_relaxed) != enabled)
+        LOG_INFO(General, "tracing %s", enabled ? "enabled" : "disabled");
+}
+
+void Tracer::flushThread()
+{
+    flush(getThreadBuffer());
+}
+
+std::string Tracer::exportChromeTrace()
+{
+    auto threadEvents = copyEvents();
+
+    uint64_t firstStart = ~uint64_t(0);
+
+    for(auto &thread : threadEvents)
+    {
+        if(!thread.second.empty())
+            firstStart = std::min(firstStart, thread.second.front().start);
+    }
+
+    std::string ret = "{\"traceEvents\":[\n";
+    bool first = true;
+    char buf[128];
+
+    for(auto &thread : threadEvents)
+    {
+        for(auto &event : thread.second)
+        {
+            if(!first)
+                ret += ",\n";
+
+            first = false;
+
+            snprintf(buf, sizeof(buf), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}", thread.first,
+                     (event.start - firstStart) / 1000.0, (event.end - event.start) / 1000.0);
+
+            ret.append("{\"name\":\"").append(getName(event)).append(buf);
+        }
+    }
+
+    ret += "\n]}\n";
+
+    return ret;
+}
+
+std::string Tracer::exportFoldedStacks()
+{
+    auto threadEvents = copyEvents();
+
+    // self time for each stack
+    std::map<std::string, int64_t> stacks;
+
+    for(auto &thread : threadEvents)
+    {
+        std::string root = "thread " + std::to_string(thread.first);
+
+        // open spans and their stacks
+        std::vector<std::pair<const Event *, std::string>> open;
+
+        for(auto &event : thread.second)
+        {
+            while(!open.empty() && open.back().first->depth >= event.depth)
+                open.pop_back();
+
+            // the parents may have been dropped from the buffer, these just end up higher up the stack
+            auto &parent = open.empty() ? root : open.back().second;
+            auto stack = parent + ";" + getName(event);
+
+            auto duration = int64_t(event.end - event.start);
+            stacks[stack] += duration;
+
+            if(!open.empty() && open.back().first->depth + 1 == event.depth)
+                stacks[parent] -= duration;
+
+            open.emplace_back(&event, std::move(stack));
+        }
+    }
+
+    std::string ret;
+
+    for(auto &stack : stacks)
+    {
+        auto us = (stack.second + 500) / 1000;
+
+        if(us > 0)
+            ret.append(stack.first).append(" ").append(std::to_string(us)).append("\n");
+    }
+
+    return ret;
+}
+
+Tracer::ThreadHandle::~ThreadHandle()
+{
+    if(buffer)
+        Tracer::get().flush(*buffer);
+}
+
+uint64_t Tracer::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Tracer::ThreadBuffer &Tracer::getThreadBuffer()
+{
+    static thread_local ThreadHandle handle;
+
+    if(!handle.buffer)
+    {
+        std::lock_guard lock(mutex);
+
+        // kept after the thread exits so the exports still have its spans
+        auto &buffer = threads.emplace_back(std::make_unique<ThreadBuffer>());
+        buffer->id = threads.size();
+        buffer->pending.reserve(chunkEvents);
+
+        handle.buffer = buffer.get();
+    }
+
+    return *handle.buffer;
+}
+
+void Tracer::record(ThreadBuffer &buffer, const Event &event)
+{
+    buffer.pending.push_back(event);
+
+    if(buffer.pending.size() >= chunkEvents)
+        flush(buffer);
+}
+
+void Tracer::flush(ThreadBuffer &buffer)
+{
+    if(buffer.pending.empty())
+        return;
+
+    std::lock_guard lock(mutex);
+
+    buffer.events.insert(buffer.events.end(), buffer.pending.begin(), buffer.pending.end());
+
+    if(buffer.events.size() > maxEvents)
+        buffer.events.erase(buffer.events.begin(), buffer.events.begin() + (buffer.events.size() - maxEvents));
+
+    buffer.pending.clear();
+}
+
+std::vector<std::pair<unsigned, std::vector<Tracer::Event>>> Tracer::copyEvents()
+{
+    std::vector<std::pair<unsigned, std::vector<Event>>> ret;
+
+    {
+        // only hold up the recording threads for the copy
+        std::lock_guard lock(mutex);
+
+        for(auto &thread : threads)
+            ret.emplace_back(thread->id, std::vector<Event>(thread->events.begin(), thread->events.end()));
+    }
+
+    for(auto &[id, events] : ret)
+    {
+        // recorded when they end, parents go before their children
+        std::sort(events.begin(), events.end(), [](const Event &a, const Event &b)
+        {
+            return a.start != b.start ? a.start < b.start : a.depth < b.depth;
+        });
+    }
+
+    return ret;
+}
+
+std::string Tracer::getName(const Event &event)
+{
+    if(event.arg == noArg)
+        return event.name;
+
+    return std::string(event.name) + "(" + std::to_string(event.arg) + ")";
+}
+
+void TraceSpan::begin(const char *name, uint32_t arg)
+{
+    Tracer::get().getThreadBuffer().depth++;
+
+    this->name = name;
+    this->arg = arg;
+    start = Tracer::now();
+}
+
+void TraceSpan::end()
+{
+    auto end = Tracer::now();
+
+    auto &tracer = Tracer::get();
+    auto &buffer = tracer.getThreadBuffer();
+
+    buffer.depth--;
+    tracer.record(buffer, {name, arg, buffer.depth, start, end});
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class IniFile;
+
+// scoped spans, recorded into per-thread buffers and exported on demand as chrome trace JSON or folded stacks
+// a span costs one relaxed load and a branch while tracing is disabled
+class Tracer final
+{
+public:
+    static constexpr uint32_t noArg = ~0u;
+
+    static Tracer &get();
+
+    // [Trace] Enabled/BufferEvents
+    void configure(const IniFile &config);
+
+    void setEnabled(bool enabled);
+
+    static bool isEnabled()
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    // makes the calling thread's latest spans visible to the exports, otherwise they're moved in chunks
+    void flushThread();
+
+    // chrome://tracing / perfetto
+    std::string exportChromeTrace();
+
+    // flamegraph.pl input, self time in microseconds
+    std::string exportFoldedStacks();
+
+private:
+    friend class TraceSpan;
+
+    struct Event
+    {
+        const char *name; // string literals only
+        uint32_t arg;
+        uint32_t depth;
+        uint64_t start, end; // ns, steady clock
+    };
+
+    struct ThreadBuffer
+    {
+        unsigned id;
+        uint32_t depth = 0;
+
+        std::vector<Event> pending; // only touched by the owner
+
+        std::deque<Event> events; // needs the mutex
+    };
+
+    // flushes the pending events when the thread exits
+    struct ThreadHandle
+    {
+        ~ThreadHandle();
+
+        ThreadBuffer *buffer = nullptr;
+    };
+
+    static constexpr size_t chunkEvents = 1024;
+
+    Tracer() = default;
+
+    static uint64_t now();
+
+    ThreadBuffer &getThreadBuffer();
+
+    void record(ThreadBuffer &buffer, const Event &event);
+    void flush(ThreadBuffer &buffer);
+
+    // all threads, sorted by start time
+    std::vector<std::pair<unsigned, std::vector<Event>>> copyEvents();
+
+    static std::string getName(const Event &event);
+
+    static std::atomic<bool> enabled;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> threads;
+    size_t maxEvents = 200000; // per thread, oldest are dropped
+};
+
+class TraceSpan final
+{
+public:
+    TraceSpan(const char *name, uint32_t arg = Tracer::noArg)
+    {
+        if(Tracer::isEnabled())
+            begin(name, arg);
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+
+    ~TraceSpan()
+    {
+        // spans that started before tracing was disabled still end
+        if(name)
+            end();
+    }
+
+private:
+    void begin(const char *name, uint32_t arg);
+    void end();
+
+    const char *name = nullptr;
+    uint32_t arg;
+    uint64_t start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+// TRACE_SPAN("name") or TRACE_SPAN("name", number), until the end of the scope
+#define TRACE_SPAN(...) TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(__VA_ARGS__)
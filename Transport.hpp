@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Socket.hpp"
+
+// what a Socket does with its fd, for swapping the OS sockets for something else (see MemoryTransport)
+// the OS is used directly while none is set, a socket keeps the transport that was current when it was created
+// errors are reported like the syscalls, -1 and errno
+class Transport
+{
+public:
+    virtual ~Transport() = default;
+
+    // these return the new fd
+    virtual int connect(SocketType type, const char *addr, uint16_t port, uint16_t sourcePort, const char *sourceAddr, bool wait) = 0;
+    virtual int bind(SocketType type, const char *addr, uint16_t port, bool reusePort) = 0;
+    virtual int accept(int fd, SocketAddress *addr) = 0;
+
+    virtual bool listen(int fd) = 0;
+
+    // EWOULDBLOCK if there's nothing to read/no room, 0 from recv is a closed stream
+    virtual int recv(int fd, void *data, size_t len, SocketAddress *addr, int flags) = 0;
+    virtual ssize_t send(int fd, const iovec *iov, int iovCount, const SocketAddress *addr, int flags) = 0;
+
+    virtual int getPendingError(int fd) = 0;
+
+    virtual int close(int fd) = 0;
+
+    static Transport *getCurrent()
+    {
+        return current;
+    }
+
+    // nullptr goes back to the OS
+    static void setCurrent(Transport *transport)
+    {
+        current = transport;
+    }
+
+private:
+    static Transport *current;
+};
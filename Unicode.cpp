@@ -0,0 +1,72 @@
+#include <cassert>
+
+#include "Unicode.hpp"
+
+std::u16string convertUTF8ToUCS2(std::string_view u8)
+{
+    std::u16string ret;
+    ret.reserve(u8.size()); // pessimistic
+
+    auto end = u8.end();
+
+    for(auto it = u8.begin(); it != end; ++it)
+    {
+        auto c = static_cast<unsigned>(*it);
+        if(c < 0x80)
+            ret += c;
+        else if((c & 0xE0) == 0xC0)
+        {
+            // two byte seq
+            if(++it == end)
+                break;
+
+            auto c1 = static_cast<unsigned>(*it);
+            ret += static_cast<char16_t>((c & 0x1F) << 6 | (c1 & 0x3F));
+        }
+        else if((c & 0xF0) == 0xE0)
+        {
+            // three bytes
+            if(++it == end)
+                break;
+
+            auto c1 = static_cast<unsigned>(*it);
+            if(++it == end)
+                break;
+
+            auto c2 = static_cast<unsigned>(*it);
+
+            ret += static_cast<char16_t>((c & 0x0F) << 12 | (c1 & 0x3F) << 6 | (c2 & 0x3F));
+        }
+        else
+            break;
+    }
+
+    return ret;
+}
+
+std::string convertUCS2ToUTF8(std::u16string_view u16)
+{
+    std::string ret;
+    ret.reserve(u16.length()); // optimistic
+
+    for(auto &c : u16)
+    {
+        assert(c < 0xD800 || c >= 0xE000); // not UTF-16, no surrogates
+
+        if(c <= 0x7F)
+            ret += static_cast<char>(c);
+        else if(c <= 0x7FF)
+        {
+            ret += static_cast<char>(0xC0 | c >> 6);
+            ret += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else // <= 0xFFFF
+        {
+            ret += static_cast<char>(0xE0 | c >> 12);
+            ret += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            ret += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+
+std::u16string convertUTF8ToUCS2(std::string_view u8);
+std::string convertUCS2ToUTF8(std::u16string_view u16);
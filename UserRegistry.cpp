@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Logger.hpp"
+#include "UserRegistry.hpp"
+
+static constexpr uint32_t initialCapacity = 256;
+static constexpr uint32_t maxUsers = 1 << 24;
+
+static size_t getFileSize(uint32_t capacity)
+{
+    return sizeof(UserRegistryHeader) + capacity * sizeof(UserRecord);
+}
+
+UserRegistry &UserRegistry::get()
+{
+    static UserRegistry registry;
+    return registry;
+}
+
+UserRegistry::~UserRegistry()
+{
+    close();
+}
+
+bool UserRegistry::open(const char *path)
+{
+    close();
+
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) == -1)
+    {
+        LOG_ERROR(General, "failed to open user registry %s", path);
+        close();
+        return false;
+    }
+
+    bool isNew = st.st_size == 0;
+
+    if(isNew)
+    {
+        if(ftruncate(fd, getFileSize(initialCapacity)) == -1 || !mapFile(getFileSize(initialCapacity)))
+        {
+            LOG_ERROR(General, "failed to create user registry %s", path);
+            close();
+            return false;
+        }
+
+        memcpy(header->magic, "BTUR", 4);
+        header->version = 1;
+        header->unused = 0;
+        header->count = 0;
+        header->capacity = initialCapacity;
+        header->reserved = 0;
+    }
+    else
+    {
+        if(static_cast<size_t>(st.st_size) < sizeof(UserRegistryHeader) || !mapFile(st.st_size)
+           || memcmp(header->magic, "BTUR", 4) != 0 || header->version != 1
+           || mapSize != getFileSize(header->capacity) || header->count > header->capacity || header->count > maxUsers)
+        {
+            LOG_ERROR(General, "%s is not a user registry", path);
+            close();
+            return false;
+        }
+    }
+
+    valueIndex.reserve(header->count);
+
+    for(uint32_t i = 0; i < header->count; i++)
+    {
+        records[i].name[sizeof(records[i].name) - 1] = 0;
+        valueIndex.emplace(records[i].userValue, i);
+    }
+
+    LOG_INFO(General, "user registry %s: %u users", path, header->count);
+
+    return true;
+}
+
+void UserRegistry::close()
+{
+    if(map)
+        munmap(map, mapSize);
+
+    if(fd != -1)
+        ::close(fd);
+
+    fd = -1;
+    map = nullptr;
+    mapSize = 0;
+    header = nullptr;
+    records = nullptr;
+    valueIndex.clear();
+}
+
+UserRecord *UserRegistry::find(uint32_t userValue)
+{
+    if(!header)
+        return nullptr;
+
+    auto it = valueIndex.find(userValue);
+
+    return it == valueIndex.end() ? nullptr : &records[it->second];
+}
+
+UserRecord *UserRegistry::create(std::string_view name)
+{
+    if(!header || header->count >= maxUsers)
+        return nullptr;
+
+    if(header->count == header->capacity)
+    {
+        // records are referred to by index, so moving the mapping is fine
+        auto newCapacity = std::min(header->capacity * 2, maxUsers);
+
+        if(ftruncate(fd, getFileSize(newCapacity)) == -1)
+            return nullptr;
+
+        munmap(map, mapSize);
+
+        if(!mapFile(getFileSize(newCapacity)))
+        {
+            LOG_ERROR(General, "failed to grow user registry");
+            return nullptr;
+        }
+
+        header->capacity = newCapacity;
+    }
+
+    auto index = header->count;
+    auto &record = records[index];
+
+    auto now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+    memset(&record, 0, sizeof(record));
+
+    // all 32 bits are random, a guess finds someone else one time in 2^32 / count
+    // (never 0 or invalidValue, which look like no value)
+    do
+        record.userValue = random();
+    while(record.userValue == 0 || record.userValue == invalidValue || valueIndex.count(record.userValue));
+
+    valueIndex.emplace(record.userValue, index);
+    record.firstSeen = record.lastSeen = now;
+
+    setName(record, name);
+
+    header->count++;
+
+    return &record;
+}
+
+void UserRegistry::setName(UserRecord &record, std::string_view name)
+{
+    auto len = std::min(name.length(), sizeof(record.name) - 1);
+    memcpy(record.name, name.data(), len);
+    memset(record.name + len, 0, sizeof(record.name) - len);
+}
+
+bool UserRegistry::mapFile(size_t size)
+{
+    auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(ptr == MAP_FAILED)
+    {
+        map = nullptr;
+        header = nullptr;
+        records = nullptr;
+        return false;
+    }
+
+    map = static_cast<uint8_t *>(ptr);
+    mapSize = size;
+    header = reinterpret_cast<UserRegistryHeader *>(map);
+    records = reinterpret_cast<UserRecord *>(header + 1);
+
+    return true;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <string_view>
+#include <unordered_map>
+
+// stable ids for the loco 1002 user value, with some state for each user
+// the file is a header followed by fixed size records
+// values are random so that knowing your own doesn't give away anyone else's, they're indexed when opening
+
+struct UserRegistryHeader
+{
+    char magic[4]; // "BTUR"
+    uint32_t version;
+    uint32_t unused; // the high bits of every value when they were sequential
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t reserved;
+};
+static_assert(sizeof(UserRegistryHeader) == 24);
+
+struct UserRecord
+{
+    uint32_t userValue;
+    uint32_t sessionCount;
+
+    uint64_t firstSeen, lastSeen; // unix time
+
+    // last postcards seen from this user (in the postcard store), the same ones again aren't hashed
+    uint64_t postcardHash;
+    uint32_t postcardLength;
+    uint32_t reserved;
+
+    uint8_t lastSession[16]; // guid
+
+    char name[40]; // utf-8, truncated, null terminated
+};
+static_assert(sizeof(UserRecord) == 96);
+
+class UserRegistry final
+{
+public:
+    static constexpr uint32_t invalidValue = 0xFFFFFFFF;
+
+    static UserRegistry &get();
+
+    ~UserRegistry();
+
+    bool open(const char *path);
+    void close();
+
+    bool isOpen() const
+    {
+        return map != nullptr;
+    }
+
+    // null if the value isn't one of ours
+    // users are only ever found by the value the game sent, names aren't unique or checked
+    UserRecord *find(uint32_t userValue);
+
+    UserRecord *create(std::string_view name);
+
+    // for display only
+    void setName(UserRecord &record, std::string_view name);
+
+    uint32_t getCount() const
+    {
+        return header ? header->count : 0;
+    }
+
+private:
+    UserRegistry() = default;
+
+    bool mapFile(size_t size);
+
+    int fd = -1;
+    uint8_t *map = nullptr;
+    size_t mapSize = 0;
+
+    UserRegistryHeader *header = nullptr;
+    UserRecord *records = nullptr;
+
+    // user value -> record index
+    std::unordered_map<uint32_t, uint32_t> valueIndex;
+
+    std::mt19937 random{std::random_device()()};
+};
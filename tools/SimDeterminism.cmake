@@ -0,0 +1,27 @@
+# runs the simulator twice with the same seed, the digests have to match
+# and all clients have to join unless ALLOW_FAILED is set (some won't with loss)
+# cmake -DSIM=path/to/BrickTrainSim [-DSIM_ARGS="--clients;50"] [-DALLOW_FAILED=ON] -P SimDeterminism.cmake
+
+foreach(run 1 2)
+  execute_process(
+    COMMAND ${SIM} ${SIM_ARGS}
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+  )
+
+  if(NOT result EQUAL 0 AND NOT (ALLOW_FAILED AND result EQUAL 1))
+    message(FATAL_ERROR "run ${run} failed (${result}):\n${output}")
+  endif()
+
+  string(REGEX MATCH "digest [0-9a-f]+" digest${run} "${output}")
+
+  if(NOT digest${run})
+    message(FATAL_ERROR "run ${run} didn't print a digest:\n${output}")
+  endif()
+endforeach()
+
+if(NOT digest1 STREQUAL digest2)
+  message(FATAL_ERROR "not deterministic, ${digest1} then ${digest2}")
+endif()
+
+message(STATUS "${digest1}")